@@ -0,0 +1,750 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <linux/types.h>          /* for videodev2.h */
+#include <linux/videodev2.h>
+
+#include "mjpg_streamer.h"
+
+/******************************************************************************
+Description.: read the clock used for the stage timestamps of a frame. It is
+              monotonic, so differences are valid even if the wall clock is
+              adjusted while streaming.
+Input Value.: tv is filled with the current time
+Return Value: -
+******************************************************************************/
+void frame_clock(struct timeval *tv)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    tv->tv_sec = ts.tv_sec;
+    tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+/******************************************************************************
+Description.: calculate the time between two stage timestamps
+Input Value.: from and to are timestamps taken with frame_clock()
+Return Value: microseconds, 0 if one of the stages was never reached
+******************************************************************************/
+long frame_elapsed_us(const struct timeval *from, const struct timeval *to)
+{
+    if(from->tv_sec == 0 || to->tv_sec == 0)
+        return 0;
+
+    return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_usec - from->tv_usec);
+}
+
+/******************************************************************************
+Description.: lock the mutex of an input. If another thread holds it the time
+              spent waiting is added to the contention counters of /metrics,
+              the uncontended case costs nothing extra.
+Input Value.: in is the input
+Return Value: -
+******************************************************************************/
+static void frame_lock(input *in)
+{
+    struct timeval from, to;
+
+    if(pthread_mutex_trylock(&in->db) == 0)
+        return;
+
+    frame_clock(&from);
+    pthread_mutex_lock(&in->db);
+    frame_clock(&to);
+
+    __atomic_add_fetch(&in->db_contended, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&in->db_wait_us, frame_elapsed_us(&from, &to), __ATOMIC_RELAXED);
+}
+
+/******************************************************************************
+Description.: fill width and height of a frame from the SOF marker of its JPG
+              data. Inputs which receive ready made pictures call this once,
+              so that consumers never need to parse the headers themselves.
+Input Value.: f is a frame with complete JPG data in buf
+Return Value: -
+******************************************************************************/
+void frame_probe_jpeg(frame *f)
+{
+    unsigned char *p = f->buf, *end = f->buf + f->size;
+    int len;
+
+    f->format = V4L2_PIX_FMT_MJPEG;
+
+    if(f->size < 4 || p[0] != 0xff || p[1] != 0xd8)
+        return;
+    p += 2;
+
+    while(p + 4 <= end) {
+        if(p[0] != 0xff) {
+            DBG("invalid JPG marker\n");
+            return;
+        }
+
+        /* fill bytes in front of a marker */
+        if(p[1] == 0xff) {
+            p++;
+            continue;
+        }
+
+        /* SOF0..SOF15, except DHT (c4), JPG (c8) and DAC (cc) */
+        if(p[1] >= 0xc0 && p[1] <= 0xcf && p[1] != 0xc4 && p[1] != 0xc8 && p[1] != 0xcc) {
+            if(p + 9 > end)
+                return;
+            f->height = (p[5] << 8) | p[6];
+            f->width = (p[7] << 8) | p[8];
+            return;
+        }
+
+        /* start of scan, no SOF in front of it */
+        if(p[1] == 0xda)
+            return;
+
+        len = (p[2] << 8) | p[3];
+        p += 2 + len;
+    }
+}
+
+/******************************************************************************
+Description.: prepare the frame ring of an input, no frame slot is allocated
+              until the input acquires it for the first time
+Input Value.: in is the input to initialize
+Return Value: 0 if everything is OK, -1 otherwise
+******************************************************************************/
+int frame_ring_init(input *in)
+{
+    struct timeval now;
+    int i;
+
+    for(i = 0; i < FRAME_RING_SIZE; i++)
+        in->ring[i] = NULL;
+    in->latest = NULL;
+    in->seq = 0;
+
+    /* sequence numbers start over, with a new plugin or a restarted program */
+    gettimeofday(&now, NULL);
+    in->epoch = (unsigned int)(now.tv_sec * 1000000ULL + now.tv_usec);
+    in->waiters = 0;
+    in->subscribers = 0;
+    for(i = 0; i < FRAME_LISTENERS; i++)
+        in->listeners[i] = 0;
+    in->listening = 0;
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: free the data consumers attached to a frame
+Input Value.: f is a frame nobody holds a reference to
+Return Value: -
+******************************************************************************/
+static void frame_wire_free(frame *f)
+{
+    if(f->wire != NULL && f->wire_free != NULL)
+        f->wire_free(f->wire);
+    else
+        free(f->wire);
+    f->wire = NULL;
+    f->wire_free = NULL;
+}
+
+/******************************************************************************
+Description.: free all frame slots of an input, nobody may hold a reference
+              to one of them anymore
+Input Value.: in is the input to clean up
+Return Value: -
+******************************************************************************/
+void frame_ring_free(input *in)
+{
+    int i;
+
+    for(i = 0; i < FRAME_RING_SIZE; i++) {
+        if(in->ring[i] == NULL)
+            continue;
+        free(in->ring[i]->buf);
+        free(in->ring[i]->raw);
+        frame_wire_free(in->ring[i]);
+        pthread_mutex_destroy(&in->ring[i]->encode_lock);
+        free(in->ring[i]);
+        in->ring[i] = NULL;
+    }
+    in->latest = NULL;
+}
+
+/******************************************************************************
+Description.: wake up the event loops registered with frame_listen()
+Input Value.: in is the input
+Return Value: -
+******************************************************************************/
+static void frame_signal_listeners(input *in)
+{
+    uint64_t one = 1;
+    int i, fd;
+
+    for(i = 0; i < FRAME_LISTENERS; i++) {
+        if((fd = __atomic_load_n(&in->listeners[i], __ATOMIC_ACQUIRE)) != 0 &&
+           write(fd - 1, &one, sizeof(one)) < 0) {
+            DBG("could not signal listener %d\n", fd - 1);
+        }
+    }
+}
+
+/******************************************************************************
+Description.: release the pictures of an input which was stopped for good.
+              Consumers sleeping in frame_wait() get NULL and event loops
+              are signalled, from now on frame_retired() tells them the
+              input is gone.
+              Consumers which looked the input up just before may still
+              take a reference to a frame, so the slots themselves stay
+              allocated. Idle slots are claimed and keep that reference,
+              their buffers are freed. Slots somebody still holds keep
+              their buffers as well.
+Input Value.: in is the input, its threads must have terminated
+Return Value: -
+******************************************************************************/
+void frame_ring_retire(input *in)
+{
+    frame *f;
+    int i;
+
+    /* under the mutex, a consumer about to sleep in frame_wait() sees it */
+    frame_lock(in);
+    __atomic_store_n(&in->retired, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&in->db_update);
+    pthread_mutex_unlock(&in->db);
+    frame_signal_listeners(in);
+
+    /* frame_get() only keeps a reference to the latest frame */
+    frame_put(__atomic_exchange_n(&in->latest, NULL, __ATOMIC_ACQ_REL));
+
+    for(i = 0; i < FRAME_RING_SIZE; i++) {
+        if((f = in->ring[i]) == NULL || !__sync_bool_compare_and_swap(&f->refcount, 0, 1))
+            continue;
+        free(f->buf);
+        free(f->raw);
+        f->buf = f->raw = NULL;
+        f->size = f->capacity = 0;
+        f->raw_size = f->raw_capacity = 0;
+        frame_wire_free(f);
+    }
+}
+
+/******************************************************************************
+Description.: get an unused frame slot to fill with a new picture. The caller
+              owns the returned frame exclusively until frame_publish() or
+              frame_put() is called for it.
+Input Value.: in is the input which produces the frame
+Return Value: the frame or NULL if every slot is still referenced
+******************************************************************************/
+frame *frame_acquire(input *in)
+{
+    int i;
+
+    __atomic_add_fetch(&in->frames_captured, 1, __ATOMIC_RELAXED);
+
+    for(i = 0; i < FRAME_RING_SIZE; i++) {
+        frame *f = in->ring[i];
+
+        if(f == NULL) {
+            if((f = calloc(1, sizeof(frame))) == NULL) {
+                fprintf(stderr, "could not allocate memory for frame\n");
+                __atomic_add_fetch(&in->frames_dropped, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            f->refcount = 1;
+            f->in = in;
+            f->quality = -1;
+            pthread_mutex_init(&f->encode_lock, NULL);
+            in->ring[i] = f;
+            return f;
+        }
+
+        /* claim the slot, consumers only ever increment referenced frames */
+        if(__sync_bool_compare_and_swap(&f->refcount, 0, 1)) {
+            f->size = 0;
+            f->raw_size = 0;
+            f->jpeg = FRAME_JPEG_PENDING;
+            f->encode = NULL;
+            f->width = f->height = 0;
+            f->format = 0;
+            f->quality = -1;
+            frame_wire_free(f);
+            timerclear(&f->captured);
+            timerclear(&f->encoded);
+            return f;
+        }
+    }
+
+    DBG("all %d frame slots are in use\n", FRAME_RING_SIZE);
+    __atomic_add_fetch(&in->frames_dropped, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/******************************************************************************
+Description.: grow a frame buffer, the content is preserved
+Input Value.: buf and capacity describe the buffer, size the bytes needed
+Return Value: 0 if everything is OK, -1 if memory could not be allocated
+******************************************************************************/
+static int frame_grow(unsigned char **buf, int *capacity, int size)
+{
+    unsigned char *tmp;
+
+    if(size <= *capacity)
+        return 0;
+
+    if((tmp = realloc(*buf, size)) == NULL) {
+        fprintf(stderr, "could not allocate memory for frame\n");
+        return -1;
+    }
+
+    *buf = tmp;
+    *capacity = size;
+    return 0;
+}
+
+/******************************************************************************
+Description.: make sure the JPG buffer of a frame can hold at least size bytes
+Input Value.: f is the frame, size the number of bytes needed
+Return Value: 0 if everything is OK, -1 if memory could not be allocated
+******************************************************************************/
+int frame_reserve(frame *f, int size)
+{
+    return frame_grow(&f->buf, &f->capacity, size);
+}
+
+/******************************************************************************
+Description.: make sure the raw buffer of a frame can hold at least size bytes
+Input Value.: f is the frame, size the number of bytes needed
+Return Value: 0 if everything is OK, -1 if memory could not be allocated
+******************************************************************************/
+int frame_reserve_raw(frame *f, int size)
+{
+    return frame_grow(&f->raw, &f->raw_capacity, size);
+}
+
+/******************************************************************************
+Description.: make a completely filled frame the latest frame of the input
+              and signal it to all consumers. The reference obtained with
+              frame_acquire() is handed over to the input.
+              The new frame is published with an atomic pointer swap, the
+              mutex is only taken if a consumer sleeps in frame_wait().
+Input Value.: in is the input, f the frame returned by frame_acquire()
+Return Value: -
+******************************************************************************/
+void frame_publish(input *in, frame *f)
+{
+    frame *old;
+
+    /* in->seq is only ever written here, by the single input thread */
+    f->seq = in->seq + 1;
+    frame_clock(&f->published);
+    if(f->encode == NULL) {
+        f->jpeg = FRAME_JPEG_READY;
+        if(f->encoded.tv_sec == 0)
+            f->encoded = f->published;
+        __atomic_add_fetch(&in->frames_encoded, 1, __ATOMIC_RELAXED);
+    }
+    if(trace_enabled && f->captured.tv_sec != 0) {
+        if(f->encode == NULL)
+            trace_record(&in->trace[TRACE_ENCODE], frame_elapsed_us(&f->captured, &f->encoded));
+        trace_record(&in->trace[TRACE_PUBLISH], frame_elapsed_us(&f->captured, &f->published));
+    }
+
+    old = __atomic_exchange_n(&in->latest, f, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&in->seq, f->seq, __ATOMIC_SEQ_CST);
+
+    /*
+     * pairs with frame_wait(), a consumer either sees the new sequence
+     * number or it is already counted in waiters and gets woken up
+     */
+    if(__atomic_load_n(&in->waiters, __ATOMIC_SEQ_CST) > 0) {
+        frame_lock(in);
+        pthread_cond_broadcast(&in->db_update);
+        pthread_mutex_unlock(&in->db);
+    }
+
+    /* same pairing for event loops, they check frame_poll() after frame_listen() */
+    if(__atomic_load_n(&in->listening, __ATOMIC_SEQ_CST) > 0)
+        frame_signal_listeners(in);
+
+    if(old != NULL)
+        frame_put(old);
+}
+
+/******************************************************************************
+Description.: position a cursor at the latest frame, so that the next
+              frame_wait() only returns a frame published after this call
+Input Value.: in is the input to read from, cur the cursor to initialize
+Return Value: -
+******************************************************************************/
+void frame_cursor_init(input *in, frame_cursor *cur)
+{
+    cur->seq = __atomic_load_n(&in->seq, __ATOMIC_ACQUIRE);
+    cur->skipped = 0;
+}
+
+/******************************************************************************
+Description.: take a reference to the latest frame without waiting and
+              without any lock. Between reading the pointer and taking the
+              reference the input may have replaced the frame and even
+              started to refill that slot, so the pointer is read again and
+              the reference is only kept if it is still the latest frame.
+              Slots are never freed while the input runs, so touching the
+              refcount of a recycled slot is harmless.
+Input Value.: in is the input to read from
+Return Value: the frame, NULL if the input did not publish a frame yet.
+              Release it with frame_put().
+******************************************************************************/
+frame *frame_get(input *in)
+{
+    frame *f;
+
+    while((f = __atomic_load_n(&in->latest, __ATOMIC_ACQUIRE)) != NULL) {
+        __atomic_fetch_add(&f->refcount, 1, __ATOMIC_ACQ_REL);
+        if(f == __atomic_load_n(&in->latest, __ATOMIC_ACQUIRE))
+            break;
+        frame_put(f);
+    }
+
+    return f;
+}
+
+/******************************************************************************
+Description.: cleanup handler, consumers get cancelled while they wait
+Input Value.: in is the input the consumer was waiting for
+Return Value: -
+******************************************************************************/
+static void frame_wait_cleanup(void *arg)
+{
+    input *in = arg;
+
+    __atomic_fetch_sub(&in->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&in->db);
+}
+
+/******************************************************************************
+Description.: take a reference to the first frame newer than the cursor
+              without waiting. Frames the consumer missed in between are
+              added to cur->skipped.
+Input Value.: in is the input to read from, cur the read position of the
+              consumer which gets advanced to the returned frame
+Return Value: the frame, NULL if nothing newer was published yet or the
+              input was retired. Release it with frame_put().
+******************************************************************************/
+frame *frame_poll(input *in, frame_cursor *cur)
+{
+    frame *f;
+
+    if(__atomic_load_n(&in->retired, __ATOMIC_SEQ_CST) ||
+       __atomic_load_n(&in->seq, __ATOMIC_SEQ_CST) == cur->seq ||
+       (f = frame_get(in)) == NULL)
+        return NULL;
+
+    /* a zero cursor has not seen any frame yet, nothing was skipped */
+    if(cur->seq != 0)
+        cur->skipped += f->seq - cur->seq - 1;
+    cur->seq = f->seq;
+
+    return f;
+}
+
+/******************************************************************************
+Description.: take a reference to the first frame newer than the cursor.
+              If such a frame was already published this returns at once
+              without touching the mutex, otherwise it sleeps until the
+              input publishes one.
+              Frames the consumer missed in between are added to
+              cur->skipped.
+Input Value.: in is the input to read from, cur the read position of the
+              consumer which gets advanced to the returned frame
+Return Value: the frame, release it with frame_put(). NULL once the input
+              was retired, it never publishes frames again.
+******************************************************************************/
+frame *frame_wait(input *in, frame_cursor *cur)
+{
+    frame *f;
+
+    while((f = frame_poll(in, cur)) == NULL) {
+        if(frame_retired(in))
+            return NULL;
+
+        frame_lock(in);
+        __atomic_fetch_add(&in->waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_cleanup_push(frame_wait_cleanup, in);
+
+        /* an idle input has to produce a frame for this consumer */
+        pthread_cond_broadcast(&in->demand);
+
+        while(__atomic_load_n(&in->seq, __ATOMIC_SEQ_CST) == cur->seq &&
+              !__atomic_load_n(&in->retired, __ATOMIC_SEQ_CST))
+            pthread_cond_wait(&in->db_update, &in->db);
+
+        pthread_cleanup_pop(1);
+    }
+
+    return f;
+}
+
+/******************************************************************************
+Description.: check if an input was taken out of service. Event loops look
+              at it when frame_poll() returns nothing after a signal.
+Input Value.: in is the input
+Return Value: 1 if the input was retired, 0 otherwise
+******************************************************************************/
+int frame_retired(input *in)
+{
+    return __atomic_load_n(&in->retired, __ATOMIC_SEQ_CST);
+}
+
+/******************************************************************************
+Description.: let frame_publish() signal an eventfd, so event loops can wait
+              for frames of several inputs together with their sockets.
+              Registering does not create demand, listeners subscribe as
+              well if the input has to capture for them. After registering,
+              the caller has to check frame_poll() once, a frame published
+              before that is not signalled.
+Input Value.: in is the input, fd an eventfd (or pipe) to write to
+Return Value: 0 if everything is OK, -1 if all listener slots are in use
+******************************************************************************/
+int frame_listen(input *in, int fd)
+{
+    int i;
+
+    for(i = 0; i < FRAME_LISTENERS; i++) {
+        if(__sync_bool_compare_and_swap(&in->listeners[i], 0, fd + 1)) {
+            __atomic_fetch_add(&in->listening, 1, __ATOMIC_SEQ_CST);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/******************************************************************************
+Description.: remove a listener added with frame_listen(). A publish running
+              concurrently may still signal the fd once, so it has to stay
+              open a while longer.
+Input Value.: in is the input, fd the listener
+Return Value: -
+******************************************************************************/
+void frame_unlisten(input *in, int fd)
+{
+    int i;
+
+    for(i = 0; i < FRAME_LISTENERS; i++) {
+        if(__sync_bool_compare_and_swap(&in->listeners[i], fd + 1, 0)) {
+            __atomic_fetch_sub(&in->listening, 1, __ATOMIC_SEQ_CST);
+            return;
+        }
+    }
+}
+
+/******************************************************************************
+Description.: register a consumer which reads frames continuously, e.g. a
+              stream client. As long as at least one consumer is subscribed
+              the input keeps capturing at full rate. Waking up an idle input
+              needs the mutex, but only on the transition from zero.
+Input Value.: in is the input to read from
+Return Value: -
+******************************************************************************/
+void frame_subscribe(input *in)
+{
+    if(__atomic_fetch_add(&in->subscribers, 1, __ATOMIC_SEQ_CST) == 0) {
+        frame_lock(in);
+        pthread_cond_broadcast(&in->demand);
+        pthread_mutex_unlock(&in->db);
+    }
+}
+
+/******************************************************************************
+Description.: unregister a consumer added with frame_subscribe()
+Input Value.: in is the input the consumer was reading from
+Return Value: -
+******************************************************************************/
+void frame_unsubscribe(input *in)
+{
+    __atomic_fetch_sub(&in->subscribers, 1, __ATOMIC_SEQ_CST);
+}
+
+/******************************************************************************
+Description.: check if anybody is interested in new frames of an input, that
+              is a subscribed consumer or one sleeping in frame_wait()
+Input Value.: in is the input
+Return Value: 1 if frames are wanted, 0 if the input may idle
+******************************************************************************/
+int frame_demand(input *in)
+{
+    return __atomic_load_n(&in->subscribers, __ATOMIC_SEQ_CST) > 0 ||
+           __atomic_load_n(&in->waiters, __ATOMIC_SEQ_CST) > 0;
+}
+
+/******************************************************************************
+Description.: cleanup handler, the input gets cancelled while it is idle
+Input Value.: in is the idle input
+Return Value: -
+******************************************************************************/
+static void frame_idle_cleanup(void *arg)
+{
+    input *in = arg;
+
+    pthread_mutex_unlock(&in->db);
+}
+
+/******************************************************************************
+Description.: block the input thread while no consumer wants frames. It
+              returns as soon as a consumer subscribes or starts waiting in
+              frame_wait(), so resuming costs a wakeup and not a frame period.
+Input Value.: in is the input
+              timeout_ms limits the time to sleep, so the input can still
+              publish keep-alive frames. 0 sleeps until there is demand.
+Return Value: 1 if there is demand, 0 if the timeout expired
+******************************************************************************/
+int frame_idle(input *in, int timeout_ms)
+{
+    struct timespec deadline;
+    int rc = 0;
+
+    if(frame_demand(in))
+        return 1;
+
+    if(timeout_ms > 0) {
+        /* in->demand uses this clock, see load_input() */
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    frame_lock(in);
+    pthread_cleanup_push(frame_idle_cleanup, in);
+
+    while(!frame_demand(in) && rc == 0) {
+        if(timeout_ms > 0)
+            rc = pthread_cond_timedwait(&in->demand, &in->db, &deadline);
+        else
+            pthread_cond_wait(&in->demand, &in->db);
+    }
+
+    pthread_cleanup_pop(1);
+
+    return frame_demand(in);
+}
+
+/******************************************************************************
+Description.: get the data a consumer attached to a frame
+Input Value.: f is a frame the caller holds a reference to
+Return Value: the data or NULL if nothing was attached yet
+******************************************************************************/
+void *frame_wire(frame *f)
+{
+    return __atomic_load_n(&f->wire, __ATOMIC_ACQUIRE);
+}
+
+/******************************************************************************
+Description.: attach data to a frame which all consumers can share, it lives
+              as long as the frame and needs no reference of its own. If
+              several consumers attach at the same time the first one wins.
+Input Value.: f is a frame the caller holds a reference to, wire is the data.
+              Ownership passes to the frame, it is freed with release, or
+              with free() if release is NULL.
+Return Value: the data attached to the frame, wire or what was there before
+******************************************************************************/
+void *frame_wire_attach(frame *f, void *wire, void (*release)(void *wire))
+{
+    void *old = NULL;
+
+    /* nobody calls wire_free before the caller dropped its reference */
+    if(__atomic_compare_exchange_n(&f->wire, &old, wire, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        f->wire_free = release;
+        return wire;
+    }
+
+    if(release != NULL)
+        release(wire);
+    else
+        free(wire);
+    return old;
+}
+
+/******************************************************************************
+Description.: make sure buf/size of a frame contain the JPG data. If the input
+              published only the raw picture the first caller encodes it,
+              all others wait for that and then share the result.
+Input Value.: f is a frame the caller holds a reference to
+Return Value: 0 if buf is valid, -1 if encoding failed
+******************************************************************************/
+int frame_jpeg(frame *f)
+{
+    int state;
+
+    if((state = __atomic_load_n(&f->jpeg, __ATOMIC_ACQUIRE)) == FRAME_JPEG_PENDING) {
+        pthread_mutex_lock(&f->encode_lock);
+        if((state = f->jpeg) == FRAME_JPEG_PENDING) {
+            state = (f->encode(f) == 0) ? FRAME_JPEG_READY : FRAME_JPEG_FAILED;
+            frame_clock(&f->encoded);
+            __atomic_add_fetch((state == FRAME_JPEG_READY) ? &f->in->frames_encoded : &f->in->frames_dropped,
+                               1, __ATOMIC_RELAXED);
+            if(trace_enabled && f->captured.tv_sec != 0)
+                trace_record(&f->in->trace[TRACE_ENCODE], frame_elapsed_us(&f->captured, &f->encoded));
+            __atomic_store_n(&f->jpeg, state, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&f->encode_lock);
+    }
+
+    return (state == FRAME_JPEG_READY) ? 0 : -1;
+}
+
+/******************************************************************************
+Description.: take another reference to a frame, e.g. for a thread the
+              caller hands the frame to
+Input Value.: f is a frame the caller holds a reference to
+Return Value: f
+******************************************************************************/
+frame *frame_hold(frame *f)
+{
+    __atomic_fetch_add(&f->refcount, 1, __ATOMIC_RELAXED);
+    return f;
+}
+
+/******************************************************************************
+Description.: drop a reference, the slot gets reused once nobody holds it
+Input Value.: f is the frame, NULL is ignored
+Return Value: -
+******************************************************************************/
+void frame_put(frame *f)
+{
+    if(f == NULL)
+        return;
+
+    __atomic_fetch_sub(&f->refcount, 1, __ATOMIC_RELEASE);
+}
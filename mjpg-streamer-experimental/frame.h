@@ -0,0 +1,147 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <sys/time.h>
+#include <pthread.h>
+
+struct _input;
+
+/*
+ * Number of frame slots each input keeps. Slots are allocated on first use,
+ * a slot can be reused as soon as no consumer holds a reference to it any more.
+ * If all slots are referenced the input has to drop the frame it just grabbed.
+ */
+#define FRAME_RING_SIZE 16
+
+/*
+ * Number of event file descriptors each input can signal on publish, see
+ * frame_listen(). Event loops register one per thread, not one per client.
+ */
+#define FRAME_LISTENERS 64
+
+/* states of the JPG data in buf */
+#define FRAME_JPEG_PENDING 0    /* not encoded yet, see frame_jpeg() */
+#define FRAME_JPEG_READY   1
+#define FRAME_JPEG_FAILED  2
+
+/*
+ * A single frame. The input fills a frame it got from frame_acquire() and
+ * hands it over with frame_publish(). From that moment on the frame is
+ * immutable, consumers read the metadata and raw directly while they hold a
+ * reference.
+ *
+ * An input may publish just the raw picture and set encode. The JPG is then
+ * created by the first consumer calling frame_jpeg(), so nothing is encoded
+ * for frames nobody looks at. JPG consumers must call frame_jpeg() before
+ * they touch buf/size.
+ */
+typedef struct _frame frame;
+struct _frame {
+    int refcount;               /* modified atomically, 0 means the slot is unused */
+    struct _input *in;          /* the input which owns the slot */
+    unsigned int seq;           /* assigned by frame_publish(), starts at 1 */
+
+    /* JPG data */
+    unsigned char *buf;
+    int size;                   /* bytes used in buf */
+    int capacity;               /* bytes allocated for buf */
+    int jpeg;                   /* FRAME_JPEG_*, modified atomically */
+
+    /* raw picture as captured, only used by inputs which encode lazily */
+    unsigned char *raw;
+    int raw_size;
+    int raw_capacity;
+
+    /* fills buf/size from raw, NULL if the input already filled buf */
+    int (*encode)(frame *f);
+    pthread_mutex_t encode_lock;
+
+    /* v4l2_buffer timestamp, or the time the frame was grabbed */
+    struct timeval timestamp;
+
+    /* metadata, 0 or -1 if the input does not know the value */
+    int width;
+    int height;
+    unsigned int format;        /* V4L2_PIX_FMT_* of raw, V4L2_PIX_FMT_MJPEG if there is only buf */
+    int quality;                /* JPG quality buf is encoded with */
+
+    /*
+     * data a consumer derived from the frame, e.g. protocol headers, shared
+     * by all its clients. Set once with frame_wire_attach(), freed with
+     * wire_free or free() when the slot gets reused.
+     */
+    void *wire;
+    void (*wire_free)(void *wire);
+
+    /* processing stages, taken with frame_clock() */
+    struct timeval captured;    /* the input got the picture */
+    struct timeval encoded;     /* buf is complete */
+    struct timeval published;   /* set by frame_publish() */
+};
+
+/*
+ * Read position of a single consumer. A zeroed cursor returns the latest
+ * frame immediately, frame_cursor_init() makes the first frame_wait() block
+ * until a fresh frame gets published.
+ */
+typedef struct _frame_cursor frame_cursor;
+struct _frame_cursor {
+    unsigned int seq;           /* sequence number of the last frame returned */
+    unsigned int skipped;       /* frames published but never seen by this consumer */
+};
+
+void frame_clock(struct timeval *tv);
+long frame_elapsed_us(const struct timeval *from, const struct timeval *to);
+void frame_probe_jpeg(frame *f);
+
+int frame_ring_init(struct _input *in);
+void frame_ring_free(struct _input *in);
+void frame_ring_retire(struct _input *in);
+
+/* producer side */
+frame *frame_acquire(struct _input *in);
+int frame_reserve(frame *f, int size);
+int frame_reserve_raw(frame *f, int size);
+void frame_publish(struct _input *in, frame *f);
+int frame_demand(struct _input *in);
+int frame_idle(struct _input *in, int timeout_ms);
+
+/* consumer side */
+void frame_cursor_init(struct _input *in, frame_cursor *cur);
+frame *frame_get(struct _input *in);
+frame *frame_wait(struct _input *in, frame_cursor *cur);
+frame *frame_poll(struct _input *in, frame_cursor *cur);
+int frame_retired(struct _input *in);
+int frame_listen(struct _input *in, int fd);
+void frame_unlisten(struct _input *in, int fd);
+void frame_subscribe(struct _input *in);
+void frame_unsubscribe(struct _input *in);
+int frame_jpeg(frame *f);
+void *frame_wire(frame *f);
+void *frame_wire_attach(frame *f, void *wire, void (*release)(void *wire));
+frame *frame_hold(frame *f);
+void frame_put(frame *f);
+
+#endif
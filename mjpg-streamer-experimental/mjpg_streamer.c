@@ -45,6 +45,9 @@
 /* globals */
 static globals global;
 
+/* serializes adding and removing plugins */
+static pthread_mutex_t registry = PTHREAD_MUTEX_INITIALIZER;
+
 /******************************************************************************
 Description.: Display a help message
 Input Value.: argv[0] is the program name and the parameter progname
@@ -58,7 +61,10 @@ static void help(char *progname)
             "  -o | --output \"<output-plugin.so> [parameters]\"\n" \
             " [-h | --help ]........: display this help\n" \
             " [-v | --version ].....: display version information\n" \
-            " [-b | --background]...: fork to the background, daemon mode\n", progname);
+            " [-b | --background]...: fork to the background, daemon mode\n" \
+            " [-t | --trace ].......: record latency histograms of the frame stages\n" \
+            " [-p | --plugins <folder>]: allow commands to add and remove plugins,\n" \
+            "                          which are loaded from this folder only\n", progname);
     fprintf(stderr, "-----------------------------------------------------------------------\n");
     fprintf(stderr, "Example #1:\n" \
             " To open an UVC webcam \"/dev/video1\" and stream it via HTTP:\n" \
@@ -102,48 +108,35 @@ static void signal_handler(int sig)
     /* clean up threads */
     LOG("force cancellation of threads and cleanup resources\n");
     for(i = 0; i < global.incnt; i++) {
-        global.in[i].stop(i);
-        /*for (j = 0; j<MAX_PLUGIN_ARGUMENTS; j++) {
-            if (global.in[i].param.argv[j] != NULL) {
-                free(global.in[i].param.argv[j]);
-            }
-        }*/
+        if(global.in[i]->handle == NULL)
+            continue;
+        global.in[i]->stop(i);
     }
 
     for(i = 0; i < global.outcnt; i++) {
-        global.out[i].stop(global.out[i].param.id);
-        pthread_cond_destroy(&global.in[i].db_update);
-        pthread_mutex_destroy(&global.in[i].db);
-        /*for (j = 0; j<MAX_PLUGIN_ARGUMENTS; j++) {
-            if (global.out[i].param.argv[j] != NULL)
-                free(global.out[i].param.argv[j]);
-        }*/
+        if(global.out[i]->handle == NULL)
+            continue;
+        global.out[i]->stop(global.out[i]->param.id);
     }
     usleep(1000 * 1000);
 
     /* close handles of input plugins */
     for(i = 0; i < global.incnt; i++) {
-        dlclose(global.in[i].handle);
+        if(global.in[i]->handle == NULL)
+            continue;
+        pthread_cond_destroy(&global.in[i]->db_update);
+        pthread_cond_destroy(&global.in[i]->demand);
+        pthread_mutex_destroy(&global.in[i]->db);
+        dlclose(global.in[i]->handle);
     }
 
+    /* every dlopen() of an output plugin is paired with a dlclose() */
     for(i = 0; i < global.outcnt; i++) {
-        int j, skip = 0;
-        DBG("about to decrement usage counter for handle of %s, id #%02d, handle: %p\n", \
-            global.out[i].plugin, global.out[i].param.id, global.out[i].handle);
-
-        for(j=i+1; j<global.outcnt; j++) {
-          if ( global.out[i].handle == global.out[j].handle ) {
-            DBG("handles are pointing to the same destination (%p == %p)\n", global.out[i].handle, global.out[j].handle);
-            skip = 1;
-          }
-        }
-        if ( skip ) {
-          continue;
-        }
-
-        DBG("closing handle %p\n", global.out[i].handle);
-
-        dlclose(global.out[i].handle);
+        if(global.out[i]->handle == NULL)
+            continue;
+        DBG("closing handle %p of %s, id #%02d\n", \
+            global.out[i]->handle, global.out[i]->plugin, global.out[i]->param.id);
+        dlclose(global.out[i]->handle);
     }
     DBG("all plugin handles closed\n");
 
@@ -173,6 +166,7 @@ static int split_parameters(char *parameter_string, int *argc, char **argv)
                     count++;
                     if(count >= MAX_PLUGIN_ARGUMENTS) {
                         IPRINT("ERROR: too many arguments to input plugin\n");
+                        free(arg);
                         return 0;
                     }
                 }
@@ -184,6 +178,422 @@ static int split_parameters(char *parameter_string, int *argc, char **argv)
     return 1;
 }
 
+/******************************************************************************
+Description.: free the arguments split_parameters() allocated
+Input Value.: argv is the argument vector, argv[0] belongs to the plugin
+Return Value: -
+******************************************************************************/
+static void free_parameters(char **argv)
+{
+    int j;
+
+    for(j = 1; j < MAX_PLUGIN_ARGUMENTS; j++) {
+        free(argv[j]);
+        argv[j] = NULL;
+    }
+}
+
+/******************************************************************************
+Description.: append a new, zeroed slot to a plugin table. Slots are
+              allocated once and never move, so plugins and their consumers
+              can keep pointers to them. The table itself is replaced when it
+              grows, the old one is not freed because other threads may still
+              read from it. The new table is published before the counter, so
+              every index below the counter is valid in whatever table a
+              reader sees.
+Input Value.: table points to the slot table, count to the number of slots,
+              item_size is the size of a slot
+Return Value: the id of the new slot, -1 if there is not enough memory
+******************************************************************************/
+static int grow_table(void ***table, int *count, size_t item_size)
+{
+    void **grown, *slot;
+
+    if((slot = calloc(1, item_size)) == NULL)
+        return -1;
+
+    if((grown = malloc((*count + 1) * sizeof(void *))) == NULL) {
+        free(slot);
+        return -1;
+    }
+    if(*count > 0)
+        memcpy(grown, *table, *count * sizeof(void *));
+    grown[*count] = slot;
+
+    __atomic_store_n(table, grown, __ATOMIC_RELEASE);
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELEASE);
+
+    return *count - 1;
+}
+
+/******************************************************************************
+Description.: split a plugin specification like "input_uvc.so -d /dev/video1"
+              into the file name of the plugin and its parameters
+Input Value.: spec is the specification, it gets copied
+              plugin and parameters receive pointers into the copy,
+              parameters is NULL if the plugin has no parameters
+Return Value: the copy which must be freed once the plugin is gone,
+              NULL if there is not enough memory
+******************************************************************************/
+static char *split_spec(const char *spec, char **plugin, char **parameters)
+{
+    char *copy, *space;
+
+    if((copy = strdup(spec)) == NULL)
+        return NULL;
+
+    if((space = strchr(copy, ' ')) != NULL) {
+        *plugin = strndup(copy, space - copy);
+        *parameters = space;
+    } else {
+        *plugin = strdup(copy);
+        *parameters = NULL;
+    }
+
+    if(*plugin == NULL) {
+        free(copy);
+        return NULL;
+    }
+
+    return copy;
+}
+
+/******************************************************************************
+Description.: open the library of a plugin. Plugins added by a command are
+              only loaded from the folder given with "--plugins", their file
+              name must not point anywhere else.
+Input Value.: kind is "input" or "output" for the messages
+              folder is the plugin folder, NULL to search the library the
+              way dlopen() does, plugin is the file name
+Return Value: the handle, NULL if the plugin can not be opened
+******************************************************************************/
+static void *open_plugin(const char *kind, const char *folder, const char *plugin)
+{
+    void *handle;
+    char *path = NULL;
+
+    if(folder != NULL) {
+        if(*plugin == '\0' || strchr(plugin, '/') != NULL) {
+            LOG("ERROR: %s plugin \"%s\" must be a file name in %s\n", kind, plugin, folder);
+            return NULL;
+        }
+        if((path = malloc(strlen(folder) + strlen(plugin) + 2)) == NULL) {
+            LOG("not enough memory for %s plugin\n", kind);
+            return NULL;
+        }
+        sprintf(path, "%s/%s", folder, plugin);
+    }
+
+    if((handle = dlopen((path != NULL) ? path : plugin, RTLD_LAZY)) == NULL) {
+        LOG("ERROR: could not find %s plugin %s\n", kind, plugin);
+        if(folder == NULL) {
+            LOG("       Perhaps you want to adjust the search path with:\n");
+            LOG("       # export LD_LIBRARY_PATH=/path/to/plugin/folder\n");
+        }
+        LOG("       dlopen: %s\n", dlerror());
+    }
+
+    free(path);
+    return handle;
+}
+
+/******************************************************************************
+Description.: release everything load_input() allocated for an input which
+              could not be loaded, the slot can be reused afterwards. No
+              consumer could see the input, its handle was never published.
+              The library is not closed, init may have left state behind.
+Input Value.: in is the input
+Return Value: -
+******************************************************************************/
+static void free_input(input *in)
+{
+    frame_ring_free(in);
+    pthread_cond_destroy(&in->db_update);
+    pthread_cond_destroy(&in->demand);
+    pthread_mutex_destroy(&in->db);
+
+    free_parameters(in->param.argv);
+    free(in->name);
+    free(in->plugin);
+    in->name = in->plugin = NULL;
+
+    /* marks the slot as unused */
+    free(in->spec);
+    in->spec = NULL;
+}
+
+/******************************************************************************
+Description.: take an input out of service whose threads are gone. Consumers
+              check the handle, see INPUT_VALID(), but one which looked the
+              input up just before may still lock its mutex, take a frame or
+              read its name. So the slot is never reused and only the frame
+              buffers nobody holds are released. The library stays open as
+              well.
+Input Value.: in is the input
+Return Value: -
+******************************************************************************/
+static void retire_input(input *in)
+{
+    __atomic_store_n(&in->handle, NULL, __ATOMIC_RELEASE);
+    frame_ring_retire(in);
+}
+
+/******************************************************************************
+Description.: release everything load_output() allocated for an output which
+              could not be loaded, the slot can be reused afterwards
+Input Value.: out is the output
+Return Value: -
+******************************************************************************/
+static void free_output(output *out)
+{
+    free_parameters(out->param.argv);
+    free(out->name);
+    free(out->plugin);
+    out->name = out->plugin = NULL;
+
+    free(out->spec);
+    out->spec = NULL;
+}
+
+/******************************************************************************
+Description.: open an input plugin and initialize it, the plugin is not
+              started yet. Only slots of inputs which failed to load get
+              reused, removed inputs stay retired.
+Input Value.: spec is the plugin file name followed by its parameters
+              folder is passed to open_plugin()
+Return Value: the id of the input, -1 if the plugin can not be loaded,
+              -2 if its init function signals to exit (e.g. "--help")
+******************************************************************************/
+static int load_input(const char *spec, const char *folder)
+{
+    input *in;
+    pthread_condattr_t monotonic;
+    void *handle;
+    int id, rc;
+
+    for(id = 0; id < global.incnt; id++) {
+        if(global.in[id]->spec == NULL)
+            break;
+    }
+    if(id == global.incnt && grow_table((void ***)&global.in, &global.incnt, sizeof(input)) < 0) {
+        LOG("not enough memory for input plugin\n");
+        return -1;
+    }
+    in = global.in[id];
+    memset(in, 0, sizeof(input));
+
+    /* this mutex and the conditional variable are used to synchronize access to the global picture buffer */
+    if(pthread_mutex_init(&in->db, NULL) != 0) {
+        LOG("could not initialize mutex variable\n");
+        return -1;
+    }
+    /* frame_idle() waits for demand with a deadline, setting the clock must not shift it */
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+    rc = pthread_cond_init(&in->demand, &monotonic);
+    pthread_condattr_destroy(&monotonic);
+    if(pthread_cond_init(&in->db_update, NULL) != 0 || rc != 0) {
+        LOG("could not initialize condition variable\n");
+        return -1;
+    }
+
+    if(frame_ring_init(in) != 0) {
+        LOG("could not initialize frame ring\n");
+        return -1;
+    }
+
+    if((in->spec = split_spec(spec, &in->plugin, &in->param.parameters)) == NULL) {
+        LOG("not enough memory for input plugin\n");
+        return -1;
+    }
+
+    if((handle = open_plugin("input", folder, in->plugin)) == NULL)
+        goto fail;
+    in->init = dlsym(handle, "input_init");
+    in->stop = dlsym(handle, "input_stop");
+    in->run = dlsym(handle, "input_run");
+    if(in->init == NULL || in->stop == NULL || in->run == NULL) {
+        LOG("%s\n", dlerror());
+        goto fail;
+    }
+    /* try to find optional command */
+    in->cmd = dlsym(handle, "input_cmd");
+
+    split_parameters(in->param.parameters, &in->param.argc, in->param.argv);
+    in->param.global = &global;
+    in->param.id = id;
+
+    if(in->init(&in->param, id)) {
+        LOG("input_init() return value signals to exit\n");
+        free_input(in);
+        return -2;
+    }
+
+    /* from now on consumers may use the input, see INPUT_VALID() */
+    __atomic_store_n(&in->handle, handle, __ATOMIC_RELEASE);
+
+    return id;
+
+fail:
+    free_input(in);
+    return -1;
+}
+
+/******************************************************************************
+Description.: open an output plugin and initialize it, the plugin is not
+              started yet
+Input Value.: spec is the plugin file name followed by its parameters
+              folder is passed to open_plugin()
+Return Value: the id of the output, -1 if the plugin can not be loaded or
+              its init function signals to exit
+******************************************************************************/
+static int load_output(const char *spec, const char *folder)
+{
+    output *out;
+    void *handle;
+    int id;
+
+    for(id = 0; id < global.outcnt; id++) {
+        if(global.out[id]->spec == NULL)
+            break;
+    }
+    if(id == global.outcnt && grow_table((void ***)&global.out, &global.outcnt, sizeof(output)) < 0) {
+        LOG("not enough memory for output plugin\n");
+        return -1;
+    }
+    out = global.out[id];
+    memset(out, 0, sizeof(output));
+
+    if((out->spec = split_spec(spec, &out->plugin, &out->param.parameters)) == NULL) {
+        LOG("not enough memory for output plugin\n");
+        return -1;
+    }
+
+    if((handle = open_plugin("output", folder, out->plugin)) == NULL)
+        goto fail;
+    out->init = dlsym(handle, "output_init");
+    out->stop = dlsym(handle, "output_stop");
+    out->run = dlsym(handle, "output_run");
+    if(out->init == NULL || out->stop == NULL || out->run == NULL) {
+        LOG("%s\n", dlerror());
+        goto fail;
+    }
+
+    /* try to find optional command */
+    out->cmd = dlsym(handle, "output_cmd");
+
+    split_parameters(out->param.parameters, &out->param.argc, out->param.argv);
+    out->param.global = &global;
+    out->param.id = id;
+
+    if(out->init(&out->param, id)) {
+        LOG("output_init() return value signals to exit\n");
+        goto fail;
+    }
+
+    __atomic_store_n(&out->handle, handle, __ATOMIC_RELEASE);
+
+    return id;
+
+fail:
+    free_output(out);
+    return -1;
+}
+
+/******************************************************************************
+Description.: load, initialize and start a plugin while the others keep
+              running, e.g. triggered by a command of output_http. This is
+              only allowed if a plugin folder was given with "--plugins".
+Input Value.: dest is Dest_Input or Dest_Output
+              spec is the plugin file name followed by its parameters, just
+              like the argument of the "-i" and "-o" command line options.
+              The file name must not contain a path.
+Return Value: the id of the new plugin, -1 in case of an error
+******************************************************************************/
+int plugin_add(command_dest dest, const char *spec)
+{
+    int id = -1;
+
+    if(global.plugin_dir == NULL) {
+        LOG("adding plugins is disabled, see option --plugins\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&registry);
+    switch(dest) {
+    case Dest_Input:
+        if((id = load_input(spec, global.plugin_dir)) < 0)
+            break;
+        syslog(LOG_INFO, "starting input plugin %s", global.in[id]->plugin);
+        if(global.in[id]->run(id)) {
+            LOG("can not run input plugin %d: %s\n", id, global.in[id]->plugin);
+            retire_input(global.in[id]);
+            id = -1;
+        }
+        PLUGIN_CHANGED(&global);
+        break;
+    case Dest_Output:
+        if((id = load_output(spec, global.plugin_dir)) < 0)
+            break;
+        syslog(LOG_INFO, "starting output plugin: %s (ID: %02d)", global.out[id]->plugin, id);
+        global.out[id]->run(id);
+        PLUGIN_CHANGED(&global);
+        break;
+    default:
+        break;
+    }
+    pthread_mutex_unlock(&registry);
+
+    return (id < 0) ? -1 : id;
+}
+
+/******************************************************************************
+Description.: stop a single plugin and wait for its threads, the ids of all
+              other plugins stay valid. Consumers of a removed input get no
+              more frames, clients get the end of their response and the
+              outputs reading from it stop. Like plugin_add() this needs
+              "--plugins".
+Input Value.: dest is Dest_Input or Dest_Output, id is the plugin id
+Return Value: 0 if the plugin was removed, -1 otherwise
+******************************************************************************/
+int plugin_remove(command_dest dest, int id)
+{
+    int rc = -1;
+
+    if(global.plugin_dir == NULL) {
+        LOG("removing plugins is disabled, see option --plugins\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&registry);
+    switch(dest) {
+    case Dest_Input:
+        if(!INPUT_VALID(&global, id))
+            break;
+        syslog(LOG_INFO, "removing input plugin %s (ID: %02d)", global.in[id]->plugin, id);
+        global.in[id]->stop(id);
+        retire_input(global.in[id]);
+        PLUGIN_CHANGED(&global);
+        rc = 0;
+        break;
+    case Dest_Output:
+        if(!OUTPUT_VALID(&global, id))
+            break;
+        syslog(LOG_INFO, "removing output plugin %s (ID: %02d)", global.out[id]->plugin, id);
+        global.out[id]->stop(id);
+        /* like inputs, the slot stays retired */
+        __atomic_store_n(&global.out[id]->handle, NULL, __ATOMIC_RELEASE);
+        PLUGIN_CHANGED(&global);
+        rc = 0;
+        break;
+    default:
+        break;
+    }
+    pthread_mutex_unlock(&registry);
+
+    return rc;
+}
+
 /******************************************************************************
 Description.:
 Input Value.:
@@ -192,12 +602,10 @@ Return Value:
 int main(int argc, char *argv[])
 {
     //char *input  = "input_uvc.so --resolution 640x480 --fps 5 --device /dev/video0";
-    char *input[MAX_INPUT_PLUGINS];
-    char *output[MAX_OUTPUT_PLUGINS];
-    int daemon = 0, i, j;
-    size_t tmp = 0;
+    char **input = NULL, **output = NULL;
+    int incnt = 0, outcnt = 0;
+    int daemon = 0, i, id;
 
-    output[0] = "output_http.so --port 8080";
     global.outcnt = 0;
     global.incnt = 0;
 
@@ -210,21 +618,31 @@ int main(int argc, char *argv[])
             {"output", required_argument, NULL, 'o'},
             {"version", no_argument, NULL, 'v'},
             {"background", no_argument, NULL, 'b'},
+            {"trace", no_argument, NULL, 't'},
+            {"plugins", required_argument, NULL, 'p'},
             {NULL, 0, NULL, 0}
         };
 
-        c = getopt_long(argc, argv, "hi:o:vb", long_options, NULL);
+        c = getopt_long(argc, argv, "hi:o:vbtp:", long_options, NULL);
 
         /* no more options to parse */
         if(c == -1) break;
 
         switch(c) {
         case 'i':
-            input[global.incnt++] = strdup(optarg);
+            if((input = realloc(input, (incnt + 1) * sizeof(char *))) == NULL) {
+                fprintf(stderr, "not enough memory\n");
+                exit(EXIT_FAILURE);
+            }
+            input[incnt++] = optarg;
             break;
 
         case 'o':
-            output[global.outcnt++] = strdup(optarg);
+            if((output = realloc(output, (outcnt + 1) * sizeof(char *))) == NULL) {
+                fprintf(stderr, "not enough memory\n");
+                exit(EXIT_FAILURE);
+            }
+            output[outcnt++] = optarg;
             break;
 
         case 'v':
@@ -244,6 +662,18 @@ int main(int argc, char *argv[])
             daemon = 1;
             break;
 
+        case 't':
+            trace_enabled = 1;
+            break;
+
+        case 'p':
+            /* daemon mode changes the working directory */
+            if((global.plugin_dir = realpath(optarg, NULL)) == NULL) {
+                fprintf(stderr, "plugin folder %s: %s\n", optarg, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            break;
+
         case 'h': /* fall through */
         default:
             help(argv[0]);
@@ -282,118 +712,27 @@ int main(int argc, char *argv[])
 #endif
 
     /* check if at least one output plugin was selected */
-    if(global.outcnt == 0) {
+    if(outcnt == 0) {
         /* no? Then use the default plugin instead */
-        global.outcnt = 1;
+        static char *default_output = "output_http.so --port 8080";
+        output = &default_output;
+        outcnt = 1;
     }
 
-    /* open input plugin */
-    for(i = 0; i < global.incnt; i++) {
-        /* this mutex and the conditional variable are used to synchronize access to the global picture buffer */
-        if(pthread_mutex_init(&global.in[i].db, NULL) != 0) {
-            LOG("could not initialize mutex variable\n");
-            closelog();
-            exit(EXIT_FAILURE);
-        }
-        if(pthread_cond_init(&global.in[i].db_update, NULL) != 0) {
-            LOG("could not initialize condition variable\n");
-            closelog();
-            exit(EXIT_FAILURE);
-        }
-
-        tmp = (size_t)(strchr(input[i], ' ') - input[i]);
-        global.in[i].stop      = 0;
-        global.in[i].context   = NULL;
-        global.in[i].buf       = NULL;
-        global.in[i].size      = 0;
-        global.in[i].plugin = (tmp > 0) ? strndup(input[i], tmp) : strdup(input[i]);
-        global.in[i].handle = dlopen(global.in[i].plugin, RTLD_LAZY);
-        if(!global.in[i].handle) {
-            LOG("ERROR: could not find input plugin\n");
-            LOG("       Perhaps you want to adjust the search path with:\n");
-            LOG("       # export LD_LIBRARY_PATH=/path/to/plugin/folder\n");
-            LOG("       dlopen: %s\n", dlerror());
-            closelog();
-            exit(EXIT_FAILURE);
-        }
-        global.in[i].init = dlsym(global.in[i].handle, "input_init");
-        if(global.in[i].init == NULL) {
-            LOG("%s\n", dlerror());
-            exit(EXIT_FAILURE);
-        }
-        global.in[i].stop = dlsym(global.in[i].handle, "input_stop");
-        if(global.in[i].stop == NULL) {
-            LOG("%s\n", dlerror());
-            exit(EXIT_FAILURE);
-        }
-        global.in[i].run = dlsym(global.in[i].handle, "input_run");
-        if(global.in[i].run == NULL) {
-            LOG("%s\n", dlerror());
-            exit(EXIT_FAILURE);
-        }
-        /* try to find optional command */
-        global.in[i].cmd = dlsym(global.in[i].handle, "input_cmd");
+    /* commands of already running plugins may add further plugins meanwhile */
+    pthread_mutex_lock(&registry);
 
-        global.in[i].param.parameters = strchr(input[i], ' ');
-
-        for (j = 0; j<MAX_PLUGIN_ARGUMENTS; j++) {
-            global.in[i].param.argv[j] = NULL;
-        }
-
-        split_parameters(global.in[i].param.parameters, &global.in[i].param.argc, global.in[i].param.argv);
-        global.in[i].param.global = &global;
-        global.in[i].param.id = i;
-
-        if(global.in[i].init(&global.in[i].param, i)) {
-            LOG("input_init() return value signals to exit\n");
+    /* open input plugin */
+    for(i = 0; i < incnt; i++) {
+        if((id = load_input(input[i], NULL)) < 0) {
             closelog();
-            exit(0);
+            exit((id == -2) ? 0 : EXIT_FAILURE);
         }
     }
 
     /* open output plugin */
-    for(i = 0; i < global.outcnt; i++) {
-        tmp = (size_t)(strchr(output[i], ' ') - output[i]);
-        global.out[i].plugin = (tmp > 0) ? strndup(output[i], tmp) : strdup(output[i]);
-        global.out[i].handle = dlopen(global.out[i].plugin, RTLD_LAZY);
-        if(!global.out[i].handle) {
-            LOG("ERROR: could not find output plugin %s\n", global.out[i].plugin);
-            LOG("       Perhaps you want to adjust the search path with:\n");
-            LOG("       # export LD_LIBRARY_PATH=/path/to/plugin/folder\n");
-            LOG("       dlopen: %s\n", dlerror());
-            closelog();
-            exit(EXIT_FAILURE);
-        }
-        global.out[i].init = dlsym(global.out[i].handle, "output_init");
-        if(global.out[i].init == NULL) {
-            LOG("%s\n", dlerror());
-            exit(EXIT_FAILURE);
-        }
-        global.out[i].stop = dlsym(global.out[i].handle, "output_stop");
-        if(global.out[i].stop == NULL) {
-            LOG("%s\n", dlerror());
-            exit(EXIT_FAILURE);
-        }
-        global.out[i].run = dlsym(global.out[i].handle, "output_run");
-        if(global.out[i].run == NULL) {
-            LOG("%s\n", dlerror());
-            exit(EXIT_FAILURE);
-        }
-
-        /* try to find optional command */
-        global.out[i].cmd = dlsym(global.out[i].handle, "output_cmd");
-
-        global.out[i].param.parameters = strchr(output[i], ' ');
-
-        for (j = 0; j<MAX_PLUGIN_ARGUMENTS; j++) {
-            global.out[i].param.argv[j] = NULL;
-        }
-        split_parameters(global.out[i].param.parameters, &global.out[i].param.argc, global.out[i].param.argv);
-
-        global.out[i].param.global = &global;
-        global.out[i].param.id = i;
-        if(global.out[i].init(&global.out[i].param, i)) {
-            LOG("output_init() return value signals to exit\n");
+    for(i = 0; i < outcnt; i++) {
+        if(load_output(output[i], NULL) < 0) {
             closelog();
             exit(EXIT_FAILURE);
         }
@@ -402,9 +741,9 @@ int main(int argc, char *argv[])
     /* start to read the input, push pictures into global buffer */
     DBG("starting %d input plugin\n", global.incnt);
     for(i = 0; i < global.incnt; i++) {
-        syslog(LOG_INFO, "starting input plugin %s", global.in[i].plugin);
-        if(global.in[i].run(i)) {
-            LOG("can not run input plugin %d: %s\n", i, global.in[i].plugin);
+        syslog(LOG_INFO, "starting input plugin %s", global.in[i]->plugin);
+        if(global.in[i]->run(i)) {
+            LOG("can not run input plugin %d: %s\n", i, global.in[i]->plugin);
             closelog();
             return 1;
         }
@@ -412,10 +751,12 @@ int main(int argc, char *argv[])
 
     DBG("starting %d output plugin(s)\n", global.outcnt);
     for(i = 0; i < global.outcnt; i++) {
-        syslog(LOG_INFO, "starting output plugin: %s (ID: %02d)", global.out[i].plugin, global.out[i].param.id);
-        global.out[i].run(global.out[i].param.id);
+        syslog(LOG_INFO, "starting output plugin: %s (ID: %02d)", global.out[i]->plugin, global.out[i]->param.id);
+        global.out[i]->run(global.out[i]->param.id);
     }
 
+    pthread_mutex_unlock(&registry);
+
     /* wait for signals */
     pause();
 
@@ -24,9 +24,6 @@
 #define MJPG_STREAMER_H
 #define SOURCE_VERSION "2.0"
 
-/* FIXME take a look to the output_http clients thread marked with fixme if you want to set more then 10 plugins */
-#define MAX_INPUT_PLUGINS 10
-#define MAX_OUTPUT_PLUGINS 10
 #define MAX_PLUGIN_ARGUMENTS 32
 
 #include <linux/types.h>          /* for videodev2.h */
@@ -40,6 +37,8 @@
 
 #define LOG(...) { char _bf[1024] = {0}; snprintf(_bf, sizeof(_bf)-1, __VA_ARGS__); fprintf(stderr, "%s", _bf); syslog(LOG_INFO, "%s", _bf); }
 
+#include "frame.h"
+#include "trace.h"
 #include "plugins/input.h"
 #include "plugins/output.h"
 
@@ -63,6 +62,14 @@ enum _cmd_group {
     IN_CMD_PWC =            4,
 };
 
+/* commands which can be send to the program itself (Dest_Program) */
+enum _prog_cmd {
+    PROG_CMD_ADD_INPUT =    1, // the plugin specification is passed as string
+    PROG_CMD_REMOVE_INPUT = 2, // the plugin number selects the plugin
+    PROG_CMD_ADD_OUTPUT =   3,
+    PROG_CMD_REMOVE_OUTPUT = 4,
+};
+
 typedef struct _control control;
 struct _control {
     struct v4l2_queryctrl ctrl;
@@ -79,16 +86,37 @@ struct _control {
 struct _globals {
     int stop;
 
-    /* input plugin */
-    input in[MAX_INPUT_PLUGINS];
+    /*
+     * input plugins, indexed by the plugin id. The slots never move, a
+     * removed plugin leaves its slot behind so the ids of the others stay
+     * valid. Check ids with INPUT_VALID() and OUTPUT_VALID().
+     */
+    input **in;
     int incnt;
 
     /* output plugin */
-    output out[MAX_OUTPUT_PLUGINS];
+    output **out;
     int outcnt;
 
-    /* pointer to control functions */
-    //int (*control)(int command, char *details);
+    /* folder plugins added by commands are loaded from, NULL if commands may not add or remove plugins */
+    char *plugin_dir;
+
+    /* incremented whenever a plugin is added or removed, see PLUGIN_CHANGED() */
+    unsigned int version;
 };
 
+#define INPUT_VALID(g, id)  ((id) >= 0 && (id) < (g)->incnt && (g)->in[id]->handle != NULL)
+#define OUTPUT_VALID(g, id) ((id) >= 0 && (id) < (g)->outcnt && (g)->out[id]->handle != NULL)
+
+/*
+ * a plugin changed its controls, their values or its formats. Consumers
+ * which cache a description of it, like the JSON of output_http, compare
+ * the version and format it again.
+ */
+#define PLUGIN_CHANGED(p) __atomic_add_fetch(&(p)->version, 1, __ATOMIC_RELEASE)
+
+/* load or unload plugins while the others keep running */
+int plugin_add(command_dest dest, const char *spec);
+int plugin_remove(command_dest dest, int id);
+
 #endif
@@ -52,15 +52,17 @@ struct _input_format {
 /* structure to store variables/functions for input plugin */
 typedef struct _input input;
 struct _input {
+    char *spec;     /* as given on the command line, NULL if the slot is unused */
     char *plugin;
     char *name;
-    void *handle;
+    void *handle;   /* NULL once the plugin was removed */
 
     input_parameter param; // this holds the command line arguments
 
     // input plugin parameters
     struct _control *in_parameters;
     int parametercount;
+    unsigned int version;   /* see PLUGIN_CHANGED() */
 
 
     struct v4l2_jpegcompression jpegcomp;
@@ -68,13 +70,28 @@ struct _input {
     /* signal fresh frames */
     pthread_mutex_t db;
     pthread_cond_t  db_update;
+    pthread_cond_t  demand;     /* signals an idle input that consumers showed up */
 
-    /* global JPG frame, this is more or less the "database" */
-    unsigned char *buf;
-    int size;
+    /* reference counted JPG frames, this is more or less the "database" */
+    frame *ring[FRAME_RING_SIZE];
+    frame *latest;
+    unsigned int seq;       /* sequence number of the latest published frame */
+    unsigned int epoch;     /* tells this input apart from earlier ones, e.g. in ETags */
+    int waiters;            /* consumers sleeping on db_update */
+    int subscribers;        /* consumers reading continuously, see frame_subscribe() */
+    int listeners[FRAME_LISTENERS]; /* eventfd + 1 of event loops, 0 if unused */
+    int listening;          /* used entries of listeners */
+    int retired;            /* the plugin was removed, see frame_ring_retire() */
 
-    /* v4l2_buffer timestamp */
-    struct timeval timestamp;
+    /* stage latencies, only recorded if trace_enabled is set */
+    trace_histogram trace[TRACE_INPUT_STAGES];
+
+    /* counters for /metrics, modified atomically by frame.c */
+    unsigned long frames_captured;      /* calls of frame_acquire() */
+    unsigned long frames_encoded;       /* frames with JPG data ready */
+    unsigned long frames_dropped;       /* no free slot or encoding failed */
+    unsigned long db_contended;         /* db was locked when it was needed */
+    unsigned long long db_wait_us;      /* time spent waiting for db */
 
     input_format *in_formats;
     int formatCount;
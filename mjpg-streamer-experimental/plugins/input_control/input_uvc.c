@@ -203,6 +203,7 @@ int input_stop(void)
 {
     DBG("will cancel input thread\n");
     pthread_cancel(cam);
+    pthread_join(cam, NULL);
 
     return 0;
 }
@@ -216,7 +217,6 @@ int input_run(void)
 {
 
     pthread_create(&cam, 0, cam_thread, NULL);
-    pthread_detach(cam);
 
     return 0;
 }
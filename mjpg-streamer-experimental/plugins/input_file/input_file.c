@@ -171,8 +171,8 @@ int input_init(input_parameter *param, int id)
     IPRINT("delete file.......: %s\n", (rm) ? "yes, delete" : "no, do not delete");
     IPRINT("filename must be..: %s\n", (filename == NULL) ? "-no filter for certain filename set-" : filename);
 
-    param->global->in[id].name = malloc((strlen(INPUT_PLUGIN_NAME) + 1) * sizeof(char));
-    sprintf(param->global->in[id].name, INPUT_PLUGIN_NAME);
+    param->global->in[id]->name = malloc((strlen(INPUT_PLUGIN_NAME) + 1) * sizeof(char));
+    sprintf(param->global->in[id]->name, INPUT_PLUGIN_NAME);
 
     return 0;
 }
@@ -181,13 +181,12 @@ int input_stop(int id)
 {
     DBG("will cancel input thread\n");
     pthread_cancel(worker);
+    pthread_join(worker, NULL);
     return 0;
 }
 
 int input_run(int id)
 {
-    pglobal->in[id].buf = NULL;
-
     if (mode == NewFilesOnly) {
         rc = fd = inotify_init();
         if(rc == -1) {
@@ -210,13 +209,10 @@ int input_run(int id)
     }
 
     if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
-        free(pglobal->in[id].buf);
         fprintf(stderr, "could not start worker thread\n");
         exit(EXIT_FAILURE);
     }
 
-    pthread_detach(worker);
-
     return 0;
 }
 
@@ -246,7 +242,7 @@ void *worker_thread(void *arg)
     int fileCount = 0;
     int currentFileNumber = 0;
     char hasJpgFile = 0;
-    struct timeval timestamp;
+    frame *f;
 
     if (mode == ExistingFiles) {
         fileCount = scandir(folder, &fileList, 0, alphasort);
@@ -324,34 +320,34 @@ void *worker_thread(void *arg)
 
         filesize = stats.st_size;
 
-        /* copy frame from file to global buffer */
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+        /* copy frame from file to a free frame slot */
+        if((f = frame_acquire(pglobal->in[plugin_number])) == NULL) {
+            DBG("dropping file, all frame slots are in use\n");
+            close(file);
+            continue;
+        }
 
         /* allocate memory for frame */
-        if(pglobal->in[plugin_number].buf != NULL)
-            free(pglobal->in[plugin_number].buf);
-
-        pglobal->in[plugin_number].buf = malloc(filesize + (1 << 16));
-
-        if(pglobal->in[plugin_number].buf == NULL) {
+        if(frame_reserve(f, filesize + (1 << 16)) != 0) {
             fprintf(stderr, "could not allocate memory\n");
+            frame_put(f);
+            close(file);
             break;
         }
 
-        if((pglobal->in[plugin_number].size = read(file, pglobal->in[plugin_number].buf, filesize)) == -1) {
+        if((f->size = read(file, f->buf, filesize)) == -1) {
             perror("could not read from file");
-            free(pglobal->in[plugin_number].buf); pglobal->in[plugin_number].buf = NULL; pglobal->in[plugin_number].size = 0;
-            pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+            frame_put(f);
             close(file);
             break;
         }
 
-        gettimeofday(&timestamp, NULL);
-        pglobal->in[plugin_number].timestamp = timestamp;
-        DBG("new frame copied (size: %d)\n", pglobal->in[plugin_number].size);
+        gettimeofday(&f->timestamp, NULL);
+        frame_clock(&f->captured);
+        frame_probe_jpeg(f);
+        DBG("new frame copied (size: %d)\n", f->size);
         /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+        frame_publish(pglobal->in[plugin_number], f);
 
         close(file);
 
@@ -392,8 +388,6 @@ void worker_cleanup(void *arg)
     first_run = 0;
     DBG("cleaning up resources allocated by input thread\n");
 
-    if(pglobal->in[plugin_number].buf != NULL) free(pglobal->in[plugin_number].buf);
-
     free(ev);
 
     if (mode == NewFilesOnly) {
@@ -100,6 +100,7 @@ int input_stop(int id)
 {
     DBG("will cancel input thread\n");
     pthread_cancel(worker);
+    pthread_join(worker, NULL);
     return 0;
 }
 
@@ -110,33 +111,35 @@ Return Value: 0
 ******************************************************************************/
 int input_run(int id)
 {
-    pglobal->in[id].buf = malloc(256 * 1024);
-    if(pglobal->in[id].buf == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        exit(EXIT_FAILURE);
-    }
-
     if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
-        free(pglobal->in[id].buf);
         fprintf(stderr, "could not start worker thread\n");
         exit(EXIT_FAILURE);
     }
-    pthread_detach(worker);
 
     return 0;
 }
 
 
 void on_image_received(char * data, int length){
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+        frame *f;
+
+        /* copy JPG picture to a free frame slot */
+        if((f = frame_acquire(pglobal->in[plugin_number])) == NULL)
+            return;
+
+        if(frame_reserve(f, length) != 0) {
+            frame_put(f);
+            return;
+        }
 
-        pglobal->in[plugin_number].size = length;
-        memcpy(pglobal->in[plugin_number].buf, data, pglobal->in[plugin_number].size);
+        f->size = length;
+        memcpy(f->buf, data, f->size);
+        gettimeofday(&f->timestamp, NULL);
+        frame_clock(&f->captured);
+        frame_probe_jpeg(f);
 
         /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+        frame_publish(pglobal->in[plugin_number], f);
 
 }
 
@@ -173,7 +176,6 @@ void worker_cleanup(void *arg)
     first_run = 0;
     DBG("cleaning up resources allocated by input thread\n");
     close_mjpg_proxy(&proxy);
-    if(pglobal->in[plugin_number].buf != NULL) free(pglobal->in[plugin_number].buf);
 }
 
 
@@ -66,6 +66,8 @@ typedef struct {
     filter_process_fn filter_process;
     filter_free_fn filter_free;
     
+    int ondemand;   // keep-alive interval in ms while idle, -1 never idles
+    
 } context;
 
 
@@ -108,6 +110,10 @@ static void help() {
     " Optional filter plugin:\n" \
     " [ -filter ]............: filter plugin .so\n" \
     " [ -fargs ].............: filter plugin arguments\n" \
+    " ---------------------------------------------------------------\n" \
+    " [-od | --ondemand ]....: skip decoding and encoding while no client\n" \
+    "                          wants frames, publish one frame every given\n" \
+    "                          ms while idle (0 = none)\n" \
     " ---------------------------------------------------------------\n\n"\
     );
 }
@@ -145,10 +151,11 @@ int input_init(input_parameter *param, int plugin_no)
     context_settings *settings;
     
     pctx = new context();
+    pctx->ondemand = -1;
     
     settings = pctx->init_settings = init_settings();
     pglobal = param->global;
-    in = &pglobal->in[plugin_no];
+    in = pglobal->in[plugin_no];
     in->context = pctx;
 
     param->argv[0] = plugin_name;
@@ -180,6 +187,8 @@ int input_init(input_parameter *param, int plugin_no)
             {"ex", required_argument, 0, 0},
             {"filter", required_argument, 0, 0},
             {"fargs", required_argument, 0, 0},
+            {"od", required_argument, 0, 0},
+            {"ondemand", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
     
@@ -243,6 +252,12 @@ int input_init(input_parameter *param, int plugin_no)
             filter_args = optarg;
             break;
             
+        /* od, ondemand */
+        case 17:
+        case 18:
+            pctx->ondemand = MAX(atoi(optarg), 0);
+            break;
+            
         default:
             help();
             return 1;
@@ -251,6 +266,8 @@ int input_init(input_parameter *param, int plugin_no)
 
     IPRINT("device........... : %s\n", device);
     IPRINT("Desired Resolution: %i x %i\n", width, height);
+    if (pctx->ondemand >= 0)
+        IPRINT("on demand........ : keep-alive every %i ms\n", pctx->ondemand);
     
     // need to allocate a VideoCapture object: default device is 0
     try {
@@ -341,12 +358,13 @@ Return Value: 0
 ******************************************************************************/
 int input_stop(int id)
 {
-    input * in = &pglobal->in[id];
+    input * in = pglobal->in[id];
     context *pctx = (context*)in->context;
     
     if (pctx != NULL) {
         DBG("will cancel input thread\n");
         pthread_cancel(pctx->worker);
+        pthread_join(pctx->worker, NULL);
     }
     return 0;
 }
@@ -358,18 +376,14 @@ Return Value: 0
 ******************************************************************************/
 int input_run(int id)
 {
-    input * in = &pglobal->in[id];
+    input * in = pglobal->in[id];
     context *pctx = (context*)in->context;
     
-    in->buf = NULL;
-    in->size = 0;
-    
     if(pthread_create(&pctx->worker, 0, worker_thread, in) != 0) {
         worker_cleanup(in);
         fprintf(stderr, "could not start worker thread\n");
         exit(EXIT_FAILURE);
     }
-    pthread_detach(pctx->worker);
 
     return 0;
 }
@@ -414,6 +428,8 @@ void *worker_thread(void *arg)
     
     Mat src, dst;
     vector<uchar> jpeg_buffer;
+    frame *f;
+    struct timeval captured, last = {0, 0};
     
     // this exists so that the numpy allocator can assign a custom allocator to
     // the mat, so that it doesn't need to copy the data each time
@@ -421,27 +437,56 @@ void *worker_thread(void *arg)
         src = pctx->filter_init_frame(pctx->filter_ctx);
     
     while (!pglobal->stop) {
+        /*
+         * nobody wants frames: keep the camera running, so the next
+         * consumer gets a fresh frame at once, but skip decoding,
+         * filtering and encoding until a keep-alive frame is due
+         */
+        if (pctx->ondemand >= 0 && !frame_demand(in)) {
+            frame_clock(&captured);
+            if (pctx->ondemand == 0 || (last.tv_sec != 0 &&
+                frame_elapsed_us(&last, &captured) < pctx->ondemand * 1000L)) {
+                if (!pctx->capture.grab())
+                    break;
+                continue;
+            }
+        }
+
         if (!pctx->capture.read(src))
             break; // TODO
+        frame_clock(&captured);
+        last = captured;
             
         // call the filter function
         pctx->filter_process(pctx->filter_ctx, src, dst);
             
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&in->db);
-        
         // take whatever Mat it returns, and write it to jpeg buffer
         imencode(".jpg", dst, jpeg_buffer, compression_params);
         
         // TODO: what to do if imencode returns an error?
         
+        /* copy JPG picture to a free frame slot */
+        if ((f = frame_acquire(in)) == NULL)
+            continue;
+        
+        if (frame_reserve(f, jpeg_buffer.size()) != 0) {
+            frame_put(f);
+            continue;
+        }
+        
         // std::vector is guaranteed to be contiguous
-        in->buf = &jpeg_buffer[0];
-        in->size = jpeg_buffer.size();
+        memcpy(f->buf, &jpeg_buffer[0], jpeg_buffer.size());
+        f->size = jpeg_buffer.size();
+        gettimeofday(&f->timestamp, NULL);
+        f->width = dst.cols;
+        f->height = dst.rows;
+        f->format = V4L2_PIX_FMT_MJPEG;
+        f->quality = compression_params[1];
+        f->captured = captured;
+        frame_clock(&f->encoded);
         
         /* signal fresh_frame */
-        pthread_cond_broadcast(&in->db_update);
-        pthread_mutex_unlock(&in->db);
+        frame_publish(in, f);
     }
     
     IPRINT("leaving input thread, calling cleanup function now\n");
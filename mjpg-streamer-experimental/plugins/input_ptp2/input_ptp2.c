@@ -67,10 +67,10 @@ int input_init(input_parameter *param, int id)
 	zoom_ctrl.ctrl.default_value = 0;
 	zoom_ctrl.ctrl.flags = V4L2_CTRL_FLAG_SLIDER;
 
-	param->global->in[id].in_parameters = (control*) malloc((param->global->in[id].parametercount + 1) * sizeof(control));
+	param->global->in[id]->in_parameters = (control*) malloc((param->global->in[id]->parametercount + 1) * sizeof(control));
 
-	param->global->in[id].in_parameters[param->global->in[id].parametercount] = zoom_ctrl;
-	param->global->in[id].parametercount++;
+	param->global->in[id]->in_parameters[param->global->in[id]->parametercount] = zoom_ctrl;
+	param->global->in[id]->parametercount++;
 
 	selected_port = NULL;
 	delay = 0;
@@ -109,6 +109,7 @@ int input_stop(int id)
 {
 	DBG("will cancel input thread\n");
 	pthread_cancel(thread);
+	pthread_join(thread, NULL);
 
 	return 0;
 }
@@ -131,12 +132,6 @@ int input_run(int id)
 {
 	int res, i;
 
-	global->in[id].buf = malloc(256 * 1024);
-	if(global->in[id].buf == NULL)
-	{
-		IPRINT(INPUT_PLUGIN_NAME " - could not allocate memory\n");
-		exit(EXIT_FAILURE);
-	}
 	plugin_id = id;
 
 	// auto-detect algorithm
@@ -214,11 +209,9 @@ int input_run(int id)
 	// starting thread
 	if(pthread_create(&thread, 0, capture, NULL) != 0)
 	{
-		free(global->in[id].buf);
 		IPRINT("could not start worker thread\n");
 		exit(EXIT_FAILURE);
 	}
-	pthread_detach(thread);
 
 	return 0;
 }
@@ -228,6 +221,7 @@ void* capture(void* arg)
 	int res;
 	int i = 0;
 	CameraFile* file;
+	frame* f;
 
 	pthread_cleanup_push(cleanup, NULL);
 					while(!global->stop)
@@ -239,7 +233,6 @@ void* capture(void* arg)
 						CAMERA_CHECK_GP(res, "gp_file_new");
 						res = gp_camera_capture_preview(camera, file, context);
 						CAMERA_CHECK_GP(res, "gp_camera_capture_preview");
-						pthread_mutex_lock(&global->in[plugin_id].db);
 						res = gp_file_get_data_and_size(file, &xdata, &xsize);
 						if(xsize == 0)
 						{
@@ -258,14 +251,28 @@ void* capture(void* arg)
 						else
 							i = 0;
 						CAMERA_CHECK_GP(res, "gp_file_get_data_and_size");
-						memcpy(global->in[plugin_id].buf, xdata, xsize);
+						f = frame_acquire(global->in[plugin_id]);
+						if(f != NULL && frame_reserve(f, xsize) == 0)
+						{
+							memcpy(f->buf, xdata, xsize);
+							f->size = xsize;
+							gettimeofday(&f->timestamp, NULL);
+							frame_clock(&f->captured);
+							frame_probe_jpeg(f);
+						}
+						else
+						{
+							frame_put(f);
+							f = NULL;
+						}
 						res = gp_file_unref(file);
 						pthread_mutex_unlock(&control_mutex);
+						if(f != NULL)
+						{
+							DBG("Read %d bytes from camera.\n", f->size);
+							frame_publish(global->in[plugin_id], f);
+						}
 						CAMERA_CHECK_GP(res, "gp_file_unref");
-						global->in[plugin_id].size = xsize;
-						DBG("Read %d bytes from camera.\n", global->in[plugin_id].size);
-						pthread_cond_broadcast(&global->in[plugin_id].db_update);
-						pthread_mutex_unlock(&global->in[plugin_id].db);
 						usleep(delay);
 					}
 					pthread_cleanup_pop(1);
@@ -302,7 +309,6 @@ void cleanup(void *arg)
 	gp_camera_exit(camera, context);
 	gp_camera_unref(camera);
 	gp_context_unref(context);
-	free(global->in[plugin_id].buf);
 }
 
 int input_cmd(int plugin, unsigned int control_id, unsigned int group, int value)
@@ -313,18 +319,18 @@ int input_cmd(int plugin, unsigned int control_id, unsigned int group, int value
 	switch(group)
 	{
 		case IN_CMD_GENERIC:
-			for(i = 0; i < global->in[plugin_id].parametercount; i++)
+			for(i = 0; i < global->in[plugin_id]->parametercount; i++)
 			{
-				if((global->in[plugin_id].in_parameters[i].ctrl.id == control_id) && (global->in[plugin_id].in_parameters[i].group == IN_CMD_GENERIC))
+				if((global->in[plugin_id]->in_parameters[i].ctrl.id == control_id) && (global->in[plugin_id]->in_parameters[i].group == IN_CMD_GENERIC))
 				{
-					DBG("Generic control found (id: %d): %s\n", control_id, global->in[plugin_id].in_parameters[i].ctrl.name);
+					DBG("Generic control found (id: %d): %s\n", control_id, global->in[plugin_id]->in_parameters[i].ctrl.name);
 					if(control_id == 1)
 					{
 						float z = value;
 						pthread_mutex_lock(&control_mutex);
 						res = camera_set("zoom", &z);
 						pthread_mutex_unlock(&control_mutex);
-					} DBG("New %s value: %d\n", global->in[plugin_id].in_parameters[i].ctrl.name, value);
+					} DBG("New %s value: %d\n", global->in[plugin_id]->in_parameters[i].ctrl.name, value);
 					return 0;
 				}
 			}
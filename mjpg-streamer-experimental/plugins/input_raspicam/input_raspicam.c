@@ -93,6 +93,7 @@ typedef struct
   VCOS_SEMAPHORE_T complete_semaphore; /// semaphore which is posted when we reach end of frame (indicates end of capture or fault)
   MMAL_POOL_T *pool; /// pointer to our state in case required in callback
   uint32_t offset;
+  frame *current; /// frame slot the encoder output is collected in, NULL if this frame gets dropped
 } PORT_USERDATA;
 
 
@@ -296,6 +297,7 @@ int input_stop(int id)
 {
   DBG("will cancel input thread\n");
   pthread_cancel(worker);
+  pthread_join(worker, NULL);
 
   return 0;
 }
@@ -348,11 +350,18 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
       //fprintf(stderr, "The flags are %x of length %i offset %i\n", buffer->flags, buffer->length, pData->offset);
 
       //Write bytes
-      /* copy JPG picture to global buffer */
-      if(pData->offset == 0)
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+      /* copy JPG picture to a free frame slot */
+      if(pData->offset == 0 && (pData->current = frame_acquire(pglobal->in[plugin_number])) != NULL)
+        frame_clock(&pData->current->captured);
 
-      memcpy(pData->offset + pglobal->in[plugin_number].buf, buffer->data, buffer->length);
+      if(pData->current != NULL && frame_reserve(pData->current, pData->offset + buffer->length) != 0)
+      {
+        frame_put(pData->current);
+        pData->current = NULL;
+      }
+
+      if(pData->current != NULL)
+        memcpy(pData->offset + pData->current->buf, buffer->data, buffer->length);
       pData->offset += buffer->length;
       //fwrite(buffer->data, 1, buffer->length, pData->file_handle);
       mmal_buffer_header_mem_unlock(buffer);
@@ -362,11 +371,22 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
     if (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED))
     {
       complete = 1;
-      pglobal->in[plugin_number].size = pData->offset;
+      if(pData->current != NULL)
+      {
+        pData->current->size = pData->offset;
+        pData->current->width = width;
+        pData->current->height = height;
+        pData->current->format = V4L2_PIX_FMT_MJPEG;
+        pData->current->quality = quality;
+        gettimeofday(&pData->current->timestamp, NULL);
+        if(buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED)
+          frame_put(pData->current);
+        else
+          /* signal fresh_frame */
+          frame_publish(pglobal->in[plugin_number], pData->current);
+        pData->current = NULL;
+      }
       pData->offset = 0;
-      /* signal fresh_frame */
-      pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-      pthread_mutex_unlock(&pglobal->in[plugin_number].db); 
     }
   }
   else
@@ -436,20 +456,11 @@ static void camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
  ******************************************************************************/
 int input_run(int id)
 {
-  pglobal->in[id].buf = malloc(width * height * 3);
-  if (pglobal->in[id].buf == NULL)
-  {
-    fprintf(stderr, "could not allocate memory\n");
-    exit(EXIT_FAILURE);
-  }
-
   if (pthread_create(&worker, 0, worker_thread, NULL) != 0)
   {
-    free(pglobal->in[id].buf);
     fprintf(stderr, "could not start worker thread\n");
     exit(EXIT_FAILURE);
   }
-  pthread_detach(worker);
 
   return 0;
 }
@@ -877,6 +888,7 @@ void *worker_thread(void *arg)
   callback_data.file_handle = NULL;
   callback_data.pool = pool;
   callback_data.offset = 0;
+  callback_data.current = NULL;
 
   vcos_assert(vcos_semaphore_create(&callback_data.complete_semaphore, "RaspiStill-sem", 0) == VCOS_SUCCESS);
 
@@ -1046,9 +1058,6 @@ void worker_cleanup(void *arg)
 
   first_run = 0;
   DBG("cleaning up resources allocated by input thread\n");
-
-  if(pglobal->in[plugin_number].buf != NULL)
-    free(pglobal->in[plugin_number].buf);
 }
 
 
@@ -55,6 +55,7 @@ void worker_cleanup(void *);
 void help(void);
 
 static int delay = 1000;
+static int ondemand = -1;
 
 /* details of converted JPG pictures */
 struct pic {
@@ -112,6 +113,8 @@ int input_init(input_parameter *param, int plugin_no)
             {"delay", required_argument, 0, 0},
             {"r", required_argument, 0, 0},
             {"resolution", required_argument, 0, 0},
+            {"od", required_argument, 0, 0},
+            {"ondemand", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -154,6 +157,13 @@ int input_init(input_parameter *param, int plugin_no)
             }
             break;
 
+            /* od, ondemand */
+        case 6:
+        case 7:
+            DBG("case 6,7\n");
+            ondemand = MAX(atoi(optarg), 0);
+            break;
+
         default:
             DBG("default case\n");
             help();
@@ -165,6 +175,8 @@ int input_init(input_parameter *param, int plugin_no)
 
     IPRINT("delay.............: %i\n", delay);
     IPRINT("resolution........: %s\n", pics->resolution);
+    if(ondemand >= 0)
+        IPRINT("on demand.........: keep-alive every %i ms\n", ondemand);
 
     return 0;
 }
@@ -178,6 +190,7 @@ int input_stop(int id)
 {
     DBG("will cancel input thread\n");
     pthread_cancel(worker);
+    pthread_join(worker, NULL);
 
     return 0;
 }
@@ -189,18 +202,10 @@ Return Value: 0
 ******************************************************************************/
 int input_run(int id)
 {
-    pglobal->in[id].buf = malloc(256 * 1024);
-    if(pglobal->in[id].buf == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        exit(EXIT_FAILURE);
-    }
-
     if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
-        free(pglobal->in[id].buf);
         fprintf(stderr, "could not start worker thread\n");
         exit(EXIT_FAILURE);
     }
-    pthread_detach(worker);
 
     return 0;
 }
@@ -218,6 +223,8 @@ void help(void)
     " The following parameters can be passed to this plugin:\n\n" \
     " [-d | --delay ]........: delay to pause between frames\n" \
     " [-r | --resolution]....: can be 960x720, 640x480, 320x240, 160x120\n"
+    " [-od | --ondemand ]....: pause while no client wants frames, publish\n" \
+    "                          one frame every given ms while idle (0 = none)\n" \
     " ---------------------------------------------------------------\n");
 }
 
@@ -230,22 +237,33 @@ Return Value: NULL
 void *worker_thread(void *arg)
 {
     int i = 0;
+    frame *f;
 
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
     while(!pglobal->stop) {
 
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+        /* sleep until somebody wants frames or a keep-alive frame is due */
+        if(ondemand >= 0)
+            frame_idle(pglobal->in[plugin_number], ondemand);
 
+        /* copy JPG picture to a free frame slot */
         i = (i + 1) % LENGTH_OF(pics->sequence);
-        pglobal->in[plugin_number].size = pics->sequence[i].size;
-        memcpy(pglobal->in[plugin_number].buf, pics->sequence[i].data, pglobal->in[plugin_number].size);
-
-        /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+        if((f = frame_acquire(pglobal->in[plugin_number])) != NULL) {
+            if(frame_reserve(f, pics->sequence[i].size) == 0) {
+                f->size = pics->sequence[i].size;
+                memcpy(f->buf, pics->sequence[i].data, f->size);
+                gettimeofday(&f->timestamp, NULL);
+                frame_clock(&f->captured);
+                frame_probe_jpeg(f);
+
+                /* signal fresh_frame */
+                frame_publish(pglobal->in[plugin_number], f);
+            } else {
+                frame_put(f);
+            }
+        }
 
         usleep(1000 * delay);
     }
@@ -272,8 +290,6 @@ void worker_cleanup(void *arg)
 
     first_run = 0;
     DBG("cleaning up resources allocated by input thread\n");
-
-    if(pglobal->in[plugin_number].buf != NULL) free(pglobal->in[plugin_number].buf);
 }
 
 
@@ -70,6 +70,7 @@ static globals *pglobal;
 static unsigned int minimum_size = 0;
 static int dynctrls = 1;
 static unsigned int every = 1;
+static int ondemand = -1;   /* keep-alive interval in ms while idle, -1 never idles */
 
 static const struct {
   const char * k;
@@ -145,7 +146,7 @@ int input_init(input_parameter *param, int id)
     
     settings = pctx->init_settings = init_settings();
     pglobal = param->global;
-    pglobal->in[id].context = pctx;
+    pglobal->in[id]->context = pctx;
 
     /* initialize the mutes variable */
     if(pthread_mutex_init(&pctx->controls_mutex, NULL) != 0) {
@@ -203,6 +204,8 @@ int input_init(input_parameter *param, int id)
             {"gain", required_argument, 0, 0},
             {"cagc", required_argument, 0, 0},
             {"cb", required_argument, 0, 0},
+            {"od", required_argument, 0, 0},
+            {"ondemand", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -351,6 +354,13 @@ int input_init(input_parameter *param, int id)
             break;
         OPTION_INT_AUTO(36, cb)
             break;
+
+        /* od, ondemand */
+        case 37:
+        case 38:
+            DBG("case 37,38\n");
+            ondemand = MAX(atoi(optarg), 0);
+            break;
     
         default:
             DBG("default case\n");
@@ -402,6 +412,12 @@ int input_init(input_parameter *param, int id)
         IPRINT("TV-Norm...........: DEFAULT\n");
     }
 
+    if(ondemand == 0) {
+        IPRINT("On demand.........: suspend while idle\n");
+    } else if(ondemand > 0) {
+        IPRINT("On demand.........: one frame every %d ms while idle\n", ondemand);
+    }
+
     DBG("vdIn pn: %d\n", id);
     /* open video device and prepare data structure */
     if(init_videoIn(pctx->videoIn, dev, width, height, fps, format, 1, pctx->pglobal, id, tvnorm) < 0) {
@@ -429,11 +445,12 @@ Return Value: always 0
 ******************************************************************************/
 int input_stop(int id)
 {
-    input * in = &pglobal->in[id];
+    input * in = pglobal->in[id];
     context *pctx = (context*)in->context;
     
     DBG("will cancel camera thread #%02d\n", id);
     pthread_cancel(pctx->threadID);
+    pthread_join(pctx->threadID, NULL);
     return 0;
 }
 
@@ -444,19 +461,12 @@ Return Value: always 0
 ******************************************************************************/
 int input_run(int id)
 {
-    input * in = &pglobal->in[id];
+    input * in = pglobal->in[id];
     context *pctx = (context*)in->context;
-    
-    in->buf = malloc(pctx->videoIn->framesizeIn);
-    if(in->buf == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        exit(EXIT_FAILURE);
-    }
 
     DBG("launching camera thread #%02d\n", id);
     /* create thread and pass context to thread function */
     pthread_create(&(pctx->threadID), NULL, cam_thread, in);
-    pthread_detach(pctx->threadID);
     return 0;
 }
 
@@ -493,6 +503,9 @@ void help(void)
     " [-l | --led ]..........: switch the LED \"on\", \"off\", let it \"blink\" or leave\n" \
     "                          it up to the driver using the value \"auto\"\n" \
     " [-t | --tvnorm ] ......: set TV-Norm pal, ntsc or secam\n"
+    " [-od | --ondemand ]....: stop streaming while no client wants frames,\n" \
+    "                          capture one frame every given ms while idle\n" \
+    "                          (0 publishes no frames at all while idle)\n" \
     " ---------------------------------------------------------------\n");
 
     fprintf(stderr, "\n"\
@@ -515,6 +528,26 @@ void help(void)
     );
 }
 
+#ifndef NO_LIBJPEG
+/******************************************************************************
+Description.: encoder of frames published as YUYV or RGB565, it runs in the
+              thread of the first consumer asking for the JPG
+Input Value.: f is the frame
+Return Value: 0 if buf holds the JPG, -1 otherwise
+******************************************************************************/
+static int encode_frame(frame *f)
+{
+    /* the JPG is always smaller than the raw picture */
+    if(frame_reserve(f, f->raw_size) != 0)
+        return -1;
+
+    DBG("compressing frame %u\n", f->seq);
+    f->size = compress_raw_to_jpeg(f->raw, f->width, f->height, f->format, f->buf, f->capacity, f->quality);
+
+    return (f->size > 0) ? 0 : -1;
+}
+#endif
+
 /******************************************************************************
 Description.: this thread worker grabs a frame and copies it to the global buffer
 Input Value.: unused
@@ -528,6 +561,8 @@ void *cam_thread(void *arg)
     
     unsigned int every_count = 0;
     int quality = settings->quality;
+    struct timeval last_timestamp = {0, 0}, captured;
+    frame *f;
     
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(cam_cleanup, in);
@@ -610,11 +645,23 @@ void *cam_thread(void *arg)
             usleep(1); // maybe not the best way so FIXME
         }
 
+        /*
+         * nobody is interested in frames, stop the camera until a consumer
+         * subscribes or the next keep-alive frame is due
+         */
+        if(ondemand >= 0 && !frame_demand(in)) {
+            DBG("no consumers, suspending camera #%02d\n", pcontext->id);
+            uvcSuspend(pcontext->videoIn);
+            frame_idle(in, ondemand);
+            DBG("resuming camera #%02d\n", pcontext->id);
+        }
+
         /* grab a frame */
         if(uvcGrab(pcontext->videoIn) < 0) {
             IPRINT("Error grabbing frames\n");
             exit(EXIT_FAILURE);
         }
+        frame_clock(&captured);
 
         if ( every_count < every - 1 ) {
             DBG("dropping %d frame for every=%d\n", every_count + 1, every);
@@ -640,8 +687,8 @@ void *cam_thread(void *arg)
 
         // use software frame dropping on low fps
         if (pcontext->videoIn->soft_framedrop == 1) {
-            unsigned long last = pglobal->in[pcontext->id].timestamp.tv_sec * 1000 +
-                                (pglobal->in[pcontext->id].timestamp.tv_usec/1000); // convert to ms
+            unsigned long last = last_timestamp.tv_sec * 1000 +
+                                (last_timestamp.tv_usec/1000); // convert to ms
             unsigned long current = pcontext->videoIn->buf.timestamp.tv_sec * 1000 +
                                     pcontext->videoIn->buf.timestamp.tv_usec/1000; // convert to ms
 
@@ -653,27 +700,45 @@ void *cam_thread(void *arg)
             DBG("Lagg: %ld\n", (current - last) - pcontext->videoIn->frame_period_time);
         }
 
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&pglobal->in[pcontext->id].db);
+        /* get a free frame slot, consumers may still read older frames meanwhile */
+        if((f = frame_acquire(in)) == NULL) {
+            DBG("dropping frame, all frame slots are in use\n");
+            continue;
+        }
 
         /*
-         * If capturing in YUV mode convert to JPEG now.
+         * If capturing in YUV mode just keep the raw picture, it gets converted
+         * to JPEG by frame_jpeg() once the first consumer asks for it.
          * This compression requires many CPU cycles, so try to avoid YUV format.
          * Getting JPEGs straight from the webcam, is one of the major advantages of
          * Linux-UVC compatible devices.
          */
         #ifndef NO_LIBJPEG
         if ((pcontext->videoIn->formatIn == V4L2_PIX_FMT_YUYV) || (pcontext->videoIn->formatIn == V4L2_PIX_FMT_RGB565)) {
-            DBG("compressing frame from input: %d\n", (int)pcontext->id);
-            pglobal->in[pcontext->id].size = compress_image_to_jpeg(pcontext->videoIn, pglobal->in[pcontext->id].buf, pcontext->videoIn->framesizeIn, quality);
+            if(frame_reserve_raw(f, pcontext->videoIn->framesizeIn) != 0) {
+                frame_put(f);
+                continue;
+            }
+            DBG("copying raw frame from input: %d\n", (int)pcontext->id);
+            memcpy(f->raw, pcontext->videoIn->framebuffer, pcontext->videoIn->framesizeIn);
+            f->raw_size = pcontext->videoIn->framesizeIn;
+            f->format = pcontext->videoIn->formatIn;
+            f->quality = quality;
+            f->encode = encode_frame;
             /* copy this frame's timestamp to user space */
-            pglobal->in[pcontext->id].timestamp = pcontext->videoIn->buf.timestamp;
+            f->timestamp = pcontext->videoIn->buf.timestamp;
         } else {
         #endif
+            if(frame_reserve(f, pcontext->videoIn->framesizeIn) != 0) {
+                frame_put(f);
+                continue;
+            }
             DBG("copying frame from input: %d\n", (int)pcontext->id);
-            pglobal->in[pcontext->id].size = memcpy_picture(pglobal->in[pcontext->id].buf, pcontext->videoIn->tmpbuffer, pcontext->videoIn->tmpbytesused);
+            f->size = memcpy_picture(f->buf, pcontext->videoIn->tmpbuffer, pcontext->videoIn->tmpbytesused);
+            f->format = V4L2_PIX_FMT_MJPEG;
             /* copy this frame's timestamp to user space */
-            pglobal->in[pcontext->id].timestamp = pcontext->videoIn->tmptimestamp;
+            f->timestamp = pcontext->videoIn->tmptimestamp;
+            frame_clock(&f->encoded);
         #ifndef NO_LIBJPEG
         }
         #endif
@@ -686,10 +751,14 @@ void *cam_thread(void *arg)
         prev_size = global->size;
 #endif
 
+        f->width = pcontext->videoIn->width;
+        f->height = pcontext->videoIn->height;
+        f->captured = captured;
+
+        last_timestamp = f->timestamp;
 
         /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[pcontext->id].db_update);
-        pthread_mutex_unlock(&pglobal->in[pcontext->id].db);
+        frame_publish(in, f);
     }
 
     DBG("leaving input thread, calling cleanup function now\n");
@@ -716,10 +785,6 @@ void cam_cleanup(void *arg)
         free(pctx->videoIn);
         pctx->videoIn = NULL;
     }
-    
-    free(in->buf);
-    in->buf = NULL;
-    in->size = 0;
 }
 
 /******************************************************************************
@@ -732,7 +797,7 @@ Return Value: depends in the command, for most cases 0 means no errors and
 ******************************************************************************/
 int input_cmd(int plugin_number, unsigned int control_id, unsigned int group, int value, char *value_string)
 {
-    input * in = &pglobal->in[plugin_number];
+    input * in = pglobal->in[plugin_number];
     context *pctx = (context*)in->context;
     
     int ret = -1;
@@ -756,6 +821,7 @@ int input_cmd(int plugin_number, unsigned int control_id, unsigned int group, in
             ret = v4l2SetControl(pctx->videoIn, control_id, value, plugin_number, pglobal);
             if(ret == 0) {
                 in->in_parameters[i].value = value;
+                PLUGIN_CHANGED(in);
             } else {
                 DBG("v4l2SetControl failed: %d\n", ret);
             }
@@ -772,6 +838,7 @@ int input_cmd(int plugin_number, unsigned int control_id, unsigned int group, in
         ret = setResolution(pctx->videoIn, width, height);
         if(ret == 0) {
             in->in_formats[in->currentFormat].currentResolution = value;
+            PLUGIN_CHANGED(in);
         }
         return ret;
     } break;
@@ -780,6 +847,7 @@ int input_cmd(int plugin_number, unsigned int control_id, unsigned int group, in
             in->jpegcomp.quality = value;
             if(IOCTL_VIDEO(pctx->videoIn->fd, VIDIOC_S_JPEGCOMP, &in->jpegcomp) != EINVAL) {
                 DBG("JPEG quality is set to %d\n", value);
+                PLUGIN_CHANGED(in);
                 ret = 0;
             } else {
                 DBG("Setting the JPEG quality is not supported\n");
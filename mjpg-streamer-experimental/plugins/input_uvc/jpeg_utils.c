@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <jpeglib.h>
 #include <stdlib.h>
+#include <setjmp.h>
 
 #include <linux/types.h>          /* for videodev2.h */
 #include <linux/videodev2.h>
@@ -48,6 +49,25 @@ typedef struct {
 
 typedef mjpg_destination_mgr * mjpg_dest_ptr;
 
+/* libjpeg reports errors by calling error_exit, which must not return */
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+} mjpg_error_mgr;
+
+/******************************************************************************
+Description.: leave the encoder which failed, a broken frame must not end
+              the program
+Input Value.: cinfo is the encoder
+Return Value: does not return
+******************************************************************************/
+METHODDEF(void) error_exit(j_common_ptr cinfo)
+{
+    mjpg_error_mgr *err = (mjpg_error_mgr *) cinfo->err;
+
+    longjmp(err->jump, 1);
+}
+
 /******************************************************************************
 Description.:
 Input Value.:
@@ -127,36 +147,41 @@ GLOBAL(void) dest_buffer(j_compress_ptr cinfo, unsigned char *buffer, int size,
 }
 
 /******************************************************************************
-Description.: yuv2jpeg function is based on compress_yuyv_to_jpeg written by
-              Gabriel A. Devenyi.
-              modified to support other formats like RGB5:6:5 by Miklós Márton
-              It uses the destination manager implemented above to compress
-              YUYV data to JPEG. Most other implementations use the
-              "jpeg_stdio_dest" from libjpeg, which can not store compressed
-              pictures to memory instead of a file.
-Input Value.: video structure from v4l2uvc.c/h, destination buffer and buffersize
-              the buffer must be large enough, no error/size checking is done!
-Return Value: the buffer will contain the compressed data
+Description.: compress a raw picture that was already copied out of the
+              video structure. This is used to encode frames lazily, long
+              after the next picture was grabbed.
+Input Value.: raw picture, its size and V4L2_PIX_FMT_YUYV or _RGB565 format,
+              destination buffer and buffersize
+Return Value: number of bytes written to buffer, -1 if encoding failed
 ******************************************************************************/
-int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int quality)
+int compress_raw_to_jpeg(unsigned char *raw, int width, int height, unsigned int format, unsigned char *buffer, int size, int quality)
 {
     struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    mjpg_error_mgr jerr;
     JSAMPROW row_pointer[1];
     unsigned char *line_buffer, *yuyv;
     int z;
-    static int written;
+    int written;
 
-    line_buffer = calloc(vd->width * 3, 1);
-    yuyv = vd->framebuffer;
+    if((line_buffer = calloc(width * 3, 1)) == NULL)
+        return -1;
+    yuyv = raw;
 
-    cinfo.err = jpeg_std_error(&jerr);
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = error_exit;
     jpeg_create_compress(&cinfo);
+
+    if(setjmp(jerr.jump) != 0) {
+        jpeg_destroy_compress(&cinfo);
+        free(line_buffer);
+        return -1;
+    }
+
     /* jpeg_stdio_dest (&cinfo, file); */
     dest_buffer(&cinfo, buffer, size, &written);
 
-    cinfo.image_width = vd->width;
-    cinfo.image_height = vd->height;
+    cinfo.image_width = width;
+    cinfo.image_height = height;
     cinfo.input_components = 3;
     cinfo.in_color_space = JCS_RGB;
 
@@ -166,13 +191,13 @@ int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int
     jpeg_start_compress(&cinfo, TRUE);
 
     z = 0;
-    if (vd->formatIn == V4L2_PIX_FMT_YUYV) {
-        while(cinfo.next_scanline < vd->height) {
+    if (format == V4L2_PIX_FMT_YUYV) {
+        while(cinfo.next_scanline < height) {
             int x;
             unsigned char *ptr = line_buffer;
 
 
-            for(x = 0; x < vd->width; x++) {
+            for(x = 0; x < width; x++) {
                 int r, g, b;
                 int y, u, v;
 
@@ -200,12 +225,12 @@ int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int
             row_pointer[0] = line_buffer;
             jpeg_write_scanlines(&cinfo, row_pointer, 1);
         }
-    } else if (vd->formatIn == V4L2_PIX_FMT_RGB565) {
-        while(cinfo.next_scanline < vd->height) {
+    } else if (format == V4L2_PIX_FMT_RGB565) {
+        while(cinfo.next_scanline < height) {
             int x;
             unsigned char *ptr = line_buffer;
 
-            for(x = 0; x < vd->width; x++) {
+            for(x = 0; x < width; x++) {
                 /*
                 unsigned int tb = ((unsigned char)raw[i+1] << 8) + (unsigned char)raw[i];
                 r =  ((unsigned char)(raw[i+1]) & 248);
@@ -231,3 +256,20 @@ int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int
 
     return (written);
 }
+
+/******************************************************************************
+Description.: yuv2jpeg function is based on compress_yuyv_to_jpeg written by
+              Gabriel A. Devenyi.
+              modified to support other formats like RGB5:6:5 by Miklós Márton
+              It uses the destination manager implemented above to compress
+              YUYV data to JPEG. Most other implementations use the
+              "jpeg_stdio_dest" from libjpeg, which can not store compressed
+              pictures to memory instead of a file.
+Input Value.: video structure from v4l2uvc.c/h, destination buffer and buffersize
+              the buffer must be large enough, no error/size checking is done!
+Return Value: the buffer will contain the compressed data
+******************************************************************************/
+int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int quality)
+{
+    return compress_raw_to_jpeg(vd->framebuffer, vd->width, vd->height, vd->formatIn, buffer, size, quality);
+}
@@ -1 +1,2 @@
 int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int quality);
+int compress_raw_to_jpeg(unsigned char *raw, int width, int height, unsigned int format, unsigned char *buffer, int size, int quality);
@@ -71,6 +71,7 @@ enum _streaming_state {
     STREAMING_OFF = 0,
     STREAMING_ON = 1,
     STREAMING_PAUSED = 2,
+    STREAMING_SUSPENDED = 3,    /* stopped by uvcSuspend(), buffers need to be queued again */
 };
 
 struct vdIn {
@@ -152,6 +153,7 @@ int setResolution(struct vdIn *vd, int width, int height);
 
 int memcpy_picture(unsigned char *out, unsigned char *buf, int size);
 int uvcGrab(struct vdIn *vd);
+int uvcSuspend(struct vdIn *vd);
 int close_v4l2(struct vdIn *vd);
 
 int v4l2GetControl(struct vdIn *vd, int control);
@@ -39,14 +39,24 @@ struct _output_parameter {
 /* structure to store variables/functions for output plugin */
 typedef struct _output output;
 struct _output {
+    char *spec;     /* as given on the command line, NULL if the slot is unused */
     char *plugin;
     char *name;
-    void *handle;
+    void *handle;   /* NULL once the plugin was removed */
     output_parameter param;
 
     // input plugin parameters
     struct _control *out_parameters;
     int parametercount;
+    unsigned int version;   /* see PLUGIN_CHANGED() */
+
+    /* stage latencies, recorded by the plugin with trace_frame_sent() */
+    trace_histogram trace[TRACE_OUTPUT_STAGES];
+
+    /* counters for /metrics, modified atomically */
+    unsigned long frames_sent;          /* counted by trace_frame_sent() */
+    unsigned long long bytes_sent;
+    int clients;                        /* consumers connected right now */
 
     int (*init)(output_parameter *param, int id);
     int (*stop)(int);
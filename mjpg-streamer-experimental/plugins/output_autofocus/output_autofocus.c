@@ -49,7 +49,6 @@
 static pthread_t worker;
 static globals *pglobal;
 static int fd, delay;
-static unsigned char *frame = NULL;
 static int input_number;
 
 /******************************************************************************
@@ -84,7 +83,7 @@ void worker_cleanup(void *arg)
     first_run = 0;
     OPRINT("cleaning up resources allocated by worker thread\n");
 
-    free(frame);
+    frame_unsubscribe(pglobal->in[input_number]);
     close(fd);
 }
 
@@ -98,31 +97,33 @@ Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int frame_size = 0;
+    frame *f;
+    frame_cursor cursor = {0, 0};
     double sv = -1.0, max_sv = 100.0, delta = 500;
     int focus = 255, step = 10, max_focus = 100, search_focus = 1;
 
-    if((frame = malloc(256 * 1024)) == NULL) {
-        OPRINT("not enough memory for worker thread\n");
-        exit(EXIT_FAILURE);
-    }
-
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
+    /* this output reads every frame, keep an on-demand input capturing */
+    frame_subscribe(pglobal->in[input_number]);
+
     while(!pglobal->stop) {
         DBG("waiting for fresh frame\n");
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+        f = frame_wait(pglobal->in[input_number], &cursor);
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        /* the input was removed, it never delivers frames again */
+        if(f == NULL)
+            break;
 
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        if(frame_jpeg(f) != 0) {
+            frame_put(f);
+            continue;
+        }
 
         /* process frame */
-        sv = getFrameSharpnessValue(frame, frame_size);
+        sv = getFrameSharpnessValue(f->buf, f->size);
+        frame_put(f);
         DBG("sharpness is: %f\n", sv);
 
         if(search_focus || (ABS(sv - max_sv) > delta)) {
@@ -250,6 +251,7 @@ int output_stop(int id)
 {
     DBG("will cancel worker thread\n");
     pthread_cancel(worker);
+    pthread_join(worker, NULL);
     return 0;
 }
 
@@ -262,6 +264,5 @@ int output_run(int id)
 {
     DBG("launching worker thread\n");
     pthread_create(&worker, 0, worker_thread, NULL);
-    pthread_detach(worker);
     return 0;
 }
@@ -46,13 +46,16 @@
 
 static pthread_t worker;
 static globals *pglobal;
-static int fd, delay, ringbuffer_size = -1, ringbuffer_exceed = 0, max_frame_size;
+static int fd = -1, delay, ringbuffer_size = -1, ringbuffer_exceed = 0;
 static char *folder = "/tmp";
-static unsigned char *frame = NULL;
 static char *command = NULL;
 static int input_number = 0;
+static int output_number = 0;
 static char *mjpgFileName = NULL;
 
+/* frame being written, worker_cleanup() releases it if the thread is cancelled */
+static frame *held = NULL;
+
 /******************************************************************************
 Description.: print a help message
 Input Value.: -
@@ -84,10 +87,6 @@ void worker_cleanup(void *arg)
 {
     static unsigned char first_run = 1;
 
-    if (mjpgFileName != NULL) {
-        close(fd);
-    }
-
     if(!first_run) {
         DBG("already cleaned up resources\n");
         return;
@@ -96,10 +95,15 @@ void worker_cleanup(void *arg)
     first_run = 0;
     OPRINT("cleaning up resources allocated by worker thread\n");
 
-    if(frame != NULL) {
-        free(frame);
+    frame_put(held);
+    held = NULL;
+    frame_unsubscribe(pglobal->in[input_number]);
+
+    /* a descriptor closed before may belong to somebody else by now */
+    if(fd >= 0) {
+        close(fd);
+        fd = -1;
     }
-    close(fd);
 }
 
 /******************************************************************************
@@ -201,45 +205,38 @@ Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int ok = 1, frame_size = 0, rc = 0;
+    int ok = 1, rc = 0;
     char buffer1[1024] = {0}, buffer2[1024] = {0};
     unsigned long long counter = 0;
     time_t t;
     struct tm *now;
-    unsigned char *tmp_framebuffer = NULL;
+    frame *f;
+    frame_cursor cursor = {0, 0};
 
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
+    /* this output reads every frame, keep an on-demand input capturing */
+    frame_subscribe(pglobal->in[input_number]);
+
     while(ok >= 0 && !pglobal->stop) {
         DBG("waiting for fresh frame\n");
 
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+        f = held = frame_wait(pglobal->in[input_number], &cursor);
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+        /* the input was removed, it never delivers frames again */
+        if(f == NULL)
+            break;
 
-        /* check if buffer for frame is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
+        if(cursor.skipped != 0)
+            DBG("frames skipped so far: %u\n", cursor.skipped);
 
-            max_frame_size = frame_size + (1 << 16);
-            if((tmp_framebuffer = realloc(frame, max_frame_size)) == NULL) {
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                LOG("not enough memory\n");
-                return NULL;
-            }
-
-            frame = tmp_framebuffer;
+        if(frame_jpeg(f) != 0) {
+            frame_put(f);
+            held = NULL;
+            continue;
         }
 
-        /* copy frame to our local buffer now */
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-
-        /* allow others to access the global buffer again */
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
-
         if (mjpgFileName == NULL) { // single files with ringbuffer mode
             /* prepare filename */
             memset(buffer1, 0, sizeof(buffer1));
@@ -250,14 +247,13 @@ void *worker_thread(void *arg)
             now = localtime(&t);
             if(now == NULL) {
                 perror("localtime");
-                return NULL;
+                break;
             }
 
             /* prepare string, add time and date values */
             if(strftime(buffer1, sizeof(buffer1), "%%s/%Y_%m_%d_%H_%M_%S_picture_%%09llu.jpg", now) == 0) {
                 OPRINT("strftime returned 0\n");
-                free(frame); frame = NULL;
-                return NULL;
+                break;
             }
 
             /* finish filename by adding the foldername and a counter value */
@@ -270,18 +266,21 @@ void *worker_thread(void *arg)
             /* open file for write */
             if((fd = open(buffer2, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
                 OPRINT("could not open the file %s\n", buffer2);
-                return NULL;
+                break;
             }
 
             /* save picture to file */
-            if(write(fd, frame, frame_size) < 0) {
+            if(write(fd, f->buf, f->size) < 0) {
                 OPRINT("could not write to file %s\n", buffer2);
                 perror("write()");
-                close(fd);
-                return NULL;
+                break;
             }
+            trace_frame_sent(pglobal->out[output_number], f, f->size);
 
             close(fd);
+            fd = -1;
+            frame_put(f);
+            held = NULL;
 
             /* call the command if user specified one, pass current filename as argument */
             if(command != NULL) {
@@ -316,12 +315,14 @@ void *worker_thread(void *arg)
             }
         } else { // recording to MJPG file
             /* save picture to file */
-            if(write(fd, frame, frame_size) < 0) {
+            if(write(fd, f->buf, f->size) < 0) {
                 OPRINT("could not write to file %s\n", buffer2);
                 perror("write()");
-                close(fd);
-                return NULL;
+                break;
             }
+            trace_frame_sent(pglobal->out[output_number], f, f->size);
+            frame_put(f);
+            held = NULL;
         }
 
         /* if specified, wait now */
@@ -330,7 +331,7 @@ void *worker_thread(void *arg)
         }
     }
 
-    /* cleanup now */
+    /* cleanup now, this releases the frame an error left the loop with */
     pthread_cleanup_pop(1);
 
     return NULL;
@@ -348,9 +349,10 @@ int output_init(output_parameter *param, int id)
 	int i;
     delay = 0;
     pglobal = param->global;
-    pglobal->out[id].name = malloc((1+strlen(OUTPUT_PLUGIN_NAME))*sizeof(char));
-    sprintf(pglobal->out[id].name, "%s", OUTPUT_PLUGIN_NAME);
-    DBG("OUT plugin %d name: %s\n", id, pglobal->out[id].name);
+    output_number = id;
+    pglobal->out[id]->name = malloc((1+strlen(OUTPUT_PLUGIN_NAME))*sizeof(char));
+    sprintf(pglobal->out[id]->name, "%s", OUTPUT_PLUGIN_NAME);
+    DBG("OUT plugin %d name: %s\n", id, pglobal->out[id]->name);
 
     param->argv[0] = OUTPUT_PLUGIN_NAME;
 
@@ -446,13 +448,13 @@ int output_init(output_parameter *param, int id)
         }
     }
 
-    if(!(input_number < pglobal->incnt)) {
+    if(!INPUT_VALID(pglobal, input_number)) {
         OPRINT("ERROR: the %d input_plugin number is too much only %d plugins loaded\n", input_number, param->global->incnt);
         return 1;
     }
 
     OPRINT("output folder.....: %s\n", folder);
-    OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number].plugin);
+    OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number]->plugin);
     OPRINT("delay after save..: %d\n", delay);
     if  (mjpgFileName == NULL) {
         if(ringbuffer_size > 0) {
@@ -473,9 +475,9 @@ int output_init(output_parameter *param, int id)
         free(fnBuffer);
     }
 
-    param->global->out[id].parametercount = 2;
+    param->global->out[id]->parametercount = 2;
 
-    param->global->out[id].out_parameters = (control*) calloc(2, sizeof(control));
+    param->global->out[id]->out_parameters = (control*) calloc(2, sizeof(control));
 
     control take_ctrl;
 	take_ctrl.group = IN_CMD_GENERIC;
@@ -491,7 +493,7 @@ int output_init(output_parameter *param, int id)
 	take_ctrl.ctrl.step = 1;
 	take_ctrl.ctrl.default_value = 0;
 
-	param->global->out[id].out_parameters[0] = take_ctrl;
+	param->global->out[id]->out_parameters[0] = take_ctrl;
 
     control filename_ctrl;
 	filename_ctrl.group = IN_CMD_GENERIC;
@@ -507,7 +509,7 @@ int output_init(output_parameter *param, int id)
 	filename_ctrl.ctrl.step = 1;
 	filename_ctrl.ctrl.default_value = 0;
 
-	param->global->out[id].out_parameters[1] = filename_ctrl;
+	param->global->out[id]->out_parameters[1] = filename_ctrl;
 
 
     return 0;
@@ -522,6 +524,7 @@ int output_stop(int id)
 {
     DBG("will cancel worker thread\n");
     pthread_cancel(worker);
+    pthread_join(worker, NULL);
     return 0;
 }
 
@@ -534,7 +537,6 @@ int output_run(int id)
 {
     DBG("launching worker thread\n");
     pthread_create(&worker, 0, worker_thread, NULL);
-    pthread_detach(worker);
     return 0;
 }
 
@@ -544,60 +546,46 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
     DBG("command (%d, value: %d) for group %d triggered for plugin instance #%02d\n", control_id, value, group, plugin_id);
     switch(group) {
 		case IN_CMD_GENERIC:
-			for(i = 0; i < pglobal->out[plugin_id].parametercount; i++) {
-				if((pglobal->out[plugin_id].out_parameters[i].ctrl.id == control_id) && (pglobal->out[plugin_id].out_parameters[i].group == IN_CMD_GENERIC)) {
-					DBG("Generic control found (id: %d): %s\n", control_id, pglobal->out[plugin_id].out_parameters[i].ctrl.name);
+			for(i = 0; i < pglobal->out[plugin_id]->parametercount; i++) {
+				if((pglobal->out[plugin_id]->out_parameters[i].ctrl.id == control_id) && (pglobal->out[plugin_id]->out_parameters[i].group == IN_CMD_GENERIC)) {
+					DBG("Generic control found (id: %d): %s\n", control_id, pglobal->out[plugin_id]->out_parameters[i].ctrl.name);
 					switch(control_id) {
                             case OUT_FILE_CMD_TAKE: {
                                 if (valueStr != NULL) {
-                                    int frame_size = 0;
-                                    unsigned char *tmp_framebuffer = NULL;
+                                    frame *f;
 
-                                    if(pthread_mutex_lock(&pglobal->in[input_number].db)) {
-                                        DBG("Unable to lock mutex\n");
+                                    /* take the latest frame, do not wait for a fresh one */
+                                    if((f = frame_get(pglobal->in[input_number])) == NULL) {
+                                        DBG("No frame available yet\n");
                                         return -1;
                                     }
-                                    /* read buffer */
-                                    frame_size = pglobal->in[input_number].size;
-
-                                    /* check if buffer for frame is large enough, increase it if necessary */
-                                    if(frame_size > max_frame_size) {
-                                        DBG("increasing buffer size to %d\n", frame_size);
 
-                                        max_frame_size = frame_size + (1 << 16);
-                                        if((tmp_framebuffer = realloc(frame, max_frame_size)) == NULL) {
-                                            pthread_mutex_unlock(&pglobal->in[input_number].db);
-                                            LOG("not enough memory\n");
-                                            return -1;
-                                        }
-
-                                        frame = tmp_framebuffer;
+                                    if(frame_jpeg(f) != 0) {
+                                        frame_put(f);
+                                        return -1;
                                     }
 
-                                    /* copy frame to our local buffer now */
-                                    memcpy(frame, pglobal->in[input_number].buf, frame_size);
-
-                                    /* allow others to access the global buffer again */
-                                    pthread_mutex_unlock(&pglobal->in[input_number].db);
-
                                     DBG("writing file: %s\n", valueStr);
 
                                     int fd;
                                     /* open file for write */
                                     if((fd = open(valueStr, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
                                         OPRINT("could not open the file %s\n", valueStr);
+                                        frame_put(f);
                                         return -1;
                                     }
 
                                     /* save picture to file */
-                                    if(write(fd, frame, frame_size) < 0) {
+                                    if(write(fd, f->buf, f->size) < 0) {
                                         OPRINT("could not write to file %s\n", valueStr);
                                         perror("write()");
                                         close(fd);
+                                        frame_put(f);
                                         return -1;
                                     }
 
                                     close(fd);
+                                    frame_put(f);
                                 } else {
                                     DBG("No filename specified\n");
                                     return -1;
@@ -612,7 +600,7 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
                                 return -1;
                             } break;
 					}
-					DBG("Ctrl %s new value: %d\n", pglobal->out[plugin_id].out_parameters[i].ctrl.name, value);
+					DBG("Ctrl %s new value: %d\n", pglobal->out[plugin_id]->out_parameters[i].ctrl.name, value);
 					return 0;
 				}
 			}
@@ -29,14 +29,26 @@
 #include <ctype.h>
 #include <pthread.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <syslog.h>
 #include <netdb.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdarg.h>
+
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
 
 #include <linux/version.h>
 #include <linux/types.h>          /* for videodev2.h */
@@ -55,19 +67,22 @@
 
 
 static globals *pglobal;
-extern context servers[MAX_OUTPUT_PLUGINS];
-int piggy_fine = 2; // FIXME make it command line parameter
 
-/******************************************************************************
-Description.: initializes the iobuffer structure properly
-Input Value.: pointer to already allocated iobuffer
-Return Value: iobuf
-******************************************************************************/
-void init_iobuffer(iobuffer *iobuf)
-{
-    memset(iobuf->buffer, 0, sizeof(iobuf->buffer));
-    iobuf->level = 0;
-}
+/* stream clients of all server instances, only used to serve /metrics */
+static stream_client *stream_clients;
+static pthread_mutex_t stream_clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the JSON descriptions of the plugins of all server instances, see json_get() */
+static struct {
+    pthread_mutex_t lock;
+    unsigned int epoch;         /* time the first one was formatted, part of the ETags */
+    unsigned int version;       /* documents formatted so far, each gets the next ETag */
+    json_doc program;
+    json_doc *inputs;
+    json_doc *outputs;
+    int inputs_len;
+    int outputs_len;
+} json_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
 /******************************************************************************
 Description.: initializes the request structure properly
@@ -76,125 +91,16 @@ Return Value: req
 ******************************************************************************/
 void init_request(request *req)
 {
-    req->type        = A_UNKNOWN;
-    req->parameter   = NULL;
-    req->client      = NULL;
-    req->credentials = NULL;
-}
-
-/******************************************************************************
-Description.: If strings were assigned to the different members free them
-              This will fail if strings are static, so always use strdup().
-Input Value.: req: pointer to request structure
-Return Value: -
-******************************************************************************/
-void free_request(request *req)
-{
-    if(req->parameter != NULL) free(req->parameter);
-    if(req->client != NULL) free(req->client);
-    if(req->credentials != NULL) free(req->credentials);
-    if(req->query_string != NULL) free(req->query_string);
-}
-
-/******************************************************************************
-Description.: read with timeout, implemented without using signals
-              tries to read len bytes and returns if enough bytes were read
-              or the timeout was triggered. In case of timeout the return
-              value may differ from the requested bytes "len".
-Input Value.: * fd.....: fildescriptor to read from
-              * iobuf..: iobuffer that allows to use this functions from multiple
-                         threads because the complete context is the iobuffer.
-              * buffer.: The buffer to store values at, will be set to zero
-                         before storing values.
-              * len....: the length of buffer
-              * timeout: seconds to wait for an answer
-Return Value: * buffer.: will become filled with bytes read
-              * iobuf..: May get altered to save the context for future calls.
-              * func().: bytes copied to buffer or -1 in case of error
-******************************************************************************/
-int _read(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout)
-{
-    int copied = 0, rc, i;
-    fd_set fds;
-    struct timeval tv;
-
-    memset(buffer, 0, len);
-
-    while((copied < len)) {
-        i = MIN(iobuf->level, len - copied);
-        memcpy(buffer + copied, iobuf->buffer + IO_BUFFER - iobuf->level, i);
-
-        iobuf->level -= i;
-        copied += i;
-        if(copied >= len)
-            return copied;
-
-        /* select will return in case of timeout or new data arrived */
-        tv.tv_sec = timeout;
-        tv.tv_usec = 0;
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        if((rc = select(fd + 1, &fds, NULL, NULL, &tv)) <= 0) {
-            if(rc < 0)
-                exit(EXIT_FAILURE);
-
-            /* this must be a timeout */
-            return copied;
-        }
-
-        init_iobuffer(iobuf);
-
-        /*
-         * there should be at least one byte, because select signalled it.
-         * But: It may happen (very seldomly), that the socket gets closed remotly between
-         * the select() and the following read. That is the reason for not relying
-         * on reading at least one byte.
-         */
-        if((iobuf->level = read(fd, &iobuf->buffer, IO_BUFFER)) <= 0) {
-            /* an error occured */
-            return -1;
-        }
-
-        /* align data to the end of the buffer if less than IO_BUFFER bytes were read */
-        memmove(iobuf->buffer + (IO_BUFFER - iobuf->level), iobuf->buffer, iobuf->level);
-    }
-
-    return 0;
-}
-
-/******************************************************************************
-Description.: Read a single line from the provided fildescriptor.
-              This funtion will return under two conditions:
-              * line end was reached
-              * timeout occured
-Input Value.: * fd.....: fildescriptor to read from
-              * iobuf..: iobuffer that allows to use this functions from multiple
-                         threads because the complete context is the iobuffer.
-              * buffer.: The buffer to store values at, will be set to zero
-                         before storing values.
-              * len....: the length of buffer
-              * timeout: seconds to wait for an answer
-Return Value: * buffer.: will become filled with bytes read
-              * iobuf..: May get altered to save the context for future calls.
-              * func().: bytes copied to buffer or -1 in case of error
-******************************************************************************/
-/* read just a single line or timeout */
-int _readline(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout)
-{
-    char c = '\0', *out = buffer;
-    int i;
-
-    memset(buffer, 0, len);
-
-    for(i = 0; i < len && c != '\n'; i++) {
-        if(_read(fd, iobuf, &c, 1, timeout) <= 0) {
-            /* timeout or error occured */
-            return -1;
-        }
-        *out++ = c;
-    }
-
-    return i;
+    req->type            = A_UNKNOWN;
+    req->parameter[0]    = '\0';
+    req->query_string[0] = '\0';
+    req->keepalive       = 0;
+    req->etag_epoch      = 0;
+    req->etag_seq        = 0;
+    req->wait            = 0;
+    req->gzip            = 0;
+    req->fps             = 0;
+    req->scale           = 0;
 }
 
 /******************************************************************************
@@ -306,358 +212,868 @@ int unescape(char *string)
     return 0;
 }
 
+/******************************************************************************
+Description.: hash a numeric client address (FNV-1a)
+Input Value.: address is the address
+Return Value: the hash
+******************************************************************************/
+static unsigned int address_hash(const char *address)
+{
+    unsigned int hash = 2166136261u;
+
+    for(; *address != '\0'; address++)
+        hash = (hash ^ (unsigned char)*address) * 16777619u;
+
+    return hash;
+}
+
 #ifdef MANAGMENT
+/* the clients of all servers, see client_info */
+static struct {
+    client_info *buckets[CLIENT_BUCKETS];
+    pthread_mutex_t locks[CLIENT_SHARDS];
+} client_infos;
+static pthread_once_t client_infos_once = PTHREAD_ONCE_INIT;
+
+static void client_infos_init(void)
+{
+    int i;
+
+    for(i = 0; i < CLIENT_SHARDS; i++)
+        pthread_mutex_init(&client_infos.locks[i], NULL);
+}
 
 /******************************************************************************
-Description.: Adds a new client information struct to the ino list.
-Input Value.: Client IP address as a string
-Return Value: Returns with the newly added info or with a pointer to the existing item
+Description.: drop the entries of a list whose address had no socket open
+              for CLIENT_EXPIRE seconds
+Input Value.: link is the head of the list, its shard has to be locked,
+              now the frame_clock() seconds
+Return Value: -
 ******************************************************************************/
-client_info *add_client(char *address)
+static void client_expire(client_info **link, time_t now)
 {
-    unsigned int i = 0;
-    int name_length = strlen(address) + 1;
-
-    pthread_mutex_lock(&client_infos.mutex);
+    client_info *client;
 
-    for (; i<client_infos.client_count; i++) {
-        if (strcmp(client_infos.infos[i]->address, address) == 0) {
-            pthread_mutex_unlock(&client_infos.mutex);
-            return client_infos.infos[i];
+    while((client = *link) != NULL) {
+        if(client->connections == 0 && now - client->left > CLIENT_EXPIRE) {
+            *link = client->next;
+            free(client);
+        } else {
+            link = &client->next;
         }
     }
+}
 
-    client_info *current_client_info = malloc(sizeof(client_info));
-    if (current_client_info == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        pthread_mutex_unlock(&client_infos.mutex);
-        return NULL;
-    }
+/******************************************************************************
+Description.: Look up the client information of an address and count a
+              socket for it. A new entry is added for unknown addresses.
+Input Value.: Client IP address as a string
+Return Value: the entry, NULL if memory ran out. Release it with
+              release_client() once the socket is closed.
+******************************************************************************/
+client_info *add_client(const char *address)
+{
+    unsigned int bucket = address_hash(address) % CLIENT_BUCKETS;
+    pthread_mutex_t *lock = &client_infos.locks[bucket % CLIENT_SHARDS];
+    client_info *client;
+    struct timeval now;
 
-    current_client_info->address = malloc(name_length * sizeof(char));
-    if (current_client_info->address == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        pthread_mutex_unlock(&client_infos.mutex);
-        return NULL;
-    }
+    frame_clock(&now);
+    pthread_mutex_lock(lock);
+    client_expire(&client_infos.buckets[bucket], now.tv_sec);
 
-    strcpy(current_client_info->address, address);
-    memset(&(current_client_info->last_take_time), 0, sizeof(struct timeval)); // set last time to zero
+    for(client = client_infos.buckets[bucket]; client != NULL; client = client->next) {
+        if(strcmp(client->address, address) == 0)
+            break;
+    }
 
-    client_infos.infos = realloc(client_infos.infos, (client_infos.client_count + 1) * sizeof(client_info*));
-    client_infos.infos[client_infos.client_count] = current_client_info;
-    client_infos.client_count += 1;
+    if(client == NULL) {
+        if((client = calloc(1, sizeof(client_info))) == NULL) {
+            fprintf(stderr, "could not allocate memory\n");
+        } else {
+            snprintf(client->address, sizeof(client->address), "%s", address);
+            client->next = client_infos.buckets[bucket];
+            client_infos.buckets[bucket] = client;
+        }
+    }
+    if(client != NULL)
+        client->connections++;
+    pthread_mutex_unlock(lock);
 
-    pthread_mutex_unlock(&client_infos.mutex);
-    return current_client_info;
+    return client;
 }
 
 /******************************************************************************
-Description.: Looks in the client_infos for the current ip address.
-Input Value.: Client IP address as a string
-Return Value: If a frame was served to it within the specified interval it returns 1
-              If not it returns with 0
-******************************************************************************/
-int check_client_status(client_info *client)
-{
-    unsigned int i = 0;
-    pthread_mutex_lock(&client_infos.mutex);
-    for (; i<client_infos.client_count; i++) {
-        if (client_infos.infos[i] == client) {
-            long msec;
-            struct timeval tim;
-            gettimeofday(&tim, NULL);
-            msec  =(tim.tv_sec - client_infos.infos[i]->last_take_time.tv_sec)*1000;
-            msec +=(tim.tv_usec - client_infos.infos[i]->last_take_time.tv_usec)/1000;
-            DBG("diff: %ld\n", msec);
-            if ((msec < 1000) && (msec > 0)) { // FIXME make it parameter
-                DBG("CHEATER\n");
-                pthread_mutex_unlock(&client_infos.mutex);
-                return 1;
-            } else {
-                pthread_mutex_unlock(&client_infos.mutex);
-                return 0;
-            }
-        }
-    }
-    DBG("Client not found in the client list! How did it happend?? This is a BUG\n");
-    pthread_mutex_unlock(&client_infos.mutex);
-    return 0;
+Description.: a socket of an address of add_client() was closed
+Input Value.: client is the entry or NULL
+Return Value: -
+******************************************************************************/
+void release_client(client_info *client)
+{
+    pthread_mutex_t *lock;
+    struct timeval now;
+
+    if(client == NULL)
+        return;
+
+    lock = &client_infos.locks[address_hash(client->address) % CLIENT_BUCKETS % CLIENT_SHARDS];
+    frame_clock(&now);
+    pthread_mutex_lock(lock);
+    if(--client->connections == 0)
+        client->left = now.tv_sec;
+    pthread_mutex_unlock(lock);
 }
 
+/******************************************************************************
+Description.: note that a frame was sent to a client. Streams call it for
+              every frame, the entry is only written once a second.
+Input Value.: client is the entry or NULL
+Return Value: -
+******************************************************************************/
 void update_client_timestamp(client_info *client)
 {
-    struct timeval tim;
-    pthread_mutex_lock(&client_infos.mutex);
-    gettimeofday(&tim, NULL);
-    memcpy(&client->last_take_time, &tim, sizeof(struct timeval));
-    pthread_mutex_unlock(&client_infos.mutex);
+    time_t now = time(NULL);
+
+    if(client != NULL && __atomic_load_n(&client->last_take_time, __ATOMIC_RELAXED) != now)
+        __atomic_store_n(&client->last_take_time, now, __ATOMIC_RELAXED);
 }
 #endif
 
 /******************************************************************************
-Description.: Send a complete HTTP response and a single JPG-frame.
-Input Value.: fildescriptor fd to send the answer to
+Description.: prepare the table of client addresses of a server
+Input Value.: pc is the server context
 Return Value: -
 ******************************************************************************/
-void send_snapshot(cfd *context_fd, int input_number)
+static void peer_init(context *pc)
 {
-    unsigned char *frame = NULL;
-    int frame_size = 0;
-    char buffer[BUFFER_SIZE] = {0};
-    struct timeval timestamp;
+    int i;
 
-    /* wait for a fresh frame */
-    pthread_mutex_lock(&pglobal->in[input_number].db);
-    pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+    memset(pc->peers, 0, sizeof(pc->peers));
+    for(i = 0; i < PEER_LOCKS; i++)
+        pthread_mutex_init(&pc->peer_locks[i], NULL);
+    pc->streams = 0;
+}
 
-    /* read buffer */
-    frame_size = pglobal->in[input_number].size;
+/******************************************************************************
+Description.: free the table of client addresses, no connection may
+              reference an address anymore
+Input Value.: pc is the server context
+Return Value: -
+******************************************************************************/
+static void peer_free(context *pc)
+{
+    peer *p;
+    int i;
 
-    /* allocate a buffer for this single frame */
-    if((frame = malloc(frame_size + 1)) == NULL) {
-        free(frame);
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
-        send_error(context_fd->fd, 500, "not enough memory");
-        return;
+    for(i = 0; i < PEER_BUCKETS; i++) {
+        while((p = pc->peers[i]) != NULL) {
+            pc->peers[i] = p->next;
+            free(p);
+        }
     }
-    /* copy v4l2_buffer timeval to user space */
-    timestamp = pglobal->in[input_number].timestamp;
+    for(i = 0; i < PEER_LOCKS; i++)
+        pthread_mutex_destroy(&pc->peer_locks[i]);
+}
 
-    memcpy(frame, pglobal->in[input_number].buf, frame_size);
-    DBG("got frame (size: %d kB)\n", frame_size / 1024);
+/******************************************************************************
+Description.: the list of the peer table an address is kept in
+Input Value.: address is the numeric address
+Return Value: index into the table
+******************************************************************************/
+static unsigned int peer_bucket(const char *address)
+{
+    return address_hash(address) % PEER_BUCKETS;
+}
 
-    pthread_mutex_unlock(&pglobal->in[input_number].db);
+/******************************************************************************
+Description.: look up the address a client connected from and count the
+              connection for it. Addresses which had no connection for
+              PEER_EXPIRE seconds are dropped from its list on the way.
+Input Value.: pc is the server context, address the numeric address
+Return Value: the address, NULL if there are no limits per address or
+              memory ran out. Release it with peer_put().
+******************************************************************************/
+static peer *peer_get(context *pc, const char *address)
+{
+    unsigned int bucket = peer_bucket(address);
+    pthread_mutex_t *lock = &pc->peer_locks[bucket % PEER_LOCKS];
+    peer **link, *p = NULL;
+    struct timeval now;
 
-    #ifdef MANAGMENT
-    update_client_timestamp(context_fd->client);
-    #endif
+    if(pc->conf.streams_per_ip == 0 && pc->conf.snapshot_rate == 0)
+        return NULL;
 
-    /* write the response */
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            STD_HEADER \
-            "Content-type: image/jpeg\r\n" \
-            "X-Timestamp: %d.%06d\r\n" \
-            "\r\n", (int) timestamp.tv_sec, (int) timestamp.tv_usec);
-
-    /* send header and image now */
-    if (write(context_fd->fd, buffer, strlen(buffer)) < 0 ||
-        write(context_fd->fd, frame, frame_size) < 0) {
-        free(frame);
-        return;
+    frame_clock(&now);
+    pthread_mutex_lock(lock);
+    for(link = &pc->peers[bucket]; *link != NULL;) {
+        p = *link;
+        if(strcmp(p->address, address) == 0)
+            break;
+        if(p->connections == 0 && now.tv_sec - p->left > PEER_EXPIRE) {
+            *link = p->next;
+            free(p);
+        } else {
+            link = &p->next;
+        }
+        p = NULL;
+    }
+
+    if(p == NULL && (p = calloc(1, sizeof(peer))) != NULL) {
+        snprintf(p->address, sizeof(p->address), "%s", address);
+        p->tokens = pc->conf.snapshot_rate;
+        p->refilled = now;
+        p->next = pc->peers[bucket];
+        pc->peers[bucket] = p;
     }
+    if(p != NULL)
+        p->connections++;
+    pthread_mutex_unlock(lock);
 
-    free(frame);
+    return p;
 }
 
 /******************************************************************************
-Description.: Send a complete HTTP response and a stream of JPG-frames.
-Input Value.: fildescriptor fd to send the answer to
+Description.: a connection of an address of peer_get() was closed
+Input Value.: pc is the server context, p the address or NULL
 Return Value: -
 ******************************************************************************/
-void send_stream(cfd *context_fd, int input_number)
+static void peer_put(context *pc, peer *p)
 {
-    unsigned char *frame = NULL, *tmp = NULL;
-    int frame_size = 0, max_frame_size = 0;
-    char buffer[BUFFER_SIZE] = {0};
-    struct timeval timestamp;
-
-    DBG("preparing header\n");
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Access-Control-Allow-Origin: *\r\n" \
-            STD_HEADER \
-            "Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY "\r\n" \
-            "\r\n" \
-            "--" BOUNDARY "\r\n");
+    pthread_mutex_t *lock;
+    struct timeval now;
 
-    if(write(context_fd->fd, buffer, strlen(buffer)) < 0) {
-        free(frame);
+    if(p == NULL)
         return;
-    }
 
-    DBG("Headers send, sending stream now\n");
+    lock = &pc->peer_locks[peer_bucket(p->address) % PEER_LOCKS];
+    frame_clock(&now);
+    pthread_mutex_lock(lock);
+    if(--p->connections == 0)
+        p->left = now.tv_sec;
+    pthread_mutex_unlock(lock);
+}
 
-    while(!pglobal->stop) {
+/******************************************************************************
+Description.: take one snapshot from the token bucket of an address, it
+              refills with --snapshot_rate tokens per second and holds as
+              many at most
+Input Value.: pc is the server context, p the address
+Return Value: 0 if the snapshot may be sent, -1 if the bucket is empty.
+              At one snapshot per second or more it holds a token again
+              within a second.
+******************************************************************************/
+static int peer_take_snapshot(context *pc, peer *p)
+{
+    pthread_mutex_t *lock = &pc->peer_locks[peer_bucket(p->address) % PEER_LOCKS];
+    double rate = pc->conf.snapshot_rate;
+    struct timeval now;
+    int rc = 0;
+
+    frame_clock(&now);
+    pthread_mutex_lock(lock);
+    p->tokens += frame_elapsed_us(&p->refilled, &now) * rate / 1000000;
+    if(p->tokens > rate)
+        p->tokens = rate;
+    p->refilled = now;
+    if(p->tokens >= 1)
+        p->tokens -= 1;
+    else
+        rc = -1;
+    pthread_mutex_unlock(lock);
+
+    return rc;
+}
 
-        /* wait for fresh frames */
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+/******************************************************************************
+Description.: add a stream client to the list /metrics reports and count it
+              as client of its output
+Input Value.: client is the entry, it must stay valid until stream_unregister()
+Return Value: -
+******************************************************************************/
+static void stream_register(stream_client *client)
+{
+    pthread_mutex_lock(&stream_clients_lock);
+    client->next = stream_clients;
+    stream_clients = client;
+    pthread_mutex_unlock(&stream_clients_lock);
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+    __atomic_add_fetch(&pglobal->out[client->output]->clients, 1, __ATOMIC_RELAXED);
+}
 
-        /* check if framebuffer is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
+/******************************************************************************
+Description.: remove a stream client added with stream_register()
+Input Value.: client is the entry
+Return Value: -
+******************************************************************************/
+static void stream_unregister(stream_client *client)
+{
+    stream_client **p;
 
-            max_frame_size = frame_size + TEN_K;
-            if((tmp = realloc(frame, max_frame_size)) == NULL) {
-                free(frame);
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                send_error(context_fd->fd, 500, "not enough memory");
-                return;
-            }
+    __atomic_sub_fetch(&pglobal->out[client->output]->clients, 1, __ATOMIC_RELAXED);
 
-            frame = tmp;
+    pthread_mutex_lock(&stream_clients_lock);
+    for(p = &stream_clients; *p != NULL; p = &(*p)->next) {
+        if(*p == client) {
+            *p = client->next;
+            break;
         }
+    }
+    pthread_mutex_unlock(&stream_clients_lock);
+}
 
-        /* copy v4l2_buffer timeval to user space */
-        timestamp = pglobal->in[input_number].timestamp;
+/******************************************************************************
+Description.: make room in a response body, if memory runs out all further
+              calls of reply_append() and reply_printf() return at once
+Input Value.: r is the body, len the bytes which are about to be appended
+Return Value: 0 if everything is OK, -1 otherwise
+******************************************************************************/
+static int reply_reserve(reply_buffer *r, size_t len)
+{
+    size_t size;
+    char *grown;
+
+    if(r->failed)
+        return -1;
+    if(r->len + len + 1 <= r->size)
+        return 0;
+
+    for(size = (r->size > 0) ? r->size : BUFFER_SIZE * 4; size < r->len + len + 1; size *= 2);
+    if((grown = realloc(r->data, size)) == NULL) {
+        r->failed = 1;
+        return -1;
+    }
+    r->data = grown;
+    r->size = size;
 
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-        DBG("got frame (size: %d kB)\n", frame_size / 1024);
+    return 0;
+}
 
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+/******************************************************************************
+Description.: append data to a response body, the buffer grows as needed
+Input Value.: r is the body, data and len what to append
+Return Value: -
+******************************************************************************/
+void reply_append(reply_buffer *r, const void *data, size_t len)
+{
+    if(reply_reserve(r, len) != 0)
+        return;
 
-        #ifdef MANAGMENT
-        update_client_timestamp(context_fd->client);
-        #endif
+    memcpy(r->data + r->len, data, len);
+    r->len += len;
+    r->data[r->len] = '\0';
+}
 
-        /*
-         * print the individual mimetype and the length
-         * sending the content-length fixes random stream disruption observed
-         * with firefox
-         */
-        sprintf(buffer, "Content-Type: image/jpeg\r\n" \
-                "Content-Length: %d\r\n" \
-                "X-Timestamp: %d.%06d\r\n" \
-                "\r\n", frame_size, (int)timestamp.tv_sec, (int)timestamp.tv_usec);
-        DBG("sending intemdiate header\n");
-        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
+/******************************************************************************
+Description.: append formatted text to a response body
+Input Value.: r is the body, the rest are printf() arguments
+Return Value: -
+******************************************************************************/
+void reply_printf(reply_buffer *r, const char *format, ...)
+{
+    va_list ap;
+    int len;
 
-        DBG("sending frame\n");
-        if(write(context_fd->fd, frame, frame_size) < 0) break;
+    if(r->failed)
+        return;
 
-        DBG("sending boundary\n");
-        sprintf(buffer, "\r\n--" BOUNDARY "\r\n");
-        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
+    va_start(ap, format);
+    len = vsnprintf(r->data + r->len, r->size - r->len, format, ap);
+    va_end(ap);
+    if(len < 0) {
+        r->failed = 1;
+        return;
     }
 
-    free(frame);
+    /* does not fit, grow the buffer and format again */
+    if((size_t)len >= r->size - r->len) {
+        if(reply_reserve(r, len) != 0)
+            return;
+        va_start(ap, format);
+        vsnprintf(r->data + r->len, r->size - r->len, format, ap);
+        va_end(ap);
+    }
+    r->len += len;
 }
 
-#ifdef WXP_COMPAT
 /******************************************************************************
-Description.: Sends a mjpg stream in the same format as the WebcamXP does
-Input Value.: fildescriptor fd to send the answer to
+Description.: free a response body, it can be filled again afterwards
+Input Value.: r is the body
 Return Value: -
 ******************************************************************************/
-void send_stream_wxp(cfd *context_fd, int input_number)
+void reply_free(reply_buffer *r)
 {
-    unsigned char *frame = NULL, *tmp = NULL;
-    int frame_size = 0, max_frame_size = 0;
-    char buffer[BUFFER_SIZE] = {0};
-    struct timeval timestamp;
+    free(r->data);
+    memset(r, 0, sizeof(reply_buffer));
+}
 
-    DBG("preparing header\n");
+/******************************************************************************
+Description.: format the headers of a frame or of a variant of it
+Input Value.: chunk gets the headers, f is the frame, size the length of the
+              JPG sent
+Return Value: -
+******************************************************************************/
+static void wire_format(wire_chunk *chunk, frame *f, int size)
+{
+    /*
+     * print the individual mimetype and the length
+     * sending the content-length fixes random stream disruption observed
+     * with firefox
+     */
+    chunk->part_len = snprintf(chunk->part, sizeof(chunk->part), "Content-Type: image/jpeg\r\n" \
+                               "Content-Length: %d\r\n" \
+                               "X-Timestamp: %d.%06d\r\n",
+                               size, (int)f->timestamp.tv_sec, (int)f->timestamp.tv_usec);
+
+    chunk->snapshot_len = snprintf(chunk->snapshot, sizeof(chunk->snapshot), REVALIDATE_HEADER \
+                                   "ETag: \"%x-%u\"\r\n" \
+                                   "Content-type: image/jpeg\r\n" \
+                                   "Content-Length: %d\r\n" \
+                                   "X-Timestamp: %d.%06d\r\n",
+                                   f->in->epoch, f->seq,
+                                   size, (int) f->timestamp.tv_sec, (int) f->timestamp.tv_usec);
 
-    time_t curDate, expiresDate;
-    curDate = time(NULL);
-    expiresDate = curDate - 1380; // teh expires date is before the current date with 23 minute (1380) sec
+    #ifdef WXP_COMPAT
+    memset(chunk->wxp, 0, sizeof(chunk->wxp));
+    snprintf(chunk->wxp, sizeof(chunk->wxp), "mjpeg %07d12345", size);
+    #endif
+}
 
-    char curDateBuffer[80];
-    char expDateBuffer[80];
+/******************************************************************************
+Description.: free what the server derived from a frame, called once the
+              frame slot gets reused
+Input Value.: wire is the wire_frame
+Return Value: -
+******************************************************************************/
+static void wire_free(void *wire)
+{
+    wire_frame *w = wire;
+    int step, reduced;
+
+    for(step = 0; step <= SCALE_STEPS; step++) {
+        for(reduced = 0; reduced < 2; reduced++) {
+            if(w->variant[step][reduced] != NULL) {
+                free(w->variant[step][reduced]->buf);
+                free(w->variant[step][reduced]);
+            }
+        }
+    }
+    pthread_cond_destroy(&w->built);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+}
 
-    strftime(curDateBuffer, 80, "%a, %d %b %Y %H:%M:%S %Z", localtime(&curDate));
-    strftime(expDateBuffer, 80, "%a, %d %b %Y %H:%M:%S %Z", localtime(&expiresDate));
-    sprintf(buffer, "HTTP/1.1 200 OK\r\n" \
-                    "Connection: keep-alive\r\n" \
-                    "Content-Type: multipart/x-mixed-replace; boundary=--myboundary\r\n" \
-                    "Content-Length: 9999999\r\n" \
-                    "Cache-control: no-cache, must revalidate\r\n" \
-                    "Date: %s\r\n" \
-                    "Expires: %s\r\n" \
-                    "Pragma: no-cache\r\n" \
-                    "Server: webcamXP\r\n"
-                    "\r\n",
-                    curDateBuffer,
-                    expDateBuffer);
-
-    if(write(context_fd->fd, buffer, strlen(buffer)) < 0) {
-        free(frame);
-        return;
+/******************************************************************************
+Description.: get what the server derived from a frame. It does not depend on
+              the client, so the first client formats the headers and
+              attaches them to the frame, all others send the same bytes.
+Input Value.: f is a frame with JPG data the caller holds a reference to
+Return Value: the data, valid as long as the reference. NULL if memory could
+              not be allocated.
+******************************************************************************/
+static wire_frame *frame_wire_frame(frame *f)
+{
+    wire_frame *w;
+
+    if((w = frame_wire(f)) != NULL)
+        return w;
+
+    if((w = calloc(1, sizeof(wire_frame))) == NULL) {
+        fprintf(stderr, "could not allocate memory for frame headers\n");
+        return NULL;
     }
+    wire_format(&w->chunk, f, f->size);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->built, NULL);
 
-    DBG("Headers send, sending stream now\n");
+    return frame_wire_attach(f, w, wire_free);
+}
+
+/******************************************************************************
+Description.: get the headers of a frame, see frame_wire_frame()
+Input Value.: f is a frame with JPG data the caller holds a reference to
+Return Value: the headers, valid as long as the reference. NULL if memory
+              could not be allocated.
+******************************************************************************/
+static const wire_chunk *frame_chunk(frame *f)
+{
+    wire_frame *w = frame_wire_frame(f);
 
-    while(!pglobal->stop) {
+    return (w != NULL) ? &w->chunk : NULL;
+}
 
-        /* wait for fresh frames */
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+/******************************************************************************
+Description.: get a variant of a frame. The first encoder which asks for a
+              variant makes it, the others wait for it. libjpeg runs without
+              the lock, it is only held to publish the result.
+Input Value.: * f......: a frame with JPG data the caller holds a reference to
+              * step...: 0 for the size of the frame, 1, 2 or 3 for 1/2, 1/4
+                         or 1/8 of it
+              * reduced: 1 to encode it at LADDER_QUALITY, 0 at the quality
+                         of the frame. Not both step and reduced may be 0.
+Return Value: the variant, valid as long as the reference. NULL if it could
+              not be made.
+******************************************************************************/
+static const wire_variant *frame_variant(frame *f, int step, int reduced)
+{
+    wire_frame *w;
+    wire_variant *v;
+    unsigned long size;
+    int bit = 1 << (step * 2 + reduced);
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+    if((w = frame_wire_frame(f)) == NULL)
+        return NULL;
 
-        /* check if framebuffer is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
+    /* once it is there it never changes, no lock is needed to read it */
+    if((v = __atomic_load_n(&w->variant[step][reduced], __ATOMIC_ACQUIRE)) != NULL)
+        return v;
 
-            max_frame_size = frame_size + TEN_K;
-            if((tmp = realloc(frame, max_frame_size)) == NULL) {
-                free(frame);
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                send_error(context_fd->fd, 500, "not enough memory");
-                return;
-            }
+    pthread_mutex_lock(&w->lock);
+    while(w->variant[step][reduced] == NULL && !(w->failed & bit) && (w->building & bit))
+        pthread_cond_wait(&w->built, &w->lock);
+    if((v = w->variant[step][reduced]) != NULL || (w->failed & bit)) {
+        pthread_mutex_unlock(&w->lock);
+        return v;
+    }
+    w->building |= bit;
+    pthread_mutex_unlock(&w->lock);
+
+    if((v = malloc(sizeof(wire_variant))) != NULL &&
+       jpeg_scale(f->buf, f->size, step,
+                  reduced ? LADDER_QUALITY : (f->quality > 0) ? f->quality : SCALE_QUALITY,
+                  &v->buf, &size) == 0) {
+        v->size = size;
+        wire_format(&v->chunk, f, v->size);
+    } else {
+        DBG("could not make variant 1/%d%s of frame %u\n", 1 << step, reduced ? " reduced" : "", f->seq);
+        free(v);
+        v = NULL;
+    }
 
-            frame = tmp;
-        }
+    pthread_mutex_lock(&w->lock);
+    if(v != NULL)
+        __atomic_store_n(&w->variant[step][reduced], v, __ATOMIC_RELEASE);
+    else
+        __atomic_or_fetch(&w->failed, bit, __ATOMIC_RELEASE);
+    w->building &= ~bit;
+    pthread_cond_broadcast(&w->built);
+    pthread_mutex_unlock(&w->lock);
 
-        /* copy v4l2_buffer timeval to user space */
-        timestamp = pglobal->in[input_number].timestamp;
+    return v;
+}
 
-        #ifdef MANAGMENT
-        update_client_timestamp(context_fd->client);
-        #endif
+/******************************************************************************
+Description.: check without blocking if a frame can be queued for a client,
+              that is its JPG and the variant the client gets were made or
+              could not be made. Otherwise an encoder has to make them.
+Input Value.: f is a frame the caller holds a reference to, step and reduced
+              select the variant like for frame_variant()
+Return Value: 1 if it is ready, 0 if not
+******************************************************************************/
+static int frame_ready(frame *f, int step, int reduced)
+{
+    wire_frame *w;
+    int state = __atomic_load_n(&f->jpeg, __ATOMIC_ACQUIRE);
+
+    if(state == FRAME_JPEG_PENDING)
+        return 0;
+    if((step == 0 && !reduced) || state == FRAME_JPEG_FAILED)
+        return 1;
+    if((w = frame_wire(f)) == NULL)
+        return 0;
+
+    return __atomic_load_n(&w->variant[step][reduced], __ATOMIC_ACQUIRE) != NULL ||
+           (__atomic_load_n(&w->failed, __ATOMIC_ACQUIRE) & (1 << (step * 2 + reduced))) != 0;
+}
 
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-        DBG("got frame (size: %d kB)\n", frame_size / 1024);
+/******************************************************************************
+Description.: get a variant of a frame an encoder made before
+Input Value.: f is a frame frame_ready() returned 1 for, step and reduced
+              like for frame_variant()
+Return Value: the variant, valid as long as the reference. NULL if it could
+              not be made.
+******************************************************************************/
+static const wire_variant *frame_variant_made(frame *f, int step, int reduced)
+{
+    wire_frame *w = frame_wire(f);
 
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+    return (w != NULL) ? __atomic_load_n(&w->variant[step][reduced], __ATOMIC_ACQUIRE) : NULL;
+}
 
-        memset(buffer, 0, 50*sizeof(char));
-        sprintf(buffer, "mjpeg %07d12345", frame_size);
-        DBG("sending intemdiate header\n");
-        if(write(context_fd->fd, buffer, 50) < 0) break;
+/******************************************************************************
+Description.: hand a frame to the encoder threads. They make its JPG and the
+              variant and signal the event loop, which then queues it.
+Input Value.: * pc.......: the server
+              * f........: a frame the caller holds a reference to
+              * step, reduced: the variant like for frame_variant(), both 0
+                         if only the JPG is needed
+              * w........: the event loop waiting for it
+Return Value: 0 if the job was queued, -1 if memory ran out
+******************************************************************************/
+static int encoder_submit(context *pc, frame *f, int step, int reduced, worker *w)
+{
+    encode_job *job;
 
-        DBG("sending frame\n");
-        if(write(context_fd->fd, frame, frame_size) < 0) break;
+    if((job = malloc(sizeof(encode_job))) == NULL) {
+        fprintf(stderr, "could not allocate memory for an encoder job\n");
+        return -1;
     }
+    job->next = NULL;
+    job->f = frame_hold(f);
+    job->step = step;
+    job->reduced = reduced;
+    job->w = w;
+
+    pthread_mutex_lock(&pc->jobs_lock);
+    if(pc->jobs_last != NULL)
+        pc->jobs_last->next = job;
+    else
+        pc->jobs = job;
+    pc->jobs_last = job;
+    pthread_cond_signal(&pc->jobs_ready);
+    pthread_mutex_unlock(&pc->jobs_lock);
 
-    free(frame);
+    return 0;
 }
-#endif
 
 /******************************************************************************
-Description.: Send error messages and headers.
-Input Value.: * fd.....: is the filedescriptor to send the message to
-              * which..: HTTP error code, most popular is 404
-              * message: append this string to the displayed response
+Description.: cleanup handler of an encoder thread cancelled while it waits
+Input Value.: arg is the server context
 Return Value: -
 ******************************************************************************/
-void send_error(int fd, int which, char *message)
+static void encoder_unlock(void *arg)
 {
-    char buffer[BUFFER_SIZE] = {0};
+    context *pc = arg;
 
-    if(which == 401) {
-        sprintf(buffer, "HTTP/1.0 401 Unauthorized\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "WWW-Authenticate: Basic realm=\"MJPG-Streamer\"\r\n" \
-                "\r\n" \
-                "401: Not Authenticated!\r\n" \
-                "%s", message);
-    } else if(which == 404) {
-        sprintf(buffer, "HTTP/1.0 404 Not Found\r\n" \
-                "Content-type: text/plain\r\n" \
-                STD_HEADER \
-                "\r\n" \
-                "404: Not Found!\r\n" \
-                "%s", message);
-    } else if(which == 500) {
-        sprintf(buffer, "HTTP/1.0 500 Internal Server Error\r\n" \
-                "Content-type: text/plain\r\n" \
+    pthread_mutex_unlock(&pc->jobs_lock);
+}
+
+/******************************************************************************
+Description.: run libjpeg for the event loops, one job after the other. A
+              loop which waits for the same frame as another one gets it as
+              soon as that job is done.
+              The thread only gets cancelled while it waits for a job.
+Input Value.: arg is the server context
+Return Value: always NULL, will only return on exit
+******************************************************************************/
+static void *encoder_thread(void *arg)
+{
+    context *pc = arg;
+    encode_job *job;
+    uint64_t one = 1;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    for(;;) {
+        pthread_mutex_lock(&pc->jobs_lock);
+        pthread_cleanup_push(encoder_unlock, pc);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        while(pc->jobs == NULL)
+            pthread_cond_wait(&pc->jobs_ready, &pc->jobs_lock);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        job = pc->jobs;
+        if((pc->jobs = job->next) == NULL)
+            pc->jobs_last = NULL;
+        pthread_cleanup_pop(1);
+
+        if(frame_jpeg(job->f) == 0 && (job->step != 0 || job->reduced))
+            frame_variant(job->f, job->step, job->reduced);
+        frame_put(job->f);
+
+        if(write(job->w->event, &one, sizeof(one)) < 0) {
+            DBG("could not signal event loop\n");
+        }
+        free(job);
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: start the encoder threads of a server, one per event loop
+Input Value.: pc is the server context, worker_count is set
+Return Value: -
+******************************************************************************/
+static void encoder_start(context *pc)
+{
+    pthread_mutex_init(&pc->jobs_lock, NULL);
+    pthread_cond_init(&pc->jobs_ready, NULL);
+
+    if((pc->encoders = calloc(pc->worker_count, sizeof(pthread_t))) == NULL) {
+        fprintf(stderr, "could not allocate memory for the encoders\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(pc->encoders_started = 0; pc->encoders_started < pc->worker_count; pc->encoders_started++) {
+        if(pthread_create(&pc->encoders[pc->encoders_started], NULL, encoder_thread, pc) != 0) {
+            fprintf(stderr, "could not start an encoder thread\n");
+            break;
+        }
+    }
+
+    /* without an encoder frames which are not encoded yet are never sent */
+    if(pc->encoders_started == 0)
+        exit(EXIT_FAILURE);
+}
+
+/******************************************************************************
+Description.: stop the encoder threads of a server and drop the jobs left,
+              the event loops must have stopped before
+Input Value.: pc is the server context
+Return Value: -
+******************************************************************************/
+static void encoder_stop(context *pc)
+{
+    encode_job *job;
+    int i;
+
+    for(i = 0; i < pc->encoders_started; i++)
+        pthread_cancel(pc->encoders[i]);
+    for(i = 0; i < pc->encoders_started; i++)
+        pthread_join(pc->encoders[i], NULL);
+    pc->encoders_started = 0;
+    free(pc->encoders);
+    pc->encoders = NULL;
+
+    while((job = pc->jobs) != NULL) {
+        pc->jobs = job->next;
+        frame_put(job->f);
+        free(job);
+    }
+    pc->jobs_last = NULL;
+}
+
+/* the rungs of the quality ladder, from the frames themselves down */
+static const struct {
+    int step;
+    int reduced;
+} ladder_rungs[] = {
+    {0, 0},
+    {0, 1},
+    {1, 1},
+    {2, 1},
+};
+#define LADDER_RUNGS ((int)(sizeof(ladder_rungs) / sizeof(ladder_rungs[0])))
+
+/******************************************************************************
+Description.: format the last header line and the empty line which complete
+              a part or response header, these are the only bytes which
+              differ per client
+Input Value.: buffer gets the header and has to hold strlen(name) + 26 bytes,
+              name is the name of the header, value its value
+Return Value: length of the header
+******************************************************************************/
+static int last_header(char *buffer, const char *name, unsigned long value)
+{
+    char digits[20];
+    int n = 0, len = strlen(name);
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while(value > 0);
+
+    memcpy(buffer, name, len);
+    buffer[len++] = ':';
+    buffer[len++] = ' ';
+    while(n > 0)
+        buffer[len++] = digits[--n];
+    memcpy(buffer + len, "\r\n\r\n", 4);
+
+    return len + 4;
+}
+
+/******************************************************************************
+Description.: milliseconds since the picture of a frame was taken
+Input Value.: f is the frame
+Return Value: the age, at least 0
+******************************************************************************/
+static long frame_age_ms(const frame *f)
+{
+    struct timeval now;
+    long us;
+
+    frame_clock(&now);
+    us = frame_elapsed_us(f->captured.tv_sec != 0 ? &f->captured : &f->published, &now);
+
+    return (us > 0) ? us / 1000 : 0;
+}
+
+/******************************************************************************
+Description.: Send a complete HTTP response and a single JPG-frame with a
+              blocking socket.
+Input Value.: fildescriptor fd to send the answer to
+Return Value: -
+******************************************************************************/
+void send_snapshot(cfd *context_fd, int input_number)
+{
+    frame *f;
+    frame_cursor cursor;
+    const wire_chunk *chunk;
+    struct iovec iov[4];
+    char age[64];
+
+    /* wait for a fresh frame, the reference keeps it valid while sending */
+    frame_cursor_init(pglobal->in[input_number], &cursor);
+    f = frame_wait(pglobal->in[input_number], &cursor);
+    if(f == NULL) {
+        send_error(context_fd->fd, 404, "the input was removed");
+        return;
+    }
+    if(frame_jpeg(f) != 0 || (chunk = frame_chunk(f)) == NULL) {
+        frame_put(f);
+        send_error(context_fd->fd, 500, "could not encode frame");
+        return;
+    }
+    DBG("got frame (size: %d kB)\n", f->size / 1024);
+
+    #ifdef MANAGMENT
+    update_client_timestamp(context_fd->client);
+    #endif
+
+    /* send header and image now, with a single syscall */
+    iov[0].iov_base = STATUS_CLOSE;
+    iov[0].iov_len = strlen(STATUS_CLOSE);
+    iov[1].iov_base = (void *)chunk->snapshot;
+    iov[1].iov_len = chunk->snapshot_len;
+    iov[2].iov_base = age;
+    iov[2].iov_len = last_header(age, "X-Frame-Age", frame_age_ms(f));
+    iov[3].iov_base = f->buf;
+    iov[3].iov_len = f->size;
+    if (tls_writev(context_fd->fd, iov, 4) == iov[0].iov_len + iov[1].iov_len + iov[2].iov_len + iov[3].iov_len)
+        trace_frame_sent(pglobal->out[context_fd->pc->id], f, f->size);
+
+    frame_put(f);
+}
+
+/******************************************************************************
+Description.: Send error messages and headers.
+Input Value.: * fd.....: is the filedescriptor to send the message to
+              * which..: HTTP error code, most popular is 404
+              * message: append this string to the displayed response
+Return Value: -
+******************************************************************************/
+void send_error(int fd, int which, char *message)
+{
+    char buffer[BUFFER_SIZE] = {0};
+
+    if(which == 401) {
+        sprintf(buffer, "HTTP/1.0 401 Unauthorized\r\n" \
+                "Content-type: text/plain\r\n" \
+                STD_HEADER \
+                "WWW-Authenticate: Basic realm=\"MJPG-Streamer\"\r\n" \
+                "\r\n" \
+                "401: Not Authenticated!\r\n" \
+                "%s", message);
+    } else if(which == 404) {
+        sprintf(buffer, "HTTP/1.0 404 Not Found\r\n" \
+                "Content-type: text/plain\r\n" \
+                STD_HEADER \
+                "\r\n" \
+                "404: Not Found!\r\n" \
+                "%s", message);
+    } else if(which == 500) {
+        sprintf(buffer, "HTTP/1.0 500 Internal Server Error\r\n" \
+                "Content-type: text/plain\r\n" \
                 STD_HEADER \
                 "\r\n" \
                 "500: Internal Server Error!\r\n" \
@@ -685,59 +1101,87 @@ void send_error(int fd, int which, char *message)
                 "%s", message);
     }
 
-    if(write(fd, buffer, strlen(buffer)) < 0) {
+    if(tls_write(fd, buffer, strlen(buffer)) < 0) {
+        DBG("write failed, done anyway\n");
+    }
+}
+
+/******************************************************************************
+Description.: refuse a request because a limit of the server is reached
+Input Value.: * fd.........: is the filedescriptor to send the message to
+              * retry_after: seconds the client should wait before it tries again
+              * message....: append this string to the displayed response
+Return Value: -
+******************************************************************************/
+static void send_unavailable(int fd, int retry_after, const char *message)
+{
+    char buffer[BUFFER_SIZE] = {0};
+
+    snprintf(buffer, sizeof(buffer), "HTTP/1.0 503 Service Unavailable\r\n" \
+             "Content-type: text/plain\r\n" \
+             "Retry-After: %d\r\n" \
+             STD_HEADER \
+             "\r\n" \
+             "503: Service Unavailable!\r\n" \
+             "%s", retry_after, message);
+
+    if(tls_write(fd, buffer, strlen(buffer)) < 0) {
         DBG("write failed, done anyway\n");
     }
 }
 
+/******************************************************************************
+Description.: look up the mimetype of a file by its extension. Only files with
+              a known mimetype are served.
+Input Value.: name is the file name
+Return Value: the mimetype, NULL if the extension is not known
+******************************************************************************/
+static const char *www_mimetype(const char *name)
+{
+    const char *extension;
+    int i;
+
+    if((extension = strrchr(name, '.')) == NULL || extension == name)
+        return NULL;
+
+    for(i = 0; i < LENGTH_OF(mimetypes); i++) {
+        if(strcmp(mimetypes[i].dot_extension, extension) == 0)
+            return mimetypes[i].mimetype;
+    }
+
+    return NULL;
+}
+
 /******************************************************************************
 Description.: Send HTTP header and copy the content of a file. To keep things
               simple, just a single folder gets searched for the file. Just
               files with known extension and supported mimetype get served.
               If no parameter was given, the file "index.html" will be copied.
 Input Value.: * fd.......: filedescriptor to send data to
-              * id.......: specifies which server-context is the right one
+              * pc.......: the server-context
               * parameter: string that consists of the filename
 Return Value: -
 ******************************************************************************/
-void send_file(int id, int fd, char *parameter)
+void send_file(context *pc, int fd, char *parameter)
 {
     char buffer[BUFFER_SIZE] = {0};
-    char *extension, *mimetype = NULL;
+    const char *extension, *mimetype;
     int i, lfd;
-    config conf = servers[id].conf;
+    config conf = pc->conf;
 
     /* in case no parameter was given */
     if(parameter == NULL || strlen(parameter) == 0)
         parameter = "index.html";
 
     /* find file-extension */
-    char * pch;
-    pch = strchr(parameter, '.');
-    int lastDot = 0;
-    while(pch != NULL) {
-        lastDot = pch - parameter;
-        pch = strchr(pch + 1, '.');
-    }
-
-    if(lastDot == 0) {
+    if((extension = strrchr(parameter, '.')) == NULL || extension == parameter) {
         send_error(fd, 400, "No file extension found");
         return;
-    } else {
-        extension = parameter + lastDot;
-        DBG("%s EXTENSION: %s\n", parameter, extension);
-    }
-
-    /* determine mime-type */
-    for(i = 0; i < LENGTH_OF(mimetypes); i++) {
-        if(strcmp(mimetypes[i].dot_extension, extension) == 0) {
-            mimetype = (char *)mimetypes[i].mimetype;
-            break;
-        }
     }
+    DBG("%s EXTENSION: %s\n", parameter, extension);
 
     /* in case of unknown mimetype or extension leave */
-    if(mimetype == NULL) {
+    if((mimetype = www_mimetype(parameter)) == NULL) {
         send_error(fd, 404, "MIME-TYPE not known");
         return;
     }
@@ -766,7 +1210,7 @@ void send_file(int id, int fd, char *parameter)
 
     /* first transmit HTTP-header, afterwards transmit content of file */
     do {
-        if(write(fd, buffer, i) < 0) {
+        if(tls_write(fd, buffer, i) < 0) {
             close(lfd);
             return;
         }
@@ -777,130 +1221,576 @@ void send_file(int id, int fd, char *parameter)
 }
 
 /******************************************************************************
-Description.: Executes the specified CGI file if exists
-Input Value.: * fd...........: filedescriptor to send data to
-              * id...........: specifies which server-context is the right one
-              * parameter....: the requested file name
-              * query_string.: query parameters
-Return Value: -
+Description.: read a file of the www folder into memory
+Input Value.: path is the file, mimetype its mimetype, gzip is set for a
+              precompressed .gz variant
+Return Value: the file with one reference, NULL if it can not be read or is
+              too large
 ******************************************************************************/
-void execute_cgi(int id, int fd, char *parameter, char *query_string)
+static www_file *www_read(const char *path, const char *mimetype, int gzip)
 {
-    int lfd = 0, i;
-    int buffer_length = 0;
-    char *buffer = NULL;
-    char fn_buffer[BUFFER_SIZE] = {0};
-    FILE *f = NULL;
-    config conf = servers[id].conf;
-
-    /* build the absolute path to the file */
-    strncat(fn_buffer, conf.www_folder, sizeof(fn_buffer) - 1);
-    strncat(fn_buffer, parameter, sizeof(fn_buffer) - strlen(fn_buffer) - 1);
+    struct stat st;
+    struct tm tm;
+    char modified[64];
+    www_file *file;
+    ssize_t rc;
+    size_t done;
+    int fd;
+
+    if((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
 
-    if((lfd = open(fn_buffer, O_RDONLY)) < 0) {
-        DBG("file %s not accessible\n", fn_buffer);
-        send_error(fd, 404, "Could not open file");
-        return;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > WWW_FILE_MAX ||
+       (file = calloc(1, sizeof(www_file))) == NULL) {
+        close(fd);
+        return NULL;
     }
 
-    char *enviroment =
-        "SERVER_SOFTWARE=\"mjpg-streamer\" "
-        //"SERVER_NAME=\"%s\" "
-        "SERVER_PROTOCOL=\"HTTP/1.1\" "
-        "SERVER_PORT=\"%d\" "  // OK
-        "GATEWAY_INTERFACE=\"CGI/1.1\" "
-        "REQUEST_METHOD=\"GET\" "
-        "SCRIPT_NAME=\"%s\" " // OK
-        "QUERY_STRING=\"%s\" " //OK
-        //"REMOTE_ADDR=\"%s\" "
-        //"REMOTE_PORT=\"%d\" "
-        "%s"; // OK
-
-    buffer_length = 3;
-    buffer_length = strlen(fn_buffer) + strlen(enviroment) + strlen(parameter) + 256;
+    file->refcount = 1;
+    file->mtime = st.st_mtime;
+    file->len = st.st_size;
+    if((file->data = malloc(file->len + 1)) == NULL) {
+        free(file);
+        close(fd);
+        return NULL;
+    }
 
-    buffer = malloc(buffer_length);
-    if (buffer == NULL) {
-        exit(EXIT_FAILURE);
+    for(done = 0; done < file->len; done += rc) {
+        if((rc = read(fd, file->data + done, file->len - done)) <= 0) {
+            if(rc < 0 && errno == EINTR) {
+                rc = 0;
+                continue;
+            }
+            break;
+        }
+    }
+    close(fd);
+    if(done < file->len) {
+        free(file->data);
+        free(file);
+        return NULL;
     }
 
-    sprintf(buffer,
-            enviroment,
-            conf.port,
-            parameter,
-            query_string,
-            fn_buffer);
+    file->etag_epoch = (unsigned int)file->mtime;
+    file->etag_seq = (unsigned int)file->len;
+
+    gmtime_r(&file->mtime, &tm);
+    strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    /* the ETag differs from the one of the other variant because the length does */
+    file->header_len = snprintf(file->header, sizeof(file->header), "Content-type: %s\r\n" \
+                                "%s" \
+                                "Vary: Accept-Encoding\r\n" \
+                                "Content-Length: %lu\r\n" \
+                                "Cache-Control: max-age=%d\r\n" \
+                                "Last-Modified: %s\r\n" \
+                                "ETag: \"%x-%u\"\r\n" \
+                                "\r\n",
+                                mimetype, gzip ? "Content-Encoding: gzip\r\n" : "",
+                                (unsigned long)file->len, WWW_MAX_AGE, modified,
+                                file->etag_epoch, file->etag_seq);
+
+    return file;
+}
 
-    f = popen(buffer, "r");
-    if(f == NULL) {
-        DBG("Unable to execute the requested CGI script\n");
-        send_error(fd, 403, "CGI script cannot be executed");
+/******************************************************************************
+Description.: release a reference to a file of the www folder
+Input Value.: file is the file, NULL is ignored
+Return Value: -
+******************************************************************************/
+static void www_put(www_file *file)
+{
+    if(file == NULL || __atomic_sub_fetch(&file->refcount, 1, __ATOMIC_ACQ_REL) > 0)
         return;
-    }
 
-    while((i = fread(buffer, 1, sizeof(buffer), f)) > 0) {
-        if (write(fd, buffer, i) < 0) {
-            fclose(f);
-            return;
-        }
+    free(file->data);
+    free(file);
+}
+
+/******************************************************************************
+Description.: read a file of the www folder again if it was modified since it
+              was read, or read it for the first time
+Input Value.: path is the file, mimetype its mimetype, gzip is set for a
+              precompressed variant, file is the file read before or NULL
+Return Value: the current file, NULL if there is none any more
+******************************************************************************/
+static www_file *www_refresh(const char *path, const char *mimetype, int gzip, www_file *file)
+{
+    struct stat st;
+
+    if(stat(path, &st) != 0) {
+        www_put(file);
+        return NULL;
     }
+
+    if(file != NULL && file->mtime == st.st_mtime && file->len == (size_t)st.st_size)
+        return file;
+
+    www_put(file);
+    return www_read(path, mimetype, gzip);
 }
 
+/******************************************************************************
+Description.: compare two files of the www folder by name, for qsort() and
+              bsearch()
+Input Value.: a and b are the entries
+Return Value: like strcmp()
+******************************************************************************/
+static int www_compare(const void *a, const void *b)
+{
+    return strcmp(((const www_entry *)a)->name, ((const www_entry *)b)->name);
+}
 
 /******************************************************************************
-Description.: Perform a command specified by parameter. Send response to fd.
-Input Value.: * fd.......: filedescriptor to send HTTP response to.
-              * parameter: contains the command and value as string.
-              * id.......: specifies which server-context to choose.
+Description.: read all files of the www folder with a known mimetype into
+              memory, together with their precompressed .gz variants
+Input Value.: pc is the server context
 Return Value: -
 ******************************************************************************/
-void command(int id, int fd, char *parameter)
+static void www_load(context *pc)
 {
-    char buffer[BUFFER_SIZE] = {0};
-    char *command = NULL, *svalue = NULL, *value, *command_id_string;
-    int res = 0, ivalue = 0, command_id = -1,  len = 0;
+    char path[BUFFER_SIZE];
+    struct dirent *de;
+    www_entry *grown, *e;
+    const char *mimetype;
+    DIR *dir;
+    int size = 0;
+
+    pthread_mutex_init(&pc->www_lock, NULL);
+    pc->www = NULL;
+    pc->www_len = 0;
+
+    if(pc->conf.www_folder == NULL || (dir = opendir(pc->conf.www_folder)) == NULL)
+        return;
 
-    DBG("parameter is: %s\n", parameter);
+    while((de = readdir(dir)) != NULL) {
+        if((mimetype = www_mimetype(de->d_name)) == NULL)
+            continue;
 
-    /* sanity check of parameter-string */
-    if(parameter == NULL || strlen(parameter) >= 255 || strlen(parameter) == 0) {
-        DBG("parameter string looks bad\n");
-        send_error(fd, 400, "Parameter-string of command does not look valid.");
-        return;
-    }
+        if(pc->www_len == size) {
+            size = (size > 0) ? size * 2 : 32;
+            if((grown = realloc(pc->www, size * sizeof(www_entry))) == NULL)
+                break;
+            pc->www = grown;
+        }
 
-    /* command format:
-        ?control&dest=0plugin=0&id=0&group=0&value=0
-        where:
-        dest: specifies the command destination (input, output, program itself) 0-1-2
-        plugin specifies the plugin id  (not acceptable at the commands sent to the program itself)
-        id: the control id
-        group: the control's group eg. V4L2 control, jpg control, etc. This is optional
-        value: value the control
-    */
+        e = &pc->www[pc->www_len];
+        memset(e, 0, sizeof(www_entry));
+        e->mimetype = mimetype;
+        if((e->name = strdup(de->d_name)) == NULL)
+            break;
 
-    /* search for required variable "command" */
-    if((command = strstr(parameter, "id=")) == NULL) {
-        DBG("no command id specified\n");
-        send_error(fd, 400, "no GET variable \"id=...\" found, it is required to specify which command id to execute");
-        return;
-    }
+        snprintf(path, sizeof(path), "%s%s", pc->conf.www_folder, e->name);
+        if((e->plain = www_read(path, mimetype, 0)) == NULL) {
+            free(e->name);
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s%s.gz", pc->conf.www_folder, e->name);
+        e->gzip = www_read(path, mimetype, 1);
 
-    /* allocate and copy command string */
-    command += strlen("id=");
-    len = strspn(command, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_1234567890");
-    if((command = strndup(command, len)) == NULL) {
-        send_error(fd, 500, "could not allocate memory");
-        LOG("could not allocate memory\n");
-        return;
+        pc->www_len++;
     }
+    closedir(dir);
 
-    /* convert the command to id */
-    command_id_string = command;
-    len = strspn(command_id_string, "-1234567890");
-    if((svalue = strndup(command_id_string, len)) == NULL) {
-        if(command != NULL) free(command);
-        send_error(fd, 500, "could not allocate memory");
+    qsort(pc->www, pc->www_len, sizeof(www_entry), www_compare);
+    DBG("%d files of the www folder in memory\n", pc->www_len);
+}
+
+/******************************************************************************
+Description.: free the files read by www_load(), clients may still hold
+              references to some of them
+Input Value.: pc is the server context
+Return Value: -
+******************************************************************************/
+static void www_free(context *pc)
+{
+    int i;
+
+    for(i = 0; i < pc->www_len; i++) {
+        free(pc->www[i].name);
+        www_put(pc->www[i].plain);
+        www_put(pc->www[i].gzip);
+    }
+    free(pc->www);
+    pc->www = NULL;
+    pc->www_len = 0;
+    pthread_mutex_destroy(&pc->www_lock);
+}
+
+/******************************************************************************
+Description.: get a file of the www folder from memory. It is compared with
+              the folder at most every WWW_CHECK_INTERVAL seconds, so changes
+              show up without a restart.
+Input Value.: pc is the server context, name the file name, an empty name
+              means index.html. gzip is set if the client accepts it.
+Return Value: the file with a reference for the caller, NULL if it is not in
+              memory
+******************************************************************************/
+static www_file *www_get(context *pc, const char *name, int gzip)
+{
+    char path[BUFFER_SIZE];
+    struct timeval now;
+    www_entry key, *e;
+    www_file *file;
+
+    key.name = (char *)((name == NULL || name[0] == '\0') ? "index.html" : name);
+    if(pc->www_len == 0 || (e = bsearch(&key, pc->www, pc->www_len, sizeof(www_entry), www_compare)) == NULL)
+        return NULL;
+
+    frame_clock(&now);
+    pthread_mutex_lock(&pc->www_lock);
+
+    if(now.tv_sec - e->checked >= WWW_CHECK_INTERVAL) {
+        snprintf(path, sizeof(path), "%s%s", pc->conf.www_folder, e->name);
+        e->plain = www_refresh(path, e->mimetype, 0, e->plain);
+        snprintf(path, sizeof(path), "%s%s.gz", pc->conf.www_folder, e->name);
+        e->gzip = www_refresh(path, e->mimetype, 1, e->gzip);
+        e->checked = now.tv_sec;
+    }
+
+    if((file = (gzip && e->gzip != NULL) ? e->gzip : e->plain) != NULL)
+        __atomic_add_fetch(&file->refcount, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&pc->www_lock);
+
+    return file;
+}
+
+/******************************************************************************
+Description.: compress a JSON description with gzip
+Input Value.: data and len are the document, out and out_len get the
+              compressed copy which has to be freed
+Return Value: 0 if the copy is smaller than the document, -1 otherwise
+******************************************************************************/
+static int json_gzip(const char *data, size_t len, char **out, size_t *out_len)
+{
+#ifdef NO_ZLIB
+    return -1;
+#else
+    z_stream z;
+    uLong bound;
+    int rc;
+
+    memset(&z, 0, sizeof(z));
+    /* 16 added to the window bits writes a gzip header and trailer */
+    if(deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    bound = deflateBound(&z, len);
+    if((*out = malloc(bound)) == NULL) {
+        deflateEnd(&z);
+        return -1;
+    }
+
+    z.next_in = (Bytef *)data;
+    z.avail_in = len;
+    z.next_out = (Bytef *)*out;
+    z.avail_out = bound;
+    rc = deflate(&z, Z_FINISH);
+    *out_len = z.total_out;
+    deflateEnd(&z);
+
+    if(rc != Z_STREAM_END || *out_len >= len) {
+        free(*out);
+        return -1;
+    }
+
+    return 0;
+#endif
+}
+
+/******************************************************************************
+Description.: wrap a formatted JSON description into a file with its
+              response header
+Input Value.: data and len are the document which the file takes over, gzip
+              is set if it is compressed, version numbers the document
+Return Value: the file with one reference, NULL if memory ran out
+******************************************************************************/
+static www_file *json_file(char *data, size_t len, int gzip, unsigned int version)
+{
+    www_file *file;
+
+    if((file = calloc(1, sizeof(www_file))) == NULL) {
+        free(data);
+        return NULL;
+    }
+
+    file->refcount = 1;
+    file->data = data;
+    file->len = len;
+    /* both variants of a document have their own ETag */
+    file->etag_epoch = json_cache.epoch;
+    file->etag_seq = version * 2 + gzip;
+    file->header_len = snprintf(file->header, sizeof(file->header), "Content-type: application/x-javascript\r\n" \
+                                "%s" \
+                                "Vary: Accept-Encoding\r\n" \
+                                "Content-Length: %lu\r\n" \
+                                "Cache-Control: no-cache, must-revalidate, max-age=0\r\n" \
+                                "ETag: \"%x-%u\"\r\n" \
+                                "\r\n",
+                                gzip ? "Content-Encoding: gzip\r\n" : "",
+                                (unsigned long)len, file->etag_epoch, file->etag_seq);
+
+    return file;
+}
+
+/******************************************************************************
+Description.: look up the entry of a JSON description in the cache, the
+              lists of the plugins grow as needed. json_cache.lock has to
+              be held.
+Input Value.: type is A_INPUT_JSON, A_OUTPUT_JSON or A_PROGRAM_JSON, plugin
+              the number of the plugin
+Return Value: the entry, NULL if memory ran out
+******************************************************************************/
+static json_doc *json_doc_of(answer_t type, int plugin)
+{
+    json_doc **docs, *grown;
+    int *len;
+
+    if(type == A_PROGRAM_JSON)
+        return &json_cache.program;
+
+    docs = (type == A_INPUT_JSON) ? &json_cache.inputs : &json_cache.outputs;
+    len = (type == A_INPUT_JSON) ? &json_cache.inputs_len : &json_cache.outputs_len;
+    if(plugin < 0)
+        return NULL;
+
+    if(plugin >= *len) {
+        if((grown = realloc(*docs, (plugin + 1) * sizeof(json_doc))) == NULL)
+            return NULL;
+        memset(grown + *len, 0, (plugin + 1 - *len) * sizeof(json_doc));
+        *docs = grown;
+        *len = plugin + 1;
+    }
+
+    return &(*docs)[plugin];
+}
+
+/******************************************************************************
+Description.: forget a JSON description, clients still sending it keep their
+              references
+Input Value.: doc is the entry, json_cache.lock has to be held
+Return Value: -
+******************************************************************************/
+static void json_drop(json_doc *doc)
+{
+    www_put(doc->plain);
+    www_put(doc->gzip);
+    doc->plain = NULL;
+    doc->gzip = NULL;
+}
+
+/******************************************************************************
+Description.: get the version of what a JSON description shows, plugins
+              increment theirs with PLUGIN_CHANGED(), the globals change when
+              plugins are added or removed
+Input Value.: type is A_INPUT_JSON, A_OUTPUT_JSON or A_PROGRAM_JSON, plugin
+              the number of a valid plugin
+Return Value: the version
+******************************************************************************/
+static unsigned int json_source(answer_t type, int plugin)
+{
+    switch(type) {
+    case A_INPUT_JSON:
+        return __atomic_load_n(&pglobal->in[plugin]->version, __ATOMIC_ACQUIRE);
+    case A_OUTPUT_JSON:
+        return __atomic_load_n(&pglobal->out[plugin]->version, __ATOMIC_ACQUIRE);
+    default:
+        return __atomic_load_n(&pglobal->version, __ATOMIC_ACQUIRE);
+    }
+}
+
+/******************************************************************************
+Description.: get the JSON description of a plugin or of the program. It is
+              formatted once and served from memory until the version of the
+              plugin or of the globals changes, with a new ETag each time.
+              The UIs poll them every second, while their content changes
+              only by commands.
+Input Value.: type is A_INPUT_JSON, A_OUTPUT_JSON or A_PROGRAM_JSON, plugin
+              the number of a valid plugin, gzip is set if the client
+              accepts gzip
+Return Value: the document with a reference, NULL if memory ran out
+******************************************************************************/
+static www_file *json_get(answer_t type, int plugin, int gzip)
+{
+    reply_buffer r;
+    json_doc *doc;
+    www_file *file = NULL;
+    char *packed;
+    size_t packed_len;
+    unsigned int source;
+
+    pthread_mutex_lock(&json_cache.lock);
+
+    /* read before formatting, a change meanwhile is picked up by the next request */
+    source = json_source(type, plugin);
+    if((doc = json_doc_of(type, plugin)) != NULL && doc->plain != NULL && doc->source != source)
+        json_drop(doc);
+
+    if(doc != NULL && doc->plain == NULL) {
+        memset(&r, 0, sizeof(r));
+        switch(type) {
+        case A_INPUT_JSON:
+            format_input_JSON(&r, plugin);
+            break;
+        case A_OUTPUT_JSON:
+            format_output_JSON(&r, plugin);
+            break;
+        default:
+            format_program_JSON(&r);
+            break;
+        }
+
+        if(r.failed || r.data == NULL) {
+            reply_free(&r);
+        } else {
+            if(json_cache.epoch == 0)
+                json_cache.epoch = (unsigned int)time(NULL);
+            json_cache.version++;
+            if(json_gzip(r.data, r.len, &packed, &packed_len) == 0)
+                doc->gzip = json_file(packed, packed_len, 1, json_cache.version);
+            doc->plain = json_file(r.data, r.len, 0, json_cache.version);
+            doc->source = source;
+            if(doc->plain == NULL)
+                json_drop(doc);
+        }
+    }
+
+    if(doc != NULL && (file = (gzip && doc->gzip != NULL) ? doc->gzip : doc->plain) != NULL)
+        __atomic_add_fetch(&file->refcount, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&json_cache.lock);
+
+    return file;
+}
+
+/******************************************************************************
+Description.: Executes the specified CGI file if exists
+Input Value.: * fd...........: filedescriptor to send data to
+              * pc...........: the server-context
+              * parameter....: the requested file name
+              * query_string.: query parameters
+Return Value: -
+******************************************************************************/
+void execute_cgi(context *pc, int fd, char *parameter, char *query_string)
+{
+    int lfd = 0, i;
+    int buffer_length = 0;
+    char *buffer = NULL;
+    char fn_buffer[BUFFER_SIZE] = {0};
+    FILE *f = NULL;
+    config conf = pc->conf;
+
+    /* build the absolute path to the file */
+    strncat(fn_buffer, conf.www_folder, sizeof(fn_buffer) - 1);
+    strncat(fn_buffer, parameter, sizeof(fn_buffer) - strlen(fn_buffer) - 1);
+
+    if((lfd = open(fn_buffer, O_RDONLY)) < 0) {
+        DBG("file %s not accessible\n", fn_buffer);
+        send_error(fd, 404, "Could not open file");
+        return;
+    }
+
+    char *enviroment =
+        "SERVER_SOFTWARE=\"mjpg-streamer\" "
+        //"SERVER_NAME=\"%s\" "
+        "SERVER_PROTOCOL=\"HTTP/1.1\" "
+        "SERVER_PORT=\"%d\" "  // OK
+        "GATEWAY_INTERFACE=\"CGI/1.1\" "
+        "REQUEST_METHOD=\"GET\" "
+        "SCRIPT_NAME=\"%s\" " // OK
+        "QUERY_STRING=\"%s\" " //OK
+        //"REMOTE_ADDR=\"%s\" "
+        //"REMOTE_PORT=\"%d\" "
+        "%s"; // OK
+
+    buffer_length = 3;
+    buffer_length = strlen(fn_buffer) + strlen(enviroment) + strlen(parameter) + 256;
+
+    buffer = malloc(buffer_length);
+    if (buffer == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    sprintf(buffer,
+            enviroment,
+            conf.port,
+            parameter,
+            query_string,
+            fn_buffer);
+
+    f = popen(buffer, "r");
+    if(f == NULL) {
+        DBG("Unable to execute the requested CGI script\n");
+        send_error(fd, 403, "CGI script cannot be executed");
+        return;
+    }
+
+    while((i = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        if (tls_write(fd, buffer, i) < 0) {
+            fclose(f);
+            return;
+        }
+    }
+}
+
+
+/******************************************************************************
+Description.: Perform a command specified by parameter. Send response to fd.
+Input Value.: * fd.......: filedescriptor to send HTTP response to.
+              * parameter: contains the command and value as string.
+              * id.......: specifies which server-context to choose.
+Return Value: -
+******************************************************************************/
+void command(int id, int fd, char *parameter)
+{
+    char buffer[BUFFER_SIZE] = {0};
+    char *command = NULL, *svalue = NULL, *value, *command_id_string, *spec;
+    int res = 0, ivalue = 0, command_id = -1,  len = 0;
+
+    DBG("parameter is: %s\n", parameter);
+
+    /* sanity check of parameter-string */
+    if(parameter == NULL || strlen(parameter) >= 255 || strlen(parameter) == 0) {
+        DBG("parameter string looks bad\n");
+        send_error(fd, 400, "Parameter-string of command does not look valid.");
+        return;
+    }
+
+    /* command format:
+        ?control&dest=0plugin=0&id=0&group=0&value=0
+        where:
+        dest: specifies the command destination (input, output, program itself) 0-1-2
+        plugin specifies the plugin id, for the program itself the plugin to remove
+        spec: for the program itself the plugin to add, like "input_uvc.so -d /dev/video1"
+              URL encoded, always the last parameter
+        id: the control id
+        group: the control's group eg. V4L2 control, jpg control, etc. This is optional
+        value: value the control
+    */
+
+    /* search for required variable "command" */
+    if((command = strstr(parameter, "id=")) == NULL) {
+        DBG("no command id specified\n");
+        send_error(fd, 400, "no GET variable \"id=...\" found, it is required to specify which command id to execute");
+        return;
+    }
+
+    /* allocate and copy command string */
+    command += strlen("id=");
+    len = strspn(command, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_1234567890");
+    if((command = strndup(command, len)) == NULL) {
+        send_error(fd, 500, "could not allocate memory");
+        LOG("could not allocate memory\n");
+        return;
+    }
+
+    /* convert the command to id */
+    command_id_string = command;
+    len = strspn(command_id_string, "-1234567890");
+    if((svalue = strndup(command_id_string, len)) == NULL) {
+        if(command != NULL) free(command);
+        send_error(fd, 500, "could not allocate memory");
         LOG("could not allocate memory\n");
         return;
     }
@@ -980,20 +1870,40 @@ void command(int id, int fd, char *parameter)
 
     switch(dest) {
     case Dest_Input:
-        if(plugin_no < pglobal->incnt) {
-            res = pglobal->in[plugin_no].cmd(plugin_no, command_id, group, ivalue, value);
+        if(INPUT_VALID(pglobal, plugin_no) && pglobal->in[plugin_no]->cmd != NULL) {
+            res = pglobal->in[plugin_no]->cmd(plugin_no, command_id, group, ivalue, value);
         } else {
             DBG("Invalid plugin number: %d because only %d input plugins loaded", plugin_no,  pglobal->incnt-1);
         }
         break;
     case Dest_Output:
-        if(plugin_no < pglobal->outcnt) {
-            res = pglobal->out[plugin_no].cmd(plugin_no, command_id, group, ivalue, value);
+        if(OUTPUT_VALID(pglobal, plugin_no) && pglobal->out[plugin_no]->cmd != NULL) {
+            res = pglobal->out[plugin_no]->cmd(plugin_no, command_id, group, ivalue, value);
         } else {
             DBG("Invalid plugin number: %d because only %d output plugins loaded", plugin_no,  pglobal->incnt-1);
         }
         break;
     case Dest_Program:
+        switch(command_id) {
+        case PROG_CMD_ADD_INPUT:
+        case PROG_CMD_ADD_OUTPUT:
+            /* the specification contains blanks, so it has to be the last parameter */
+            if((spec = strstr(parameter, "spec=")) == NULL) {
+                res = -1;
+                break;
+            }
+            spec += strlen("spec=");
+            res = plugin_add((command_id == PROG_CMD_ADD_INPUT) ? Dest_Input : Dest_Output, spec);
+            break;
+        case PROG_CMD_REMOVE_INPUT:
+            res = plugin_remove(Dest_Input, plugin_no);
+            break;
+        case PROG_CMD_REMOVE_OUTPUT:
+            res = plugin_remove(Dest_Output, plugin_no);
+            break;
+        default:
+            res = -1;
+        }
         break;
     default:
         fprintf(stderr, "Illegal command destination: %d\n", dest);
@@ -1006,7 +1916,7 @@ void command(int id, int fd, char *parameter)
             "\r\n" \
             "%s: %d", command, res);
 
-    if(write(fd, buffer, strlen(buffer)) < 0) {
+    if(tls_write(fd, buffer, strlen(buffer)) < 0) {
         DBG("write failed, done anyway\n");
     }
 
@@ -1014,412 +1924,1866 @@ void command(int id, int fd, char *parameter)
     if(svalue != NULL) free(svalue);
 }
 
+/* the requests answered besides files and CGI scripts, the first match counts */
+static const route routes[] = {
+    {"GET",  "/",             "snapshot#", A_SNAPSHOT,     ROUTE_INPUT},
+    {"GET",  "/",             "stream#",   A_STREAM,       ROUTE_INPUT},
+    {"POST", "/stream#",      NULL,        A_STREAM,       ROUTE_INPUT},
+    {"GET",  "/",             "take#",     A_TAKE,         ROUTE_INPUT | ROUTE_PARAMETER},
+    {"GET",  "/",             "command",   A_COMMAND,      ROUTE_PARAMETER},
+    #ifdef WXP_COMPAT
+    {"GET",  "/cam#.jpg",     NULL,        A_SNAPSHOT_WXP, ROUTE_INPUT | ROUTE_WXP},
+    {"GET",  "/cam#.mjpg",    NULL,        A_STREAM_WXP,   ROUTE_INPUT | ROUTE_WXP},
+    #endif
+    {"GET",  "/input#.json",  NULL,        A_INPUT_JSON,   ROUTE_INPUT},
+    {"GET",  "/output#.json", NULL,        A_OUTPUT_JSON,  ROUTE_OUTPUT},
+    {"GET",  "/program.json", NULL,        A_PROGRAM_JSON, 0},
+    {"GET",  "/trace.json",   NULL,        A_TRACE_JSON,   0},
+    {"GET",  "/metrics",      NULL,        A_METRICS,      0},
+    #ifdef MANAGMENT
+    {"GET",  "/clients.json", NULL,        A_CLIENTS_JSON, 0},
+    #endif
+};
+
 /******************************************************************************
-Description.: Serve a connected TCP-client. This thread function is called
-              for each connect of a HTTP client like a webbrowser. It determines
-              if it is a valid HTTP request and dispatches between the different
-              response options.
-Input Value.: arg is the filedescriptor and server-context of the connected TCP
-              socket. It must have been allocated so it is freeable by this
-              thread function.
-Return Value: always NULL
+Description.: match the path or action of a request with the one of a route
+Input Value.: * s......: path or action of the request
+              * pattern: of the route, '#' stands for an optional _<number>
+              * number.: gets the number if there is one
+Return Value: 1 if they match, 0 otherwise
 ******************************************************************************/
-/* thread for clients that connected to this server */
-void *client_thread(void *arg)
+static int route_match(const http_slice *s, const char *pattern, int *number)
 {
-    int cnt;
-    char query_suffixed = 0;
-    int input_number = 0;
-    char buffer[BUFFER_SIZE] = {0}, *pb = buffer;
-    iobuffer iobuf;
-    request req;
-    cfd lcfd; /* local-connected-file-descriptor */
-
-    /* we really need the fildescriptor and it must be freeable by us */
-    if(arg != NULL) {
-        memcpy(&lcfd, arg, sizeof(cfd));
-        free(arg);
-    } else
-        return NULL;
+    const char *p = s->data, *end = s->data + s->len;
+
+    for(; *pattern != '\0'; pattern++) {
+        if(*pattern != '#') {
+            if(p == end || *p != *pattern)
+                return 0;
+            p++;
+            continue;
+        }
 
-    /* initializes the structures */
-    init_iobuffer(&iobuf);
-    init_request(&req);
+        if(p == end || *p != '_')
+            continue;
+        if(++p == end || *p < '0' || *p > '9')
+            return 0;
+        for(*number = 0; p < end && *p >= '0' && *p <= '9' && *number < 10000; p++)
+            *number = *number * 10 + (*p - '0');
+    }
 
-    /* What does the client want to receive? Read the request. */
-    memset(buffer, 0, sizeof(buffer));
-    if((cnt = _readline(lcfd.fd, &iobuf, buffer, sizeof(buffer) - 1, 5)) == -1) {
-        close(lcfd.fd);
-        return NULL;
+    return p == end;
+}
+
+/******************************************************************************
+Description.: copy the part of a slice which consists of letters, digits and
+              certain other characters
+Input Value.: * dest...: gets the zero terminated copy, PARAMETER_SIZE bytes
+              * s......: the slice
+              * accept.: the other characters copied, the copy ends before any
+                         other character
+              * max....: the copy is cut after that many characters
+Return Value: -
+******************************************************************************/
+static void request_copy(char *dest, const http_slice *s, const char *accept, int max)
+{
+    int len;
+
+    for(len = 0; len < s->len && len < max && len < PARAMETER_SIZE - 1; len++) {
+        if(!isalnum((unsigned char)s->data[len]) && (s->data[len] == '\0' || strchr(accept, s->data[len]) == NULL))
+            break;
+    }
+    memcpy(dest, s->data, len);
+    dest[len] = '\0';
+}
+
+/******************************************************************************
+Description.: read an entity tag as the server sends them, "<hex>-<decimal>",
+              optionally weak
+Input Value.: * s......: the value of an If-None-Match header
+              * epoch..: gets the hexadecimal number
+              * seq....: gets the decimal number
+Return Value: 0 if the tag has this form, -1 otherwise
+******************************************************************************/
+static int request_etag(const http_slice *s, unsigned int *epoch, unsigned int *seq)
+{
+    const char *c = s->data, *end = s->data + s->len;
+    int digit;
+
+    if(http_slice_starts(s, "W/"))
+        c += 2;
+    if(c == end || *c++ != '"' || c == end || (digit = hex_char_to_int(*c)) < 0)
+        return -1;
+
+    for(*epoch = 0; c < end && (digit = hex_char_to_int(*c)) >= 0; c++)
+        *epoch = (*epoch << 4) | digit;
+    if(c == end || *c++ != '-' || c == end || *c < '0' || *c > '9')
+        return -1;
+    for(*seq = 0; c < end && *c >= '0' && *c <= '9'; c++)
+        *seq = *seq * 10 + (*c - '0');
+
+    return (c < end && *c == '"') ? 0 : -1;
+}
+
+/******************************************************************************
+Description.: read the scale parameter of a request, "1/2", "1/4" or "1/8".
+              The slash may be escaped.
+Input Value.: s is the value of the parameter
+Return Value: the step, 1 for 1/2 up to SCALE_STEPS, 0 for "1", -1 if the
+              value is not valid
+******************************************************************************/
+static int request_scale(const http_slice *s)
+{
+    http_slice denominator;
+    int step;
+
+    if(http_slice_is(s, "1"))
+        return 0;
+
+    if(http_slice_starts(s, "1/"))
+        denominator.data = s->data + strlen("1/");
+    else if(http_slice_starts(s, "1%2F"))
+        denominator.data = s->data + strlen("1%2F");
+    else
+        return -1;
+    denominator.len = s->data + s->len - denominator.data;
+
+    for(step = 1; step <= SCALE_STEPS; step++) {
+        if(denominator.len == 1 && denominator.data[0] == '0' + (1 << step))
+            return step;
     }
 
-    req.query_string = NULL;
+    return -1;
+}
+
+/******************************************************************************
+Description.: Route a parsed HTTP request head. Requests which can not be
+              served are answered here already.
+Input Value.: * lcfd.........: the connected client
+              * p............: the parsed request head
+              * req..........: initialized request, gets filled
+              * plugin_number: gets the number of the plugin the request is for
+Return Value: 0 if the request has to be answered, -1 if the connection can
+              be closed
+******************************************************************************/
+static int parse_request(cfd *lcfd, const http_parser *p, request *req, int *plugin_number)
+{
+    const route *r = NULL;
+    const http_slice *action, *value;
+    http_slice rest;
+    char credentials[BUFFER_SIZE];
+    int i, number = 0, len;
 
     /* determine what to deliver */
-    if(strstr(buffer, "GET /?action=snapshot") != NULL) {
-        req.type = A_SNAPSHOT;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
+    action = http_query(p, "action");
+    for(i = 0; i < LENGTH_OF(routes); i++) {
+        number = 0;
+        if(route_match(&p->path, routes[i].path, &number) && http_slice_is(&p->method, routes[i].method) &&
+           (routes[i].action == NULL || (action != NULL && route_match(action, routes[i].action, &number)))) {
+            r = &routes[i];
+            break;
         }
-        #endif
+    }
+
+    if(r != NULL) {
+        req->type = r->type;
+        if(r->flags & ROUTE_WXP)
+            number--;   /* webcamxp adds offset to the camera number */
+        *plugin_number = (r->flags & (ROUTE_INPUT | ROUTE_OUTPUT)) ? number : 0;
+        DBG("plugin_no: %d\n", *plugin_number);
+
+        /* the parameters following the action, e.g. "&dest=0&id=..." */
+        if(r->flags & ROUTE_PARAMETER) {
+            rest.data = action->data + action->len;
+            rest.len = p->query.data + p->query.len - rest.data;
+            request_copy(req->parameter, &rest, "_-=&%./", 250);
+            if(unescape(req->parameter) == -1) {
+                send_error(lcfd->fd, 500, "could not properly unescape command parameter string");
+                LOG("could not properly unescape command parameter string\n");
+                return -1;
+            }
+            DBG("command parameter: \"%s\"\n", req->parameter);
+        }
+    } else {
+        DBG("try to serve a file\n");
+        if(!http_slice_is(&p->method, "GET")) {
+            DBG("HTTP request seems to be malformed\n");
+            send_error(lcfd->fd, 400, "Malformed HTTP request");
+            return -1;
+        }
+
+        rest.data = p->path.data + 1;
+        rest.len = p->path.len - 1;
+        request_copy(req->parameter, &rest, "._-", 100);
+
+        if(memmem(p->path.data, p->path.len, ".cgi", strlen(".cgi")) != NULL) {
+            req->type = A_CGI;
+            if(p->query.data != NULL)
+                request_copy(req->query_string, &p->query, "._-=&", PARAMETER_SIZE);
+            else
+                strcpy(req->query_string, " ");
+        } else {
+            req->type = A_FILE;
+        }
+        DBG("parameter: \"%s\"\n", req->parameter);
+    }
+
+    /* a long polling snapshot waits for a newer frame than the one it has */
+    if((value = http_query(p, "wait")) != NULL)
+        req->wait = http_slice_number(value);
+
+    /* a stream may be paced and frames may be scaled down */
+    if((value = http_query(p, "fps")) != NULL && (req->fps = MIN(http_slice_number(value), 1000)) < 1) {
+        send_error(lcfd->fd, 400, "fps has to be a whole number of frames per second");
+        return -1;
+    }
+    if((value = http_query(p, "scale")) != NULL && (req->scale = request_scale(value)) < 0) {
+        send_error(lcfd->fd, 400, "scale has to be 1/2, 1/4 or 1/8");
+        return -1;
+    }
+#ifdef NO_LIBJPEG
+    if(req->scale > 0) {
+        send_error(lcfd->fd, 501, "compiled without libjpeg, frames can not be scaled");
+        return -1;
+    }
+#endif
+
+    /* HTTP/1.1 keeps the connection open unless the client says otherwise */
+    req->minor = (p->minor >= 1) ? 1 : 0;
+    req->keepalive = (p->minor >= 1);
+    if(http_slice_starts(&p->connection, "keep-alive"))
+        req->keepalive = 1;
+    else if(http_slice_starts(&p->connection, "close"))
+        req->keepalive = 0;
+
+    /* a body is not read, the next request could not be found after it */
+    if(http_slice_number(&p->content_length) > 0 || p->transfer_encoding.data != NULL)
+        req->keepalive = 0;
+
+    /* only the first entity tag counts, clients send the one they got */
+    if(p->if_none_match.len > 0 && request_etag(&p->if_none_match, &req->etag_epoch, &req->etag_seq) != 0)
+        req->etag_seq = 0;
+
+    req->gzip = (p->accept_encoding.len > 0 && memmem(p->accept_encoding.data, p->accept_encoding.len, "gzip", strlen("gzip")) != NULL);
+
+    /* check for username and password if parameter -c was given */
+    if(lcfd->pc->conf.credentials != NULL) {
+        credentials[0] = '\0';
+        if(http_slice_starts(&p->authorization, "Basic ")) {
+            len = MIN(p->authorization.len - strlen("Basic "), sizeof(credentials) - 1);
+            memcpy(credentials, p->authorization.data + strlen("Basic "), len);
+            credentials[len] = '\0';
+            decodeBase64(credentials);
+            DBG("username:password: %s\n", credentials);
+        }
+        if(strcmp(lcfd->pc->conf.credentials, credentials) != 0) {
+            DBG("access denied\n");
+            send_error(lcfd->fd, 401, "username and password do not match to configuration");
+            return -1;
+        }
+        DBG("access granted\n");
+    }
+
+    if(r != NULL && (r->flags & ROUTE_OUTPUT)) {
+        if(!OUTPUT_VALID(pglobal, *plugin_number)) {
+            DBG("Output number: %d out of range (valid: 0..%d)\n", *plugin_number, pglobal->outcnt-1);
+            send_error(lcfd->fd, 404, "Invalid output plugin number");
+            return -1;
+        }
+    } else if(r != NULL && (r->flags & ROUTE_INPUT)) {
+        if(!INPUT_VALID(pglobal, *plugin_number)) {
+            DBG("Input number: %d out of range (valid: 0..%d)\n", *plugin_number, pglobal->incnt-1);
+            send_error(lcfd->fd, 404, "Invalid input plugin number");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Answer a request with a blocking socket, for commands, files,
+              CGI scripts and taken pictures. Everything else is served by
+              the event loops.
+Input Value.: * lcfd........: the connected client
+              * req.........: the parsed request
+              * input_number: plugin number the request is for
+Return Value: -
+******************************************************************************/
+static void answer_request(cfd *lcfd, request *req, int input_number)
+{
+    switch(req->type) {
+    case A_COMMAND:
+        if(lcfd->pc->conf.nocommands) {
+            send_error(lcfd->fd, 501, "this server is configured to not accept commands");
+            break;
+        }
+        command(lcfd->pc->id, lcfd->fd, req->parameter);
+        break;
+    case A_FILE:
+        if(lcfd->pc->conf.www_folder == NULL)
+            send_error(lcfd->fd, 501, "no www-folder configured");
+        else
+            send_file(lcfd->pc, lcfd->fd, req->parameter);
+        break;
+    /*
+        With the take argument we try to save the current image to file before we transmit it to the user.
+        This is done trough the output_file plugin.
+        If it not loaded, or the file could not be saved then we won't transmit the frame.
+    */
+    case A_TAKE: {
+        int i, ret = 0, found = 0;
+        for (i = 0; i<pglobal->outcnt; i++) {
+            if (OUTPUT_VALID(pglobal, i) && pglobal->out[i]->name != NULL) {
+                if (strstr(pglobal->out[i]->name, "FILE output plugin")) {
+                    found = 255;
+                    DBG("output_file found id: %d\n", i);
+                    char *filename = NULL;
+                    char *filenamearg = NULL;
+                    int len = 0;
+                    DBG("Buffer: %s \n", req->parameter);
+                    if((filename = strstr(req->parameter, "filename=")) != NULL) {
+                        filename += strlen("filename=");
+                        char *fn = strchr(filename, '&');
+                        if (fn == NULL)
+                            len = strlen(filename);
+                        else
+                            len = (int)(fn - filename);
+                        filenamearg = (char*)calloc(len, sizeof(char));
+                        memcpy(filenamearg, filename, len);
+                        DBG("Filename = %s\n", filenamearg);
+                        //int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int value, char *valueStr)
+                        ret = pglobal->out[i]->cmd(i, OUT_FILE_CMD_TAKE, IN_CMD_GENERIC, 0, filenamearg);
+                    } else {
+                        DBG("filename is not specified int the URL\n");
+                        send_error(lcfd->fd, 404, "The &filename= must present for the take command in the URL");
+                    }
+                    break;
+                }
+            }
+        }
+
+        if (found == 0) {
+            LOG("FILE CHANGE TEST output plugin not loaded\n");
+            send_error(lcfd->fd, 404, "FILE output plugin not loaded, taking snapshot not possible");
+        } else {
+            if (ret == 0) {
+                send_snapshot(lcfd, input_number);
+            } else {
+                send_error(lcfd->fd, 404, "Taking snapshot failed!");
+            }
+        }
+        } break;
+    case A_CGI:
+        DBG("cgi script: %s requested\n", req->parameter);
+        execute_cgi(lcfd->pc, lcfd->fd, req->parameter, req->query_string);
+        break;
+    default:
+        DBG("unknown request\n");
+    }
+
+}
+
+/******************************************************************************
+Description.: Serve a request the event loop handed over. Commands, files and
+              CGI scripts may block for a while, so each of them gets a short
+              lived thread.
+Input Value.: arg is the request_job, it must have been allocated so it is
+              freeable by this thread function.
+Return Value: always NULL
+******************************************************************************/
+void *client_thread(void *arg)
+{
+    request_job *job = arg;
+
+    answer_request(&job->lcfd, &job->req, job->input_number);
+
+    tls_close(job->lcfd.fd);
+    #ifdef MANAGMENT
+    release_client(job->lcfd.client);
+    #endif
+    free(job);
+
+    DBG("leaving HTTP client thread\n");
+    return NULL;
+}
+
+#ifdef WXP_COMPAT
+/******************************************************************************
+Description.: format the response header of a stream in the same format as
+              the WebcamXP does
+Input Value.: buffer gets the header and has to hold BUFFER_SIZE bytes
+Return Value: length of the header
+******************************************************************************/
+static int stream_wxp_header(char *buffer)
+{
+    time_t curDate, expiresDate;
+    curDate = time(NULL);
+    expiresDate = curDate - 1380; // teh expires date is before the current date with 23 minute (1380) sec
+
+    char curDateBuffer[80];
+    char expDateBuffer[80];
+
+    strftime(curDateBuffer, 80, "%a, %d %b %Y %H:%M:%S %Z", localtime(&curDate));
+    strftime(expDateBuffer, 80, "%a, %d %b %Y %H:%M:%S %Z", localtime(&expiresDate));
+    return sprintf(buffer, "HTTP/1.1 200 OK\r\n" \
+                   "Connection: keep-alive\r\n" \
+                   "Content-Type: multipart/x-mixed-replace; boundary=--myboundary\r\n" \
+                   "Content-Length: 9999999\r\n" \
+                   "Cache-control: no-cache, must revalidate\r\n" \
+                   "Date: %s\r\n" \
+                   "Expires: %s\r\n" \
+                   "Pragma: no-cache\r\n" \
+                   "Server: webcamXP\r\n"
+                   "\r\n",
+                   curDateBuffer,
+                   expDateBuffer);
+}
+#endif
+
+/******************************************************************************
+Description.: count a connection of an event loop which needs the frames of
+              an input. The first one registers the eventfd of the loop with
+              the input.
+Input Value.: w is the event loop, input_number the input
+Return Value: 0 if everything is OK, -1 otherwise
+******************************************************************************/
+static int worker_listen(worker *w, int input_number)
+{
+    if(input_number >= w->listening_len) {
+        int *grown = realloc(w->listening, (input_number + 1) * sizeof(int));
+        if(grown == NULL)
+            return -1;
+        memset(grown + w->listening_len, 0, (input_number + 1 - w->listening_len) * sizeof(int));
+        w->listening = grown;
+        w->listening_len = input_number + 1;
+    }
+
+    if(w->listening[input_number] == 0 && frame_listen(pglobal->in[input_number], w->event) != 0)
+        return -1;
+
+    w->listening[input_number]++;
+    return 0;
+}
+
+/******************************************************************************
+Description.: undo worker_listen()
+Input Value.: w is the event loop, input_number the input
+Return Value: -
+******************************************************************************/
+static void worker_unlisten(worker *w, int input_number)
+{
+    if(--w->listening[input_number] == 0)
+        frame_unlisten(pglobal->in[input_number], w->event);
+}
+
+/******************************************************************************
+Description.: change the events epoll reports for a connection
+Input Value.: conn is the connection, its state is set already.
+              out is set if it waits to write
+Return Value: -
+******************************************************************************/
+static void conn_want(connection *conn, int out)
+{
+    struct epoll_event ev;
+    uint32_t events = (out ? EPOLLOUT : 0);
+
+    /* the next request of a persistent connection is read after the response */
+    if(!conn->eof && (!conn->keepalive || conn->state == C_REQUEST))
+        events |= EPOLLIN | EPOLLRDHUP;
+
+    if(events == conn->events)
+        return;
+
+    ev.events = events;
+    ev.data.ptr = conn;
+    if(epoll_ctl(conn->w->epfd, EPOLL_CTL_MOD, conn->c.fd, &ev) == 0)
+        conn->events = events;
+}
+
+/******************************************************************************
+Description.: subscribe the input of a connection and get woken up once it
+              publishes a frame
+Input Value.: conn is the connection
+Return Value: 0 if ok, -1 if the event loop can not listen to another input
+******************************************************************************/
+static int conn_subscribe(connection *conn)
+{
+    if(worker_listen(conn->w, conn->input) != 0)
+        return -1;
+
+    /* keep an on-demand input capturing while this client is connected */
+    frame_subscribe(pglobal->in[conn->input]);
+    conn->subscribed = 1;
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: undo conn_subscribe()
+Input Value.: conn is the connection
+Return Value: -
+******************************************************************************/
+static void conn_unsubscribe(connection *conn)
+{
+    if(!conn->subscribed)
+        return;
+
+    if(conn->type == A_STREAM || conn->type == A_STREAM_WXP) {
+        stream_unregister(&conn->client);
+        DBG("stream closed, %u frames skipped\n", conn->cursor.skipped);
+    }
+    worker_unlisten(conn->w, conn->input);
+    frame_unsubscribe(pglobal->in[conn->input]);
+    conn->subscribed = 0;
+}
+
+/******************************************************************************
+Description.: undo the counting of conn_admit()
+Input Value.: conn is the connection
+Return Value: -
+******************************************************************************/
+static void conn_release(connection *conn)
+{
+    context *pc = conn->c.pc;
+    pthread_mutex_t *lock;
+
+    if(conn->streaming) {
+        __atomic_sub_fetch(&pc->streams, 1, __ATOMIC_RELAXED);
+        if(conn->peer != NULL && pc->conf.streams_per_ip > 0) {
+            lock = &pc->peer_locks[peer_bucket(conn->peer->address) % PEER_LOCKS];
+            pthread_mutex_lock(lock);
+            conn->peer->streams--;
+            pthread_mutex_unlock(lock);
+        }
+        conn->streaming = 0;
+    }
+
+    peer_put(pc, conn->peer);
+    conn->peer = NULL;
+}
+
+/******************************************************************************
+Description.: take a connection out of its event loop, the socket stays open
+Input Value.: conn is the connection, it gets freed by worker_reap()
+Return Value: the socket
+******************************************************************************/
+static int conn_detach(connection *conn)
+{
+    int fd = conn->c.fd;
+
+    epoll_ctl(conn->w->epfd, EPOLL_CTL_DEL, fd, NULL);
+
+    if(conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        conn->w->connections = conn->next;
+    if(conn->next != NULL)
+        conn->next->prev = conn->prev;
+
+    if(conn->f != NULL)
+        frame_put(conn->f);
+    frame_put(conn->pending);
+    conn->pending = NULL;
+    reply_free(&conn->reply);
+    www_put(conn->file);
+    conn->file = NULL;
+    conn_unsubscribe(conn);
+    conn_release(conn);
+
+    /* epoll may still report events for it in this round */
+    conn->state = C_CLOSED;
+    conn->next = conn->w->closed;
+    conn->w->closed = conn;
+
+    return fd;
+}
+
+/******************************************************************************
+Description.: close a connection and free everything it holds
+Input Value.: conn is the connection
+Return Value: -
+******************************************************************************/
+static void conn_close(connection *conn)
+{
+    #ifdef MANAGMENT
+    release_client(conn->c.client);
+    #endif
+    tls_close(conn_detach(conn));
+}
+
+/******************************************************************************
+Description.: append a buffer to the data a connection has to write. Headers
+              formatted back to back into conn->header become one buffer.
+Input Value.: conn is the connection, data and len the buffer
+Return Value: -
+******************************************************************************/
+static void conn_queue(connection *conn, const void *data, size_t len)
+{
+    struct iovec *last;
+
+    if(conn->out_count > conn->out_index) {
+        last = &conn->out[conn->out_count - 1];
+        if((char *)last->iov_base + last->iov_len == data) {
+            last->iov_len += len;
+            return;
+        }
+    }
+
+    conn->out[conn->out_count].iov_base = (void *)data;
+    conn->out[conn->out_count].iov_len = len;
+    conn->out_count++;
+}
+
+/******************************************************************************
+Description.: queue the status line and the headers each response of the
+              event loops starts with, in the HTTP version of the request
+Input Value.: conn is the connection, status the code and reason phrase
+Return Value: -
+******************************************************************************/
+static void conn_status(connection *conn, const char *status)
+{
+    char *header = conn->header + conn->header_len;
+    int len;
+
+    len = sprintf(header, "HTTP/1.%d %s\r\n" \
+                  "Connection: %s\r\n" \
+                  SERVER_HEADER,
+                  conn->minor, status, conn->keepalive ? "keep-alive" : "close");
+    conn->header_len += len;
+    conn_queue(conn, header, len);
+}
+
+/******************************************************************************
+Description.: limit the data a stream client has queued in its socket to
+              conf.queue frames of the given size. The limit is only updated
+              if the frame size changed noticeably, to save syscalls.
+Input Value.: conn is the connection, size the size of the current frame
+Return Value: -
+******************************************************************************/
+static void conn_limit(connection *conn, int size)
+{
+    int lowat = (conn->c.pc->conf.queue - 1) * size + 1;
+
+    if(conn->lowat < 0 || (conn->lowat > 0 && abs(lowat - conn->lowat) <= conn->lowat / 4))
+        return;
+
+    if(setsockopt(conn->c.fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) == 0) {
+        conn->lowat = lowat;
+    } else {
+        /* not supported, the kernel buffers as much as it likes */
+        DBG("could not set TCP_NOTSENT_LOWAT: %s\n", strerror(errno));
+        conn->lowat = -1;
+    }
+}
+
+/******************************************************************************
+Description.: wake the paced streams of an event loop at a certain time, or
+              earlier if the timer expires earlier already
+Input Value.: w is the event loop, due the frame_clock() time
+Return Value: -
+******************************************************************************/
+static void worker_timer(worker *w, const struct timeval *due)
+{
+    struct itimerspec its;
+
+    if(timerisset(&w->armed) && !timercmp(due, &w->armed, <))
+        return;
+
+    /* frame_clock() reads the same clock */
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = due->tv_sec;
+    its.it_value.tv_nsec = due->tv_usec * 1000;
+    if(timerfd_settime(w->timer, TFD_TIMER_ABSTIME, &its, NULL) == 0)
+        w->armed = *due;
+}
+
+/******************************************************************************
+Description.: a paced stream took a frame, its next frame is due one period
+              after this one was. The periods do not drift, but a client
+              which fell behind by more than one period does not get a burst
+              of frames to catch up.
+Input Value.: conn is the connection
+Return Value: 1 if the client fell behind, 0 if it keeps the pace
+******************************************************************************/
+static int conn_schedule(connection *conn)
+{
+    struct timeval now, period;
+
+    period.tv_sec = conn->pace / 1000000;
+    period.tv_usec = conn->pace % 1000000;
+
+    frame_clock(&now);
+    timeradd(&conn->due, &period, &conn->due);
+    if(timercmp(&conn->due, &now, <)) {
+        timeradd(&now, &period, &conn->due);
+        return 1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: judge the link of an adapting stream client about once a
+              second and move it along the quality ladder. A client which
+              missed more than a quarter of its frames moves down a rung. One
+              which missed none and found its socket drained whenever a frame
+              was queued moves up after ladder.hold good judgements. If it
+              has to move down right after that, it waits twice as long
+              before it tries again.
+Input Value.: * conn...: the connection
+              * missed.: frames the client was too slow for before this one
+              * unsent.: bytes still in its socket when this one was queued
+              * size...: bytes of this one
+Return Value: -
+******************************************************************************/
+static void conn_ladder(connection *conn, int missed, int unsent, int size)
+{
+    ladder_state *l = &conn->ladder;
+    struct timeval now;
+
+    l->frames++;
+    l->missed += missed;
+    if(unsent > size / 2)
+        l->crowded++;
+
+    frame_clock(&now);
+    if(l->frames < LADDER_FRAMES || frame_elapsed_us(&l->start, &now) < 1000000)
+        return;
+
+    /* /metrics reads the rung */
+    if(l->missed * 4 > l->frames) {
+        if(l->probing)
+            l->hold = MIN(l->hold * 2, LADDER_HOLD_MAX);
+        if(l->rung < LADDER_RUNGS - 1)
+            __atomic_store_n(&l->rung, l->rung + 1, __ATOMIC_RELAXED);
+        l->good = 0;
+        l->probing = 0;
+    } else {
+        /* the last move up held */
+        if(l->probing)
+            l->hold = MAX(l->hold / 2, LADDER_HOLD);
+        l->probing = 0;
+
+        if(l->missed > 0 || l->crowded > 0) {
+            l->good = 0;
+        } else if(++l->good >= l->hold && l->rung > 0) {
+            __atomic_store_n(&l->rung, l->rung - 1, __ATOMIC_RELAXED);
+            l->good = 0;
+            l->probing = 1;
+        }
+    }
+    DBG("stream judged: %d frames, %d missed, %d crowded, rung %d\n",
+        l->frames, l->missed, l->crowded, l->rung);
+
+    l->start = now;
+    l->frames = l->missed = l->crowded = 0;
+}
+
+/******************************************************************************
+Description.: check if the next frame of a paced stream is due, otherwise
+              let it wait for the timer of its event loop
+Input Value.: conn is the connection
+Return Value: 1 if it has to wait, 0 if a frame can be sent
+******************************************************************************/
+static int conn_paced(connection *conn)
+{
+    struct timeval now;
+
+    frame_clock(&now);
+    if(!timercmp(&now, &conn->due, <))
+        return 0;
+
+    conn->state = C_PACED;
+    conn_want(conn, 0);
+    worker_timer(conn->w, &conn->due);
+    return 1;
+}
+
+/******************************************************************************
+Description.: queue the next frame for a snapshot or stream client. Frames
+              published while the client was busy are skipped, it always
+              gets the latest one.
+Input Value.: conn is the connection, at most the response header may be
+              queued
+Return Value: 0 if a frame was queued, -1 if there is no new frame yet or
+              the encoders still work on it, 1 if the client still has too
+              many frames in flight
+******************************************************************************/
+static int conn_queue_frame(connection *conn)
+{
+    frame *f;
+    const wire_chunk *chunk;
+    const wire_variant *variant = NULL;
+    unsigned char *data;
+    unsigned int skipped = (conn->pending != NULL) ? conn->pending_skipped : conn->cursor.skipped;
+    char *header;
+    int len, size, unsent = 0, missed, step, reduced;
+
+    /*
+     * the socket still holds queue frames which were not sent, skip frames
+     * until it drained. epoll reports EPOLLOUT once unsent drops below the
+     * TCP_NOTSENT_LOWAT set in conn_limit().
+     */
+    if(conn->lowat > 0 && ioctl(conn->c.fd, SIOCOUTQNSD, &unsent) == 0 && unsent >= conn->lowat)
+        return 1;
+
+    if(conn->adapt) {
+        step = ladder_rungs[conn->ladder.rung].step;
+        reduced = ladder_rungs[conn->ladder.rung].reduced;
+    } else {
+        step = conn->scale;
+        reduced = 0;
+    }
+
+    do {
+        /* libjpeg never runs in the loop, a frame which is not ready goes to the encoders */
+        if((f = conn->pending) != NULL) {
+            if(!frame_ready(f, step, reduced))
+                return -1;
+            conn->pending = NULL;
+        } else {
+            if((f = frame_poll(pglobal->in[conn->input], &conn->cursor)) == NULL)
+                return -1;
+            if(!frame_ready(f, step, reduced)) {
+                if(encoder_submit(conn->c.pc, f, step, reduced, conn->w) != 0) {
+                    frame_put(f);
+                    return -1;
+                }
+                conn->pending = f;
+                conn->pending_skipped = skipped;
+                return -1;
+            }
+        }
+        if(frame_jpeg(f) == 0 && (chunk = frame_chunk(f)) != NULL &&
+           ((step == 0 && !reduced) || (variant = frame_variant_made(f, step, reduced)) != NULL))
+            break;
+        frame_put(f);
+    } while(1);
+    DBG("got frame (size: %d kB)\n", f->size / 1024);
+
+    /* a variant is sent with its own headers */
+    if(variant != NULL) {
+        chunk = &variant->chunk;
+        data = variant->buf;
+        size = variant->size;
+    } else {
+        data = f->buf;
+        size = f->size;
+    }
+
+    /*
+     * the frames left out to keep the pace the client asked for were not
+     * missed, a paced client only missed frames if it fell behind
+     */
+    if(conn->pace > 0) {
+        conn->cursor.skipped = skipped;
+        missed = conn_schedule(conn);
+    } else {
+        missed = conn->cursor.skipped - skipped;
+    }
+    if(conn->adapt)
+        conn_ladder(conn, missed, unsent, size);
+
+    #ifdef MANAGMENT
+    update_client_timestamp(conn->c.client);
+    if(conn->c.client != NULL) {
+        __atomic_add_fetch(&conn->c.client->dropped, conn->cursor.skipped - conn->dropped, __ATOMIC_RELAXED);
+        conn->dropped = conn->cursor.skipped;
+    }
+    #endif
+
+    if(conn->type == A_STREAM || conn->type == A_STREAM_WXP)
+        conn_limit(conn, size);
+
+    /* everything but the skipped counter or the age is shared with the other clients */
+    conn->f = f;
+    conn->f_size = size;
+    header = conn->header + conn->header_len;
+    switch(conn->type) {
+    case A_STREAM:
+        len = last_header(header, "X-Frames-Skipped", conn->cursor.skipped);
+        conn->header_len += len;
+        conn_queue(conn, chunk->part, chunk->part_len);
+        conn_queue(conn, header, len);
+        conn_queue(conn, data, size);
+        conn_queue(conn, "\r\n--" BOUNDARY "\r\n", strlen("\r\n--" BOUNDARY "\r\n"));
+        break;
     #ifdef WXP_COMPAT
-    } else if((strstr(buffer, "GET /cam") != NULL) && (strstr(buffer, ".jpg") != NULL)) {
-        req.type = A_SNAPSHOT_WXP;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
+    case A_STREAM_WXP:
+        conn_queue(conn, chunk->wxp, sizeof(chunk->wxp));
+        conn_queue(conn, data, size);
+        break;
+    #endif
+    default:
+        conn_status(conn, "200 OK");
+        header = conn->header + conn->header_len;
+        len = last_header(header, "X-Frame-Age", frame_age_ms(f));
+        conn->header_len += len;
+        conn_queue(conn, chunk->snapshot, chunk->snapshot_len);
+        conn_queue(conn, header, len);
+        conn_queue(conn, data, size);
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: write as much of the queued data as the socket takes, with one
+              writev() for a complete part in the common case
+Input Value.: conn is the connection
+Return Value: 0 if everything was written, 1 if the socket is full, -1 if
+              the client is gone
+******************************************************************************/
+static int conn_flush(connection *conn)
+{
+    struct iovec *iov;
+    ssize_t rc;
+
+    while(conn->out_index < conn->out_count) {
+        if((rc = tls_writev(conn->c.fd, conn->out + conn->out_index, conn->out_count - conn->out_index)) < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn_want(conn, 1);
+                return 1;
+            }
+            return -1;
+        }
+
+        /* skip what was written, the rest of a short write stays queued */
+        while(conn->out_index < conn->out_count && (size_t)rc >= conn->out[conn->out_index].iov_len)
+            rc -= conn->out[conn->out_index++].iov_len;
+        if(conn->out_index < conn->out_count) {
+            iov = &conn->out[conn->out_index];
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    conn->out_count = conn->out_index = 0;
+    conn->header_len = 0;
+    conn_want(conn, 0);
+    return 0;
+}
+
+/******************************************************************************
+Description.: a response is complete. A persistent connection waits for the
+              next request, the requests the client pipelined are kept.
+Input Value.: conn is the connection, it is closed if it is not persistent
+Return Value: -
+******************************************************************************/
+static void conn_done(connection *conn)
+{
+    struct timeval now;
+
+    conn->requests++;
+    if(!conn->keepalive) {
+        conn_close(conn);
+        return;
+    }
+
+    conn_unsubscribe(conn);
+    reply_free(&conn->reply);
+    www_put(conn->file);
+    conn->file = NULL;
+    frame_put(conn->pending);
+    conn->pending = NULL;
+    memset(&conn->cursor, 0, sizeof(conn->cursor));
+    conn->type = A_UNKNOWN;
+    conn->known = 0;
+    conn->answered = 0;
+    conn->deadline = 0;
+
+    /* clients may separate pipelined requests with empty lines */
+    while(conn->head_end < conn->head_len && (conn->head[conn->head_end] == '\r' || conn->head[conn->head_end] == '\n'))
+        conn->head_end++;
+    conn->head_len -= conn->head_end;
+    memmove(conn->head, conn->head + conn->head_end, conn->head_len + 1);
+    conn->head_end = 0;
+    http_parser_init(&conn->parser);
+
+    conn->state = C_REQUEST;
+    frame_clock(&now);
+    conn->since = now.tv_sec;
+    conn_want(conn, 0);
+}
+
+/******************************************************************************
+Description.: end the response of a client whose input was removed, it will
+              never publish another frame. A stream gets its closing
+              boundary, the others an error.
+Input Value.: conn is the connection, nothing is queued
+Return Value: 0 if the end of the stream was queued, -1 if the connection
+              was closed
+******************************************************************************/
+static int conn_retired(connection *conn)
+{
+    DBG("input %d was removed, ending the response\n", conn->input);
+
+    if(conn->type == A_STREAM) {
+        conn->state = C_SENDING;
+        conn->answered = 1;
+        conn->keepalive = 0;
+        conn_queue(conn, "\r\n--" BOUNDARY "--\r\n", strlen("\r\n--" BOUNDARY "--\r\n"));
+        return 0;
+    }
+
+    /* the WXP stream has no way to tell its end, it just gets closed */
+    if(conn->type != A_STREAM_WXP)
+        send_error(conn->c.fd, 404, "the input was removed");
+    conn_close(conn);
+    return -1;
+}
+
+/******************************************************************************
+Description.: drive a client as far as possible without blocking: finish the
+              queued data, then queue the next frame of a snapshot or stream
+Input Value.: conn is the connection, see conn_done() once it is done
+Return Value: -
+******************************************************************************/
+static void conn_send(connection *conn)
+{
+    int rc;
+
+    /* a response which was queued at once is complete once it is written */
+    if(conn->answered) {
+        if((rc = conn_flush(conn)) < 0)
+            conn_close(conn);
+        else if(rc == 0)
+            conn_done(conn);
+        return;
+    }
+
+    for(;;) {
+        /* a paced stream waits until its next frame is due */
+        if(conn->f == NULL && conn->pace > 0 && conn_paced(conn))
+            return;
+
+        /* a frame goes out together with the response header if it is still queued */
+        if(conn->f == NULL && (rc = conn_queue_frame(conn)) != 0 && conn->out_count == 0) {
+            if(rc > 0) {
+                /* too slow, the newest frame is picked once the socket drained */
+                conn->state = C_SENDING;
+                conn_want(conn, 1);
+            } else if(frame_retired(pglobal->in[conn->input])) {
+                if(conn_retired(conn) == 0)
+                    conn_send(conn);
+            } else if(!conn->subscribed) {
+                /* the frame a snapshot was started for is gone, wait for the next one */
+                if(conn_subscribe(conn) != 0) {
+                    send_error(conn->c.fd, 500, "too many clients");
+                    conn_close(conn);
+                    return;
+                }
+                continue;
+            } else {
+                conn->state = C_WAITING;
+                conn_want(conn, 0);
+            }
+            return;
         }
-        #endif
-    #endif
-    } else if(strstr(buffer, "POST /stream") != NULL) {
-        req.type = A_STREAM;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
+
+        if((rc = conn_flush(conn)) != 0) {
+            conn->state = C_SENDING;
+            if(rc < 0)
+                conn_close(conn);
+            return;
         }
-        #endif
-    } else if(strstr(buffer, "GET /?action=stream") != NULL) {
-        req.type = A_STREAM;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
+
+        if(conn->f != NULL) {
+            trace_frame_sent(pglobal->out[conn->c.pc->id], conn->f, conn->f_size);
+
+            #ifdef DEBUG
+            {
+                struct timeval sent;
+                frame *f = conn->f;
+                frame_clock(&sent);
+                DBG("frame %u %dx%d: encode %ld us, publish %ld us, send %ld us\n",
+                    f->seq, f->width, f->height,
+                    frame_elapsed_us(&f->captured, &f->encoded),
+                    frame_elapsed_us(&f->encoded, &f->published),
+                    frame_elapsed_us(&f->published, &sent));
+            }
+            #endif
+
+            frame_put(conn->f);
+            conn->f = NULL;
+
+            if(conn->type != A_STREAM && conn->type != A_STREAM_WXP) {
+                conn_done(conn);
+                return;
+            }
         }
-        #endif
+    }
+}
+
+/******************************************************************************
+Description.: answer a snapshot request of a client which has the latest
+              frame already, or whose long poll did not see a newer one
+Input Value.: conn is the connection, known is set
+Return Value: -
+******************************************************************************/
+static void conn_not_modified(connection *conn)
+{
+    char *header;
+    int len;
+
+    conn->state = C_SENDING;
+    conn->answered = 1;
+    conn_status(conn, "304 Not Modified");
+    header = conn->header + conn->header_len;
+    len = sprintf(header, REVALIDATE_HEADER \
+                  "ETag: \"%x-%u\"\r\n" \
+                  "\r\n",
+                  pglobal->in[conn->input]->epoch, conn->known);
+    conn->header_len += len;
+    conn_queue(conn, header, len);
+
+    conn_send(conn);
+}
+
+/******************************************************************************
+Description.: answer a request for a file of the www folder or a JSON
+              description from memory, or with 304 if the client has this
+              version of it already
+Input Value.: conn is the connection, file the file with a reference which
+              the connection takes over, req the request
+Return Value: -
+******************************************************************************/
+static void conn_file(connection *conn, www_file *file, const request *req)
+{
+    char *header;
+    int len;
+
+    conn->state = C_SENDING;
+    conn->answered = 1;
+    conn->file = file;
+
+    if(req->etag_epoch == file->etag_epoch && req->etag_seq == file->etag_seq) {
+        conn_status(conn, "304 Not Modified");
+        header = conn->header + conn->header_len;
+        len = sprintf(header, "ETag: \"%x-%u\"\r\n" \
+                      "\r\n",
+                      req->etag_epoch, req->etag_seq);
+        conn->header_len += len;
+        conn_queue(conn, header, len);
+    } else {
+        conn_status(conn, "200 OK");
+        conn_queue(conn, file->header, file->header_len);
+        conn_queue(conn, file->data, file->len);
+    }
+
+    conn_send(conn);
+}
+
+/******************************************************************************
+Description.: start to serve a snapshot or stream request
+Input Value.: conn is the connection, type and input are set
+Return Value: -
+******************************************************************************/
+static void conn_start(connection *conn)
+{
+    input *in = pglobal->in[conn->input];
+    frame *f;
+    int len, fresh;
+
+    conn->state = C_SENDING;
+
+    switch(conn->type) {
+    case A_STREAM:
+        DBG("Request for stream from input: %d\n", conn->input);
+        conn_status(conn, "200 OK");
+        len = sprintf(conn->header + conn->header_len, "Access-Control-Allow-Origin: *\r\n" \
+                      NOCACHE_FIELDS \
+                      "Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY "\r\n" \
+                      "\r\n" \
+                      "--" BOUNDARY "\r\n");
+        conn_queue(conn, conn->header + conn->header_len, len);
+        conn->header_len += len;
+        break;
     #ifdef WXP_COMPAT
-    } else if((strstr(buffer, "GET /cam") != NULL) && (strstr(buffer, ".mjpg") != NULL)) {
-        req.type = A_STREAM_WXP;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
+    case A_STREAM_WXP:
+        DBG("Request for WXP compat stream from input: %d\n", conn->input);
+        len = stream_wxp_header(conn->header);
+        conn_queue(conn, conn->header, len);
+        conn->header_len = len;
+        break;
+    #endif
+    default:
+        DBG("Request for snapshot from input: %d\n", conn->input);
+
+        /* a long poll waits for any frame newer than the one the client has */
+        if(conn->deadline != 0) {
+            conn->cursor.seq = conn->known;
+            break;
         }
-        #endif
+
+        /* the client has the latest frame already, this does not touch a lock */
+        if(conn->known != 0 && conn->known == __atomic_load_n(&in->seq, __ATOMIC_ACQUIRE)) {
+            conn_not_modified(conn);
+            return;
+        }
+
+        /*
+         * the latest frame is sent at once if it is fresh enough, the zeroed
+         * cursor returns it. Nothing has to be subscribed for that.
+         */
+        if(conn->c.pc->conf.max_age > 0 && (f = frame_get(in)) != NULL) {
+            fresh = (frame_age_ms(f) <= conn->c.pc->conf.max_age);
+            frame_put(f);
+            if(fresh) {
+                conn_send(conn);
+                return;
+            }
+        }
+
+        /* otherwise the snapshot waits for a fresh frame */
+        frame_cursor_init(in, &conn->cursor);
+    }
+
+    if(conn_subscribe(conn) != 0) {
+        send_error(conn->c.fd, 500, "too many clients");
+        conn_close(conn);
+        return;
+    }
+
+    if(conn->type == A_STREAM || conn->type == A_STREAM_WXP) {
+        conn->client.output = conn->c.pc->id;
+        conn->client.input = conn->input;
+        conn->client.address = conn->c.address;
+        conn->client.cursor = &conn->cursor;
+        conn->client.rung = &conn->ladder.rung;
+        stream_register(&conn->client);
+    }
+
+    conn_send(conn);
+}
+
+/******************************************************************************
+Description.: answer a request for counters or latencies, the response is
+              formatted in memory and sent without blocking
+Input Value.: conn is the connection, type and input are set
+Return Value: -
+******************************************************************************/
+static void conn_answer(connection *conn)
+{
+    const char *content_type = "application/x-javascript";
+    int len;
+
+    conn->state = C_SENDING;
+    conn->answered = 1;
+
+    switch(conn->type) {
+    case A_TRACE_JSON:
+        DBG("Request for the trace JSON file\n");
+        format_trace_JSON(&conn->reply);
+        break;
+    case A_METRICS:
+        DBG("Request for the metrics\n");
+        format_metrics(&conn->reply);
+        content_type = "text/plain; version=0.0.4";
+        break;
+    #ifdef MANAGMENT
+    case A_CLIENTS_JSON:
+        DBG("Request for the clients JSON file\n");
+        format_clients_JSON(&conn->reply);
+        break;
     #endif
-    } else if(strstr(buffer, "GET /?action=take") != NULL) {
-        int len;
-        req.type = A_TAKE;
-        query_suffixed = 255;
+    default:
+        break;
+    }
 
-        /* advance by the length of known string */
-        if((pb = strstr(buffer, "GET /?action=take")) == NULL) {
-            DBG("HTTP request seems to be malformed\n");
-            send_error(lcfd.fd, 400, "Malformed HTTP request");
-            close(lcfd.fd);
-            query_suffixed = 0;
-            return NULL;
+    if(conn->reply.failed || conn->reply.data == NULL) {
+        send_error(conn->c.fd, 500, "not enough memory");
+        conn_close(conn);
+        return;
+    }
+
+    conn_status(conn, "200 OK");
+    len = snprintf(conn->header + conn->header_len, sizeof(conn->header) - conn->header_len,
+                   "Content-type: %s\r\n" \
+                   "Content-Length: %lu\r\n" \
+                   NOCACHE_FIELDS \
+                   "\r\n",
+                   content_type, (unsigned long)conn->reply.len);
+    conn_queue(conn, conn->header + conn->header_len, len);
+    conn->header_len += len;
+    conn_queue(conn, conn->reply.data, conn->reply.len);
+
+    conn_send(conn);
+}
+
+/******************************************************************************
+Description.: check the limits of the server before a stream or snapshot
+              gets served, nothing about its frames is looked at before.
+              An admitted stream is counted until the connection is closed.
+Input Value.: conn is the connection, its type is set
+Return Value: 0 if it may be served, -1 if it was refused and closed
+******************************************************************************/
+static int conn_admit(connection *conn)
+{
+    context *pc = conn->c.pc;
+    pthread_mutex_t *lock;
+    const char *refused = NULL;
+
+    if(conn->type == A_STREAM || conn->type == A_STREAM_WXP) {
+        if(__atomic_add_fetch(&pc->streams, 1, __ATOMIC_RELAXED) > pc->conf.streams && pc->conf.streams > 0) {
+            refused = "too many streams";
+        } else if(conn->peer != NULL && pc->conf.streams_per_ip > 0) {
+            lock = &pc->peer_locks[peer_bucket(conn->peer->address) % PEER_LOCKS];
+            pthread_mutex_lock(lock);
+            if(conn->peer->streams < pc->conf.streams_per_ip)
+                conn->peer->streams++;
+            else
+                refused = "too many streams from your address";
+            pthread_mutex_unlock(lock);
         }
-        pb += strlen("GET /?action=take"); // a pb points to thestring after the first & after command
 
-        /* only accept certain characters */
-        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./"), 0), 100);
-        req.parameter = malloc(len + 1);
-        if(req.parameter == NULL) {
-            exit(EXIT_FAILURE);
+        if(refused != NULL) {
+            __atomic_sub_fetch(&pc->streams, 1, __ATOMIC_RELAXED);
+            DBG("%s: %s\n", conn->c.address, refused);
+            send_unavailable(conn->c.fd, ADMISSION_RETRY, refused);
+            conn_close(conn);
+            return -1;
+        }
+        conn->streaming = 1;
+    } else if(conn->type == A_SNAPSHOT || conn->type == A_SNAPSHOT_WXP) {
+        if(conn->peer != NULL && pc->conf.snapshot_rate > 0 && peer_take_snapshot(pc, conn->peer) != 0) {
+            DBG("%s: too many snapshots\n", conn->c.address);
+            send_unavailable(conn->c.fd, 1, "too many snapshots from your address");
+            conn_close(conn);
+            return -1;
         }
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
+    }
 
-        if(unescape(req.parameter) == -1) {
-            free(req.parameter);
-            send_error(lcfd.fd, 500, "could not properly unescape command parameter string");
-            LOG("could not properly unescape command parameter string\n");
-            close(lcfd.fd);
-            return NULL;
+    return 0;
+}
+
+/******************************************************************************
+Description.: the request head of a connection is complete, serve it
+Input Value.: conn is the connection
+Return Value: -
+******************************************************************************/
+static void conn_request(connection *conn)
+{
+    request_job parsed, *job;
+    struct timeval now;
+    www_file *file;
+    pthread_t client;
+    int fd, on;
+
+    parsed.lcfd = conn->c;
+    init_request(&parsed.req);
+    if(parse_request(&parsed.lcfd, &conn->parser, &parsed.req, &parsed.input_number) != 0) {
+        conn_close(conn);
+        return;
+    }
+
+    conn->type = parsed.req.type;
+    conn->input = parsed.input_number;
+    conn->keepalive = parsed.req.keepalive && conn->c.pc->conf.keepalive > 0;
+    conn->minor = parsed.req.minor;
+    conn->scale = parsed.req.scale;
+    conn->pace = 0;
+    timerclear(&conn->due);
+    conn->adapt = 0;
+
+    if(conn_admit(conn) != 0)
+        return;
+
+    switch(parsed.req.type) {
+    case A_STREAM:
+    case A_STREAM_WXP:
+        conn->keepalive = 0;
+        if(parsed.req.fps > 0)
+            conn->pace = 1000000 / parsed.req.fps;
+        /* a client which asked for a size keeps it */
+        conn->adapt = (conn->c.pc->conf.adapt && conn->scale == 0);
+        memset(&conn->ladder, 0, sizeof(conn->ladder));
+        conn->ladder.hold = LADDER_HOLD;
+        frame_clock(&conn->ladder.start);
+        conn_start(conn);
+        return;
+    case A_SNAPSHOT:
+    case A_SNAPSHOT_WXP:
+        /* an ETag of an input loaded before is meaningless */
+        if(parsed.req.etag_epoch == pglobal->in[conn->input]->epoch)
+            conn->known = parsed.req.etag_seq;
+        if(parsed.req.wait > 0) {
+            frame_clock(&now);
+            conn->deadline = now.tv_sec + MIN(parsed.req.wait, LONGPOLL_MAX);
+        }
+        conn_start(conn);
+        return;
+    case A_INPUT_JSON:
+    case A_OUTPUT_JSON:
+    case A_PROGRAM_JSON:
+        if((file = json_get(parsed.req.type, conn->input, parsed.req.gzip)) == NULL) {
+            send_error(conn->c.fd, 500, "not enough memory");
+            conn_close(conn);
+            return;
         }
-    } else if((strstr(buffer, "GET /input") != NULL) && (strstr(buffer, ".json") != NULL)) {
-        req.type = A_INPUT_JSON;
-        query_suffixed = 255;
-    } else if((strstr(buffer, "GET /output") != NULL) && (strstr(buffer, ".json") != NULL)) {
-        req.type = A_OUTPUT_JSON;
-        query_suffixed = 255;
-    } else if(strstr(buffer, "GET /program.json") != NULL) {
-        req.type = A_PROGRAM_JSON;
+        conn_file(conn, file, &parsed.req);
+        return;
+    case A_TRACE_JSON:
+    case A_METRICS:
     #ifdef MANAGMENT
-    } else if(strstr(buffer, "GET /clients.json") != NULL) {
-        req.type = A_CLIENTS_JSON;
+    case A_CLIENTS_JSON:
     #endif
-    } else if(strstr(buffer, "GET /?action=command") != NULL) {
-        int len;
-        req.type = A_COMMAND;
+        conn_answer(conn);
+        return;
+    case A_FILE:
+        /* files which are not in memory are read by a thread */
+        if(conn->c.pc->conf.www_folder != NULL &&
+           (file = www_get(conn->c.pc, parsed.req.parameter, parsed.req.gzip)) != NULL) {
+            conn_file(conn, file, &parsed.req);
+            return;
+        }
+        break;
+    default:
+        break;
+    }
 
-        /* advance by the length of known string */
-        if((pb = strstr(buffer, "GET /?action=command")) == NULL) {
-            DBG("HTTP request seems to be malformed\n");
-            send_error(lcfd.fd, 400, "Malformed HTTP request");
-            close(lcfd.fd);
-            return NULL;
+    if((job = malloc(sizeof(request_job))) == NULL) {
+        fprintf(stderr, "failed to allocate (a very small amount of) memory\n");
+        conn_close(conn);
+        return;
+    }
+    *job = parsed;
+
+    /* everything else may block for a while, e.g. a CGI script */
+    fd = conn_detach(conn);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    /* those answers are written piecewise, let Nagle merge the pieces */
+    on = 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    DBG("create thread to handle client that just established a connection\n");
+    if(pthread_create(&client, NULL, &client_thread, job) != 0) {
+        DBG("could not launch another client thread\n");
+        tls_close(fd);
+        #ifdef MANAGMENT
+        release_client(job->lcfd.client);
+        #endif
+        free(job);
+        return;
+    }
+    pthread_detach(client);
+}
+
+/******************************************************************************
+Description.: read the requests of a connection as far as they arrived and
+              serve the complete ones, one after the other
+Input Value.: conn is the connection
+Return Value: -
+******************************************************************************/
+static void conn_read(connection *conn)
+{
+    ssize_t rc;
+
+    for(;;) {
+        /* the client may have sent further requests with the last one */
+        while(conn->state == C_REQUEST && (conn->head_end = http_parse(&conn->parser, conn->head, conn->head_len)) > 0)
+            conn_request(conn);
+        if(conn->state != C_REQUEST)
+            return;
+
+        if(conn->head_end < 0) {
+            send_error(conn->c.fd, 400, "Malformed HTTP request");
+            conn_close(conn);
+            return;
         }
-        pb += strlen("GET /?action=command"); // a pb points to thestring after the first & after command
 
-        /* only accept certain characters */
-        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./"), 0), 100);
+        if(conn->head_len == sizeof(conn->head) - 1) {
+            send_error(conn->c.fd, 400, "request too large");
+            conn_close(conn);
+            return;
+        }
 
-        req.parameter = malloc(len + 1);
-        if(req.parameter == NULL) {
-            exit(EXIT_FAILURE);
+        rc = tls_read(conn->c.fd, conn->head + conn->head_len, sizeof(conn->head) - 1 - conn->head_len);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if(rc <= 0) {
+            conn_close(conn);
+            return;
         }
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
 
-        if(unescape(req.parameter) == -1) {
-            free(req.parameter);
-            send_error(lcfd.fd, 500, "could not properly unescape command parameter string");
-            LOG("could not properly unescape command parameter string\n");
-            close(lcfd.fd);
-            return NULL;
+        conn->head_len += rc;
+        conn->head[conn->head_len] = '\0';
+    }
+}
+
+/******************************************************************************
+Description.: continue the TLS handshake of an HTTPS client, once it is done
+              the client sends its request
+Input Value.: conn is the connection
+Return Value: -
+******************************************************************************/
+static void conn_handshake(connection *conn)
+{
+    switch(tls_handshake(conn->c.fd)) {
+    case 0:
+        DBG("TLS handshake done, encrypted by %s\n", tls_offloaded(conn->c.fd) ? "the kernel" : "OpenSSL");
+        conn->state = C_REQUEST;
+        conn_want(conn, 0);
+        /* the request may have come with the end of the handshake */
+        conn_read(conn);
+        break;
+    case TLS_WANT_READ:
+        conn_want(conn, 0);
+        break;
+    case TLS_WANT_WRITE:
+        conn_want(conn, 1);
+        break;
+    default:
+        DBG("TLS handshake failed\n");
+        conn_close(conn);
+    }
+}
+
+/******************************************************************************
+Description.: handle the events epoll reported for a connection
+Input Value.: conn is the connection, events the epoll events
+Return Value: -
+******************************************************************************/
+static void conn_event(connection *conn, uint32_t events)
+{
+    char scratch[256];
+    ssize_t rc;
+
+    if(conn->state == C_CLOSED)
+        return;
+
+    if(conn->state == C_HANDSHAKE) {
+        conn_handshake(conn);
+        return;
+    }
+
+    if(conn->state == C_REQUEST) {
+        conn_read(conn);
+        return;
+    }
+
+    if(events & (EPOLLERR | EPOLLHUP)) {
+        conn_close(conn);
+        return;
+    }
+
+    /*
+     * clients which close the connection do not send anything while they get
+     * served, just drain it. The next request of a persistent connection
+     * is not read before the response is complete.
+     */
+    if(!conn->keepalive && (events & (EPOLLIN | EPOLLRDHUP))) {
+        if((rc = tls_read(conn->c.fd, scratch, sizeof(scratch))) == 0) {
+            /* half closed, keep sending until writing fails */
+            conn->eof = 1;
+            conn_want(conn, conn->state == C_SENDING);
+        } else if(rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            conn_close(conn);
+            return;
         }
+    }
 
-        DBG("command parameter (len: %d): \"%s\"\n", len, req.parameter);
-    } else {
-        int len;
+    if((events & EPOLLOUT) && conn->state == C_SENDING) {
+        conn_send(conn);
+        if(conn->state == C_REQUEST)
+            conn_read(conn);
+    }
+}
 
-        DBG("try to serve a file\n");
-        req.type = A_FILE;
+/******************************************************************************
+Description.: accept all pending clients of a server socket
+Input Value.: w is the event loop, sd the server socket
+Return Value: -
+******************************************************************************/
+static void worker_accept(worker *w, int sd)
+{
+    struct sockaddr_storage client_addr;
+    socklen_t addr_len;
+    char name[NI_MAXHOST], serv[NI_MAXSERV];
+    struct epoll_event ev;
+    struct timeval now;
+    connection *conn;
+    int fd, on;
+
+    for(;;) {
+        addr_len = sizeof(client_addr);
+        if((fd = accept4(sd, (struct sockaddr *)&client_addr, &addr_len, SOCK_NONBLOCK)) < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                DBG("accept failed: %s\n", strerror(errno));
+            }
+            return;
+        }
 
-        if((pb = strstr(buffer, "GET /")) == NULL) {
-            DBG("HTTP request seems to be malformed\n");
-            send_error(lcfd.fd, 400, "Malformed HTTP request");
-            close(lcfd.fd);
-            return NULL;
+        if((conn = calloc(1, sizeof(connection))) == NULL) {
+            fprintf(stderr, "failed to allocate memory for a client\n");
+            close(fd);
+            continue;
         }
 
-        pb += strlen("GET /");
-        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890"), 0), 100);
-        req.parameter = malloc(len + 1);
-        if(req.parameter == NULL) {
-            exit(EXIT_FAILURE);
+        /*
+         * every part of a stream is handed over with a single writev(), so
+         * there is nothing left to merge. Without Nagle the last segment of a
+         * frame does not wait for the acknowledgement of the previous one.
+         */
+        on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        /* HTTPS clients send their request after the handshake */
+        if(w->pc->tls != NULL && tls_accept(w->pc->tls, fd) != 0) {
+            fprintf(stderr, "could not start a TLS session\n");
+            close(fd);
+            free(conn);
+            continue;
+        }
+
+        conn->c.pc = w->pc;
+        conn->c.fd = fd;
+        conn->w = w;
+        conn->state = (w->pc->tls != NULL) ? C_HANDSHAKE : C_REQUEST;
+        http_parser_init(&conn->parser);
+        frame_clock(&now);
+        conn->since = now.tv_sec;
+        strcpy(conn->c.address, "unknown");
+        strcpy(name, "unknown");
+
+        if(getnameinfo((struct sockaddr *)&client_addr, addr_len, name, sizeof(name), serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+            snprintf(conn->c.address, sizeof(conn->c.address), (strchr(name, ':') != NULL) ? "[%s]:%s" : "%s:%s", name, serv);
+            syslog(LOG_INFO, "serving client: %s\n", name);
+            DBG("serving client: %s\n", name);
+        }
+
+        conn->peer = peer_get(w->pc, name);
+        #if defined(MANAGMENT)
+        conn->c.client = add_client(name);
+        #endif
+
+        conn->events = EPOLLIN | EPOLLRDHUP;
+        ev.events = conn->events;
+        ev.data.ptr = conn;
+        if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            tls_close(fd);
+            peer_put(w->pc, conn->peer);
+            #ifdef MANAGMENT
+            release_client(conn->c.client);
+            #endif
+            free(conn);
+            continue;
         }
 
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
+        conn->next = w->connections;
+        if(conn->next != NULL)
+            conn->next->prev = conn;
+        w->connections = conn;
+    }
+}
+
+/******************************************************************************
+Description.: prepare an event loop, it waits for clients on all server
+              sockets and for the inputs to publish frames
+Input Value.: pc is the server context, w the event loop
+Return Value: 0 if everything is OK, -1 otherwise
+******************************************************************************/
+static int worker_init(context *pc, worker *w)
+{
+    struct epoll_event ev;
+    int i;
+
+    w->pc = pc;
+    w->connections = NULL;
+    w->closed = NULL;
+    w->listening = NULL;
+    w->listening_len = 0;
+
+    timerclear(&w->armed);
+
+    if((w->epfd = epoll_create1(0)) < 0 || (w->event = eventfd(0, EFD_NONBLOCK)) < 0 ||
+       (w->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+        perror("could not create event loop");
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &w->event;
+    if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->event, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
 
-        if (strstr(pb, ".cgi") != NULL) {
-            req.type = A_CGI;
-            pb = strchr(pb, '?');
-            if (pb != NULL) {
-                pb++; // skip the ?
-                len = strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890=&");
-                req.query_string = malloc(len + 1);
-                if (req.query_string == NULL)
-                    exit(EXIT_FAILURE);
-                strncpy(req.query_string, pb, len);
-            } else {
-                req.query_string = malloc(2);
-                if (req.query_string == NULL)
-                    exit(EXIT_FAILURE);
-                sprintf(req.query_string, " ");
-            }
-        }
-        DBG("parameter (len: %d): \"%s\"\n", len, req.parameter);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &w->timer;
+    if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->timer, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
     }
 
-    /*
-     * Since when we are working with multiple input plugins
-     * there are some url which could have a _[plugin number suffix]
-     * For compatibility reasons it could be left in that case the output will be
-     * generated from the 0. input plugin
-     */
-    if(query_suffixed) {
-        char *sch = strchr(buffer, '_');
-        if(sch != NULL) {  // there is an _ in the url so the input number should be present
-            DBG("Suffix character: %s\n", sch + 1); // FIXME if more than 10 input plugin is added
-            char numStr[3];
-            memset(numStr, 0, 3);
-            strncpy(numStr, sch + 1, 1);
-            input_number = atoi(numStr);
-
-            if ((req.type == A_SNAPSHOT_WXP) || (req.type == A_STREAM_WXP)) { // webcamxp adds offset to the camera number
-                input_number--;
-            }
+    /* every loop accepts clients, the kernel wakes only one of them */
+    for(i = 0; i < pc->sd_len; i++) {
+        ev.events = EPOLLIN;
+        #ifdef EPOLLEXCLUSIVE
+        ev.events |= EPOLLEXCLUSIVE;
+        #endif
+        ev.data.ptr = &pc->sd[i];
+        if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, pc->sd[i], &ev) < 0) {
+            perror("epoll_ctl");
+            return -1;
         }
-        DBG("plugin_no: %d\n", input_number);
     }
 
-    /*
-     * parse the rest of the HTTP-request
-     * the end of the request-header is marked by a single, empty line with "\r\n"
-     */
-    do {
-        memset(buffer, 0, sizeof(buffer));
+    return 0;
+}
 
-        if((cnt = _readline(lcfd.fd, &iobuf, buffer, sizeof(buffer) - 1, 5)) == -1) {
-            free_request(&req);
-            close(lcfd.fd);
-            return NULL;
-        }
+/******************************************************************************
+Description.: free the connections closed while handling the last events
+Input Value.: w is the event loop
+Return Value: -
+******************************************************************************/
+static void worker_reap(worker *w)
+{
+    connection *conn;
 
-        if(strcasestr(buffer, "User-Agent: ") != NULL) {
-            req.client = strdup(buffer + strlen("User-Agent: "));
-        } else if(strcasestr(buffer, "Authorization: Basic ") != NULL) {
-            req.credentials = strdup(buffer + strlen("Authorization: Basic "));
-            decodeBase64(req.credentials);
-            DBG("username:password: %s\n", req.credentials);
-        }
+    while((conn = w->closed) != NULL) {
+        w->closed = conn->next;
+        free(conn);
+    }
+}
 
-    } while(cnt > 2 && !(buffer[0] == '\r' && buffer[1] == '\n'));
+/******************************************************************************
+Description.: cleanup handler of an event loop, it closes all its clients
+Input Value.: arg is the event loop
+Return Value: -
+******************************************************************************/
+static void worker_cleanup(void *arg)
+{
+    worker *w = arg;
 
-    /* check for username and password if parameter -c was given */
-    if(lcfd.pc->conf.credentials != NULL) {
-        if(req.credentials == NULL || strcmp(lcfd.pc->conf.credentials, req.credentials) != 0) {
-            DBG("access denied\n");
-            send_error(lcfd.fd, 401, "username and password do not match to configuration");
-            close(lcfd.fd);
-            free_request(&req);
-            return NULL;
-        }
-        DBG("access granted\n");
-    }
+    while(w->connections != NULL)
+        conn_close(w->connections);
+    worker_reap(w);
 
-    /* now it's time to answer */
-    if (query_suffixed) {
-        if (req.type == A_OUTPUT_JSON) {
-            if(!(input_number < pglobal->outcnt)) {
-                DBG("Output number: %d out of range (valid: 0..%d)\n", input_number, pglobal->outcnt-1);
-                send_error(lcfd.fd, 404, "Invalid output plugin number");
-                req.type = A_UNKNOWN;
-            }
-        } else {
-            if(!(input_number < pglobal->incnt)) {
-                DBG("Input number: %d out of range (valid: 0..%d)\n", input_number, pglobal->incnt-1);
-                send_error(lcfd.fd, 404, "Invalid input plugin number");
-                req.type = A_UNKNOWN;
-            }
-        }
-    }
+    /*
+     * the eventfd stays open, an input which is just publishing may still
+     * write to it after the last frame_unlisten()
+     */
+    close(w->epfd);
+    close(w->timer);
+    free(w->listening);
+    w->listening = NULL;
+    w->listening_len = 0;
+}
 
-    switch(req.type) {
-    case A_SNAPSHOT_WXP:
-    case A_SNAPSHOT:
-        DBG("Request for snapshot from input: %d\n", input_number);
-        send_snapshot(&lcfd, input_number);
-        break;
-    case A_STREAM:
-        DBG("Request for stream from input: %d\n", input_number);
-        send_stream(&lcfd, input_number);
-        break;
-    #ifdef WXP_COMPAT
-    case A_STREAM_WXP:
-        DBG("Request for WXP compat stream from input: %d\n", input_number);
-        send_stream_wxp(&lcfd, input_number);
-        break;
-    #endif
-    case A_COMMAND:
-        if(lcfd.pc->conf.nocommands) {
-            send_error(lcfd.fd, 501, "this server is configured to not accept commands");
-            break;
+/******************************************************************************
+Description.: run an event loop. It accepts clients, reads their requests and
+              serves snapshots and streams. Other requests are handed over to
+              a thread of their own.
+              The loop only gets cancelled while it waits for events, so the
+              connections are always consistent when it gets cleaned up.
+Input Value.: arg is the event loop
+Return Value: always NULL, will only return on exit
+******************************************************************************/
+static void *worker_thread(void *arg)
+{
+    worker *w = arg;
+    struct epoll_event events[WORKER_EVENTS];
+    struct timeval now;
+    connection *conn, *next;
+    uint64_t signalled;
+    int n, i;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_cleanup_push(worker_cleanup, w);
+
+    for(;;) {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        n = epoll_wait(w->epfd, events, WORKER_EVENTS, 1000);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if(n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
         }
-        command(lcfd.pc->id, lcfd.fd, req.parameter);
-        break;
-    case A_INPUT_JSON:
-        DBG("Request for the Input plugin descriptor JSON file\n");
-        send_input_JSON(lcfd.fd, input_number);
-        break;
-    case A_OUTPUT_JSON:
-        DBG("Request for the Output plugin descriptor JSON file\n");
-        send_output_JSON(lcfd.fd, input_number);
-        break;
-    case A_PROGRAM_JSON:
-        DBG("Request for the program descriptor JSON file\n");
-        send_program_JSON(lcfd.fd);
-        break;
-    #ifdef MANAGMENT
-    case A_CLIENTS_JSON:
-        DBG("Request for the clients JSON file\n");
-        send_clients_JSON(lcfd.fd);
-        break;
-    #endif
-    case A_FILE:
-        if(lcfd.pc->conf.www_folder == NULL)
-            send_error(lcfd.fd, 501, "no www-folder configured");
-        else
-            send_file(lcfd.pc->id, lcfd.fd, req.parameter);
-        break;
-    /*
-        With the take argument we try to save the current image to file before we transmit it to the user.
-        This is done trough the output_file plugin.
-        If it not loaded, or the file could not be saved then we won't transmit the frame.
-    */
-    case A_TAKE: {
-        int i, ret = 0, found = 0;
-        for (i = 0; i<pglobal->outcnt; i++) {
-            if (pglobal->out[i].name != NULL) {
-                if (strstr(pglobal->out[i].name, "FILE output plugin")) {
-                    found = 255;
-                    DBG("output_file found id: %d\n", i);
-                    char *filename = NULL;
-                    char *filenamearg = NULL;
-                    int len = 0;
-                    DBG("Buffer: %s \n", req.parameter);
-                    if((filename = strstr(req.parameter, "filename=")) != NULL) {
-                        filename += strlen("filename=");
-                        char *fn = strchr(filename, '&');
-                        if (fn == NULL)
-                            len = strlen(filename);
-                        else
-                            len = (int)(fn - filename);
-                        filenamearg = (char*)calloc(len, sizeof(char));
-                        memcpy(filenamearg, filename, len);
-                        DBG("Filename = %s\n", filenamearg);
-                        //int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int value, char *valueStr)
-                        ret = pglobal->out[i].cmd(i, OUT_FILE_CMD_TAKE, IN_CMD_GENERIC, 0, filenamearg);
+
+        for(i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if(ptr == &w->event) {
+                /* an input published a frame, serve everybody waiting for one */
+                if(read(w->event, &signalled, sizeof(signalled)) < 0 && errno != EAGAIN) {
+                    DBG("could not read eventfd\n");
+                }
+                for(conn = w->connections; conn != NULL; conn = next) {
+                    next = conn->next;
+                    if(conn->state == C_WAITING) {
+                        conn_send(conn);
+                        if(conn->state == C_REQUEST)
+                            conn_read(conn);
+                    }
+                }
+            } else if(ptr == &w->timer) {
+                /* serve the paced streams which are due, the others arm the timer again */
+                if(read(w->timer, &signalled, sizeof(signalled)) < 0 && errno != EAGAIN) {
+                    DBG("could not read timerfd\n");
+                }
+                timerclear(&w->armed);
+                frame_clock(&now);
+                for(conn = w->connections; conn != NULL; conn = next) {
+                    next = conn->next;
+                    if(conn->state != C_PACED)
+                        continue;
+                    if(timercmp(&now, &conn->due, <)) {
+                        worker_timer(w, &conn->due);
                     } else {
-                        DBG("filename is not specified int the URL\n");
-                        send_error(lcfd.fd, 404, "The &filename= must present for the take command in the URL");
+                        conn->state = C_SENDING;
+                        conn_send(conn);
                     }
-                    break;
                 }
+            } else if(ptr >= (void *)w->pc->sd && ptr < (void *)(w->pc->sd + w->pc->sd_len)) {
+                worker_accept(w, *(int *)ptr);
+            } else {
+                conn_event(ptr, events[i].events);
             }
         }
 
-        if (found == 0) {
-            LOG("FILE CHANGE TEST output plugin not loaded\n");
-            send_error(lcfd.fd, 404, "FILE output plugin not loaded, taking snapshot not possible");
-        } else {
-            if (ret == 0) {
-                send_snapshot(&lcfd, input_number);
-            } else {
-                send_error(lcfd.fd, 404, "Taking snapshot failed!");
+        /*
+         * drop clients which do not finish the handshake or send their
+         * request in time, and persistent connections which were idle for
+         * too long. Long polls which did not see a newer frame get their
+         * answer.
+         */
+        frame_clock(&now);
+        for(conn = w->connections; conn != NULL; conn = next) {
+            next = conn->next;
+            if(conn->state == C_WAITING && conn->deadline != 0 && now.tv_sec >= conn->deadline) {
+                conn_not_modified(conn);
+                if(conn->state == C_REQUEST)
+                    conn_read(conn);
+            } else if(conn->state == C_REQUEST &&
+                      now.tv_sec - conn->since > ((conn->requests > 0 && conn->head_len == 0) ? w->pc->conf.keepalive : REQUEST_TIMEOUT)) {
+                conn_close(conn);
+            } else if(conn->state == C_HANDSHAKE && now.tv_sec - conn->since > REQUEST_TIMEOUT) {
+                conn_close(conn);
             }
         }
-        } break;
-    case A_CGI:
-        DBG("cgi script: %s requested\n", req.parameter);
-        execute_cgi(lcfd.pc->id, lcfd.fd, req.parameter, req.query_string);
-        break;
-    default:
-        DBG("unknown request\n");
+
+        worker_reap(w);
     }
 
-    close(lcfd.fd);
-    free_request(&req);
+    pthread_cleanup_pop(1);
 
-    DBG("leaving HTTP client thread\n");
     return NULL;
 }
 
 /******************************************************************************
 Description.: This function cleans up resources allocated by the server_thread
-Input Value.: arg is not used
+Input Value.: arg is the context of the server
 Return Value: -
 ******************************************************************************/
 void server_cleanup(void *arg)
@@ -1429,32 +3793,48 @@ void server_cleanup(void *arg)
 
     OPRINT("cleaning up resources allocated by server thread #%02d\n", pcontext->id);
 
+    /* the first event loop ran in this thread and is cleaned up already */
+    for(i = 1; i < pcontext->workers_started; i++)
+        pthread_cancel(pcontext->workers[i].thread);
+    for(i = 1; i < pcontext->workers_started; i++)
+        pthread_join(pcontext->workers[i].thread, NULL);
+    pcontext->workers_started = 0;
+    encoder_stop(pcontext);
+    www_free(pcontext);
+    peer_free(pcontext);
+    tls_context_free(pcontext->tls);
+    pcontext->tls = NULL;
+
     for(i = 0; i < MAX_SD_LEN; i++)
         close(pcontext->sd[i]);
 }
 
 /******************************************************************************
-Description.: Open a TCP socket and wait for clients to connect. If clients
-              connect, start a new thread for each accepted connection.
+Description.: Open a TCP socket and serve the clients which connect with a
+              fixed pool of event loops, one per CPU core. This thread runs
+              the first of them.
 Input Value.: arg is a pointer to the globals struct
 Return Value: always NULL, will only return on exit
 ******************************************************************************/
 void *server_thread(void *arg)
 {
     int on;
-    pthread_t client;
     struct addrinfo *aip, *aip2;
     struct addrinfo hints;
-    struct sockaddr_storage client_addr;
-    socklen_t addr_len = sizeof(struct sockaddr_storage);
-    fd_set selectfds;
-    int max_fds = 0;
     char name[NI_MAXHOST];
     int err;
     int i;
 
     context *pcontext = arg;
     pglobal = pcontext->pglobal;
+    pcontext->workers_started = 0;
+    pcontext->encoders_started = 0;
+    pcontext->encoders = NULL;
+    pcontext->jobs = pcontext->jobs_last = NULL;
+
+    /* serve the www folder from memory, server_cleanup() frees it */
+    www_load(pcontext);
+    peer_init(pcontext);
 
     /* set cleanup handler to cleanup resources */
     pthread_cleanup_push(server_cleanup, pcontext);
@@ -1474,13 +3854,7 @@ void *server_thread(void *arg)
         pcontext->sd[i] = -1;
 
     #ifdef MANAGMENT
-    if (pthread_mutex_init(&client_infos.mutex, NULL)) {
-        perror("Mutex initialization failed");
-        exit(EXIT_FAILURE);
-    }
-
-    client_infos.client_count = 0;
-    client_infos.infos = NULL;
+    pthread_once(&client_infos_once, client_infos_init);
     #endif
 
     /* open sockets for server (1 socket / address family) */
@@ -1533,66 +3907,38 @@ void *server_thread(void *arg)
         exit(EXIT_FAILURE);
     }
 
-    /* create a child for every client that connects */
-    while(!pglobal->stop) {
-        //int *pfd = (int *)malloc(sizeof(int));
-        cfd *pcfd = malloc(sizeof(cfd));
-
-        if(pcfd == NULL) {
-            fprintf(stderr, "failed to allocate (a very small amount of) memory\n");
-            exit(EXIT_FAILURE);
-        }
-
-        DBG("waiting for clients to connect\n");
-
-        do {
-            FD_ZERO(&selectfds);
-
-            for(i = 0; i < MAX_SD_LEN; i++) {
-                if(pcontext->sd[i] != -1) {
-                    FD_SET(pcontext->sd[i], &selectfds);
-
-                    if(pcontext->sd[i] > max_fds)
-                        max_fds = pcontext->sd[i];
-                }
-            }
-
-            err = select(max_fds + 1, &selectfds, NULL, NULL, NULL);
+    /* the event loops accept clients without blocking */
+    for(i = 0; i < pcontext->sd_len; i++)
+        fcntl(pcontext->sd[i], F_SETFL, fcntl(pcontext->sd[i], F_GETFL) | O_NONBLOCK);
 
-            if(err < 0 && errno != EINTR) {
-                perror("select");
-                exit(EXIT_FAILURE);
-            }
-        } while(err <= 0);
-
-        for(i = 0; i < max_fds + 1; i++) {
-            if(pcontext->sd[i] != -1 && FD_ISSET(pcontext->sd[i], &selectfds)) {
-                pcfd->fd = accept(pcontext->sd[i], (struct sockaddr *)&client_addr, &addr_len);
-                pcfd->pc = pcontext;
-
-                /* start new thread that will handle this TCP connected client */
-                DBG("create thread to handle client that just established a connection\n");
+    /* one event loop per CPU core serves all snapshot and stream clients */
+    if((pcontext->worker_count = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        pcontext->worker_count = 1;
+    if((pcontext->workers = calloc(pcontext->worker_count, sizeof(worker))) == NULL) {
+        fprintf(stderr, "could not allocate memory for the event loops\n");
+        exit(EXIT_FAILURE);
+    }
 
-                if(getnameinfo((struct sockaddr *)&client_addr, addr_len, name, sizeof(name), NULL, 0, NI_NUMERICHOST) == 0) {
-                    syslog(LOG_INFO, "serving client: %s\n", name);
-                    DBG("serving client: %s\n", name);
-                }
+    for(i = 0; i < pcontext->worker_count; i++) {
+        if(worker_init(pcontext, &pcontext->workers[i]) != 0)
+            exit(EXIT_FAILURE);
+    }
 
-                #if defined(MANAGMENT)
-                pcfd->client = add_client(name);
-                #endif
+    /* libjpeg runs in threads of its own, the event loops never wait for it */
+    encoder_start(pcontext);
 
-                if(pthread_create(&client, NULL, &client_thread, pcfd) != 0) {
-                    DBG("could not launch another client thread\n");
-                    close(pcfd->fd);
-                    free(pcfd);
-                    continue;
-                }
-                pthread_detach(client);
-            }
+    DBG("starting %d event loops\n", pcontext->worker_count);
+    for(pcontext->workers_started = 1; pcontext->workers_started < pcontext->worker_count; pcontext->workers_started++) {
+        worker *w = &pcontext->workers[pcontext->workers_started];
+        if(pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+            DBG("could not launch another event loop\n");
+            close(w->epfd);
+            break;
         }
     }
 
+    worker_thread(&pcontext->workers[0]);
+
     DBG("leaving server thread, calling cleanup function now\n");
     pthread_cleanup_pop(1);
 
@@ -1600,45 +3946,41 @@ void *server_thread(void *arg)
 }
 
 /******************************************************************************
-Description.: Send a JSON file which is contains information about the input plugin's
+Description.: Format a JSON file which is contains information about the input plugin's
               acceptable parameters
-Input Value.: fildescriptor fd to send the answer to
+Input Value.: r gets the JSON, input_number is the input plugin
 Return Value: -
 ******************************************************************************/
-void send_input_JSON(int fd, int input_number)
+void format_input_JSON(reply_buffer *r, int input_number)
 {
-    char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
     int i;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
 
     DBG("Serving the input plugin %d descriptor JSON file\n", input_number);
 
 
-    sprintf(buffer + strlen(buffer),
-            "{\n"
-            "\"controls\": [\n");
-    if(pglobal->in[input_number].in_parameters != NULL) {
-        for(i = 0; i < pglobal->in[input_number].parametercount; i++) {
+    reply_printf(r,
+                 "{\n"
+                 "\"controls\": [\n");
+    if(pglobal->in[input_number]->in_parameters != NULL) {
+        for(i = 0; i < pglobal->in[input_number]->parametercount; i++) {
 
             char *menuString = NULL;
-            if(pglobal->in[input_number].in_parameters[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
-                if(pglobal->in[input_number].in_parameters[i].menuitems != NULL) {
+            if(pglobal->in[input_number]->in_parameters[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
+                if(pglobal->in[input_number]->in_parameters[i].menuitems != NULL) {
                     int j, k = 1;
-                    for(j = pglobal->in[input_number].in_parameters[i].ctrl.minimum; j <= pglobal->in[input_number].in_parameters[i].ctrl.maximum; j++) {
+                    for(j = pglobal->in[input_number]->in_parameters[i].ctrl.minimum; j <= pglobal->in[input_number]->in_parameters[i].ctrl.maximum; j++) {
                         char *tempName = NULL; // temporary storage for name sanity checking
 
                         int prevSize = 0;
-                        int itemLength = strlen((char*)&pglobal->in[input_number].in_parameters[i].menuitems[j].name);
+                        int itemLength = strlen((char*)&pglobal->in[input_number]->in_parameters[i].menuitems[j].name);
                         tempName = (char*)calloc(itemLength + 1, sizeof(char));  // allocate space for the sanity checking
                         if (tempName == NULL) {
                             DBG("Realloc/calloc failed: %s\n", strerror(errno));
+                            r->failed = 1;
                             return;
                         }
 
-                        check_JSON_string((char*)&pglobal->in[input_number].in_parameters[i].menuitems[j].name, tempName); // sanity check the string after non printable characters
+                        check_JSON_string((char*)&pglobal->in[input_number]->in_parameters[i].menuitems[j].name, tempName); // sanity check the string after non printable characters
 
                         itemLength += strlen("\"\": \"\"");
 
@@ -1650,11 +3992,12 @@ void send_input_JSON(int fd, int input_number)
 
                         if (menuString == NULL) {
                             DBG("Realloc/calloc failed: %s\n", strerror(errno));
+                            r->failed = 1;
                             return;
                         }
                         prevSize = strlen(menuString);
 
-                        if(j != pglobal->in[input_number].in_parameters[i].ctrl.maximum) {
+                        if(j != pglobal->in[input_number]->in_parameters[i].ctrl.maximum) {
                             sprintf(menuString + prevSize, "\"%d\": \"%s\", ", j , tempName);
                         } else {
                             sprintf(menuString + prevSize, "\"%d\": \"%s\"", j , tempName);
@@ -1665,77 +4008,77 @@ void send_input_JSON(int fd, int input_number)
                 }
             }
 
-            sprintf(buffer + strlen(buffer),
-                    "{\n"
-                    "\"name\": \"%s\",\n"
-                    "\"id\": \"%d\",\n"
-                    "\"type\": \"%d\",\n"
-                    "\"min\": \"%d\",\n"
-                    "\"max\": \"%d\",\n"
-                    "\"step\": \"%d\",\n"
-                    "\"default\": \"%d\",\n"
-                    "\"value\": \"%d\",\n"
-                    "\"dest\": \"0\",\n"
-                    "\"flags\": \"%d\",\n"
-                    "\"group\": \"%d\"",
-                    pglobal->in[input_number].in_parameters[i].ctrl.name,
-                    pglobal->in[input_number].in_parameters[i].ctrl.id,
-                    pglobal->in[input_number].in_parameters[i].ctrl.type,
-                    pglobal->in[input_number].in_parameters[i].ctrl.minimum,
-                    pglobal->in[input_number].in_parameters[i].ctrl.maximum,
-                    pglobal->in[input_number].in_parameters[i].ctrl.step,
-                    pglobal->in[input_number].in_parameters[i].ctrl.default_value,
-                    pglobal->in[input_number].in_parameters[i].value,
-                    // 0 is the code of the input plugin
-                    pglobal->in[input_number].in_parameters[i].ctrl.flags,
-                    pglobal->in[input_number].in_parameters[i].group
-                   );
+            reply_printf(r,
+                         "{\n"
+                         "\"name\": \"%s\",\n"
+                         "\"id\": \"%d\",\n"
+                         "\"type\": \"%d\",\n"
+                         "\"min\": \"%d\",\n"
+                         "\"max\": \"%d\",\n"
+                         "\"step\": \"%d\",\n"
+                         "\"default\": \"%d\",\n"
+                         "\"value\": \"%d\",\n"
+                         "\"dest\": \"0\",\n"
+                         "\"flags\": \"%d\",\n"
+                         "\"group\": \"%d\"",
+                         pglobal->in[input_number]->in_parameters[i].ctrl.name,
+                         pglobal->in[input_number]->in_parameters[i].ctrl.id,
+                         pglobal->in[input_number]->in_parameters[i].ctrl.type,
+                         pglobal->in[input_number]->in_parameters[i].ctrl.minimum,
+                         pglobal->in[input_number]->in_parameters[i].ctrl.maximum,
+                         pglobal->in[input_number]->in_parameters[i].ctrl.step,
+                         pglobal->in[input_number]->in_parameters[i].ctrl.default_value,
+                         pglobal->in[input_number]->in_parameters[i].value,
+                         // 0 is the code of the input plugin
+                         pglobal->in[input_number]->in_parameters[i].ctrl.flags,
+                         pglobal->in[input_number]->in_parameters[i].group
+                        );
 
             // append the menu object to the menu typecontrols
-            if(pglobal->in[input_number].in_parameters[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
-                sprintf(buffer + strlen(buffer),
-                        ",\n"
-                        "\"menu\": {%s}\n"
-                        "}",
-                        menuString);
+            if(pglobal->in[input_number]->in_parameters[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
+                reply_printf(r,
+                             ",\n"
+                             "\"menu\": {%s}\n"
+                             "}",
+                             menuString);
             } else {
-                sprintf(buffer + strlen(buffer),
-                        "\n"
-                        "}");
+                reply_printf(r,
+                             "\n"
+                             "}");
             }
 
-            if(i != (pglobal->in[input_number].parametercount - 1)) {
-                sprintf(buffer + strlen(buffer), ",\n");
+            if(i != (pglobal->in[input_number]->parametercount - 1)) {
+                reply_printf(r, ",\n");
             }
             free(menuString);
         }
     } else {
         DBG("The input plugin has no paramters\n");
     }
-    sprintf(buffer + strlen(buffer),
-            "\n],\n"
-            /*"},\n"*/);
-
-    sprintf(buffer + strlen(buffer),
-            //"{\n"
-            "\"formats\": [\n");
-    if(pglobal->in[input_number].in_formats != NULL) {
-        for(i = 0; i < pglobal->in[input_number].formatCount; i++) {
+    reply_printf(r,
+                 "\n],\n"
+                 /*"},\n"*/);
+
+    reply_printf(r,
+                 //"{\n"
+                 "\"formats\": [\n");
+    if(pglobal->in[input_number]->in_formats != NULL) {
+        for(i = 0; i < pglobal->in[input_number]->formatCount; i++) {
             char *resolutionsString = NULL;
             int resolutionsStringLength = 0;
             int j = 0;
-            for(j = 0; j < pglobal->in[input_number].in_formats[i].resolutionCount; j++) {
+            for(j = 0; j < pglobal->in[input_number]->in_formats[i].resolutionCount; j++) {
                 char buffer_num[6];
                 memset(buffer_num, '\0', 6);
                 // JSON format example:
                 // {"0": "320x240", "1": "640x480", "2": "960x720"}
                 sprintf(buffer_num, "%d", j);
                 resolutionsStringLength += strlen(buffer_num);
-                sprintf(buffer_num, "%d", pglobal->in[input_number].in_formats[i].supportedResolutions[j].width);
+                sprintf(buffer_num, "%d", pglobal->in[input_number]->in_formats[i].supportedResolutions[j].width);
                 resolutionsStringLength += strlen(buffer_num);
-                sprintf(buffer_num, "%d", pglobal->in[input_number].in_formats[i].supportedResolutions[j].height);
+                sprintf(buffer_num, "%d", pglobal->in[input_number]->in_formats[i].supportedResolutions[j].height);
                 resolutionsStringLength += strlen(buffer_num);
-                if(j != (pglobal->in[input_number].in_formats[i].resolutionCount - 1)) {
+                if(j != (pglobal->in[input_number]->in_formats[i].resolutionCount - 1)) {
                     resolutionsStringLength += (strlen("\"\": \"x\", ") + 5);
                     if (resolutionsString == NULL)
                         resolutionsString = calloc(resolutionsStringLength, sizeof(char*));
@@ -1743,14 +4086,15 @@ void send_input_JSON(int fd, int input_number)
                         resolutionsString = realloc(resolutionsString, resolutionsStringLength * sizeof(char*));
                     if (resolutionsString == NULL) {
                         DBG("Realloc/calloc failed\n");
+                        r->failed = 1;
                         return;
                     }
 
                     sprintf(resolutionsString + strlen(resolutionsString),
                             "\"%d\": \"%dx%d\", ",
                             j,
-                            pglobal->in[input_number].in_formats[i].supportedResolutions[j].width,
-                            pglobal->in[input_number].in_formats[i].supportedResolutions[j].height);
+                            pglobal->in[input_number]->in_formats[i].supportedResolutions[j].width,
+                            pglobal->in[input_number]->in_formats[i].supportedResolutions[j].height);
                 } else {
                     resolutionsStringLength += (strlen("\"\": \"x\"")+5);
                     if (resolutionsString == NULL)
@@ -1759,77 +4103,68 @@ void send_input_JSON(int fd, int input_number)
                         resolutionsString = realloc(resolutionsString, resolutionsStringLength * sizeof(char*));
                     if (resolutionsString == NULL) {
                         DBG("Realloc/calloc failed\n");
+                        r->failed = 1;
                         return;
                     }
                     sprintf(resolutionsString + strlen(resolutionsString),
                             "\"%d\": \"%dx%d\"",
                             j,
-                            pglobal->in[input_number].in_formats[i].supportedResolutions[j].width,
-                            pglobal->in[input_number].in_formats[i].supportedResolutions[j].height);
+                            pglobal->in[input_number]->in_formats[i].supportedResolutions[j].width,
+                            pglobal->in[input_number]->in_formats[i].supportedResolutions[j].height);
                 }
             }
 
-            sprintf(buffer + strlen(buffer),
-                    "{\n"
-                    "\"id\": \"%d\",\n"
-                    "\"name\": \"%s\",\n"
+            reply_printf(r,
+                         "{\n"
+                         "\"id\": \"%d\",\n"
+                         "\"name\": \"%s\",\n"
 #ifdef V4L2_FMT_FLAG_COMPRESSED
-                    "\"compressed\": \"%s\",\n"
+                         "\"compressed\": \"%s\",\n"
 #endif
 #ifdef V4L2_FMT_FLAG_EMULATED
-                    "\"emulated\": \"%s\",\n"
+                         "\"emulated\": \"%s\",\n"
 #endif
-                    "\"current\": \"%s\",\n"
-                    "\"resolutions\": {%s}\n"
-                    ,
-                    pglobal->in[input_number].in_formats[i].format.index,
-                    pglobal->in[input_number].in_formats[i].format.description,
+                         "\"current\": \"%s\",\n"
+                         "\"resolutions\": {%s}\n"
+                         ,
+                         pglobal->in[input_number]->in_formats[i].format.index,
+                         pglobal->in[input_number]->in_formats[i].format.description,
 #ifdef V4L2_FMT_FLAG_COMPRESSED
-                    pglobal->in[input_number].in_formats[i].format.flags & V4L2_FMT_FLAG_COMPRESSED ? "true" : "false",
+                         pglobal->in[input_number]->in_formats[i].format.flags & V4L2_FMT_FLAG_COMPRESSED ? "true" : "false",
 #endif
 #ifdef V4L2_FMT_FLAG_EMULATED
-                    pglobal->in[input_number].in_formats[i].format.flags & V4L2_FMT_FLAG_EMULATED ? "true" : "false",
+                         pglobal->in[input_number]->in_formats[i].format.flags & V4L2_FMT_FLAG_EMULATED ? "true" : "false",
 #endif
-                    pglobal->in[input_number].in_formats[i].currentResolution != -1 ? "true" : "false",
-                    resolutionsString
-                   );
-
-            if(pglobal->in[input_number].in_formats[i].currentResolution != -1) {
-                sprintf(buffer + strlen(buffer),
-                        ",\n\"currentResolution\": \"%d\"\n",
-                        pglobal->in[input_number].in_formats[i].currentResolution
-                       );
+                         pglobal->in[input_number]->in_formats[i].currentResolution != -1 ? "true" : "false",
+                         resolutionsString
+                        );
+
+            if(pglobal->in[input_number]->in_formats[i].currentResolution != -1) {
+                reply_printf(r,
+                             ",\n\"currentResolution\": \"%d\"\n",
+                             pglobal->in[input_number]->in_formats[i].currentResolution
+                            );
             }
 
-            if(i != (pglobal->in[input_number].formatCount - 1)) {
-                sprintf(buffer + strlen(buffer), "},\n");
+            if(i != (pglobal->in[input_number]->formatCount - 1)) {
+                reply_printf(r, "},\n");
             } else {
-                sprintf(buffer + strlen(buffer), "}\n");
+                reply_printf(r, "}\n");
             }
 
             free(resolutionsString);
         }
     }
-    sprintf(buffer + strlen(buffer),
-            "\n]\n"
-            "}\n");
-    i = strlen(buffer);
-
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
-        DBG("unable to serve the control JSON file\n");
-    }
+    reply_printf(r,
+                 "\n]\n"
+                 "}\n");
 }
 
 
-void send_program_JSON(int fd)
+void format_program_JSON(reply_buffer *r)
 {
-    char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
-    int i, k;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
+    char buffer[BUFFER_SIZE*16] = {0};
+    int k, n;
 
     DBG("Serving the program descriptor JSON file\n");
 
@@ -1839,23 +4174,28 @@ void send_program_JSON(int fd)
             /*"\"program\": [\n"
             "{\n"*/
             "\"inputs\":[\n");
-    for(k = 0; k < pglobal->incnt; k++) {
-        sprintf(buffer + strlen(buffer),
-                "{\n"
+
+    /* there can be any number of plugins, so each one is sent on its own */
+    for(k = 0, n = 0; k < pglobal->incnt; k++) {
+        /* skip the slots of removed plugins */
+        if(!INPUT_VALID(pglobal, k))
+            continue;
+        snprintf(buffer + strlen(buffer), sizeof(buffer) - strlen(buffer),
+                "%s{\n"
                 "\"id\": \"%d\",\n"
                 "\"name\": \"%s\",\n"
                 "\"plugin\": \"%s\",\n"
                 "\"args\": \"%s\"\n"
                 "}",
-                pglobal->in[k].param.id,
-                pglobal->in[k].name,
-                pglobal->in[k].plugin,
-                pglobal->in[k].param.parameters);
-        if(k != (pglobal->incnt - 1))
-            sprintf(buffer + strlen(buffer), ", \n");
-        else
-            sprintf(buffer + strlen(buffer), "\n");
+                (n++ > 0) ? ", \n" : "",
+                pglobal->in[k]->param.id,
+                pglobal->in[k]->name,
+                pglobal->in[k]->plugin,
+                pglobal->in[k]->param.parameters);
+        reply_append(r, buffer, strlen(buffer));
+        buffer[0] = '\0';
     }
+    sprintf(buffer + strlen(buffer), "\n");
     sprintf(buffer + strlen(buffer),
             /*"]\n"
             "}\n"
@@ -1863,34 +4203,239 @@ void send_program_JSON(int fd)
             "],\n");
     sprintf(buffer + strlen(buffer),
             "\"outputs\":[\n");
-    for(k = 0; k < pglobal->outcnt; k++) {
-        sprintf(buffer + strlen(buffer),
-                "{\n"
+    for(k = 0, n = 0; k < pglobal->outcnt; k++) {
+        if(!OUTPUT_VALID(pglobal, k))
+            continue;
+        snprintf(buffer + strlen(buffer), sizeof(buffer) - strlen(buffer),
+                "%s{\n"
                 "\"id\": \"%d\",\n"
                 "\"name\": \"%s\",\n"
                 "\"plugin\": \"%s\",\n"
                 "\"args\": \"%s\"\n"
                 "}",
-                pglobal->out[k].param.id,
-                pglobal->out[k].name,
-                pglobal->out[k].plugin,
-                pglobal->out[k].param.parameters);
-        if(k != (pglobal->outcnt - 1))
-            sprintf(buffer + strlen(buffer), ", \n");
-        else
-            sprintf(buffer + strlen(buffer), "\n");
+                (n++ > 0) ? ", \n" : "",
+                pglobal->out[k]->param.id,
+                pglobal->out[k]->name,
+                pglobal->out[k]->plugin,
+                pglobal->out[k]->param.parameters);
+        reply_append(r, buffer, strlen(buffer));
+        buffer[0] = '\0';
     }
+    sprintf(buffer + strlen(buffer), "\n");
     sprintf(buffer + strlen(buffer),
             /*"]\n"
             "}\n"
             "]\n"*/
             "]}\n");
-    i = strlen(buffer);
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
-        DBG("unable to serve the program JSON file\n");
+    reply_append(r, buffer, strlen(buffer));
+}
+
+/******************************************************************************
+Description.: format the percentiles of a histogram as JSON object
+Input Value.: buffer receives the object, len is its size
+              name is the key, h the histogram
+Return Value: -
+******************************************************************************/
+static void trace_JSON(char *buffer, size_t len, const char *name, const trace_histogram *h)
+{
+    snprintf(buffer, len,
+             "\"%s\": {\"count\": %lu, \"p50\": %ld, \"p90\": %ld, \"p99\": %ld, \"max\": %lu}",
+             name,
+             __atomic_load_n(&h->count, __ATOMIC_RELAXED),
+             trace_percentile(h, 500),
+             trace_percentile(h, 900),
+             trace_percentile(h, 990),
+             __atomic_load_n(&h->max, __ATOMIC_RELAXED));
+}
+
+/******************************************************************************
+Description.: Format the stage latencies of all plugins in microseconds, they
+              are only recorded if mjpg_streamer runs with --trace
+Input Value.: r gets the JSON
+Return Value: -
+******************************************************************************/
+void format_trace_JSON(reply_buffer *r)
+{
+    char buffer[BUFFER_SIZE] = {0}, first[256], second[256];
+    int k, n;
+
+
+    DBG("Serving the trace JSON file\n");
+
+    sprintf(buffer + strlen(buffer),
+            "{\n"
+            "\"enabled\": %s,\n"
+            "\"inputs\":[\n", trace_enabled ? "true" : "false");
+
+    for(k = 0, n = 0; k < pglobal->incnt; k++) {
+        if(!INPUT_VALID(pglobal, k))
+            continue;
+        trace_JSON(first, sizeof(first), "encode", &pglobal->in[k]->trace[TRACE_ENCODE]);
+        trace_JSON(second, sizeof(second), "publish", &pglobal->in[k]->trace[TRACE_PUBLISH]);
+        snprintf(buffer + strlen(buffer), sizeof(buffer) - strlen(buffer),
+                "%s{\n"
+                "\"id\": \"%d\",\n"
+                "\"plugin\": \"%s\",\n"
+                "%s,\n"
+                "%s\n"
+                "}",
+                (n++ > 0) ? ", \n" : "",
+                k, pglobal->in[k]->plugin, first, second);
+        reply_append(r, buffer, strlen(buffer));
+        buffer[0] = '\0';
+    }
+    sprintf(buffer + strlen(buffer), "\n],\n\"outputs\":[\n");
+
+    for(k = 0, n = 0; k < pglobal->outcnt; k++) {
+        if(!OUTPUT_VALID(pglobal, k))
+            continue;
+        trace_JSON(first, sizeof(first), "send", &pglobal->out[k]->trace[TRACE_SEND]);
+        trace_JSON(second, sizeof(second), "total", &pglobal->out[k]->trace[TRACE_TOTAL]);
+        snprintf(buffer + strlen(buffer), sizeof(buffer) - strlen(buffer),
+                "%s{\n"
+                "\"id\": \"%d\",\n"
+                "\"plugin\": \"%s\",\n"
+                "%s,\n"
+                "%s\n"
+                "}",
+                (n++ > 0) ? ", \n" : "",
+                k, pglobal->out[k]->plugin, first, second);
+        reply_append(r, buffer, strlen(buffer));
+        buffer[0] = '\0';
+    }
+    sprintf(buffer + strlen(buffer), "\n]}\n");
+
+    reply_append(r, buffer, strlen(buffer));
+}
+
+/******************************************************************************
+Description.: append a latency histogram in the Prometheus format
+Input Value.: m is the buffer, name the metric, labels the labels without the
+              le label, h the histogram
+Return Value: -
+******************************************************************************/
+static void metrics_histogram(reply_buffer *m, const char *name, const char *labels, const trace_histogram *h)
+{
+    static const long limits[] = {500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000};
+    unsigned long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    int i;
+
+    for(i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+        reply_printf(m, "%s_bucket{%s,le=\"%g\"} %lu\n", name, labels, limits[i] / 1e6, trace_count_below(h, limits[i]));
+    }
+    reply_printf(m, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels, count);
+    reply_printf(m, "%s_sum{%s} %.6f\n", name, labels, __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e6);
+    reply_printf(m, "%s_count{%s} %lu\n", name, labels, count);
+}
+
+/******************************************************************************
+Description.: Format counters and gauges of all plugins in the Prometheus text
+              format. Everything is read from atomic counters, serving this
+              never takes the lock of an input.
+Input Value.: m gets the metrics
+Return Value: -
+******************************************************************************/
+void format_metrics(reply_buffer *m)
+{
+    static const char *input_stages[TRACE_INPUT_STAGES] = {"encode", "publish"};
+    static const char *output_stages[TRACE_OUTPUT_STAGES] = {"send", "total"};
+    stream_client *client;
+    char labels[256];
+    int k, s;
+
+    DBG("Serving the metrics\n");
+
+#define INPUT_COUNTER(metric, help, type, format, value) \
+    reply_printf(m, "# HELP " metric " " help "\n# TYPE " metric " " type "\n"); \
+    for(k = 0; k < pglobal->incnt; k++) { \
+        if(!INPUT_VALID(pglobal, k)) \
+            continue; \
+        reply_printf(m, metric "{input=\"%d\",plugin=\"%s\"} " format "\n", k, pglobal->in[k]->plugin, value); \
+    }
+
+    INPUT_COUNTER("mjpg_input_frames_captured_total", "Frames the input grabbed.", "counter",
+                  "%lu", __atomic_load_n(&pglobal->in[k]->frames_captured, __ATOMIC_RELAXED));
+    INPUT_COUNTER("mjpg_input_frames_published_total", "Frames the input made available to consumers.", "counter",
+                  "%u", __atomic_load_n(&pglobal->in[k]->seq, __ATOMIC_RELAXED));
+    INPUT_COUNTER("mjpg_input_frames_encoded_total", "Frames with complete JPG data.", "counter",
+                  "%lu", __atomic_load_n(&pglobal->in[k]->frames_encoded, __ATOMIC_RELAXED));
+    INPUT_COUNTER("mjpg_input_frames_dropped_total", "Frames lost because no slot was free or encoding failed.", "counter",
+                  "%lu", __atomic_load_n(&pglobal->in[k]->frames_dropped, __ATOMIC_RELAXED));
+    INPUT_COUNTER("mjpg_input_subscribers", "Consumers reading the input continuously.", "gauge",
+                  "%d", __atomic_load_n(&pglobal->in[k]->subscribers, __ATOMIC_RELAXED));
+    INPUT_COUNTER("mjpg_input_lock_contended_total", "Times the frame lock of the input was held by another thread.", "counter",
+                  "%lu", __atomic_load_n(&pglobal->in[k]->db_contended, __ATOMIC_RELAXED));
+    INPUT_COUNTER("mjpg_input_lock_wait_seconds_total", "Time spent waiting for the frame lock of the input.", "counter",
+                  "%.6f", __atomic_load_n(&pglobal->in[k]->db_wait_us, __ATOMIC_RELAXED) / 1e6);
+
+#define OUTPUT_COUNTER(metric, help, type, format, value) \
+    reply_printf(m, "# HELP " metric " " help "\n# TYPE " metric " " type "\n"); \
+    for(k = 0; k < pglobal->outcnt; k++) { \
+        if(!OUTPUT_VALID(pglobal, k)) \
+            continue; \
+        reply_printf(m, metric "{output=\"%d\",plugin=\"%s\"} " format "\n", k, pglobal->out[k]->plugin, value); \
+    }
+
+    OUTPUT_COUNTER("mjpg_output_frames_sent_total", "Frames the output delivered.", "counter",
+                   "%lu", __atomic_load_n(&pglobal->out[k]->frames_sent, __ATOMIC_RELAXED));
+    OUTPUT_COUNTER("mjpg_output_bytes_sent_total", "JPG bytes the output delivered.", "counter",
+                   "%llu", __atomic_load_n(&pglobal->out[k]->bytes_sent, __ATOMIC_RELAXED));
+    OUTPUT_COUNTER("mjpg_output_clients", "Clients connected to the output.", "gauge",
+                   "%d", __atomic_load_n(&pglobal->out[k]->clients, __ATOMIC_RELAXED));
+
+    /* only this list needs a lock, it is not shared with the inputs */
+    reply_printf(m, "# HELP mjpg_http_client_lag_frames Frames published since the frame a stream client got last.\n"
+                 "# TYPE mjpg_http_client_lag_frames gauge\n");
+    pthread_mutex_lock(&stream_clients_lock);
+    for(client = stream_clients; client != NULL; client = client->next) {
+        reply_printf(m, "mjpg_http_client_lag_frames{output=\"%d\",input=\"%d\",client=\"%s\"} %u\n",
+                     client->output, client->input, client->address,
+                     __atomic_load_n(&pglobal->in[client->input]->seq, __ATOMIC_RELAXED) -
+                     __atomic_load_n(&client->cursor->seq, __ATOMIC_RELAXED));
+    }
+    reply_printf(m, "# HELP mjpg_http_client_frames_skipped_total Frames a stream client missed because it was too slow.\n"
+                 "# TYPE mjpg_http_client_frames_skipped_total counter\n");
+    for(client = stream_clients; client != NULL; client = client->next) {
+        reply_printf(m, "mjpg_http_client_frames_skipped_total{output=\"%d\",input=\"%d\",client=\"%s\"} %u\n",
+                     client->output, client->input, client->address,
+                     __atomic_load_n(&client->cursor->skipped, __ATOMIC_RELAXED));
+    }
+    reply_printf(m, "# HELP mjpg_http_client_quality_rung Rung of the quality ladder a stream client gets, 0 are the frames themselves.\n"
+                 "# TYPE mjpg_http_client_quality_rung gauge\n");
+    for(client = stream_clients; client != NULL; client = client->next) {
+        reply_printf(m, "mjpg_http_client_quality_rung{output=\"%d\",input=\"%d\",client=\"%s\"} %d\n",
+                     client->output, client->input, client->address,
+                     __atomic_load_n(client->rung, __ATOMIC_RELAXED));
+    }
+    pthread_mutex_unlock(&stream_clients_lock);
+
+    /* the latency histograms are filled with --trace only */
+    if(trace_enabled) {
+        reply_printf(m, "# HELP mjpg_input_latency_seconds Time from capture to the end of a stage of the input.\n"
+                     "# TYPE mjpg_input_latency_seconds histogram\n");
+        for(k = 0; k < pglobal->incnt; k++) {
+            if(!INPUT_VALID(pglobal, k))
+                continue;
+            for(s = 0; s < TRACE_INPUT_STAGES; s++) {
+                snprintf(labels, sizeof(labels), "input=\"%d\",stage=\"%s\"", k, input_stages[s]);
+                metrics_histogram(m, "mjpg_input_latency_seconds", labels, &pglobal->in[k]->trace[s]);
+            }
+        }
+        reply_printf(m, "# HELP mjpg_output_latency_seconds Time a frame took until the output delivered it.\n"
+                     "# TYPE mjpg_output_latency_seconds histogram\n");
+        for(k = 0; k < pglobal->outcnt; k++) {
+            if(!OUTPUT_VALID(pglobal, k))
+                continue;
+            for(s = 0; s < TRACE_OUTPUT_STAGES; s++) {
+                snprintf(labels, sizeof(labels), "output=\"%d\",stage=\"%s\"", k, output_stages[s]);
+                metrics_histogram(m, "mjpg_output_latency_seconds", labels, &pglobal->out[k]->trace[s]);
+            }
+        }
     }
+
+#undef INPUT_COUNTER
+#undef OUTPUT_COUNTER
 }
 
 /******************************************************************************
@@ -1913,34 +4458,29 @@ void check_JSON_string(char *source, char *destination)
 }
 
 /******************************************************************************
-Description.: Send a JSON file which is contains information about the output plugin's
+Description.: Format a JSON file which is contains information about the output plugin's
               acceptable parameters
-Input Value.: fildescriptor fd to send the answer to
+Input Value.: r gets the JSON, input_number is the output plugin
 Return Value: -
 ******************************************************************************/
-void send_output_JSON(int fd, int input_number)
+void format_output_JSON(reply_buffer *r, int input_number)
 {
-    char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
     int i;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
 
     DBG("Serving the output plugin %d descriptor JSON file\n", input_number);
 
-    sprintf(buffer + strlen(buffer),
-            "{\n"
-            "\"controls\": [\n");
-    if(pglobal->out[input_number].out_parameters != NULL) {
-        for(i = 0; i < pglobal->out[input_number].parametercount; i++) {
+    reply_printf(r,
+                 "{\n"
+                 "\"controls\": [\n");
+    if(pglobal->out[input_number]->out_parameters != NULL) {
+        for(i = 0; i < pglobal->out[input_number]->parametercount; i++) {
             char *menuString = calloc(0, 0);
-            if(pglobal->out[input_number].out_parameters[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
-                if(pglobal->out[input_number].out_parameters[i].menuitems != NULL) {
+            if(pglobal->out[input_number]->out_parameters[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
+                if(pglobal->out[input_number]->out_parameters[i].menuitems != NULL) {
                     int j, k = 1;
-                    for(j = pglobal->out[input_number].out_parameters[i].ctrl.minimum; j <= pglobal->out[input_number].out_parameters[i].ctrl.maximum; j++) {
+                    for(j = pglobal->out[input_number]->out_parameters[i].ctrl.minimum; j <= pglobal->out[input_number]->out_parameters[i].ctrl.maximum; j++) {
                         int prevSize = strlen(menuString);
-                        int itemLength = strlen((char*)&pglobal->out[input_number].out_parameters[i].menuitems[j].name)  + strlen("\"\": \"\"");
+                        int itemLength = strlen((char*)&pglobal->out[input_number]->out_parameters[i].menuitems[j].name)  + strlen("\"\": \"\"");
                         if (menuString == NULL) {
                             menuString = calloc(itemLength, sizeof(char));
                         } else {
@@ -1949,120 +4489,105 @@ void send_output_JSON(int fd, int input_number)
 
                         if (menuString == NULL) {
                             DBG("Realloc/calloc failed: %s\n", strerror(errno));
+                            r->failed = 1;
                             return;
                         }
 
-                        if(j != pglobal->out[input_number].out_parameters[i].ctrl.maximum) {
-                            sprintf(menuString + prevSize, "\"%d\": \"%s\", ", j , (char*)&pglobal->out[input_number].out_parameters[i].menuitems[j].name);
+                        if(j != pglobal->out[input_number]->out_parameters[i].ctrl.maximum) {
+                            sprintf(menuString + prevSize, "\"%d\": \"%s\", ", j , (char*)&pglobal->out[input_number]->out_parameters[i].menuitems[j].name);
                         } else {
-                            sprintf(menuString + prevSize, "\"%d\": \"%s\"", j , (char*)&pglobal->out[input_number].out_parameters[i].menuitems[j].name);
+                            sprintf(menuString + prevSize, "\"%d\": \"%s\"", j , (char*)&pglobal->out[input_number]->out_parameters[i].menuitems[j].name);
                         }
                         k++;
                     }
                 }
             }
 
-            sprintf(buffer + strlen(buffer),
-                    "{\n"
-                    "\"name\": \"%s\",\n"
-                    "\"id\": \"%d\",\n"
-                    "\"type\": \"%d\",\n"
-                    "\"min\": \"%d\",\n"
-                    "\"max\": \"%d\",\n"
-                    "\"step\": \"%d\",\n"
-                    "\"default\": \"%d\",\n"
-                    "\"value\": \"%d\",\n"
-                    "\"dest\": \"1\",\n"
-                    "\"flags\": \"%d\",\n"
-                    "\"group\": \"%d\"",
-                    pglobal->out[input_number].out_parameters[i].ctrl.name,
-                    pglobal->out[input_number].out_parameters[i].ctrl.id,
-                    pglobal->out[input_number].out_parameters[i].ctrl.type,
-                    pglobal->out[input_number].out_parameters[i].ctrl.minimum,
-                    pglobal->out[input_number].out_parameters[i].ctrl.maximum,
-                    pglobal->out[input_number].out_parameters[i].ctrl.step,
-                    pglobal->out[input_number].out_parameters[i].ctrl.default_value,
-                    pglobal->out[input_number].out_parameters[i].value,
-                    // 1 is the code of the output plugin
-                    pglobal->out[input_number].out_parameters[i].ctrl.flags,
-                    pglobal->out[input_number].out_parameters[i].group
-                   );
-
-            if(pglobal->out[input_number].out_parameters[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
-                sprintf(buffer + strlen(buffer),
-                        ",\n"
-                        "\"menu\": {%s}\n"
-                        "}",
-                        menuString);
+            reply_printf(r,
+                         "{\n"
+                         "\"name\": \"%s\",\n"
+                         "\"id\": \"%d\",\n"
+                         "\"type\": \"%d\",\n"
+                         "\"min\": \"%d\",\n"
+                         "\"max\": \"%d\",\n"
+                         "\"step\": \"%d\",\n"
+                         "\"default\": \"%d\",\n"
+                         "\"value\": \"%d\",\n"
+                         "\"dest\": \"1\",\n"
+                         "\"flags\": \"%d\",\n"
+                         "\"group\": \"%d\"",
+                         pglobal->out[input_number]->out_parameters[i].ctrl.name,
+                         pglobal->out[input_number]->out_parameters[i].ctrl.id,
+                         pglobal->out[input_number]->out_parameters[i].ctrl.type,
+                         pglobal->out[input_number]->out_parameters[i].ctrl.minimum,
+                         pglobal->out[input_number]->out_parameters[i].ctrl.maximum,
+                         pglobal->out[input_number]->out_parameters[i].ctrl.step,
+                         pglobal->out[input_number]->out_parameters[i].ctrl.default_value,
+                         pglobal->out[input_number]->out_parameters[i].value,
+                         // 1 is the code of the output plugin
+                         pglobal->out[input_number]->out_parameters[i].ctrl.flags,
+                         pglobal->out[input_number]->out_parameters[i].group
+                        );
+
+            if(pglobal->out[input_number]->out_parameters[i].ctrl.type == V4L2_CTRL_TYPE_MENU) {
+                reply_printf(r,
+                             ",\n"
+                             "\"menu\": {%s}\n"
+                             "}",
+                             menuString);
             } else {
-                sprintf(buffer + strlen(buffer),
-                        "\n"
-                        "}");
+                reply_printf(r,
+                             "\n"
+                             "}");
             }
 
-            if(i != (pglobal->out[input_number].parametercount - 1)) {
-                sprintf(buffer + strlen(buffer), ",\n");
+            if(i != (pglobal->out[input_number]->parametercount - 1)) {
+                reply_printf(r, ",\n");
             }
             free(menuString);
         }
     } else {
         DBG("The output plugin %d has no paramters\n", input_number);
     }
-    sprintf(buffer + strlen(buffer),
-            "\n]\n"
-            /*"},\n"*/);
+    reply_printf(r,
+                 "\n]\n"
+                 /*"},\n"*/);
 
-    sprintf(buffer + strlen(buffer),
-            "}\n");
-    i = strlen(buffer);
-
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
-        DBG("unable to serve the control JSON file\n");
-    }
+    reply_printf(r,
+                 "}\n");
 }
 
 #ifdef MANAGMENT
-void send_clients_JSON(int fd)
+void format_clients_JSON(reply_buffer *r)
 {
-    char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
-    unsigned long i = 0 ;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
+    client_info *client;
+    struct timeval now;
+    int i, first = 1;
 
     DBG("Serving the clients JSON file\n");
 
-    sprintf(buffer + strlen(buffer),
-            "{\n"
-            "\"clients\": [\n");
-
-    for (; i<client_infos.client_count; i++) {
-        sprintf(buffer + strlen(buffer),
-            "{\n"
-            "\"address\": \"%s\",\n"
-            "\"timestamp\": %ld\n"
-            "}\n",
-            client_infos.infos[i]->address,
-            (unsigned long)client_infos.infos[i]->last_take_time.tv_sec);
-
-        if(i != (client_infos.client_count - 1)) {
-            sprintf(buffer + strlen(buffer), ",\n");
+    reply_printf(r, "{\n\"clients\": [\n");
+
+    frame_clock(&now);
+    for(i = 0; i < CLIENT_BUCKETS; i++) {
+        pthread_mutex_lock(&client_infos.locks[i % CLIENT_SHARDS]);
+        client_expire(&client_infos.buckets[i], now.tv_sec);
+        for(client = client_infos.buckets[i]; client != NULL; client = client->next) {
+            reply_printf(r, "%s{\n"
+                         "\"address\": \"%s\",\n"
+                         "\"timestamp\": %ld,\n"
+                         "\"dropped\": %lu\n"
+                         "}\n",
+                         first ? "" : ",\n",
+                         client->address,
+                         (long)__atomic_load_n(&client->last_take_time, __ATOMIC_RELAXED),
+                         __atomic_load_n(&client->dropped, __ATOMIC_RELAXED));
+            first = 0;
         }
+        pthread_mutex_unlock(&client_infos.locks[i % CLIENT_SHARDS]);
     }
 
-    sprintf(buffer + strlen(buffer),
-            "]");
-
-    sprintf(buffer + strlen(buffer),
-            "\n}\n");
-    i = strlen(buffer);
-
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
-        DBG("unable to serve the control JSON file\n");
-    }
+    reply_printf(r, "]\n}\n");
 }
 #endif
 
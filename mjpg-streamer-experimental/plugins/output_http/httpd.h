@@ -20,9 +20,49 @@
 #                                                                              #
 *******************************************************************************/
 
-#define IO_BUFFER 256
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "parser.h"
+#include "scale.h"
+#include "tls.h"
+
 #define BUFFER_SIZE 1024
 
+/* largest request head (request line and header lines) a client may send */
+#define REQUEST_SIZE 4096
+
+/* longest parameter of a command, file or CGI script, longer ones are cut */
+#define PARAMETER_SIZE 256
+
+/* seconds a client may take to send its request head */
+#define REQUEST_TIMEOUT 5
+
+/* seconds a long polling snapshot waits for a newer frame at most */
+#define LONGPOLL_MAX 60
+
+/* largest file of the www folder kept in memory, larger ones are read for each request */
+#define WWW_FILE_MAX (1024*1024)
+
+/* seconds a file of the www folder is served from memory before it is checked for changes */
+#define WWW_CHECK_INTERVAL 1
+
+/* seconds browsers may use a file of the www folder without asking again */
+#define WWW_MAX_AGE 600
+
+/* seconds a client refused for too many streams is asked to wait before it tries again */
+#define ADMISSION_RETRY 5
+
+/* lists and locks the client addresses are spread over */
+#define PEER_BUCKETS 256
+#define PEER_LOCKS 16
+
+/* seconds an address without connections is remembered */
+#define PEER_EXPIRE 60
+
+/* events an event loop handles per epoll_wait() */
+#define WORKER_EVENTS 64
+
 /* the boundary is used for the M-JPEG stream, it separates the multipart stream of pictures */
 #define BOUNDARY "boundarydonotcross"
 
@@ -43,12 +83,28 @@
  * Many browser seem to ignore, or at least not always obey those headers
  * since i observed caching of files from time to time.
  */
-#define STD_HEADER "Connection: close\r\n" \
-    "Server: MJPG-Streamer/0.2\r\n" \
-    "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n" \
+#define SERVER_HEADER "Server: MJPG-Streamer/0.2\r\n"
+
+#define NOCACHE_FIELDS "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n" \
     "Pragma: no-cache\r\n" \
     "Expires: Mon, 3 Jan 2000 12:34:56 GMT\r\n"
 
+#define NOCACHE_HEADER SERVER_HEADER NOCACHE_FIELDS
+
+#define STD_HEADER "Connection: close\r\n" NOCACHE_HEADER
+
+/*
+ * Snapshots may be stored by the client, but it has to ask whether there is
+ * a newer frame each time, with the ETag of the one it has.
+ */
+#define REVALIDATE_HEADER "Cache-Control: no-cache, must-revalidate, max-age=0\r\n"
+
+/*
+ * Status line and headers of a snapshot sent by a client thread, the event
+ * loops build them for the HTTP version of the request
+ */
+#define STATUS_CLOSE "HTTP/1.0 200 OK\r\nConnection: close\r\n" SERVER_HEADER
+
 /*
  * Maximum number of server sockets (i.e. protocol families) to listen.
  */
@@ -94,6 +150,8 @@ typedef enum {
     A_INPUT_JSON,
     A_OUTPUT_JSON,
     A_PROGRAM_JSON,
+    A_TRACE_JSON,
+    A_METRICS,
     #ifdef MANAGMENT
     A_CLIENTS_JSON
     #endif
@@ -105,17 +163,36 @@ typedef enum {
  */
 typedef struct {
     answer_t type;
-    char *parameter;
-    char *client;
-    char *credentials;
-    char *query_string;
+    char parameter[PARAMETER_SIZE];    /* command, file name or CGI script */
+    char query_string[PARAMETER_SIZE]; /* of a CGI script */
+    int keepalive;          /* the client wants to send further requests on the connection */
+    int minor;              /* HTTP/1.<minor> of the request, the answer uses the same */
+    unsigned int etag_epoch; /* ETag of the frame the client has, sequence number 0 if none.
+                                for files it is the modification time and the length */
+    unsigned int etag_seq;
+    int wait;               /* seconds to wait for a newer frame than the ETag */
+    int gzip;               /* the client accepts gzip compressed files */
+    int fps;                /* frames per second of a stream, 0 for every frame */
+    int scale;              /* 1, 2 or 3 to send frames at 1/2, 1/4 or 1/8 of their size */
 } request;
 
-/* the iobuffer structure is used to read from the HTTP-client */
+/* what a route needs besides the method and path */
+#define ROUTE_INPUT     1       /* the number after '_' selects an input */
+#define ROUTE_OUTPUT    2       /* the number after '_' selects an output */
+#define ROUTE_WXP       4       /* WebcamXP counts the inputs from 1 */
+#define ROUTE_PARAMETER 8       /* the query after the action is the parameter */
+
+/*
+ * a kind of request the server answers. In the path and action a '#' stands
+ * for an optional _<number> which selects the plugin.
+ */
 typedef struct {
-    int level;              /* how full is the buffer */
-    char buffer[IO_BUFFER]; /* the data */
-} iobuffer;
+    const char *method;
+    const char *path;
+    const char *action;         /* value of the action parameter, NULL if it is not needed */
+    answer_t type;
+    int flags;
+} route;
 
 /* store configuration for each server instance */
 typedef struct {
@@ -123,8 +200,83 @@ typedef struct {
     char *credentials;
     char *www_folder;
     char nocommands;
+    int queue;              /* frames a stream client may have in flight */
+    int max_age;            /* ms the latest frame may be old to be sent as snapshot at once, 0 waits */
+    int keepalive;          /* seconds an idle connection is kept open, 0 closes after each response */
+    int adapt;              /* stream clients follow the quality ladder */
+    char *certificate;      /* PEM files for HTTPS, NULL for plain HTTP */
+    char *key;
+    int streams;            /* streams served at once, 0 for no limit */
+    int streams_per_ip;     /* streams one address may receive at once, 0 for no limit */
+    int snapshot_rate;      /* snapshots per second one address may get, 0 for no limit */
 } config;
 
+/*
+ * a file of the www folder read into memory, with the response header after
+ * the status line. It never changes, a modified file is read into a new one.
+ * The JSON descriptions of the plugins are kept the same way.
+ */
+typedef struct _www_file www_file;
+struct _www_file {
+    int refcount;               /* modified atomically, the cache holds one reference */
+    time_t mtime;
+    char *data;
+    size_t len;
+    unsigned int etag_epoch;    /* the ETag, for files the modification time and the length */
+    unsigned int etag_seq;
+    int header_len;
+    char header[512];
+};
+
+/* a file name of the www folder and the files read for it */
+typedef struct {
+    char *name;
+    const char *mimetype;
+    time_t checked;             /* frame_clock() seconds the files were compared with the folder */
+    www_file *plain;            /* NULL if the file was removed */
+    www_file *gzip;             /* precompressed .gz variant, NULL if there is none */
+} www_entry;
+
+/*
+ * an address clients connect from, counted for the limits per address.
+ * The fields are protected by the lock of its list.
+ */
+typedef struct _peer peer;
+struct _peer {
+    peer *next;
+    char address[64];
+    int connections;
+    int streams;
+    double tokens;              /* snapshots it may get at once, refilled at --snapshot_rate */
+    struct timeval refilled;    /* frame_clock() time tokens was last refilled */
+    time_t left;                /* frame_clock() seconds its last connection was closed */
+};
+
+/*
+ * a JSON description of a plugin or of the program, formatted when it is
+ * requested first and kept until the version of what it describes changes
+ */
+typedef struct {
+    www_file *plain;
+    www_file *gzip;             /* NULL if compressing does not make it smaller */
+    unsigned int source;        /* version of the plugin or of the globals it was formatted from */
+} json_doc;
+
+struct _worker;
+
+/*
+ * a frame an event loop needs the JPG or a variant of. The encoder threads
+ * run libjpeg, the loops only queue frames which are ready.
+ */
+typedef struct _encode_job encode_job;
+struct _encode_job {
+    encode_job *next;
+    frame *f;                   /* referenced until the job is done */
+    int step;                   /* the variant, both 0 if only the JPG is needed */
+    int reduced;
+    struct _worker *w;          /* its eventfd is signalled when the job is done */
+};
+
 /* context of each server thread */
 typedef struct {
     int sd[MAX_SD_LEN];
@@ -133,28 +285,71 @@ typedef struct {
     globals *pglobal;
     pthread_t threadID;
 
+    /* event loops serving the clients, the server thread runs the first one */
+    struct _worker *workers;
+    int worker_count;
+    int workers_started;
+
+    /* encoder threads and the jobs the event loops handed them, oldest first */
+    pthread_t *encoders;
+    int encoders_started;
+    encode_job *jobs;
+    encode_job *jobs_last;
+    pthread_mutex_t jobs_lock;
+    pthread_cond_t jobs_ready;
+
+    /* the files of the www folder, sorted by name */
+    www_entry *www;
+    int www_len;
+    pthread_mutex_t www_lock;
+
+    /* addresses of the clients by hash, only kept if there are limits per address */
+    peer *peers[PEER_BUCKETS];
+    pthread_mutex_t peer_locks[PEER_LOCKS];
+    int streams;                /* streams served, modified atomically */
+
     config conf;
+    void *tls;                  /* of tls_context() if the server speaks HTTPS */
 } context;
 
 
 #if defined(MANAGMENT)
 /*
- * this struct is used to hold information from the clients address, and last picture take time
+ * the clients of all servers by address, for /clients.json. The table is
+ * split into shards with a lock each, which guards the lists and the
+ * connection counts. The timestamp and the dropped frames are updated
+ * without a lock.
  */
+#define CLIENT_BUCKETS 1024
+#define CLIENT_SHARDS 16
+
+/* seconds an address without connections is listed */
+#define CLIENT_EXPIRE 300
+
 typedef struct _client_info {
     struct _client_info *next;
-    char *address;
-    struct timeval last_take_time;
+    char address[64];
+    int connections;        /* sockets of the address which are open */
+    time_t left;            /* frame_clock() seconds its last socket was closed */
+    time_t last_take_time;  /* seconds since the epoch a frame was last sent to it, modified atomically */
+    unsigned long dropped;  /* frames its streams skipped, modified atomically */
 } client_info;
 
-struct {
-    client_info **infos;
-    unsigned int client_count;
-    pthread_mutex_t mutex;
-} client_infos;
-
 #endif
 
+/*
+ * a client receiving a stream, all of them are listed for /metrics
+ */
+typedef struct _stream_client stream_client;
+struct _stream_client {
+    stream_client *next;
+    int output;
+    int input;
+    const char *address;
+    const frame_cursor *cursor;
+    const int *rung;            /* of the quality ladder, 0 if the client does not adapt */
+};
+
 /*
  * this struct is just defined to allow passing all necessary details to a worker thread
  * "cfd" is for connected/accepted filedescriptor
@@ -162,26 +357,197 @@ struct {
 typedef struct {
     context *pc;
     int fd;
+    char address[INET6_ADDRSTRLEN + 8]; /* numeric address and port of the client */
     #ifdef MANAGMENT
     client_info *client;
     #endif
 } cfd;
 
+/* a parsed request which an event loop hands over to a thread of its own */
+typedef struct {
+    cfd lcfd;
+    request req;
+    int input_number;
+} request_job;
+
+/* states of a connection served by an event loop */
+typedef enum {
+    C_HANDSHAKE,                /* the TLS handshake of an HTTPS client */
+    C_REQUEST,                  /* reading the request head */
+    C_WAITING,                  /* waiting for the next frame */
+    C_PACED,                    /* a stream with a frame rate waits for its next turn */
+    C_SENDING,                  /* writing a response or a frame */
+    C_CLOSED                    /* freed once the current events are handled */
+} conn_state;
+
+/*
+ * Number of buffers a connection queues at once, e.g. response header, part
+ * header, skipped counter, JPG data and boundary of the first stream part.
+ */
+#define CONN_IOV 6
+
+/*
+ * headers of a frame or of a scaled copy which are the same for every
+ * client, formatted once
+ */
+typedef struct {
+    int part_len;
+    int snapshot_len;
+    char part[128];             /* part header of a stream, up to X-Timestamp */
+    char snapshot[512];         /* response header of a snapshot after the status
+                                   line, up to X-Timestamp */
+    #ifdef WXP_COMPAT
+    char wxp[50];               /* part header of a WebcamXP stream */
+    #endif
+} wire_chunk;
+
+/* a frame scaled down or encoded at a lower quality for the clients which need it */
+typedef struct {
+    wire_chunk chunk;
+    unsigned char *buf;
+    int size;
+} wire_variant;
+
+/*
+ * what the server derived from a frame, shared by all clients and attached
+ * to the frame with frame_wire_attach()
+ */
+typedef struct {
+    wire_chunk chunk;           /* of the frame as captured */
+    pthread_mutex_t lock;       /* guards building, only held to publish a variant */
+    pthread_cond_t built;       /* an encoder finished a variant */
+    wire_variant *variant[SCALE_STEPS + 1][2]; /* per scale step, at the quality of the frame
+                                   or at LADDER_QUALITY. Made on first use, [0][0] is the
+                                   frame itself. */
+    int failed;                 /* bit per variant which could not be made, modified atomically */
+    int building;               /* bit per variant an encoder is making */
+} wire_frame;
+
+/*
+ * with --adapt a stream client is moved down a ladder of smaller variants
+ * of the frames while its link does not keep up, and up again once it does
+ */
+#define LADDER_QUALITY 50       /* JPG quality of the reduced rungs */
+#define LADDER_FRAMES 4         /* frames a client gets at least before it is judged */
+#define LADDER_HOLD 2           /* good judgements in a row before a client moves up */
+#define LADDER_HOLD_MAX 32      /* the same after moving up failed again and again */
+
+typedef struct {
+    int rung;                   /* 0 sends the frames themselves */
+    struct timeval start;       /* frame_clock() time the client was last judged */
+    int frames;                 /* frames queued since */
+    int missed;                 /* frames the client was too slow for since */
+    int crowded;                /* frames which found more than half a frame unsent since */
+    int good;                   /* good judgements in a row */
+    int hold;                   /* good judgements needed to move up */
+    int probing;                /* moved up at the last judgement */
+} ladder_state;
+
+/*
+ * a response body formatted in memory, so it can be sent with its length
+ */
+typedef struct {
+    char *data;                 /* zero terminated */
+    size_t len;
+    size_t size;
+    int failed;                 /* memory ran out, the body is incomplete */
+} reply_buffer;
+
+/*
+ * a client served by an event loop, it may send several requests one after
+ * the other
+ */
+typedef struct _connection connection;
+struct _connection {
+    cfd c;
+    connection *prev, *next;    /* connections of the same worker */
+    struct _worker *w;
+    conn_state state;
+    uint32_t events;            /* registered with epoll */
+    int eof;                    /* the client shut down its sending side */
+    time_t since;               /* frame_clock() seconds the connection was accepted */
+    peer *peer;                 /* its address, NULL if there are no limits per address */
+    int streaming;              /* counted as stream of the server and of its address */
+
+    char head[REQUEST_SIZE];    /* request head, zero terminated */
+    int head_len;
+    int head_end;               /* end of the request head served, the rest was pipelined */
+    http_parser parser;         /* parses head while it arrives */
+    int keepalive;              /* read the next request once the response is complete */
+    int minor;                  /* HTTP/1.<minor> of the request being answered */
+    unsigned int requests;      /* requests answered on this connection */
+
+    answer_t type;              /* A_SNAPSHOT, A_STREAM, A_INPUT_JSON... */
+    int input;
+    unsigned int known;         /* sequence number of the frame the client has, 0 if none */
+    int scale;                  /* step of the scaled copy sent, 0 for the frame itself */
+    int adapt;                  /* the stream follows the quality ladder, see ladder */
+    ladder_state ladder;
+    long pace;                  /* us between two frames of a stream, 0 to send every frame */
+    struct timeval due;         /* frame_clock() time the next frame of a paced stream is due */
+    int answered;               /* the whole response is queued, no frame follows */
+    time_t deadline;            /* frame_clock() seconds a long poll gives up, 0 if none */
+    int subscribed;             /* the input was subscribed and listened to, a snapshot
+                                   of a fresh enough frame does not need to */
+    frame_cursor cursor;
+    frame *pending;             /* handed to the encoders, queued once it is ready */
+    unsigned int pending_skipped; /* cursor.skipped before pending was taken */
+    stream_client client;       /* registered for /metrics while streaming */
+    int lowat;                  /* TCP_NOTSENT_LOWAT set, 0 before the first frame, -1 if unsupported */
+    #ifdef MANAGMENT
+    unsigned int dropped;       /* cursor.skipped already added to the client_info */
+    #endif
+
+    /* data queued for writing, out[out_index] is the next one to write */
+    frame *f;                   /* frame referenced by out */
+    int f_size;                 /* bytes of f queued, less if a variant is sent */
+    reply_buffer reply;         /* body referenced by out */
+    www_file *file;             /* file referenced by out */
+    char header[BUFFER_SIZE];   /* response header and skipped counter or age, back to back */
+    int header_len;
+    struct iovec out[CONN_IOV];
+    int out_count;
+    int out_index;
+};
+
+/*
+ * an event loop, it accepts clients and serves snapshots and streams
+ * without a thread per client
+ */
+typedef struct _worker worker;
+struct _worker {
+    context *pc;
+    pthread_t thread;
+    int epfd;
+    int event;                  /* eventfd signalled by inputs, see frame_listen() */
+    int timer;                  /* timerfd which wakes paced streams */
+    struct timeval armed;       /* the timer expires then, cleared if it is not armed */
+    connection *connections;
+    connection *closed;         /* closed during the current epoll_wait() round */
+    int *listening;             /* per input: connections which need its frames */
+    int listening_len;
+};
+
 
 
 /* prototypes */
 void *server_thread(void *arg);
 void send_error(int fd, int which, char *message);
-void send_output_JSON(int fd, int plugin_number);
-void send_input_JSON(int fd, int plugin_number);
-void send_program_JSON(int fd);
+void reply_append(reply_buffer *r, const void *data, size_t len);
+void reply_printf(reply_buffer *r, const char *format, ...);
+void reply_free(reply_buffer *r);
+void format_output_JSON(reply_buffer *r, int plugin_number);
+void format_input_JSON(reply_buffer *r, int plugin_number);
+void format_program_JSON(reply_buffer *r);
+void format_trace_JSON(reply_buffer *r);
+void format_metrics(reply_buffer *m);
 void check_JSON_string(char *source, char *destination);
 
 #ifdef MANAGMENT
-client_info *add_client(char *address);
-int check_client_status(client_info *client);
+client_info *add_client(const char *address);
+void release_client(client_info *client);
 void update_client_timestamp(client_info *client);
-void send_clients_JSON(int fd);
+void format_clients_JSON(reply_buffer *r);
 #endif
 
 
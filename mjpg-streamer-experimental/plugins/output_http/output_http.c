@@ -43,9 +43,12 @@
 
 #define OUTPUT_PLUGIN_NAME "HTTP output plugin"
 /*
- * keep context for each server
+ * keep context for each server, indexed by the output plugin id.
+ * A context is never freed, client threads of a removed server may still
+ * use it after the server thread is gone.
  */
-context servers[MAX_OUTPUT_PLUGINS];
+static context **servers;
+static int server_slots;
 
 /******************************************************************************
 Description.: print help for this plugin to stdout
@@ -63,6 +66,25 @@ void help(void)
             " [-p | --port ]..........: TCP port for this HTTP server\n" \
             " [-c | --credentials ]...: ask for \"username:password\" on connect\n" \
             " [-n | --nocommands ]....: disable execution of commands\n"
+            " [-q | --queue ].........: frames a stream client may have in flight,\n" \
+            "                           slower clients skip to the newest (default 2)\n"
+            " [-m | --max_age ].......: milliseconds the latest frame may be old to be\n" \
+            "                           sent as snapshot at once, 0 waits for the\n" \
+            "                           next frame (default 0)\n"
+            " [-k | --keepalive ].....: seconds an idle connection is kept open for\n" \
+            "                           further requests, 0 disables it (default 5)\n"
+            " [-a | --adapt ].........: send stream clients on slow links smaller\n" \
+            "                           variants of the frames\n"
+            " [-C | --certificate ]...: PEM file with the certificate chain, the\n" \
+            "                           server speaks HTTPS then\n"
+            " [-K | --key ]...........: PEM file with the private key, if it is not\n" \
+            "                           in the certificate file\n"
+            " [-s | --streams ].......: streams served at once, further clients\n" \
+            "                           get 503 (default 0, no limit)\n"
+            " [-i | --streams_per_ip ]: streams one address may receive at once\n" \
+            "                           (default 0, no limit)\n"
+            " [-r | --snapshot_rate ].: snapshots per second one address may get,\n" \
+            "                           as many at once (default 0, no limit)\n"
             " ---------------------------------------------------------------\n");
 }
 
@@ -82,6 +104,11 @@ int output_init(output_parameter *param, int id)
     int  port;
     char *credentials, *www_folder;
     char nocommands;
+    int queue, max_age, keepalive;
+    char adapt;
+    char *certificate, *key;
+    int streams, streams_per_ip, snapshot_rate;
+    void *tls;
 
     DBG("output #%02d\n", param->id);
 
@@ -89,6 +116,16 @@ int output_init(output_parameter *param, int id)
     credentials = NULL;
     www_folder = NULL;
     nocommands = 0;
+    queue = 2;
+    max_age = 0;
+    keepalive = 5;
+    adapt = 0;
+    certificate = NULL;
+    key = NULL;
+    streams = 0;
+    streams_per_ip = 0;
+    snapshot_rate = 0;
+    tls = NULL;
 
     param->argv[0] = OUTPUT_PLUGIN_NAME;
 
@@ -112,6 +149,24 @@ int output_init(output_parameter *param, int id)
             {"www", required_argument, 0, 0},
             {"n", no_argument, 0, 0},
             {"nocommands", no_argument, 0, 0},
+            {"q", required_argument, 0, 0},
+            {"queue", required_argument, 0, 0},
+            {"m", required_argument, 0, 0},
+            {"max_age", required_argument, 0, 0},
+            {"k", required_argument, 0, 0},
+            {"keepalive", required_argument, 0, 0},
+            {"a", no_argument, 0, 0},
+            {"adapt", no_argument, 0, 0},
+            {"C", required_argument, 0, 0},
+            {"certificate", required_argument, 0, 0},
+            {"K", required_argument, 0, 0},
+            {"key", required_argument, 0, 0},
+            {"s", required_argument, 0, 0},
+            {"streams", required_argument, 0, 0},
+            {"i", required_argument, 0, 0},
+            {"streams_per_ip", required_argument, 0, 0},
+            {"r", required_argument, 0, 0},
+            {"snapshot_rate", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -165,32 +220,179 @@ int output_init(output_parameter *param, int id)
             DBG("case 8,9\n");
             nocommands = 1;
             break;
+
+            /* q, queue */
+        case 10:
+        case 11:
+            DBG("case 10,11\n");
+            if((queue = atoi(optarg)) < 1) {
+                OPRINT("the queue has to hold at least one frame\n");
+                return 1;
+            }
+            break;
+
+            /* m, max_age */
+        case 12:
+        case 13:
+            DBG("case 12,13\n");
+            if((max_age = atoi(optarg)) < 0) {
+                OPRINT("the maximum age can not be negative\n");
+                return 1;
+            }
+            break;
+
+            /* k, keepalive */
+        case 14:
+        case 15:
+            DBG("case 14,15\n");
+            if((keepalive = atoi(optarg)) < 0) {
+                OPRINT("the keepalive timeout can not be negative\n");
+                return 1;
+            }
+            break;
+
+            /* a, adapt */
+        case 16:
+        case 17:
+            DBG("case 16,17\n");
+            #ifdef NO_LIBJPEG
+            OPRINT("compiled without libjpeg, frames can not be adapted\n");
+            return 1;
+            #endif
+            adapt = 1;
+            break;
+
+            /* C, certificate */
+        case 18:
+        case 19:
+            DBG("case 18,19\n");
+            certificate = strdup(optarg);
+            break;
+
+            /* K, key */
+        case 20:
+        case 21:
+            DBG("case 20,21\n");
+            key = strdup(optarg);
+            break;
+
+            /* s, streams */
+        case 22:
+        case 23:
+            DBG("case 22,23\n");
+            if((streams = atoi(optarg)) < 0) {
+                OPRINT("the number of streams can not be negative\n");
+                return 1;
+            }
+            break;
+
+            /* i, streams_per_ip */
+        case 24:
+        case 25:
+            DBG("case 24,25\n");
+            if((streams_per_ip = atoi(optarg)) < 0) {
+                OPRINT("the number of streams per address can not be negative\n");
+                return 1;
+            }
+            break;
+
+            /* r, snapshot_rate */
+        case 26:
+        case 27:
+            DBG("case 26,27\n");
+            if((snapshot_rate = atoi(optarg)) < 0) {
+                OPRINT("the snapshot rate can not be negative\n");
+                return 1;
+            }
+            break;
+        }
+    }
+
+    if(key != NULL && certificate == NULL) {
+        OPRINT("a key needs a certificate\n");
+        return 1;
+    }
+    if(certificate != NULL && (tls = tls_context(certificate, key)) == NULL) {
+        OPRINT("could not load the certificate %s\n", certificate);
+        return 1;
+    }
+
+    if(param->id >= server_slots) {
+        context **grown = realloc(servers, (param->id + 1) * sizeof(context *));
+        if(grown == NULL) {
+            OPRINT("not enough memory\n");
+            return 1;
         }
+        memset(grown + server_slots, 0, (param->id + 1 - server_slots) * sizeof(context *));
+        servers = grown;
+        server_slots = param->id + 1;
+    }
+    if((servers[param->id] = calloc(1, sizeof(context))) == NULL) {
+        OPRINT("not enough memory\n");
+        return 1;
     }
 
-    servers[param->id].id = param->id;
-    servers[param->id].pglobal = param->global;
-    servers[param->id].conf.port = port;
-    servers[param->id].conf.credentials = credentials;
-    servers[param->id].conf.www_folder = www_folder;
-    servers[param->id].conf.nocommands = nocommands;
+    servers[param->id]->id = param->id;
+    servers[param->id]->pglobal = param->global;
+    servers[param->id]->conf.port = port;
+    servers[param->id]->conf.credentials = credentials;
+    servers[param->id]->conf.www_folder = www_folder;
+    servers[param->id]->conf.nocommands = nocommands;
+    servers[param->id]->conf.queue = queue;
+    servers[param->id]->conf.max_age = max_age;
+    servers[param->id]->conf.keepalive = keepalive;
+    servers[param->id]->conf.adapt = adapt;
+    servers[param->id]->conf.certificate = certificate;
+    servers[param->id]->conf.key = key;
+    servers[param->id]->conf.streams = streams;
+    servers[param->id]->conf.streams_per_ip = streams_per_ip;
+    servers[param->id]->conf.snapshot_rate = snapshot_rate;
+    servers[param->id]->tls = tls;
 
     OPRINT("www-folder-path...: %s\n", (www_folder == NULL) ? "disabled" : www_folder);
     OPRINT("HTTP TCP port.....: %d\n", ntohs(port));
+    OPRINT("HTTPS certificate.: %s\n", (certificate == NULL) ? "disabled" : certificate);
     OPRINT("username:password.: %s\n", (credentials == NULL) ? "disabled" : credentials);
     OPRINT("commands..........: %s\n", (nocommands) ? "disabled" : "enabled");
+    OPRINT("stream queue......: %d frames\n", queue);
+    if(max_age > 0) {
+        OPRINT("snapshot max age..: %d ms\n", max_age);
+    } else {
+        OPRINT("snapshot max age..: wait for the next frame\n");
+    }
+    if(keepalive > 0) {
+        OPRINT("keepalive.........: %d s\n", keepalive);
+    } else {
+        OPRINT("keepalive.........: disabled\n");
+    }
+    OPRINT("adapt streams.....: %s\n", (adapt) ? "enabled" : "disabled");
+    if(streams > 0) {
+        OPRINT("streams...........: %d at most\n", streams);
+    } else {
+        OPRINT("streams...........: no limit\n");
+    }
+    if(streams_per_ip > 0) {
+        OPRINT("streams per addr..: %d at most\n", streams_per_ip);
+    } else {
+        OPRINT("streams per addr..: no limit\n");
+    }
+    if(snapshot_rate > 0) {
+        OPRINT("snapshot rate.....: %d per second and address\n", snapshot_rate);
+    } else {
+        OPRINT("snapshot rate.....: no limit\n");
+    }
 
-    param->global->out[id].name = malloc((strlen(OUTPUT_PLUGIN_NAME) + 1) * sizeof(char));
-    sprintf(param->global->out[id].name, OUTPUT_PLUGIN_NAME);
+    param->global->out[id]->name = malloc((strlen(OUTPUT_PLUGIN_NAME) + 1) * sizeof(char));
+    sprintf(param->global->out[id]->name, OUTPUT_PLUGIN_NAME);
 
     return 0;
 }
 
 /******************************************************************************
-Description.: this will stop the server thread, client threads
-              will not get cleaned properly, because they run detached and
-              no pointer is kept. This is not a huge issue, because this
-              funtion is intended to clean up the biggest mess on shutdown.
+Description.: this will stop the server thread and wait until it and the
+              event loops are gone. Client threads answering a single
+              request run detached, they only use the context and that is
+              never freed.
 Input Value.: id determines which server instance to send commands to
 Return Value: always 0
 ******************************************************************************/
@@ -198,7 +400,8 @@ int output_stop(int id)
 {
 
     DBG("will cancel server thread #%02d\n", id);
-    pthread_cancel(servers[id].threadID);
+    pthread_cancel(servers[id]->threadID);
+    pthread_join(servers[id]->threadID, NULL);
 
     return 0;
 }
@@ -213,8 +416,7 @@ int output_run(int id)
     DBG("launching server thread #%02d\n", id);
 
     /* create thread and pass context to thread function */
-    pthread_create(&(servers[id].threadID), NULL, server_thread, &(servers[id]));
-    pthread_detach(servers[id].threadID);
+    pthread_create(&(servers[id]->threadID), NULL, server_thread, servers[id]);
 
     return 0;
 }
@@ -0,0 +1,269 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+#include "parser.h"
+
+/* header lines http_parse() keeps, the names are compared case insensitive */
+#define HTTP_HEADER(name, member) {name, sizeof(name) - 1, offsetof(http_parser, member)}
+static const struct {
+    const char *name;
+    int len;
+    size_t offset;
+} http_headers[] = {
+    HTTP_HEADER("Connection", connection),
+    HTTP_HEADER("If-None-Match", if_none_match),
+    HTTP_HEADER("Accept-Encoding", accept_encoding),
+    HTTP_HEADER("Authorization", authorization),
+    HTTP_HEADER("Content-Length", content_length),
+    HTTP_HEADER("Transfer-Encoding", transfer_encoding),
+};
+
+/******************************************************************************
+Description.: prepare a parser for the next request
+Input Value.: p is the parser
+Return Value: -
+******************************************************************************/
+void http_parser_init(http_parser *p)
+{
+    static const http_slice none;
+
+    /* the parameters are only read up to param_count, they need no clearing */
+    p->state = HTTP_REQUEST_LINE;
+    p->pos = p->scan = 0;
+    p->method = p->path = p->query = none;
+    p->minor = -1;
+    p->param_count = 0;
+    p->connection = p->if_none_match = p->accept_encoding = none;
+    p->authorization = p->content_length = p->transfer_encoding = none;
+}
+
+/******************************************************************************
+Description.: split a query string into its key=value pairs
+Input Value.: p is the parser, the query is set
+Return Value: -
+******************************************************************************/
+static void http_split_query(http_parser *p)
+{
+    const char *s = p->query.data, *end = s + p->query.len, *amp, *eq;
+    http_param *param;
+
+    while(s < end && p->param_count < HTTP_PARAMS) {
+        if((amp = memchr(s, '&', end - s)) == NULL)
+            amp = end;
+
+        if(amp > s) {
+            param = &p->params[p->param_count++];
+            if((eq = memchr(s, '=', amp - s)) == NULL)
+                eq = amp;
+            param->key.data = s;
+            param->key.len = eq - s;
+            param->value.data = (eq < amp) ? eq + 1 : amp;
+            param->value.len = amp - param->value.data;
+        }
+
+        s = amp + 1;
+    }
+}
+
+/******************************************************************************
+Description.: parse the request line, "METHOD target HTTP/1.x"
+Input Value.: p is the parser, line the line without its line break
+Return Value: 0 if it is well formed, -1 otherwise
+******************************************************************************/
+static int http_request_line(http_parser *p, const char *line, const char *end)
+{
+    const char *target, *version, *q;
+
+    if((target = memchr(line, ' ', end - line)) == NULL || target == line)
+        return -1;
+    p->method.data = line;
+    p->method.len = target - line;
+
+    target++;
+    if(target == end || *target != '/')
+        return -1;
+    if((version = memchr(target, ' ', end - target)) == NULL)
+        version = end;
+
+    if((q = memchr(target, '?', version - target)) != NULL) {
+        p->query.data = q + 1;
+        p->query.len = version - q - 1;
+        http_split_query(p);
+    } else {
+        q = version;
+    }
+    p->path.data = target;
+    p->path.len = q - target;
+
+    /* HTTP/0.9 requests have no version */
+    if(version < end) {
+        version++;
+        if(end - version != strlen("HTTP/1.x") || strncmp(version, "HTTP/1.", strlen("HTTP/1.")) != 0 ||
+           version[7] < '0' || version[7] > '9')
+            return -1;
+        p->minor = version[7] - '0';
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: keep a header line if the server needs it
+Input Value.: p is the parser, line the line without its line break
+Return Value: -
+******************************************************************************/
+static void http_header(http_parser *p, const char *line, const char *end)
+{
+    const char *colon, *value;
+    http_slice *header;
+    size_t i;
+
+    if((colon = memchr(line, ':', end - line)) == NULL)
+        return;
+
+    for(i = 0; i < sizeof(http_headers) / sizeof(http_headers[0]); i++) {
+        if(colon - line != http_headers[i].len ||
+           strncasecmp(line, http_headers[i].name, colon - line) != 0)
+            continue;
+
+        /* clients send the header once, the first one counts */
+        header = (http_slice *)((char *)p + http_headers[i].offset);
+        if(header->data != NULL)
+            return;
+
+        for(value = colon + 1; value < end && (*value == ' ' || *value == '\t'); value++);
+        while(end > value && (end[-1] == ' ' || end[-1] == '\t'))
+            end--;
+        header->data = value;
+        header->len = end - value;
+        return;
+    }
+}
+
+/******************************************************************************
+Description.: continue to parse a request head. Only the lines which arrived
+              since the last call are looked at, the parser remembers how far
+              it got.
+Input Value.: p is the parser, buffer holds the bytes of the connection read
+              so far, len is their number
+Return Value: length of the request head once it is complete, 0 if it is not
+              complete yet, -1 if it is malformed
+******************************************************************************/
+int http_parse(http_parser *p, const char *buffer, int len)
+{
+    const char *line, *end, *eol;
+
+    while(p->state != HTTP_DONE) {
+        /* clients may send empty lines before a request */
+        if(p->state == HTTP_REQUEST_LINE) {
+            while(p->pos < len && (buffer[p->pos] == '\r' || buffer[p->pos] == '\n'))
+                p->pos++;
+        }
+        if(p->scan < p->pos)
+            p->scan = p->pos;
+
+        if((eol = memchr(buffer + p->scan, '\n', len - p->scan)) == NULL) {
+            p->scan = len;
+            return 0;
+        }
+
+        line = buffer + p->pos;
+        end = (eol > line && eol[-1] == '\r') ? eol - 1 : eol;
+
+        if(p->state == HTTP_REQUEST_LINE) {
+            if(http_request_line(p, line, end) != 0)
+                return -1;
+            p->state = HTTP_HEADERS;
+        } else if(end == line) {
+            p->state = HTTP_DONE;
+        } else {
+            http_header(p, line, end);
+        }
+
+        p->pos = p->scan = eol + 1 - buffer;
+    }
+
+    return p->pos;
+}
+
+/******************************************************************************
+Description.: look up a parameter of the query string
+Input Value.: p is the parsed request, key the name of the parameter
+Return Value: its value, NULL if there is no such parameter
+******************************************************************************/
+const http_slice *http_query(const http_parser *p, const char *key)
+{
+    int i;
+
+    for(i = 0; i < p->param_count; i++) {
+        if(http_slice_is(&p->params[i].key, key))
+            return &p->params[i].value;
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: compare a slice with a string
+Input Value.: s is the slice, string the string
+Return Value: 1 if they are equal, 0 otherwise
+******************************************************************************/
+int http_slice_is(const http_slice *s, const char *string)
+{
+    int len = strlen(string);
+
+    return s->len == len && memcmp(s->data, string, len) == 0;
+}
+
+/******************************************************************************
+Description.: check if a slice starts with a string, ignoring the case as
+              header values do
+Input Value.: s is the slice, prefix the string
+Return Value: 1 if it does, 0 otherwise
+******************************************************************************/
+int http_slice_starts(const http_slice *s, const char *prefix)
+{
+    int len = strlen(prefix);
+
+    return s->len >= len && strncasecmp(s->data, prefix, len) == 0;
+}
+
+/******************************************************************************
+Description.: read the decimal number a slice starts with
+Input Value.: s is the slice
+Return Value: the number, 0 if there is none
+******************************************************************************/
+long http_slice_number(const http_slice *s)
+{
+    long n = 0;
+    int i;
+
+    /* 18 digits fit into a long */
+    for(i = 0; i < s->len && i < 18 && s->data[i] >= '0' && s->data[i] <= '9'; i++)
+        n = n * 10 + (s->data[i] - '0');
+
+    return n;
+}
@@ -0,0 +1,82 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef PARSER_H
+#define PARSER_H
+
+/* query parameters kept per request, further ones are ignored */
+#define HTTP_PARAMS 16
+
+/*
+ * a piece of the buffer a request head was read into, it is not zero
+ * terminated. An empty slice of a header means it was not sent.
+ */
+typedef struct {
+    const char *data;
+    int len;
+} http_slice;
+
+typedef struct {
+    http_slice key;
+    http_slice value;           /* raw, %XX is not decoded */
+} http_param;
+
+/* how far http_parse() got */
+typedef enum {
+    HTTP_REQUEST_LINE,
+    HTTP_HEADERS,
+    HTTP_DONE
+} http_state;
+
+/*
+ * an HTTP/1.x request head, parsed while it arrives. It points into the
+ * buffer it was read into, which must not move until the request is served.
+ */
+typedef struct {
+    http_state state;
+    int pos;                    /* start of the first line not parsed yet */
+    int scan;                   /* searched for the end of that line up to here */
+
+    http_slice method;
+    http_slice path;            /* request target without the query */
+    http_slice query;           /* after the '?', empty if there is none */
+    int minor;                  /* HTTP/1.<minor>, -1 for a request without version */
+    http_param params[HTTP_PARAMS];
+    int param_count;
+
+    /* the header lines the server needs, others are skipped */
+    http_slice connection;
+    http_slice if_none_match;
+    http_slice accept_encoding;
+    http_slice authorization;
+    http_slice content_length;
+    http_slice transfer_encoding;
+} http_parser;
+
+void http_parser_init(http_parser *p);
+int http_parse(http_parser *p, const char *buffer, int len);
+const http_slice *http_query(const http_parser *p, const char *key);
+int http_slice_is(const http_slice *s, const char *string);
+int http_slice_starts(const http_slice *s, const char *prefix);
+long http_slice_number(const http_slice *s);
+
+#endif
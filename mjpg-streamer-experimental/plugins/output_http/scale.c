@@ -0,0 +1,196 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#ifndef NO_LIBJPEG
+#include <jpeglib.h>
+#endif
+
+#include "scale.h"
+
+#ifndef NO_LIBJPEG
+/* libjpeg reports errors by calling error_exit, which must not return */
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+} scale_error;
+
+/* the encoder writes into a buffer which grows, it is owned by the caller */
+typedef struct {
+    struct jpeg_destination_mgr pub;
+    unsigned char *buf;
+    unsigned long size;
+} scale_destination;
+
+/* the first guess of the size of a copy, it grows as needed */
+#define SCALE_BUFFER (16*1024)
+
+/******************************************************************************
+Description.: leave the decoder or encoder which failed, broken frames must
+              not end the program
+Input Value.: cinfo is the decoder or encoder
+Return Value: does not return
+******************************************************************************/
+static void scale_error_exit(j_common_ptr cinfo)
+{
+    scale_error *err = (scale_error *)cinfo->err;
+
+    longjmp(err->jump, 1);
+}
+
+/******************************************************************************
+Description.: called by jpeg_start_compress() before any data is written
+Input Value.: cinfo is the encoder
+Return Value: -
+******************************************************************************/
+static void scale_init_destination(j_compress_ptr cinfo)
+{
+    scale_destination *dest = (scale_destination *)cinfo->dest;
+
+    dest->pub.next_output_byte = dest->buf;
+    dest->pub.free_in_buffer = dest->size;
+}
+
+/******************************************************************************
+Description.: called by the encoder if the buffer is full, it is doubled
+Input Value.: cinfo is the encoder
+Return Value: TRUE
+******************************************************************************/
+static boolean scale_empty_output_buffer(j_compress_ptr cinfo)
+{
+    scale_destination *dest = (scale_destination *)cinfo->dest;
+    unsigned char *grown;
+
+    /* scale_error_exit() leaves the encoder */
+    if((grown = realloc(dest->buf, dest->size * 2)) == NULL)
+        (*cinfo->err->error_exit)((j_common_ptr)cinfo);
+
+    dest->buf = grown;
+    dest->pub.next_output_byte = dest->buf + dest->size;
+    dest->pub.free_in_buffer = dest->size;
+    dest->size *= 2;
+
+    return TRUE;
+}
+
+/******************************************************************************
+Description.: called by jpeg_finish_compress() after all data was written
+Input Value.: cinfo is the encoder
+Return Value: -
+******************************************************************************/
+static void scale_term_destination(j_compress_ptr cinfo)
+{
+    scale_destination *dest = (scale_destination *)cinfo->dest;
+
+    dest->size -= dest->pub.free_in_buffer;
+}
+#endif
+
+/******************************************************************************
+Description.: make a smaller copy of a JPG. The DCT coefficients are
+              decoded at the reduced size right away, so a 1/8 copy only
+              needs the DC values of each block instead of a whole picture
+              which is downsampled afterwards. With step 0 the JPG keeps its
+              size and is only encoded again at a lower quality.
+Input Value.: * jpeg.....: the JPG
+              * size.....: its length
+              * step.....: 1, 2 or 3 for 1/2, 1/4 or 1/8 of width and height,
+                           0 for the same size
+              * quality..: JPG quality of the copy
+              * out......: gets the copy, allocated with malloc(), its buffer
+                           may be larger than the copy
+              * out_size.: gets its length
+Return Value: 0 if the copy was made, -1 otherwise
+******************************************************************************/
+int jpeg_scale(const unsigned char *jpeg, int size, int step, int quality,
+               unsigned char **out, unsigned long *out_size)
+{
+#ifdef NO_LIBJPEG
+    return -1;
+#else
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_compress_struct cinfo;
+    scale_destination dest;
+    scale_error err;
+    JSAMPARRAY rows;
+    JDIMENSION n;
+
+    if((dest.buf = malloc(SCALE_BUFFER)) == NULL)
+        return -1;
+    dest.size = SCALE_BUFFER;
+    dest.pub.init_destination = scale_init_destination;
+    dest.pub.empty_output_buffer = scale_empty_output_buffer;
+    dest.pub.term_destination = scale_term_destination;
+
+    /* both are created before anything can fail, so both can be destroyed */
+    dinfo.err = cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = scale_error_exit;
+    jpeg_create_decompress(&dinfo);
+    jpeg_create_compress(&cinfo);
+
+    if(setjmp(err.jump) != 0) {
+        jpeg_destroy_decompress(&dinfo);
+        jpeg_destroy_compress(&cinfo);
+        free(dest.buf);
+        return -1;
+    }
+
+    jpeg_mem_src(&dinfo, (unsigned char *)jpeg, size);
+    jpeg_read_header(&dinfo, TRUE);
+    dinfo.scale_num = 1;
+    dinfo.scale_denom = 1 << step;
+    dinfo.dct_method = JDCT_IFAST;
+    dinfo.do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(&dinfo);
+
+    cinfo.dest = &dest.pub;
+    cinfo.image_width = dinfo.output_width;
+    cinfo.image_height = dinfo.output_height;
+    cinfo.input_components = dinfo.output_components;
+    cinfo.in_color_space = dinfo.out_color_space;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.dct_method = JDCT_IFAST;
+    jpeg_start_compress(&cinfo, TRUE);
+
+    /* the rows are allocated by libjpeg and freed with the decoder */
+    rows = (*dinfo.mem->alloc_sarray)((j_common_ptr)&dinfo, JPOOL_IMAGE,
+                                      dinfo.output_width * dinfo.output_components, dinfo.rec_outbuf_height);
+    while(dinfo.output_scanline < dinfo.output_height) {
+        n = jpeg_read_scanlines(&dinfo, rows, dinfo.rec_outbuf_height);
+        jpeg_write_scanlines(&cinfo, rows, n);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_finish_decompress(&dinfo);
+    jpeg_destroy_compress(&cinfo);
+    jpeg_destroy_decompress(&dinfo);
+
+    *out = dest.buf;
+    *out_size = dest.size;
+    return 0;
+#endif
+}
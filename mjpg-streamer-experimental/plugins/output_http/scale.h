@@ -0,0 +1,35 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef SCALE_H
+#define SCALE_H
+
+/* a frame can be sent at 1/2, 1/4 and 1/8 of its size, the step is the shift */
+#define SCALE_STEPS 3
+
+/* JPG quality of a scaled frame if the input did not tell the one of the frame */
+#define SCALE_QUALITY 80
+
+int jpeg_scale(const unsigned char *jpeg, int size, int step, int quality,
+               unsigned char **out, unsigned long *out_size);
+
+#endif
@@ -0,0 +1,388 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef NO_OPENSSL
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+#include "tls.h"
+
+#ifndef NO_OPENSSL
+/* pieces smaller than a record are gathered, so a part header does not become a record of its own */
+#define TLS_RECORD 16384
+
+/* sessions are kept in chunks, a chunk is allocated once one of its sockets uses TLS */
+#define TLS_CHUNK 4096
+
+/* more sockets than this are not looked up, their clients are refused */
+#define TLS_SOCKETS_MAX (TLS_CHUNK * 4096)
+
+typedef struct {
+    SSL *ssl;
+    int offloaded;              /* the kernel encrypts what is written to the socket */
+} tls_session;
+
+/*
+ * the session of each socket, indexed by the socket number. Chunks never move
+ * and are only added, so they are read without the lock. A socket is only
+ * used by one thread at a time, the entries need no lock either.
+ */
+static tls_session **sessions[TLS_SOCKETS_MAX / TLS_CHUNK];
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/******************************************************************************
+Description.: find the entry of a socket in the session table
+Input Value.: fd is the socket, create allocates its chunk if it is missing
+Return Value: the entry, NULL if there is none or no memory
+******************************************************************************/
+static tls_session **tls_entry(int fd, int create)
+{
+    tls_session **chunk;
+
+    if(fd < 0 || fd >= TLS_SOCKETS_MAX)
+        return NULL;
+
+    if((chunk = __atomic_load_n(&sessions[fd / TLS_CHUNK], __ATOMIC_ACQUIRE)) == NULL && create) {
+        pthread_mutex_lock(&sessions_lock);
+        if((chunk = sessions[fd / TLS_CHUNK]) == NULL &&
+           (chunk = calloc(TLS_CHUNK, sizeof(tls_session *))) != NULL) {
+            __atomic_store_n(&sessions[fd / TLS_CHUNK], chunk, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&sessions_lock);
+    }
+
+    return (chunk != NULL) ? &chunk[fd % TLS_CHUNK] : NULL;
+}
+
+/******************************************************************************
+Description.: look up the TLS session of a socket
+Input Value.: fd is the socket
+Return Value: the session, NULL if it is a plain socket
+******************************************************************************/
+static tls_session *tls_session_of(int fd)
+{
+    tls_session **entry = tls_entry(fd, 0);
+
+    return (entry != NULL) ? *entry : NULL;
+}
+
+/******************************************************************************
+Description.: turn the result of a failed SSL_read() or SSL_write() into
+              the result read() or write() would have
+Input Value.: s is the session, rc the result
+Return Value: 0 if the client closed the connection, -1 with errno set
+              otherwise
+******************************************************************************/
+static ssize_t tls_result(tls_session *s, int rc)
+{
+    switch(SSL_get_error(s->ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if(errno == 0)
+            errno = ECONNRESET;
+        return -1;
+    default:
+        errno = EPROTO;
+        return -1;
+    }
+}
+#endif
+
+/******************************************************************************
+Description.: prepare HTTPS for a server
+Input Value.: certificate is the PEM file with the certificate chain, key
+              the one with the private key, NULL if it is in the first one
+Return Value: the context to pass to tls_accept(), NULL if it could not be
+              created
+******************************************************************************/
+void *tls_context(const char *certificate, const char *key)
+{
+#ifdef NO_OPENSSL
+    fprintf(stderr, "compiled without OpenSSL, HTTPS is not available\n");
+    return NULL;
+#else
+    SSL_CTX *ctx;
+
+    if((ctx = SSL_CTX_new(TLS_server_method())) == NULL) {
+        ERR_print_errors_fp(stderr);
+        return NULL;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                     SSL_MODE_RELEASE_BUFFERS);
+    #ifdef SSL_OP_ENABLE_KTLS
+    /* OpenSSL hands the keys to the kernel after the handshake if it supports the cipher */
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    #endif
+    #ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* browsers close their connections without close_notify */
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    #endif
+    /* nothing may be written by OpenSSL after the handshake, sockets the kernel encrypts are written directly */
+    SSL_CTX_set_num_tickets(ctx, 0);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+
+    if(SSL_CTX_use_certificate_chain_file(ctx, certificate) != 1 ||
+       SSL_CTX_use_PrivateKey_file(ctx, (key != NULL) ? key : certificate, SSL_FILETYPE_PEM) != 1 ||
+       SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+#endif
+}
+
+/******************************************************************************
+Description.: free a context of tls_context()
+Input Value.: ctx is the context, the sessions made with it have to be gone
+Return Value: -
+******************************************************************************/
+void tls_context_free(void *ctx)
+{
+#ifndef NO_OPENSSL
+    SSL_CTX_free(ctx);
+#endif
+}
+
+/******************************************************************************
+Description.: start a TLS session for a client which just connected, the
+              handshake is done with tls_handshake()
+Input Value.: ctx is the context of the server, fd the socket
+Return Value: 0 if the session was created, -1 otherwise
+******************************************************************************/
+int tls_accept(void *ctx, int fd)
+{
+#ifdef NO_OPENSSL
+    return -1;
+#else
+    tls_session **entry, *s;
+
+    if((entry = tls_entry(fd, 1)) == NULL || (s = malloc(sizeof(tls_session))) == NULL)
+        return -1;
+
+    if((s->ssl = SSL_new(ctx)) == NULL || SSL_set_fd(s->ssl, fd) != 1) {
+        SSL_free(s->ssl);
+        free(s);
+        return -1;
+    }
+    SSL_set_accept_state(s->ssl);
+    s->offloaded = 0;
+    *entry = s;
+
+    return 0;
+#endif
+}
+
+/******************************************************************************
+Description.: continue the handshake of a client on a non-blocking socket.
+              Once it is done the kernel takes over the encryption if it can.
+Input Value.: fd is the socket
+Return Value: 0 if the handshake is done, TLS_WANT_READ or TLS_WANT_WRITE
+              if the socket has to become readable or writable first, -1 if
+              it failed
+******************************************************************************/
+int tls_handshake(int fd)
+{
+#ifdef NO_OPENSSL
+    return -1;
+#else
+    tls_session *s = tls_session_of(fd);
+    int rc;
+
+    if(s == NULL)
+        return -1;
+
+    ERR_clear_error();
+    if((rc = SSL_do_handshake(s->ssl)) == 1) {
+        #ifdef BIO_get_ktls_send
+        s->offloaded = BIO_get_ktls_send(SSL_get_wbio(s->ssl));
+        #endif
+        return 0;
+    }
+
+    switch(SSL_get_error(s->ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+        return TLS_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        return TLS_WANT_WRITE;
+    default:
+        return -1;
+    }
+#endif
+}
+
+/******************************************************************************
+Description.: tell if the kernel encrypts what is written to a socket
+Input Value.: fd is the socket
+Return Value: 1 if it does, 0 for userspace encryption or a plain socket
+******************************************************************************/
+int tls_offloaded(int fd)
+{
+#ifdef NO_OPENSSL
+    return 0;
+#else
+    tls_session *s = tls_session_of(fd);
+
+    return s != NULL && s->offloaded;
+#endif
+}
+
+/******************************************************************************
+Description.: read from a socket like read() does
+Input Value.: fd is the socket, buf and len the buffer
+Return Value: bytes read, 0 if the client closed the connection, -1 with
+              errno set otherwise
+******************************************************************************/
+ssize_t tls_read(int fd, void *buf, size_t len)
+{
+#ifdef NO_OPENSSL
+    return read(fd, buf, len);
+#else
+    tls_session *s = tls_session_of(fd);
+    int rc;
+
+    if(s == NULL)
+        return read(fd, buf, len);
+
+    ERR_clear_error();
+    if((rc = SSL_read(s->ssl, buf, (len > INT_MAX) ? INT_MAX : len)) > 0)
+        return rc;
+
+    return tls_result(s, rc);
+#endif
+}
+
+/******************************************************************************
+Description.: write to a socket like write() does
+Input Value.: fd is the socket, buf and len the buffer
+Return Value: bytes written, -1 with errno set if nothing could be written
+******************************************************************************/
+ssize_t tls_write(int fd, const void *buf, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+
+    return tls_writev(fd, &iov, 1);
+}
+
+/******************************************************************************
+Description.: write to a socket like writev() does. Encrypted in userspace,
+              the buffers are written until all are written or the socket
+              is full, so blocking sockets get everything written.
+Input Value.: fd is the socket, iov and count the buffers
+Return Value: bytes written, -1 with errno set if nothing could be written
+******************************************************************************/
+ssize_t tls_writev(int fd, const struct iovec *iov, int count)
+{
+#ifdef NO_OPENSSL
+    return writev(fd, iov, count);
+#else
+    tls_session *s = tls_session_of(fd);
+    char merged[TLS_RECORD];
+    const char *data;
+    size_t off = 0, start, len, n, done = 0;
+    int i = 0, j, rc;
+
+    if(s == NULL || s->offloaded)
+        return writev(fd, iov, count);
+
+    while(i < count) {
+        if(iov[i].iov_len - off >= TLS_RECORD) {
+            /* large buffers like frames are encrypted from where they are */
+            data = (const char *)iov[i].iov_base + off;
+            len = iov[i].iov_len - off;
+        } else {
+            /* a retry after the socket was full has to gather the same bytes again */
+            len = 0;
+            for(j = i; j < count && len < sizeof(merged); j++) {
+                start = (j == i) ? off : 0;
+                if((n = iov[j].iov_len - start) > sizeof(merged) - len)
+                    n = sizeof(merged) - len;
+                memcpy(merged + len, (const char *)iov[j].iov_base + start, n);
+                len += n;
+            }
+            data = merged;
+        }
+
+        if(len == 0) {
+            i++;
+            off = 0;
+            continue;
+        }
+
+        ERR_clear_error();
+        if((rc = SSL_write(s->ssl, data, (len > INT_MAX) ? INT_MAX : len)) <= 0)
+            return (done > 0) ? (ssize_t)done : tls_result(s, rc);
+
+        /* skip what was written */
+        done += rc;
+        for(n = rc; i < count && n >= iov[i].iov_len - off; i++, off = 0)
+            n -= iov[i].iov_len - off;
+        off += n;
+    }
+
+    return done;
+#endif
+}
+
+/******************************************************************************
+Description.: close a socket and free its TLS session. The client is told
+              with close_notify, its answer is not waited for.
+Input Value.: fd is the socket
+Return Value: the result of close()
+******************************************************************************/
+int tls_close(int fd)
+{
+#ifndef NO_OPENSSL
+    tls_session **entry = tls_entry(fd, 0), *s;
+
+    /* another thread may get the same socket number once it is closed */
+    if(entry != NULL && (s = *entry) != NULL) {
+        *entry = NULL;
+        if(SSL_is_init_finished(s->ssl))
+            SSL_shutdown(s->ssl);
+        SSL_free(s->ssl);
+        free(s);
+    }
+#endif
+
+    return close(fd);
+}
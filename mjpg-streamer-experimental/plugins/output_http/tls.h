@@ -0,0 +1,50 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* what tls_handshake() waits for */
+#define TLS_WANT_READ 1
+#define TLS_WANT_WRITE 2
+
+/*
+ * HTTPS connections are looked up by their socket, so the functions which
+ * only get the socket can write to them. Sockets without a TLS session are
+ * read and written directly. So are sessions the kernel encrypts (kTLS)
+ * once the handshake is done, the frames are written with the same
+ * writev() as for plain HTTP then.
+ */
+void *tls_context(const char *certificate, const char *key);
+void tls_context_free(void *ctx);
+int tls_accept(void *ctx, int fd);
+int tls_handshake(int fd);
+int tls_offloaded(int fd);
+ssize_t tls_read(int fd, void *buf, size_t len);
+ssize_t tls_write(int fd, const void *buf, size_t len);
+ssize_t tls_writev(int fd, const struct iovec *iov, int count);
+int tls_close(int fd);
+
+#endif
@@ -65,10 +65,10 @@ enum RTSP_State {
 
 static pthread_t worker;
 static globals *pglobal;
-static int fd, max_frame_size;
-static unsigned char *frame = NULL;
+static int fd;
 static char *command = NULL;
 static int input_number = 0;
+static int output_number = 0;
 
 // UDP port
 static int port = 554;
@@ -106,9 +106,6 @@ void worker_cleanup(void *arg)
     first_run = 0;
     OPRINT("cleaning up resources allocated by worker thread\n");
 
-    if(frame != NULL) {
-        free(frame);
-    }
     close(fd);
 }
 
@@ -120,9 +117,10 @@ Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int ok = 1, frame_size = 0, rc = 0;
+    int ok = 1, rc = 0;
     char buffer1[1024] = {0};
-    unsigned char *tmp_framebuffer = NULL;
+    frame *f;
+    frame_cursor cursor = {0, 0};
 
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
@@ -156,53 +154,43 @@ void *worker_thread(void *arg)
 
 
 
+        /*
+         * the frame has to be captured after the request came in, waiting
+         * for it also wakes up an on-demand input
+         */
         DBG("waiting for fresh frame\n");
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
-
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-
-        /* check if buffer for frame is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
-
-            max_frame_size = frame_size + (1 << 16);
-            if((tmp_framebuffer = realloc(frame, max_frame_size)) == NULL) {
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                LOG("not enough memory\n");
-                return NULL;
-            }
+        frame_cursor_init(pglobal->in[input_number], &cursor);
+        f = frame_wait(pglobal->in[input_number], &cursor);
 
-            frame = tmp_framebuffer;
-        }
-
-        /* copy frame to our local buffer now */
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-
-        /* allow others to access the global buffer again */
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        /* the input was removed, it never delivers frames again */
+        if(f == NULL)
+            break;
 
         /* only save a file if a name came in with the UDP message */
-        if(strlen(udpbuffer) > 0) {
+        if(strlen(udpbuffer) > 0 && frame_jpeg(f) == 0) {
             DBG("writing file: %s\n", udpbuffer);
 
             /* open file for write. Path must pre-exist */
             if((fd = open(udpbuffer, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
                 OPRINT("could not open the file %s\n", udpbuffer);
+                frame_put(f);
                 return NULL;
             }
 
-            /* save picture to file */
-            if(write(fd, frame, frame_size) < 0) {
+            /* save picture to file, the frame stays valid while we hold it */
+            if(write(fd, f->buf, f->size) < 0) {
                 OPRINT("could not write to file %s\n", udpbuffer);
                 perror("write()");
                 close(fd);
+                frame_put(f);
                 return NULL;
             }
 
+            trace_frame_sent(pglobal->out[output_number], f, f->size);
+
             close(fd);
         }
+        frame_put(f);
 
         // send back client's message that came in udpbuffer
         sendto(sd, udpbuffer, bytes, 0, (struct sockaddr*)&addr, sizeof(addr));
@@ -303,12 +291,13 @@ int output_init(output_parameter *param)
     }
 
     pglobal = param->global;
-    if(!(input_number < pglobal->incnt)) {
+    output_number = param->id;
+    if(!INPUT_VALID(pglobal, input_number)) {
         OPRINT("ERROR: the %d input_plugin number is too much only %d plugins loaded\n", input_number, pglobal->incnt);
         return 1;
     }
 
-    OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number].plugin);
+    OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number]->plugin);
     OPRINT("UDP port..........: %d\n", port);
     return 0;
 }
@@ -322,6 +311,7 @@ int output_stop(int id)
 {
     DBG("will cancel worker thread\n");
     pthread_cancel(worker);
+    pthread_join(worker, NULL);
     return 0;
 }
 
@@ -334,7 +324,6 @@ int output_run(int id)
 {
     DBG("launching worker thread\n");
     pthread_create(&worker, 0, worker_thread, NULL);
-    pthread_detach(worker);
     return 0;
 }
 
@@ -0,0 +1,405 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  This output plugin exports the frames of one input plugin through a POSIX
+  shared memory region, see output_shm.h for the layout. Other processes map
+  the region and read the JPG data in place, every frame is copied exactly
+  once, from the frame ring into a slot of the region.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "../../utils.h"
+#include "../../mjpg_streamer.h"
+#include "output_shm.h"
+
+#define OUTPUT_PLUGIN_NAME "Shared memory output plugin"
+
+/* state of a single instance, indexed by the output plugin id */
+typedef struct _context context;
+struct _context {
+    int id;
+    globals *pglobal;
+    pthread_t worker;
+    int input_number;
+    char name[NAME_MAX];
+    unsigned int slot_count;
+    unsigned int data_size;
+    int fd;
+    size_t length;
+    shm_frame_header *hdr;
+};
+
+static context **instances;
+static int instance_slots;
+
+/******************************************************************************
+Description.: print a help message
+Input Value.: -
+Return Value: -
+******************************************************************************/
+void help(void)
+{
+    fprintf(stderr, " ---------------------------------------------------------------\n" \
+            " Help for output plugin..: "OUTPUT_PLUGIN_NAME"\n" \
+            " ---------------------------------------------------------------\n" \
+            " The following parameters can be passed to this plugin:\n\n" \
+            " [-n | --name ]..........: name of the shared memory object,\n" \
+            "                           default /mjpg_streamer.<input>\n" \
+            " [-s | --slots ].........: number of frames kept in the region (default %d)\n" \
+            " [-m | --max_size ]......: largest JPG in KiB a slot can hold (default %d)\n" \
+            " [-i | --input ].........: read frames from the specified input plugin (first input plugin between the arguments is the 0th)\n\n" \
+            " ---------------------------------------------------------------\n",
+            SHM_FRAME_DEFAULT_SLOTS, SHM_FRAME_DEFAULT_SIZE / 1024);
+}
+
+/******************************************************************************
+Description.: create the shared memory object and map it
+Input Value.: ctx is the instance, name, slot_count and data_size are set
+Return Value: 0 if the region is ready, -1 otherwise
+******************************************************************************/
+static int create_region(context *ctx)
+{
+    shm_frame_header *hdr;
+    size_t slot_size;
+
+    /* keep every slot cache line aligned */
+    slot_size = (sizeof(shm_frame_slot) + ctx->data_size + 63) & ~(size_t)63;
+    ctx->length = sizeof(shm_frame_header) + ctx->slot_count * slot_size;
+
+    /* a previous run which crashed leaves the object behind, start over */
+    shm_unlink(ctx->name);
+    if((ctx->fd = shm_open(ctx->name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) < 0) {
+        OPRINT("could not create shared memory object %s: %s\n", ctx->name, strerror(errno));
+        return -1;
+    }
+
+    if(ftruncate(ctx->fd, ctx->length) < 0) {
+        OPRINT("could not resize shared memory object %s: %s\n", ctx->name, strerror(errno));
+        goto error;
+    }
+
+    hdr = mmap(NULL, ctx->length, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->fd, 0);
+    if(hdr == MAP_FAILED) {
+        OPRINT("could not map shared memory object %s: %s\n", ctx->name, strerror(errno));
+        goto error;
+    }
+
+    /* ftruncate() zeroed the region, only the constant fields are left */
+    hdr->version = SHM_FRAME_VERSION;
+    hdr->header_size = sizeof(shm_frame_header);
+    hdr->slot_count = ctx->slot_count;
+    hdr->slot_size = slot_size;
+    hdr->data_size = ctx->data_size;
+    hdr->latest = ctx->slot_count - 1;
+    hdr->pid = getpid();
+    __atomic_store_n(&hdr->magic, SHM_FRAME_MAGIC, __ATOMIC_RELEASE);
+
+    ctx->hdr = hdr;
+    return 0;
+
+error:
+    close(ctx->fd);
+    shm_unlink(ctx->name);
+    return -1;
+}
+
+/******************************************************************************
+Description.: copy a frame into the next slot and wake up sleeping readers
+Input Value.: hdr is the mapped region, f the frame with its JPG data ready
+Return Value: 0 if the frame was exported, -1 if it does not fit into a slot
+******************************************************************************/
+static int export_frame(shm_frame_header *hdr, frame *f)
+{
+    unsigned int index = (hdr->latest + 1) % hdr->slot_count;
+    shm_frame_slot *slot = SHM_FRAME_SLOT(hdr, index);
+    uint32_t lock = slot->lock;
+
+    if(f->size < 0 || (uint32_t)f->size > hdr->data_size) {
+        __atomic_add_fetch(&hdr->dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    /* an odd lock tells readers the slot is inconsistent right now */
+    __atomic_store_n(&slot->lock, lock + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->seq = f->seq;
+    slot->size = f->size;
+    slot->width = (f->width > 0) ? f->width : 0;
+    slot->height = (f->height > 0) ? f->height : 0;
+    /* f->format is what the input captured, the slot holds the JPG made from it */
+    slot->format = V4L2_PIX_FMT_MJPEG;
+    slot->quality = f->quality;
+    slot->timestamp_us = (int64_t)f->timestamp.tv_sec * 1000000 + f->timestamp.tv_usec;
+    memcpy(SHM_FRAME_DATA(slot), f->buf, f->size);
+
+    __atomic_store_n(&slot->lock, lock + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->latest, index, __ATOMIC_RELEASE);
+
+    /*
+     * store seq before waiters is checked, a reader increments waiters before
+     * it checks seq, so one of both sides always sees the other
+     */
+    __atomic_store_n(&hdr->seq, f->seq, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&hdr->waiters, __ATOMIC_SEQ_CST) > 0) {
+        syscall(SYS_futex, &hdr->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: clean up allocated resources
+Input Value.: arg is the instance
+Return Value: -
+******************************************************************************/
+void worker_cleanup(void *arg)
+{
+    context *ctx = arg;
+
+    OPRINT("cleaning up resources allocated by worker thread #%02d\n", ctx->id);
+
+    frame_unsubscribe(ctx->pglobal->in[ctx->input_number]);
+
+    /* tell readers the region is dead and wake up those sleeping on seq */
+    __atomic_store_n(&ctx->hdr->magic, 0, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ctx->hdr->seq, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &ctx->hdr->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+    munmap(ctx->hdr, ctx->length);
+    close(ctx->fd);
+    shm_unlink(ctx->name);
+}
+
+/******************************************************************************
+Description.: this is the main worker thread
+              it loops forever and exports every frame of the input
+Input Value.: arg is the instance
+Return Value: -
+******************************************************************************/
+void *worker_thread(void *arg)
+{
+    context *ctx = arg;
+    input *in = ctx->pglobal->in[ctx->input_number];
+    frame_cursor cursor = {0, 0};
+    frame *f;
+
+    /* set cleanup handler to cleanup allocated resources */
+    pthread_cleanup_push(worker_cleanup, ctx);
+
+    /* readers can not be counted, keep an on-demand input capturing */
+    frame_subscribe(in);
+
+    while(!ctx->pglobal->stop) {
+        f = frame_wait(in, &cursor);
+
+        /* the input was removed, it never delivers frames again */
+        if(f == NULL)
+            break;
+
+        if(frame_jpeg(f) == 0 && export_frame(ctx->hdr, f) == 0) {
+            trace_frame_sent(ctx->pglobal->out[ctx->id], f, f->size);
+        }
+        frame_put(f);
+    }
+
+    /* cleanup now */
+    pthread_cleanup_pop(1);
+
+    return NULL;
+}
+
+/*** plugin interface functions ***/
+/******************************************************************************
+Description.: this function is called first, in order to initialise
+              this plugin and pass a parameter string
+Input Value.: parameters
+Return Value: 0 if everything is ok, non-zero otherwise
+******************************************************************************/
+int output_init(output_parameter *param)
+{
+    context *ctx;
+    char *name = NULL;
+    int i, input_number = 0, slots = SHM_FRAME_DEFAULT_SLOTS, max_size = SHM_FRAME_DEFAULT_SIZE / 1024;
+
+    param->argv[0] = OUTPUT_PLUGIN_NAME;
+
+    /* show all parameters for DBG purposes */
+    for(i = 0; i < param->argc; i++) {
+        DBG("argv[%d]=%s\n", i, param->argv[i]);
+    }
+
+    reset_getopt();
+    while(1) {
+        int option_index = 0, c = 0;
+        static struct option long_options[] = {
+            {"h", no_argument, 0, 0
+            },
+            {"help", no_argument, 0, 0},
+            {"n", required_argument, 0, 0},
+            {"name", required_argument, 0, 0},
+            {"s", required_argument, 0, 0},
+            {"slots", required_argument, 0, 0},
+            {"m", required_argument, 0, 0},
+            {"max_size", required_argument, 0, 0},
+            {"i", required_argument, 0, 0},
+            {"input", required_argument, 0, 0},
+            {0, 0, 0, 0}
+        };
+
+        c = getopt_long_only(param->argc, param->argv, "", long_options, &option_index);
+
+        /* no more options to parse */
+        if(c == -1) break;
+
+        /* unrecognized option */
+        if(c == '?') {
+            help();
+            return 1;
+        }
+
+        switch(option_index) {
+            /* h, help */
+        case 0:
+        case 1:
+            DBG("case 0,1\n");
+            help();
+            return 1;
+            break;
+
+            /* n, name */
+        case 2:
+        case 3:
+            DBG("case 2,3\n");
+            name = optarg;
+            break;
+
+            /* s, slots */
+        case 4:
+        case 5:
+            DBG("case 4,5\n");
+            slots = atoi(optarg);
+            break;
+
+            /* m, max_size */
+        case 6:
+        case 7:
+            DBG("case 6,7\n");
+            max_size = atoi(optarg);
+            break;
+
+            /* i, input */
+        case 8:
+        case 9:
+            DBG("case 8,9\n");
+            input_number = atoi(optarg);
+            break;
+        }
+    }
+
+    if(!INPUT_VALID(param->global, input_number)) {
+        OPRINT("ERROR: the %d input_plugin number is too much only %d plugins loaded\n", input_number, param->global->incnt);
+        return 1;
+    }
+
+    /* two slots at least, otherwise the only slot is overwritten while it is read */
+    if(slots < 2 || max_size <= 0 || max_size > 1024 * 1024) {
+        OPRINT("ERROR: invalid number of slots or slot size\n");
+        return 1;
+    }
+
+    if(param->id >= instance_slots) {
+        context **grown = realloc(instances, (param->id + 1) * sizeof(context *));
+        if(grown == NULL) {
+            OPRINT("not enough memory\n");
+            return 1;
+        }
+        memset(grown + instance_slots, 0, (param->id + 1 - instance_slots) * sizeof(context *));
+        instances = grown;
+        instance_slots = param->id + 1;
+    }
+    if(instances[param->id] == NULL && (instances[param->id] = calloc(1, sizeof(context))) == NULL) {
+        OPRINT("not enough memory\n");
+        return 1;
+    }
+
+    ctx = instances[param->id];
+    ctx->id = param->id;
+    ctx->pglobal = param->global;
+    ctx->input_number = input_number;
+    ctx->slot_count = slots;
+    ctx->data_size = max_size * 1024;
+    if(name != NULL) {
+        snprintf(ctx->name, sizeof(ctx->name), "%s%s", (name[0] == '/') ? "" : "/", name);
+    } else {
+        snprintf(ctx->name, sizeof(ctx->name), "/mjpg_streamer.%d", input_number);
+    }
+
+    if(create_region(ctx) < 0) {
+        return 1;
+    }
+
+    OPRINT("input plugin.....: %d: %s\n", input_number, param->global->in[input_number]->plugin);
+    OPRINT("shared memory....: %s\n", ctx->name);
+    OPRINT("slots............: %d of %d KiB\n", slots, max_size);
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: calling this function stops the worker thread
+Input Value.: id determines which instance to stop
+Return Value: always 0
+******************************************************************************/
+int output_stop(int id)
+{
+    DBG("will cancel worker thread #%02d\n", id);
+    pthread_cancel(instances[id]->worker);
+    pthread_join(instances[id]->worker, NULL);
+    return 0;
+}
+
+/******************************************************************************
+Description.: calling this function creates and starts the worker thread
+Input Value.: id determines which instance to run
+Return Value: always 0
+******************************************************************************/
+int output_run(int id)
+{
+    DBG("launching worker thread #%02d\n", id);
+    pthread_create(&instances[id]->worker, 0, worker_thread, instances[id]);
+    return 0;
+}
@@ -0,0 +1,96 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef OUTPUT_SHM_H
+#define OUTPUT_SHM_H
+
+/*
+ * Layout of the shared memory region created by output_shm. This header does
+ * not depend on the rest of mjpg-streamer, consumers may copy it.
+ *
+ * The region starts with a shm_frame_header, followed by slot_count slots of
+ * slot_size bytes each. Every slot starts with a shm_frame_slot, the JPG data
+ * directly follows it. All fields use the byte order of the host.
+ *
+ * Reading the latest frame:
+ *
+ *   1. load latest, the index of the slot written last
+ *   2. load lock of that slot, retry if it is odd (the slot is being written)
+ *   3. use the metadata and data of the slot
+ *   4. load lock again, the data was overwritten meanwhile if it changed
+ *
+ * The writer uses the slots round robin, so a slot is only overwritten after
+ * slot_count - 1 newer frames got published. A reader which holds on to a
+ * slot longer than that sees the lock change in step 4.
+ *
+ * Waiting for the next frame: increment waiters, load seq, sleep with
+ * FUTEX_WAIT on seq while it still has the value seen last, decrement
+ * waiters. The writer stores seq before it checks waiters, so this does not
+ * lose a wakeup. The futex is shared, never use FUTEX_PRIVATE_FLAG.
+ *
+ * When the plugin stops it clears magic and changes seq one last time, so
+ * sleeping readers wake up and notice the region is gone.
+ */
+
+#include <stdint.h>
+
+#define SHM_FRAME_MAGIC   0x534a504d    /* "MPJS" in memory on little endian hosts */
+#define SHM_FRAME_VERSION 1
+
+/* defaults of the plugin options, the size option is given in KiB */
+#define SHM_FRAME_DEFAULT_SIZE  (2048 * 1024)
+#define SHM_FRAME_DEFAULT_SLOTS 4
+
+typedef struct _shm_frame_header shm_frame_header;
+struct _shm_frame_header {
+    uint32_t magic;             /* SHM_FRAME_MAGIC, written last when the region is ready */
+    uint32_t version;           /* SHM_FRAME_VERSION */
+    uint32_t header_size;       /* offset of the first slot */
+    uint32_t slot_count;
+    uint32_t slot_size;         /* distance between two slots */
+    uint32_t data_size;         /* maximum JPG size per slot */
+    uint32_t seq;               /* sequence number of the latest frame, 0 before the first one */
+    uint32_t latest;            /* index of the slot holding frame seq */
+    uint32_t waiters;           /* consumers sleeping on seq */
+    uint32_t dropped;           /* frames which did not fit into a slot */
+    uint32_t pid;               /* process writing the region */
+    uint32_t reserved[5];
+};
+
+typedef struct _shm_frame_slot shm_frame_slot;
+struct _shm_frame_slot {
+    uint32_t lock;              /* odd while the slot is being written */
+    uint32_t seq;               /* sequence number of the frame */
+    uint32_t size;              /* bytes of JPG data */
+    uint32_t width;             /* 0 if unknown */
+    uint32_t height;
+    uint32_t format;            /* V4L2 fourcc of the data, always V4L2_PIX_FMT_MJPEG */
+    int32_t quality;            /* JPG quality, -1 if unknown */
+    uint32_t reserved;
+    int64_t timestamp_us;       /* timestamp the input gave the frame, in microseconds */
+};
+
+#define SHM_FRAME_SLOT(hdr, i) \
+    ((shm_frame_slot *)((uint8_t *)(hdr) + (hdr)->header_size + (uint64_t)(i) * (hdr)->slot_size))
+#define SHM_FRAME_DATA(slot) ((uint8_t *)((slot) + 1))
+
+#endif
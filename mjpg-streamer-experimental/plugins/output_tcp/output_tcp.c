@@ -51,6 +51,7 @@ static globals *pglobal;
 
 static struct {
   uint32_t input_number;
+  uint32_t output_number;
   uint32_t window;
   char *addr;
   uint32_t port;
@@ -62,11 +63,9 @@ static struct {
   int sock;
 } net;
 
-static struct {
-  uint8_t *bytes;
-  uint32_t size;
-  uint32_t used;
-} raw_buf;
+/* reference to the frame being transmitted, released once it is encoded */
+static frame *cur_frame;
+static frame_cursor cursor;
 
 stse_buf_t encoded_buf;
 
@@ -99,63 +98,76 @@ void worker_cleanup(void *arg) {
   is_first_run = 0;
   OPRINT("cleaning up resources allocated by worker thread\n");
 
+  frame_unsubscribe(pglobal->in[params.input_number]);
+
   if (net.sock >= 0)
     close(net.sock);
 
   if (net.rcv_info != NULL)
     freeaddrinfo(net.rcv_info);
 
-  if (raw_buf.bytes != NULL)
-    free(raw_buf.bytes);
+  frame_put(cur_frame);
+  cur_frame = NULL;
 
   if (encoded_buf.bytes != NULL)
     free(encoded_buf.bytes);
 }
 
 static inline bool resize_buffers(uint32_t new_frame_size) {
-  raw_buf.size = 2 * new_frame_size;
-  DBG("increasing buffer size from %u to %u\n", raw_buf.size, raw_buf.size);
-  uint8_t *tmp = realloc(raw_buf.bytes, raw_buf.size);
-  if (tmp == NULL)
-    return false;
-  raw_buf.bytes = tmp;
-
-  encoded_buf.size = 2 * raw_buf.size + 2;
-  tmp = realloc(encoded_buf.bytes, encoded_buf.size);
+  uint32_t new_size = 4 * new_frame_size + 2;
+  DBG("increasing buffer size from %u to %u\n", encoded_buf.size, new_size);
+  uint8_t *tmp = realloc(encoded_buf.bytes, new_size);
   if (tmp == NULL)
     return false;
   encoded_buf.bytes = tmp;
+  encoded_buf.size = new_size;
 
   return true;
 }
 
 bool grab_frame(void) {
-  uint32_t in_num = params.input_number;
-  pthread_mutex_lock(&pglobal->in[in_num].db);
-  pthread_cond_wait(&pglobal->in[in_num].db_update, &pglobal->in[in_num].db);
-  uint32_t frame_size = pglobal->in[in_num].size;
-  if (frame_size > raw_buf.size && !resize_buffers(frame_size)) {
-    pthread_mutex_unlock(&pglobal->in[in_num].db);
+  do {
+    /* frame_wait() is a cancellation point, the cleanup must not put it twice */
+    frame_put(cur_frame);
+    cur_frame = NULL;
+    cur_frame = frame_wait(pglobal->in[params.input_number], &cursor);
+    if (cur_frame == NULL) {
+      LOG("the input was removed\n");
+      return false;
+    }
+  } while (frame_jpeg(cur_frame) != 0);
+
+  uint32_t frame_size = cur_frame->size;
+  if (2 * frame_size + 2 > encoded_buf.size && !resize_buffers(frame_size)) {
+    frame_put(cur_frame);
+    cur_frame = NULL;
     LOG("not enough memory\n");
     return false;
   }
-  memcpy(raw_buf.bytes, pglobal->in[in_num].buf, frame_size);
-  raw_buf.used = frame_size;
-  pthread_mutex_unlock(&pglobal->in[in_num].db);
 
   return true;
 }
 
 bool transmit_frame(void) {
+  bool ok;
+
+  /* encode straight from the shared frame, no private copy needed */
   encoded_buf.used = 0;
-  if (!stse_start(&encoded_buf))
-    return false;
-  if (!stse_append(&encoded_buf, raw_buf.bytes, raw_buf.used))
-    return false;
-  if (!stse_end(&encoded_buf))
+  ok = stse_start(&encoded_buf) &&
+      stse_append(&encoded_buf, cur_frame->buf, cur_frame->size) &&
+      stse_end(&encoded_buf);
+  if (!ok) {
+    frame_put(cur_frame);
+    cur_frame = NULL;
     return false;
+  }
   ssize_t x;
   x = send(net.sock, encoded_buf.bytes, encoded_buf.used, 0);
+  /* the frame is only kept to know its stage times */
+  if (x == encoded_buf.used)
+    trace_frame_sent(pglobal->out[params.output_number], cur_frame, x);
+  frame_put(cur_frame);
+  cur_frame = NULL;
   if (x == -1) {
     perror("send");
     return false;
@@ -164,13 +176,10 @@ bool transmit_frame(void) {
     return false;
   }
 
-  return false;
+  return true;
 }
 
-void *worker_thread(void *arg) {
-  /* set cleanup handler to cleanup allocated resources */
-  pthread_cleanup_push(worker_cleanup, NULL);
-
+static bool connect_receiver(void) {
   struct addrinfo hints = {0};
   hints.ai_family = AF_INET;
   hints.ai_socktype = SOCK_STREAM;
@@ -183,11 +192,11 @@ void *worker_thread(void *arg) {
       perror("getaddrinfo");
     else
       fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(x));
-    return NULL;
+    return false;
   }
   if (net.rcv_info->ai_addr->sa_family != AF_INET) {
     DBG("getaddrinfo returned a protocol family different from AF_INET");
-    return NULL;
+    return false;
   }
   struct sockaddr_in *ip4 = (struct sockaddr_in *)(net.rcv_info->ai_addr);
   ip4->sin_port = htons((uint16_t)params.port);
@@ -195,31 +204,45 @@ void *worker_thread(void *arg) {
       net.rcv_info->ai_protocol);
   if (net.sock < 0) {
     perror("socket");
-    return NULL;
+    return false;
   }
   if (connect(net.sock, net.rcv_info->ai_addr,
         net.rcv_info->ai_addrlen) != 0) {
     perror("connect");
-    return NULL;
+    return false;
+  }
+
+  return true;
+}
+
+static bool receive_ack(uint32_t *confirmed) {
+  char buf[64];
+  ssize_t x = recv(net.sock, buf, sizeof(buf), 0);
+  if (x == 0)
+    return false; /* socket closed */
+  if (x < 0) {
+    perror("recv");
+    return false;
   }
-  
+  *confirmed += x;
+
+  return true;
+}
+
+void *worker_thread(void *arg) {
+  /* set cleanup handler to cleanup allocated resources */
+  pthread_cleanup_push(worker_cleanup, NULL);
+
+  /* every frame gets sent, keep an on-demand input capturing */
+  frame_subscribe(pglobal->in[params.input_number]);
+
+  /* errors leave the loop, the cleanup handler releases the frame */
   uint32_t confirmed = 0, sent = 0;
-  while (true) {
-    while (confirmed + params.window < sent + 1) {
-      char buf[64];
-      ssize_t x = recv(net.sock, buf, sizeof(buf), 0);
-      if (x == 0)
-        return NULL; /* socket closed */
-      if (x < 0) {
-        perror("recv");
-        return NULL;
-      }
-      confirmed += x;
-    }
-    if (!grab_frame())
-      return NULL;
-    if (!transmit_frame())
-      return NULL;
+  bool ok = connect_receiver();
+  while (ok) {
+    while (ok && confirmed + params.window < sent + 1)
+      ok = receive_ack(&confirmed);
+    ok = ok && grab_frame() && transmit_frame();
     sent += 1;
   }
 
@@ -248,6 +271,7 @@ int output_init(output_parameter *param) {
 
   /* default parameters */
   params.input_number = 0;
+  params.output_number = param->id;
   params.window = 10;
   params.addr = NULL;
   params.port = 40405;
@@ -321,7 +345,7 @@ int output_init(output_parameter *param) {
   }
 
   pglobal = param->global;
-  if (params.input_number >= pglobal->incnt) {
+  if (!INPUT_VALID(pglobal, (int)params.input_number)) {
     OPRINT("Error: the %u input plugin number is too much for only"
         " %u plugins loaded\n", params.input_number, pglobal->incnt);
     return 1;
@@ -331,12 +355,11 @@ int output_init(output_parameter *param) {
     return 1;
   }
   /* buffers will be allocated when the first frame is ready */
-  raw_buf.bytes = NULL;
-  raw_buf.size = 0;
+  cur_frame = NULL;
   encoded_buf.bytes = NULL;
   encoded_buf.size = 0;
   OPRINT("input plugin....: (%u) %s\n", params.input_number,
-      pglobal->in[params.input_number].plugin);
+      pglobal->in[params.input_number]->plugin);
   OPRINT("address.........: %s\n", params.addr);
   OPRINT("port............: %u\n", params.port);
   OPRINT("window..........: %u frames\n", params.window);
@@ -349,6 +372,7 @@ int output_init(output_parameter *param) {
 int output_stop(int id) {
     DBG("will cancel worker thread\n");
     pthread_cancel(worker);
+    pthread_join(worker, NULL);
     return 0;
 }
 
@@ -356,7 +380,6 @@ int output_stop(int id) {
 int output_run(int id) {
     DBG("launching worker thread\n");
     pthread_create(&worker, 0, worker_thread, NULL);
-    pthread_detach(worker);
     return 0;
 }
 
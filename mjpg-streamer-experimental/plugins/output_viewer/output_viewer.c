@@ -38,7 +38,6 @@
 
 static pthread_t worker;
 static globals *pglobal;
-static unsigned char *frame = NULL;
 static int input_number = 0;
 
 /******************************************************************************
@@ -70,7 +69,7 @@ void worker_cleanup(void *arg)
     first_run = 0;
     OPRINT("cleaning up resources allocated by worker thread\n");
 
-    free(frame);
+    frame_unsubscribe(pglobal->in[input_number]);
     SDL_Quit();
 }
 
@@ -252,7 +251,9 @@ Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int frame_size = 0, firstrun = 1;
+    int firstrun = 1, rc;
+    frame *f;
+    frame_cursor cursor = {0, 0};
 
     SDL_Surface *screen = NULL, *image = NULL;
     decompressed_image rgbimage;
@@ -267,28 +268,37 @@ void *worker_thread(void *arg)
         exit(EXIT_FAILURE);
     }
 
-    /* just allocate a large buffer for the JPEGs */
-    if((frame = malloc(4096 * 1024)) == NULL) {
-        OPRINT("not enough memory for worker thread\n");
-        exit(EXIT_FAILURE);
-    }
-
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
+    /* this output reads every frame, keep an on-demand input capturing */
+    frame_subscribe(pglobal->in[input_number]);
+
     while(!pglobal->stop) {
         DBG("waiting for fresh frame\n");
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+        f = frame_wait(pglobal->in[input_number], &cursor);
+
+        /* the input was removed, it never delivers frames again */
+        if(f == NULL)
+            break;
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        if(frame_jpeg(f) != 0) {
+            frame_put(f);
+            continue;
+        }
 
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        /* the surface has a fixed size, skip other resolutions without decoding them */
+        if(!firstrun && f->width != 0 &&
+           (f->width != rgbimage.width || f->height != rgbimage.height)) {
+            DBG("skipping frame with different resolution %dx%d\n", f->width, f->height);
+            frame_put(f);
+            continue;
+        }
 
         /* decompress the JPEG and store results in memory */
-        if(decompress_jpeg(frame, frame_size, &rgbimage)) {
+        rc = decompress_jpeg(f->buf, f->size, &rgbimage);
+        frame_put(f);
+        if(rc) {
             DBG("could not properly decompress JPEG data\n");
             continue;
         }
@@ -392,11 +402,11 @@ int output_init(output_parameter *param)
     }
 
     pglobal = param->global;
-    if(!(input_number < pglobal->incnt)) {
+    if(!INPUT_VALID(pglobal, input_number)) {
         OPRINT("ERROR: the %d input_plugin number is too much only %d plugins loaded\n", input_number, pglobal->incnt);
         return 1;
     }
-    OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number].plugin);
+    OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number]->plugin);
 
     return 0;
 }
@@ -410,6 +420,7 @@ int output_stop(int id)
 {
     DBG("will cancel worker thread\n");
     pthread_cancel(worker);
+    pthread_join(worker, NULL);
     return 0;
 }
 
@@ -422,7 +433,6 @@ int output_run(int id)
 {
     DBG("launching worker thread\n");
     pthread_create(&worker, 0, worker_thread, NULL);
-    pthread_detach(worker);
     return 0;
 }
 
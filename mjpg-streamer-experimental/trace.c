@@ -0,0 +1,159 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <linux/types.h>          /* for videodev2.h */
+#include <linux/videodev2.h>
+
+#include "mjpg_streamer.h"
+
+/* set once by main() before any plugin starts */
+int trace_enabled = 0;
+
+/******************************************************************************
+Description.: map a sample to its bucket
+Input Value.: us is the sample in microseconds
+Return Value: index into trace_histogram.buckets
+******************************************************************************/
+static int trace_bucket(unsigned long us)
+{
+    int e;
+
+    if(us < TRACE_LINEAR)
+        return us;
+
+    /* position of the highest bit, the next 3 bits select the sub bucket */
+    e = 8 * sizeof(unsigned long) - 1 - __builtin_clzl(us);
+    if(e >= 32)
+        return TRACE_BUCKETS - 1;
+
+    return TRACE_LINEAR + (e - 4) * 8 + ((us >> (e - 3)) & 7);
+}
+
+/******************************************************************************
+Description.: the largest sample a bucket counts
+Input Value.: bucket is an index into trace_histogram.buckets
+Return Value: microseconds
+******************************************************************************/
+static unsigned long trace_bucket_limit(int bucket)
+{
+    int e, sub;
+
+    if(bucket < TRACE_LINEAR)
+        return bucket;
+
+    e = (bucket - TRACE_LINEAR) / 8 + 4;
+    sub = (bucket - TRACE_LINEAR) % 8;
+
+    return ((8UL + sub + 1) << (e - 3)) - 1;
+}
+
+/******************************************************************************
+Description.: add a sample to a histogram
+Input Value.: h is the histogram, us the sample in microseconds
+Return Value: -
+******************************************************************************/
+void trace_record(trace_histogram *h, long us)
+{
+    unsigned long max, sample = (us > 0) ? us : 0;
+
+    __atomic_add_fetch(&h->buckets[trace_bucket(sample)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum, sample, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while(sample > max &&
+          !__atomic_compare_exchange_n(&h->max, &max, sample, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/******************************************************************************
+Description.: calculate a percentile. Other threads may record meanwhile, the
+              result is based on a snapshot which is not exactly consistent.
+Input Value.: h is the histogram, permille selects the percentile (990 = p99)
+Return Value: the upper limit of the bucket the percentile falls into in
+              microseconds, never more than the maximum, 0 without samples
+******************************************************************************/
+long trace_percentile(const trace_histogram *h, int permille)
+{
+    unsigned long count, target, seen = 0, max;
+    int i;
+
+    count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    if(count == 0)
+        return 0;
+
+    target = (count * permille + 999) / 1000;
+    for(i = 0; i < TRACE_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        if(seen >= target)
+            return (trace_bucket_limit(i) < max) ? trace_bucket_limit(i) : max;
+    }
+
+    return max;
+}
+
+/******************************************************************************
+Description.: count the samples up to a limit, e.g. for the cumulative buckets
+              of a Prometheus histogram. Buckets which reach above the limit
+              are not counted.
+Input Value.: h is the histogram, us the limit in microseconds
+Return Value: number of samples
+******************************************************************************/
+unsigned long trace_count_below(const trace_histogram *h, long us)
+{
+    unsigned long seen = 0;
+    int i;
+
+    for(i = 0; i < TRACE_BUCKETS && (long)trace_bucket_limit(i) <= us; i++)
+        seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+
+    return seen;
+}
+
+/******************************************************************************
+Description.: count a frame an output delivered and record its output stages,
+              outputs call this once the frame was written to the socket,
+              file or shared memory
+Input Value.: out is the output, f the frame it just delivered
+              bytes is the size of the picture as it was written, e.g. of a
+              scaled variant instead of f->size
+Return Value: -
+******************************************************************************/
+void trace_frame_sent(output *out, const frame *f, long bytes)
+{
+    struct timeval sent;
+
+    __atomic_add_fetch(&out->frames_sent, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&out->bytes_sent, bytes, __ATOMIC_RELAXED);
+
+    if(!trace_enabled)
+        return;
+
+    frame_clock(&sent);
+    trace_record(&out->trace[TRACE_SEND], frame_elapsed_us(&f->published, &sent));
+    if(f->captured.tv_sec != 0)
+        trace_record(&out->trace[TRACE_TOTAL], frame_elapsed_us(&f->captured, &sent));
+}
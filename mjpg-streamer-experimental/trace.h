@@ -0,0 +1,71 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Latency histograms of the processing stages of a frame. Tracing is off by
+ * default and enabled with the --trace option of mjpg_streamer, while it is
+ * off recording a sample costs a single load of trace_enabled.
+ *
+ * Samples are counted in log-linear buckets: values below TRACE_LINEAR
+ * microseconds exactly, larger values in 8 buckets per power of two, so a
+ * percentile is off by at most 12.5%. Buckets are incremented atomically,
+ * any thread may record into any histogram without a lock.
+ */
+#define TRACE_LINEAR  16
+#define TRACE_BUCKETS (TRACE_LINEAR + (32 - 4) * 8)
+
+typedef struct _trace_histogram trace_histogram;
+struct _trace_histogram {
+    unsigned long count;
+    unsigned long long sum;     /* microseconds */
+    unsigned long max;
+    unsigned long buckets[TRACE_BUCKETS];
+};
+
+/* stages recorded for each input */
+enum _trace_input_stage {
+    TRACE_ENCODE = 0,           /* captured -> JPG data complete, also for lazy encoding */
+    TRACE_PUBLISH = 1,          /* captured -> visible to consumers */
+    TRACE_INPUT_STAGES
+};
+
+/* stages recorded for each output */
+enum _trace_output_stage {
+    TRACE_SEND = 0,             /* published -> handed to the socket or file */
+    TRACE_TOTAL = 1,            /* captured -> handed to the socket or file */
+    TRACE_OUTPUT_STAGES
+};
+
+struct _frame;
+struct _output;
+
+extern int trace_enabled;
+
+void trace_record(trace_histogram *h, long us);
+long trace_percentile(const trace_histogram *h, int permille);
+unsigned long trace_count_below(const trace_histogram *h, long us);
+void trace_frame_sent(struct _output *out, const struct _frame *f, long bytes);
+
+#endif